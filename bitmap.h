@@ -11,37 +11,55 @@
 #include "ouichefs.h"
 
 /*
- * Return the first free bit (set to 1) in a given in-memory bitmap spanning
- * over multiple blocks and clear it.
+ * Return the first free bit (set to 1) in the [start, end) range of a given
+ * in-memory bitmap spanning over multiple blocks and clear it.
  * Return 0 if no free bit found (we assume that the first bit is never free
  * because of the superblock and the root inode, thus allowing us to use 0 as an
  * error value).
+ * The caller must hold the lock of the group owning the range.
  */
 static inline uint32_t get_first_free_bit(unsigned long *freemap,
-					  unsigned long size)
+					  unsigned long start,
+					  unsigned long end)
 {
-	uint32_t ino;
+	unsigned long bit;
 
-	ino = find_first_bit(freemap, size);
-	if (ino == size)
+	bit = find_next_bit(freemap, end, start);
+	if (bit >= end)
 		return 0;
 
-	bitmap_clear(freemap, ino, 1);
+	__clear_bit(bit, freemap);
 
-	return ino;
+	return bit;
 }
 
 /*
- * Return an unused inode number and mark it used.
+ * Return an unused inode number and mark it used. The search starts in group
+ * goal and falls back to the following groups when it is full.
  * Return 0 if no free inode was found.
  */
-static inline uint32_t get_free_inode(struct ouichefs_sb_info *sbi)
+static inline uint32_t get_free_inode(struct ouichefs_sb_info *sbi,
+				      uint32_t goal)
 {
-	uint32_t ret;
-
-	ret = get_first_free_bit(sbi->ifree_bitmap, sbi->nr_inodes);
+	struct ouichefs_group_info *gi;
+	uint32_t ret = 0, i, g;
+
+	for (i = 0; i < sbi->nr_groups && !ret; i++) {
+		g = (goal + i) % sbi->nr_groups;
+		gi = &sbi->groups[g];
+		if (!READ_ONCE(gi->nr_free_inodes))
+			continue;
+
+		spin_lock(&gi->lock);
+		ret = get_first_free_bit(sbi->ifree_bitmap,
+					 ouichefs_group_first_ino(sbi, g),
+					 ouichefs_group_end_ino(sbi, g));
+		if (ret)
+			gi->nr_free_inodes--;
+		spin_unlock(&gi->lock);
+	}
 	if (ret) {
-		sbi->nr_free_inodes--;
+		percpu_counter_dec(&sbi->nr_free_inodes);
 		pr_debug("%s:%d: allocated inode %u\n",
 			 __func__, __LINE__, ret);
 	}
@@ -49,33 +67,121 @@ static inline uint32_t get_free_inode(struct ouichefs_sb_info *sbi)
 }
 
 /*
- * Return an unused block number and mark it used.
+ * Return an unused block number and mark it used. The search starts in group
+ * goal and falls back to the following groups when it is full.
  * Return 0 if no free block was found.
  */
-static inline uint32_t get_free_block(struct ouichefs_sb_info *sbi)
+static inline uint32_t get_free_block(struct ouichefs_sb_info *sbi,
+				      uint32_t goal)
 {
-	uint32_t ret;
-
-	ret = get_first_free_bit(sbi->bfree_bitmap, sbi->nr_blocks);
+	struct ouichefs_group_info *gi;
+	uint32_t ret = 0, i, g;
+
+	for (i = 0; i < sbi->nr_groups && !ret; i++) {
+		g = (goal + i) % sbi->nr_groups;
+		gi = &sbi->groups[g];
+		if (!READ_ONCE(gi->nr_free_blocks))
+			continue;
+
+		spin_lock(&gi->lock);
+		ret = get_first_free_bit(sbi->bfree_bitmap,
+					 ouichefs_group_first_block(sbi, g),
+					 ouichefs_group_end_block(sbi, g));
+		if (ret)
+			gi->nr_free_blocks--;
+		spin_unlock(&gi->lock);
+	}
 	if (ret) {
-		sbi->nr_free_blocks--;
+		percpu_counter_dec(&sbi->nr_free_blocks);
 		pr_debug("%s:%d: allocated block %u\n",
 			 __func__, __LINE__, ret);
 	}
 	return ret;
 }
 
+/*
+ * Return the first bit of a run of len free bits in the [start, end) range
+ * of freemap, or end if there is none. With from_end, the last len bits of
+ * the last such run are returned instead.
+ * The caller must hold the lock of the group owning the range.
+ */
+static inline unsigned long find_free_run(unsigned long *freemap,
+					  unsigned long start,
+					  unsigned long end,
+					  unsigned long len, bool from_end)
+{
+	unsigned long first, last, found = end;
+
+	while (start < end) {
+		first = find_next_bit(freemap, end, start);
+		if (first >= end)
+			break;
+		last = find_next_zero_bit(freemap, end, first);
+		if (last - first >= len) {
+			if (!from_end)
+				return first;
+			found = last - len;
+		}
+		start = last;
+	}
+	return found;
+}
+
+/*
+ * Return the first block of len contiguous unused blocks and mark them used.
+ * The search starts in group goal and goes on with the following groups, or
+ * with from_end, starts in the last group and goes backward. A run never
+ * crosses groups.
+ * Return 0 if no group has such a run.
+ */
+static inline uint32_t get_free_run(struct ouichefs_sb_info *sbi,
+				    uint32_t goal, uint32_t len, bool from_end)
+{
+	struct ouichefs_group_info *gi;
+	unsigned long end, bit;
+	uint32_t ret = 0, i, g;
+
+	for (i = 0; i < sbi->nr_groups && !ret; i++) {
+		if (from_end)
+			g = sbi->nr_groups - 1 - i;
+		else
+			g = (goal + i) % sbi->nr_groups;
+		gi = &sbi->groups[g];
+		if (READ_ONCE(gi->nr_free_blocks) < len)
+			continue;
+
+		end = ouichefs_group_end_block(sbi, g);
+		spin_lock(&gi->lock);
+		bit = find_free_run(sbi->bfree_bitmap,
+				    ouichefs_group_first_block(sbi, g), end,
+				    len, from_end);
+		if (bit < end) {
+			bitmap_clear(sbi->bfree_bitmap, bit, len);
+			gi->nr_free_blocks -= len;
+			ret = bit;
+		}
+		spin_unlock(&gi->lock);
+	}
+	if (ret) {
+		percpu_counter_sub(&sbi->nr_free_blocks, len);
+		pr_debug("%s:%d: allocated blocks %u-%u\n",
+			 __func__, __LINE__, ret, ret + len - 1);
+	}
+	return ret;
+}
+
 /*
  * Mark the i-th bit in freemap as free (i.e. 1)
+ * The caller must hold the lock of the group owning bit i.
  */
 static inline int put_free_bit(unsigned long *freemap, unsigned long size,
 			       uint32_t i)
 {
 	/* i is greater than freemap size */
-	if (i > size)
+	if (i >= size)
 		return -1;
 
-	bitmap_set(freemap, i, 1);
+	__set_bit(i, freemap);
 
 	return 0;
 }
@@ -85,10 +191,23 @@ static inline int put_free_bit(unsigned long *freemap, unsigned long size,
  */
 static inline void put_inode(struct ouichefs_sb_info *sbi, uint32_t ino)
 {
-	if (put_free_bit(sbi->ifree_bitmap, sbi->nr_inodes, ino))
+	struct ouichefs_group_info *gi;
+	int ret;
+
+	/* inode 0 is the root inode and is never freed */
+	if (!ino || ino >= sbi->nr_inodes)
+		return;
+
+	gi = &sbi->groups[ouichefs_ino_group(sbi, ino)];
+	spin_lock(&gi->lock);
+	ret = put_free_bit(sbi->ifree_bitmap, sbi->nr_inodes, ino);
+	if (!ret)
+		gi->nr_free_inodes++;
+	spin_unlock(&gi->lock);
+	if (ret)
 		return;
 
-	sbi->nr_free_inodes++;
+	percpu_counter_inc(&sbi->nr_free_inodes);
 	pr_debug("%s:%d: freed inode %u\n",
 		 __func__, __LINE__, ino);
 }
@@ -98,10 +217,23 @@ static inline void put_inode(struct ouichefs_sb_info *sbi, uint32_t ino)
  */
 static inline void put_block(struct ouichefs_sb_info *sbi, uint32_t bno)
 {
-	if (put_free_bit(sbi->bfree_bitmap, sbi->nr_blocks, bno))
+	struct ouichefs_group_info *gi;
+	int ret;
+
+	/* block 0 is the superblock and is never freed */
+	if (!bno || bno >= sbi->nr_blocks)
+		return;
+
+	gi = &sbi->groups[ouichefs_block_group(sbi, bno)];
+	spin_lock(&gi->lock);
+	ret = put_free_bit(sbi->bfree_bitmap, sbi->nr_blocks, bno);
+	if (!ret)
+		gi->nr_free_blocks++;
+	spin_unlock(&gi->lock);
+	if (ret)
 		return;
 
-	sbi->nr_free_blocks++;
+	percpu_counter_inc(&sbi->nr_free_blocks);
 	pr_debug("%s:%d: freed block %u\n",
 		 __func__, __LINE__, bno);
 }
@@ -0,0 +1,175 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * ouiche_fs - a simple educational filesystem for Linux
+ *
+ * Copyright (C) 2018 Redha Gouicem <redha.gouicem@lip6.fr>
+ */
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/blkdev.h>
+#include <linux/buffer_head.h>
+#include <linux/slab.h>
+#include <linux/workqueue.h>
+
+#include "ouichefs.h"
+#include "bitmap.h"
+
+/*
+ * Freed blocks are not scrubbed anymore: a block is zeroed when it is
+ * allocated again as an index block (see ouichefs_get_new_block()), and
+ * data blocks are always fully written or zeroed in the page cache by iomap
+ * before being used, since they are mapped with IOMAP_F_NEW.
+ *
+ * With the discard mount option, freed blocks are first queued as extents
+ * and a background work discards them in batches before giving them back
+ * to the allocator, so that a block is never discarded after being
+ * allocated again.
+ */
+
+/* Delay before discarding queued blocks, to let extents grow */
+#define OUICHEFS_DISCARD_DELAY	(HZ / 10)
+/* Queue size above which the queued blocks are discarded right away */
+#define OUICHEFS_DISCARD_BATCH	1024
+
+/*
+ * Get the buffer of block bno filled with a copy of src, or with zeroes if
+ * src is NULL, without reading it from disk since it is entirely
+ * overwritten. The buffer is dirty and attached to inode if not NULL.
+ */
+struct buffer_head *ouichefs_get_new_block(struct super_block *sb,
+					   struct inode *inode,
+					   uint32_t bno, const void *src)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct buffer_head *bh;
+
+	bh = sb_getblk(sb, bno);
+	if (!bh)
+		return NULL;
+	lock_buffer(bh);
+	if (!buffer_uptodate(bh))
+		atomic64_inc(&sbi->stats.reads_saved);
+	if (src)
+		memcpy(bh->b_data, src, OUICHEFS_BSIZE(sb));
+	else
+		memset(bh->b_data, 0, OUICHEFS_BSIZE(sb));
+	set_buffer_uptodate(bh);
+	unlock_buffer(bh);
+	ouichefs_mark_dirty(sb, bh, inode);
+
+	return bh;
+}
+
+/*
+ * Queue block bno to be discarded. Return false if it could not be queued.
+ */
+static bool ouichefs_queue_discard(struct ouichefs_sb_info *sbi,
+				   uint32_t bno)
+{
+	struct ouichefs_extent *ext;
+	uint32_t nr;
+
+	mutex_lock(&sbi->discard_lock);
+	nr = sbi->nr_discard;
+	if (nr && sbi->discard_queue[nr - 1].start +
+	    sbi->discard_queue[nr - 1].len == bno) {
+		sbi->discard_queue[nr - 1].len++;
+		goto unlock;
+	}
+	if (nr == sbi->discard_size) {
+		ext = krealloc(sbi->discard_queue,
+			       max(2 * nr, 64U) * sizeof(*ext), GFP_NOFS);
+		if (!ext) {
+			mutex_unlock(&sbi->discard_lock);
+			return false;
+		}
+		sbi->discard_queue = ext;
+		sbi->discard_size = max(2 * nr, 64U);
+	}
+	sbi->discard_queue[nr].start = bno;
+	sbi->discard_queue[nr].len = 1;
+	sbi->nr_discard++;
+unlock:
+	if (sbi->nr_discard >= OUICHEFS_DISCARD_BATCH)
+		mod_delayed_work(system_unbound_wq, &sbi->discard_work, 0);
+	else
+		queue_delayed_work(system_unbound_wq, &sbi->discard_work,
+				   OUICHEFS_DISCARD_DELAY);
+	mutex_unlock(&sbi->discard_lock);
+	return true;
+}
+
+/*
+ * Give block bno back to the allocator, after discarding it if the
+ * partition is mounted with the discard option. The caller must not use the
+ * block anymore.
+ */
+void ouichefs_release_block(struct super_block *sb, uint32_t bno)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+
+	if (!bno || bno >= sbi->nr_blocks)
+		return;
+	if (sbi->discard && ouichefs_queue_discard(sbi, bno))
+		return;
+	put_block(sbi, bno);
+}
+
+static void ouichefs_discard_work(struct work_struct *work)
+{
+	struct ouichefs_sb_info *sbi = container_of(to_delayed_work(work),
+						    struct ouichefs_sb_info,
+						    discard_work);
+	struct super_block *sb = sbi->sb;
+	struct ouichefs_extent *queue;
+	uint32_t nr, i, j;
+	int ret;
+
+	mutex_lock(&sbi->discard_lock);
+	queue = sbi->discard_queue;
+	nr = sbi->nr_discard;
+	sbi->discard_queue = NULL;
+	sbi->nr_discard = 0;
+	sbi->discard_size = 0;
+	mutex_unlock(&sbi->discard_lock);
+
+	for (i = 0; i < nr; i++) {
+		/* Nobody owns these blocks, drop their stale buffers */
+		clean_bdev_aliases(sb->s_bdev, queue[i].start, queue[i].len);
+		ret = sb_issue_discard(sb, queue[i].start, queue[i].len,
+				       GFP_NOFS, 0);
+		if (ret && ret != -EOPNOTSUPP)
+			pr_warn("failed discarding blocks %u-%u (%d)\n",
+				queue[i].start,
+				queue[i].start + queue[i].len - 1, ret);
+		for (j = 0; j < queue[i].len; j++)
+			put_block(sbi, queue[i].start + j);
+		cond_resched();
+	}
+	kfree(queue);
+}
+
+void ouichefs_discard_init(struct super_block *sb)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+
+	mutex_init(&sbi->discard_lock);
+	INIT_DELAYED_WORK(&sbi->discard_work, ouichefs_discard_work);
+	if (sbi->discard && !blk_queue_discard(bdev_get_queue(sb->s_bdev))) {
+		pr_warn("discard not supported by the device, disabled\n");
+		sbi->discard = false;
+	}
+}
+
+/*
+ * Discard the queued blocks now and give them back to the allocator.
+ */
+void ouichefs_discard_flush(struct super_block *sb)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+
+	flush_delayed_work(&sbi->discard_work);
+}
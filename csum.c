@@ -0,0 +1,280 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * ouiche_fs - a simple educational filesystem for Linux
+ *
+ * Copyright (C) 2018 Redha Gouicem <redha.gouicem@lip6.fr>
+ */
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/bitmap.h>
+#include <linux/blkdev.h>
+#include <linux/buffer_head.h>
+#include <linux/crc32c.h>
+#include <linux/highmem.h>
+#include <linux/ktime.h>
+#include <linux/mm.h>
+
+#include "ouichefs.h"
+
+/*
+ * With the metadata_csum feature, the crc32c of every block is kept in the
+ * checksum map, right after the group descriptors. The map is loaded in
+ * memory at mount, which costs 4 bytes per block of the partition (1 MiB
+ * per GiB with 4 KiB blocks), and its blocks changed since they were last
+ * written go back to disk with the bitmaps. An entry of 0 means that no
+ * checksum was recorded for the block, which is then not verified.
+ *
+ * The map on disk only matches the other metadata after a sync, while
+ * metadata buffers are written back at any time. The superblock is marked
+ * dirty as long as the partition is mounted read-write: a mount finding it
+ * dirty, after a crash, drops the map instead of failing reads, and
+ * fsck.ouichefs -y rebuilds it.
+ *
+ * The checksum of a metadata block is computed when it is marked dirty (see
+ * ouichefs_mark_dirty()) and verified the first time it is read from disk
+ * (see ouichefs_bread()): the result is kept in the buffer state, so that
+ * cached buffers are never verified again. With the data_csum feature, data
+ * blocks are checksummed once written to the page cache (see
+ * ouichefs_iomap_end()) and verified by readpage before the page is made
+ * uptodate, so that cached pages are never verified again either.
+ */
+
+static uint32_t ouichefs_crc(struct ouichefs_sb_info *sbi, const void *data,
+			     size_t len)
+{
+	ktime_t start = ktime_get();
+	uint32_t crc = crc32c(~0, data, len);
+
+	atomic64_add(ktime_to_ns(ktime_sub(ktime_get(), start)),
+		     &sbi->stats.csum_ns);
+	return crc;
+}
+
+/*
+ * Check len bytes of data against the recorded checksum of block bno.
+ */
+static bool ouichefs_csum_match(struct ouichefs_sb_info *sbi, uint32_t bno,
+				const void *data, size_t len)
+{
+	uint32_t expected;
+
+	if (bno >= sbi->nr_blocks)
+		return true;
+	expected = READ_ONCE(sbi->csums[bno]);
+	if (!expected)
+		return true;
+	atomic64_inc(&sbi->stats.csum_verified);
+	if (ouichefs_crc(sbi, data, len) == expected)
+		return true;
+	atomic64_inc(&sbi->stats.csum_errors);
+	pr_err_ratelimited("block %u: checksum mismatch\n", bno);
+	return false;
+}
+
+/*
+ * Record the checksum of len bytes of data as the content of block bno.
+ */
+static void ouichefs_csum_store(struct ouichefs_sb_info *sbi, uint32_t bno,
+				const void *data, size_t len)
+{
+	if (bno >= sbi->nr_blocks)
+		return;
+	WRITE_ONCE(sbi->csums[bno], ouichefs_crc(sbi, data, len));
+	set_bit(bno / (OUICHEFS_BSIZE(sbi->sb) / sizeof(*sbi->csums)),
+		sbi->csum_dirty);
+	atomic64_inc(&sbi->stats.csum_computed);
+}
+
+/*
+ * Read metadata block bno and verify its checksum if it was not verified
+ * since it was read. Return NULL on I/O error or checksum mismatch.
+ */
+struct buffer_head *ouichefs_bread(struct super_block *sb, uint32_t bno)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct buffer_head *bh;
+	bool ok = true;
+
+	bh = sb_bread(sb, bno);
+	if (!bh || !sbi->csums)
+		return bh;
+	if (buffer_verified(bh)) {
+		atomic64_inc(&sbi->stats.csum_cached);
+		return bh;
+	}
+
+	/* Blocks shared by several inodes are modified under the buffer lock */
+	lock_buffer(bh);
+	if (!buffer_verified(bh)) {
+		ok = ouichefs_csum_match(sbi, bno, bh->b_data, bh->b_size);
+		if (ok)
+			set_buffer_verified(bh);
+	}
+	unlock_buffer(bh);
+
+	if (!ok) {
+		brelse(bh);
+		return NULL;
+	}
+	return bh;
+}
+
+/*
+ * Record the checksum of the current content of bh. Blocks shared by several
+ * inodes must be locked by the caller.
+ */
+void ouichefs_csum_set(struct super_block *sb, struct buffer_head *bh)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+
+	if (!sbi->csums)
+		return;
+	ouichefs_csum_store(sbi, bh->b_blocknr, bh->b_data, bh->b_size);
+	set_buffer_verified(bh);
+}
+
+/*
+ * Mark a modified metadata block dirty, attached to inode if not NULL, after
+ * recording its checksum.
+ */
+void ouichefs_mark_dirty(struct super_block *sb, struct buffer_head *bh,
+			 struct inode *inode)
+{
+	ouichefs_csum_set(sb, bh);
+	if (inode)
+		mark_buffer_dirty_inode(bh, inode);
+	else
+		mark_buffer_dirty(bh);
+}
+
+/*
+ * Record the checksum of block bno, whose data was just written at offset in
+ * page. page is locked.
+ */
+void ouichefs_csum_set_page(struct inode *inode, struct page *page,
+			    unsigned int offset, uint32_t bno)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(inode->i_sb);
+	void *kaddr;
+
+	if (!sbi->data_csum)
+		return;
+	kaddr = kmap_atomic(page);
+	ouichefs_csum_store(sbi, bno, kaddr + offset, i_blocksize(inode));
+	kunmap_atomic(kaddr);
+}
+
+/*
+ * Check the data of block bno read at offset in page against its checksum.
+ */
+bool ouichefs_csum_verify_data(struct inode *inode, struct page *page,
+			       unsigned int offset, uint32_t bno)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(inode->i_sb);
+	void *kaddr;
+	bool ok;
+
+	kaddr = kmap_atomic(page);
+	ok = ouichefs_csum_match(sbi, bno, kaddr + offset, i_blocksize(inode));
+	kunmap_atomic(kaddr);
+	return ok;
+}
+
+/*
+ * Load the checksum map of the partition and verify the superblock, whose
+ * buffer is sb_bh. The map of a partition that was not unmounted cleanly
+ * is dropped, all its blocks are written again by the next sync.
+ */
+int ouichefs_csum_load(struct super_block *sb, struct buffer_head *sb_bh)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct buffer_head *bh;
+	uint32_t i, first = ouichefs_csum_block(sbi);
+
+	if (!(sbi->features & OUICHEFS_FEATURE_METADATA_CSUM))
+		return 0;
+	if ((uint64_t)sbi->nr_csum_blocks * OUICHEFS_BSIZE(sb) <
+	    (uint64_t)sbi->nr_blocks * sizeof(*sbi->csums)) {
+		pr_err("Checksum map too small\n");
+		return -EINVAL;
+	}
+
+	sbi->csums = kvzalloc(sbi->nr_csum_blocks * OUICHEFS_BSIZE(sb),
+			      GFP_KERNEL);
+	sbi->csum_dirty = bitmap_zalloc(sbi->nr_csum_blocks, GFP_KERNEL);
+	if (!sbi->csums || !sbi->csum_dirty) {
+		ouichefs_csum_free(sbi);
+		return -ENOMEM;
+	}
+	if (sbi->state & OUICHEFS_STATE_DIRTY) {
+		pr_warn("not unmounted cleanly, checksums dropped, run fsck.ouichefs\n");
+		bitmap_fill(sbi->csum_dirty, sbi->nr_csum_blocks);
+		return 0;
+	}
+	for (i = 0; i < sbi->nr_csum_blocks; i++) {
+		bh = sb_bread(sb, first + i);
+		if (!bh) {
+			ouichefs_csum_free(sbi);
+			return -EIO;
+		}
+		memcpy((void *)sbi->csums + i * OUICHEFS_BSIZE(sb),
+		       bh->b_data, OUICHEFS_BSIZE(sb));
+		brelse(bh);
+	}
+
+	if (!ouichefs_csum_match(sbi, OUICHEFS_SB_BLOCK_NR, sb_bh->b_data,
+				 sb_bh->b_size)) {
+		pr_err("Corrupted superblock\n");
+		ouichefs_csum_free(sbi);
+		return -EUCLEAN;
+	}
+	set_buffer_verified(sb_bh);
+	return 0;
+}
+
+void ouichefs_csum_free(struct ouichefs_sb_info *sbi)
+{
+	kvfree(sbi->csums);
+	sbi->csums = NULL;
+	bitmap_free(sbi->csum_dirty);
+	sbi->csum_dirty = NULL;
+}
+
+/*
+ * Flush the blocks of the checksum map changed since they were last
+ * written, then wait for all of them at once. Entries are copied without
+ * lock: words are copied whole and a concurrent change dirties the block
+ * again for the next sync.
+ */
+int ouichefs_csum_sync(struct super_block *sb, int wait)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct buffer_head *bh;
+	uint32_t i, first = ouichefs_csum_block(sbi);
+
+	if (!sbi->csums)
+		return 0;
+	for_each_set_bit(i, sbi->csum_dirty, sbi->nr_csum_blocks) {
+		clear_bit(i, sbi->csum_dirty);
+		bh = sb_bread(sb, first + i);
+		if (!bh) {
+			set_bit(i, sbi->csum_dirty);
+			return -EIO;
+		}
+
+		lock_buffer(bh);
+		memcpy(bh->b_data,
+		       (void *)sbi->csums + i * OUICHEFS_BSIZE(sb),
+		       OUICHEFS_BSIZE(sb));
+		unlock_buffer(bh);
+
+		mark_buffer_dirty(bh);
+		if (!wait)
+			write_dirty_buffer(bh, 0);
+		brelse(bh);
+	}
+	return wait ? sync_blockdev(sb->s_bdev) : 0;
+}
@@ -0,0 +1,658 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * ouiche_fs - a simple educational filesystem for Linux
+ *
+ * Copyright (C) 2018 Redha Gouicem <redha.gouicem@lip6.fr>
+ */
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/buffer_head.h>
+#include <linux/jiffies.h>
+#include <linux/math64.h>
+#include <linux/mount.h>
+#include <linux/pagemap.h>
+#include <linux/sched/signal.h>
+#include <linux/slab.h>
+#include <linux/uaccess.h>
+
+#include "ouichefs.h"
+#include "bitmap.h"
+#include "test/requettes.h"
+
+/*
+ * Online defragmentation. Every write copies the latest version of a file,
+ * so its blocks end up scattered in the order the allocator finds them and
+ * reading it sequentially turns into random I/O. The defragmentation moves
+ * the latest version to a single run of blocks: its index block followed by
+ * its data blocks in file order. With OUICHEFS_DEFRAG_HISTORY, the older
+ * versions are then packed one run each from the end of the partition, away
+ * from the blocks of the latest versions.
+ *
+ * The data of the latest version, when it is viewed, is in the page cache:
+ * each block is copied from its page. The other versions are copied through
+ * the buffer cache. A copy is on disk before an index or the version table
+ * points to it, and the old blocks are only freed once the index, the table
+ * and the inode pointing to the copies are on disk, so that a crash never
+ * leaves a file with blocks given back. The inode lock is held while blocks
+ * are moved but released when the rate limit is reached, so that the
+ * writers of the file go on meanwhile.
+ */
+
+/* Blocks of older versions moved at most before their table is written */
+#define OUICHEFS_DEFRAG_BATCH	1024
+
+/* A version moved, whose old blocks are freed once the move is on disk */
+struct ouichefs_moved {
+	uint32_t old;   /* Its old index block */
+	uint32_t flags; /* OUICHEFS_VREC_* flags of the version */
+	uint32_t run;   /* First block of its new run */
+	uint32_t len;   /* Blocks of the run */
+};
+
+static void ouichefs_put_run(struct ouichefs_sb_info *sbi, uint32_t first,
+			     uint32_t len)
+{
+	while (len--)
+		put_block(sbi, first++);
+}
+
+/*
+ * Count the data blocks of a version and the runs of contiguous blocks it is
+ * made of, its index block followed by its data blocks in file order.
+ * Return the number of runs or an error. The caller must hold index_lock.
+ */
+static int ouichefs_version_extents(struct super_block *sb,
+				    uint32_t index_block, uint32_t flags,
+				    uint32_t *nr_data)
+{
+	struct ouichefs_file_index_block *index;
+	struct buffer_head *bh;
+	uint32_t prev = index_block, i;
+	int nr = 1;
+
+	*nr_data = 0;
+	if (flags & OUICHEFS_VREC_INLINE)
+		return nr;
+	bh = ouichefs_bread(sb, index_block);
+	if (!bh)
+		return -EIO;
+	index = (struct ouichefs_file_index_block *)bh->b_data;
+	for (i = 0; i < OUICHEFS_INDEX_NR_DATA(sb); i++) {
+		if (!index->blocks[i])
+			continue;
+		if (index->blocks[i] != prev + 1)
+			nr++;
+		prev = index->blocks[i];
+		(*nr_data)++;
+	}
+	brelse(bh);
+	return nr;
+}
+
+/*
+ * Wait until the blocks moved so far fit in the rate limit, without the
+ * inode lock. Return -EINTR if the task was killed meanwhile.
+ */
+static int ouichefs_defrag_throttle(struct inode *inode,
+				    struct ouichefs_defrag *d,
+				    unsigned long start)
+{
+	unsigned long due;
+
+	if (d->max_rate) {
+		due = start + div_u64((u64)d->moved * HZ, d->max_rate);
+		if (time_before(jiffies, due)) {
+			inode_unlock(inode);
+			schedule_timeout_killable(due - jiffies);
+			inode_lock(inode);
+			inode_dio_wait(inode);
+		}
+	} else {
+		cond_resched();
+	}
+	return fatal_signal_pending(current) ? -EINTR : 0;
+}
+
+/*
+ * Write the blocks moved and the metadata of inode pointing to them, before
+ * the old blocks are freed. Called with the inode lock held but without
+ * index_lock.
+ */
+static int ouichefs_defrag_sync(struct inode *inode)
+{
+	int ret = sync_mapping_buffers(inode->i_mapping);
+
+	if (!ret)
+		ret = write_inode_now(inode, 1);
+	return ret;
+}
+
+/*
+ * Copy a version that is not in the page cache to the len blocks starting at
+ * run, through the buffer cache: its index block first, then its data blocks
+ * in file order. The copies are dirty, the caller writes them before
+ * pointing to run, and frees the old blocks once that is on disk. On error,
+ * the version is left as it was. The caller must hold index_lock.
+ */
+static int ouichefs_move_version(struct inode *inode,
+				 struct ouichefs_version_record *rec,
+				 uint32_t run, uint32_t len)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ouichefs_file_index_block *index;
+	struct buffer_head *bh, *bh_index, *bh_new;
+	uint32_t k, next = run + 1;
+
+	bh = ouichefs_bread(sb, rec->index_block);
+	if (!bh)
+		return -EIO;
+	bh_index = ouichefs_get_new_block(sb, inode, run, bh->b_data);
+	brelse(bh);
+	if (!bh_index)
+		return -EIO;
+	index = (struct ouichefs_file_index_block *)bh_index->b_data;
+
+	for (k = 0; k < OUICHEFS_INDEX_NR_DATA(sb) &&
+	     !(rec->flags & OUICHEFS_VREC_INLINE); k++) {
+		if (!index->blocks[k])
+			continue;
+		if (next == run + len)
+			goto err;
+		bh = ouichefs_bread(sb, index->blocks[k]);
+		if (!bh)
+			goto err;
+		bh_new = ouichefs_get_new_block(sb, inode, next, bh->b_data);
+		brelse(bh);
+		if (!bh_new)
+			goto err;
+		brelse(bh_new);
+		index->blocks[k] = next++;
+	}
+	ouichefs_mark_dirty(sb, bh_index, inode);
+	brelse(bh_index);
+	return 0;
+
+err:
+	/* The copies made are in blocks given back with the run */
+	bforget(bh_index);
+	return -EIO;
+}
+
+/*
+ * Move the data block mapping block k of the latest version to block bno,
+ * copied from its page, which is locked meanwhile: the copy is written to
+ * bno, then the index points to it. The old block is returned in *old, to
+ * be freed once the index is on disk. Return 1 if block k is a hole,
+ * -EAGAIN if the latest version is not viewed anymore.
+ */
+static int ouichefs_move_cached_block(struct inode *inode, uint32_t k,
+				      uint32_t bno, uint32_t *old)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct ouichefs_file_index_block *index;
+	struct buffer_head *bh_index, *bh_new;
+	loff_t pos = (loff_t)k << inode->i_blkbits;
+	struct page *page;
+	int ret;
+
+	page = read_mapping_page(inode->i_mapping, pos >> PAGE_SHIFT, NULL);
+	if (IS_ERR(page))
+		return PTR_ERR(page);
+	lock_page(page);
+	/* The block written back meanwhile would be freed under the I/O */
+	wait_on_page_writeback(page);
+
+	mutex_lock(&ci->index_lock);
+	ret = -EAGAIN;
+	if (ci->index_block != ci->last_index_block ||
+	    (ci->last_flags & OUICHEFS_VREC_INLINE))
+		goto unlock;
+	ret = -EIO;
+	bh_index = ouichefs_bread(sb, ci->index_block);
+	if (!bh_index)
+		goto unlock;
+	index = (struct ouichefs_file_index_block *)bh_index->b_data;
+	ret = 1;
+	*old = index->blocks[k];
+	if (!*old)
+		goto brelse_index;
+
+	ret = -EIO;
+	bh_new = ouichefs_get_new_block(sb, NULL, bno,
+					kmap(page) + offset_in_page(pos));
+	kunmap(page);
+	if (!bh_new)
+		goto brelse_index;
+	if (sync_dirty_buffer(bh_new)) {
+		brelse(bh_new);
+		goto brelse_index;
+	}
+	/* Later writes go through the page cache, the buffer would be stale */
+	lock_buffer(bh_new);
+	clear_buffer_uptodate(bh_new);
+	unlock_buffer(bh_new);
+	brelse(bh_new);
+
+	ouichefs_csum_set_page(inode, page, offset_in_page(pos), bno);
+	index->blocks[k] = bno;
+	ouichefs_mark_dirty(sb, bh_index, inode);
+	ouichefs_map_changed(ci);
+	ret = 0;
+brelse_index:
+	brelse(bh_index);
+unlock:
+	mutex_unlock(&ci->index_lock);
+	unlock_page(page);
+	put_page(page);
+	return ret;
+}
+
+/*
+ * Move the data blocks of the latest version, which is viewed, to the blocks
+ * following run, in file order, through the page cache. The number of
+ * blocks of the run used is returned in *used, even on error, and their old
+ * blocks in olds, which has room for nr_data of them.
+ */
+static int ouichefs_move_cached(struct inode *inode,
+				struct ouichefs_defrag *d, unsigned long start,
+				uint32_t run, uint32_t nr_data, uint32_t *olds,
+				uint32_t *used)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct ouichefs_file_index_block *index;
+	struct buffer_head *bh;
+	uint32_t *slots, nr = 0, k;
+	int ret = 0;
+
+	*used = 0;
+
+	slots = kvmalloc_array(nr_data, sizeof(*slots), GFP_KERNEL);
+	if (!slots)
+		return -ENOMEM;
+
+	/* The blocks to move, writeback may only fill holes meanwhile */
+	mutex_lock(&ci->index_lock);
+	bh = ouichefs_bread(sb, ci->last_index_block);
+	if (!bh) {
+		mutex_unlock(&ci->index_lock);
+		kvfree(slots);
+		return -EIO;
+	}
+	index = (struct ouichefs_file_index_block *)bh->b_data;
+	for (k = 0; k < OUICHEFS_INDEX_NR_DATA(sb) && nr < nr_data; k++)
+		if (index->blocks[k])
+			slots[nr++] = k;
+	brelse(bh);
+	mutex_unlock(&ci->index_lock);
+
+	for (k = 0; k < nr; k++) {
+		ret = ouichefs_move_cached_block(inode, slots[k],
+						 run + 1 + *used,
+						 &olds[*used]);
+		if (ret < 0)
+			break;
+		if (ret)
+			continue;
+		(*used)++;
+		d->moved++;
+		ret = ouichefs_defrag_throttle(inode, d, start);
+		if (ret)
+			break;
+	}
+	kvfree(slots);
+
+	/* Writers may have moved on to another view while throttled */
+	if (ret == -EAGAIN)
+		ret = 0;
+	return ret;
+}
+
+/*
+ * Record that the index block of the latest version moved from old to bno.
+ * The caller must hold index_lock.
+ */
+static void ouichefs_latest_moved(struct ouichefs_inode_info *ci,
+				  uint32_t old, uint32_t bno)
+{
+	struct ouichefs_version_record *latest;
+
+	ci->last_index_block = bno;
+	if (ci->index_block == old) {
+		ci->index_block = bno;
+		ouichefs_map_changed(ci);
+	}
+	latest = ouichefs_latest_version(ci);
+	if (latest && latest->index_block == old)
+		latest->index_block = bno;
+}
+
+/*
+ * Move the index block of the latest version to block bno. The copy is
+ * written before the inode points to it, the old block is left to the
+ * caller. The caller must hold index_lock.
+ */
+static int ouichefs_move_latest_index(struct inode *inode, uint32_t bno)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct buffer_head *bh, *bh_new;
+	uint32_t old = ci->last_index_block;
+	int ret;
+
+	bh = ouichefs_bread(sb, old);
+	if (!bh)
+		return -EIO;
+	bh_new = ouichefs_get_new_block(sb, inode, bno, bh->b_data);
+	brelse(bh);
+	if (!bh_new)
+		return -EIO;
+	ret = sync_dirty_buffer(bh_new);
+	brelse(bh_new);
+	if (ret)
+		return ret;
+	ouichefs_latest_moved(ci, old, bno);
+	return 0;
+}
+
+/* Free the old index block of the latest version, the inode moved off it */
+static void ouichefs_release_index(struct super_block *sb, uint32_t old)
+{
+	bforget(sb_find_get_block(sb->s_bdev, old));
+	ouichefs_release_block(sb, old);
+}
+
+/*
+ * Count the runs of the latest version once moved. The caller must hold
+ * index_lock.
+ */
+static void ouichefs_count_latest(struct inode *inode,
+				  struct ouichefs_defrag *d)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	uint32_t nr_data;
+	int ret;
+
+	ret = ouichefs_version_extents(inode->i_sb, ci->last_index_block,
+				       ci->last_flags, &nr_data);
+	if (ret > 0)
+		d->extents_after = ret;
+}
+
+/*
+ * Move the latest version of inode to a single run of blocks, looked for
+ * from the group of the inode.
+ */
+static int ouichefs_defrag_latest(struct inode *inode,
+				  struct ouichefs_defrag *d,
+				  unsigned long start)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct ouichefs_version_record rec = { 0 };
+	uint32_t nr_data, run, used, old, *olds, k;
+	bool cached;
+	int ret, err;
+
+	mutex_lock(&ci->index_lock);
+	ret = ouichefs_version_extents(sb, ci->last_index_block,
+				       ci->last_flags, &nr_data);
+	cached = ci->index_block == ci->last_index_block;
+	mutex_unlock(&ci->index_lock);
+	if (ret < 0)
+		return ret;
+	d->extents_before = ret;
+	d->extents_after = ret;
+	if (ret <= 1)
+		return 0;
+
+	run = get_free_run(sbi, ouichefs_ino_group(sbi, inode->i_ino),
+			   nr_data + 1, false);
+	if (!run) {
+		d->skipped++;
+		return 0;
+	}
+
+	if (!cached) {
+		/* Only the latest version can be written, it does not change */
+		mutex_lock(&ci->index_lock);
+		rec.index_block = ci->last_index_block;
+		rec.flags = ci->last_flags;
+		ret = ouichefs_move_version(inode, &rec, run, nr_data + 1);
+		if (!ret)
+			ret = sync_mapping_buffers(inode->i_mapping);
+		if (ret) {
+			mutex_unlock(&ci->index_lock);
+			ouichefs_put_run(sbi, run, nr_data + 1);
+			return ret;
+		}
+		ouichefs_latest_moved(ci, rec.index_block, run);
+		d->moved += nr_data + 1;
+		ouichefs_count_latest(inode, d);
+		mutex_unlock(&ci->index_lock);
+
+		mark_inode_dirty(inode);
+		ret = ouichefs_defrag_sync(inode);
+		if (!ret)
+			ouichefs_free_version(sb, rec.index_block, rec.flags);
+		return ret;
+	}
+
+	olds = kvmalloc_array(nr_data, sizeof(*olds), GFP_KERNEL);
+	if (!olds) {
+		ouichefs_put_run(sbi, run, nr_data + 1);
+		return -ENOMEM;
+	}
+	ret = ouichefs_move_cached(inode, d, start, run, nr_data, olds,
+				   &used);
+	/* Holes made by writers meanwhile leave blocks of the run unused */
+	ouichefs_put_run(sbi, run + 1 + used, nr_data - used);
+	mutex_lock(&ci->index_lock);
+	old = ci->last_index_block;
+	err = ouichefs_move_latest_index(inode, run);
+	if (err) {
+		/* The old index block points to the blocks moved */
+		put_block(sbi, run);
+		old = 0;
+	} else {
+		d->moved++;
+	}
+	ouichefs_count_latest(inode, d);
+	mutex_unlock(&ci->index_lock);
+	if (!ret)
+		ret = err;
+
+	/* The old blocks are freed once nothing on disk points to them */
+	mark_inode_dirty(inode);
+	err = ouichefs_defrag_sync(inode);
+	if (!err) {
+		for (k = 0; k < used; k++)
+			ouichefs_release_block(sb, olds[k]);
+		if (old)
+			ouichefs_release_index(sb, old);
+	}
+	kvfree(olds);
+	return ret ? ret : err;
+}
+
+/*
+ * Write the copies of the versions of a batch, then their table pointing to
+ * them. If the table can not be written, the records cached are dropped, to
+ * be read back from the table left as it was. The caller must hold
+ * index_lock.
+ */
+static int ouichefs_commit_moved(struct inode *inode)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	int ret;
+
+	ret = sync_mapping_buffers(inode->i_mapping);
+	if (!ret)
+		ret = ouichefs_commit_versions(inode, ci->versions,
+					       ci->nr_cached);
+	if (ret)
+		ouichefs_drop_versions(ci);
+	return ret;
+}
+
+/*
+ * Free the old blocks of the versions of a batch once their table is on
+ * disk, or give back their copies if the table could not be written
+ * (ret). Called without index_lock.
+ */
+static int ouichefs_finish_moved(struct inode *inode,
+				 struct ouichefs_moved *moved, uint32_t nr,
+				 int ret)
+{
+	struct super_block *sb = inode->i_sb;
+	uint32_t i;
+
+	if (ret) {
+		for (i = 0; i < nr; i++)
+			ouichefs_put_run(OUICHEFS_SB(sb), moved[i].run,
+					 moved[i].len);
+		return ret;
+	}
+	mark_inode_dirty(inode);
+	ret = ouichefs_defrag_sync(inode);
+	if (ret)
+		return ret;
+	for (i = 0; i < nr; i++)
+		ouichefs_free_version(sb, moved[i].old, moved[i].flags);
+	return 0;
+}
+
+/*
+ * Pack the older versions of inode at the end of the partition, one run
+ * each, from the oldest one. A version is only moved if it gets contiguous
+ * or closer to the end. The version viewed is left in place since its data
+ * is in the page cache.
+ */
+static int ouichefs_defrag_history(struct inode *inode,
+				   struct ouichefs_defrag *d,
+				   unsigned long start)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct ouichefs_version_record *rec;
+	struct ouichefs_moved *moved;
+	uint32_t next = 0, batch, nr_data, run, i, nr;
+	bool more = true;
+	int ret, err;
+
+	/* Every version moved takes one block of the batch at least */
+	moved = kvmalloc_array(OUICHEFS_DEFRAG_BATCH, sizeof(*moved),
+			       GFP_KERNEL);
+	if (!moved)
+		return -ENOMEM;
+
+	while (more) {
+		mutex_lock(&ci->index_lock);
+		ret = ouichefs_load_versions(inode);
+		more = false;
+		nr = 0;
+		batch = 0;
+		/* Numbers grow with the versions, resume after the last seen */
+		for (i = 0; !ret && i + 1 < ci->nr_cached; i++) {
+			rec = &ci->versions[i];
+			if (rec->number < next)
+				continue;
+			if (batch >= OUICHEFS_DEFRAG_BATCH) {
+				more = true;
+				break;
+			}
+			next = rec->number + 1;
+			if (rec->index_block == ci->index_block)
+				continue;
+
+			ret = ouichefs_version_extents(sb, rec->index_block,
+						       rec->flags, &nr_data);
+			if (ret < 0)
+				break;
+			run = get_free_run(sbi, 0, nr_data + 1, true);
+			if (!run) {
+				d->skipped++;
+				ret = 0;
+				continue;
+			}
+			if (ret == 1 && run < rec->index_block) {
+				ouichefs_put_run(sbi, run, nr_data + 1);
+				ret = 0;
+				continue;
+			}
+			ret = ouichefs_move_version(inode, rec, run,
+						    nr_data + 1);
+			if (ret) {
+				ouichefs_put_run(sbi, run, nr_data + 1);
+				break;
+			}
+			moved[nr].old = rec->index_block;
+			moved[nr].flags = rec->flags;
+			moved[nr].run = run;
+			moved[nr].len = nr_data + 1;
+			nr++;
+			rec->index_block = run;
+			batch += nr_data + 1;
+			d->moved += nr_data + 1;
+		}
+		err = nr ? ouichefs_commit_moved(inode) : 0;
+		mutex_unlock(&ci->index_lock);
+		if (nr)
+			err = ouichefs_finish_moved(inode, moved, nr, err);
+		if (!ret)
+			ret = err;
+		if (!ret)
+			ret = ouichefs_defrag_throttle(inode, d, start);
+		if (ret)
+			break;
+	}
+	kvfree(moved);
+	return ret;
+}
+
+long ouichefs_ioctl_defrag(struct file *file, void __user *arg)
+{
+	struct inode *inode = file_inode(file);
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(inode->i_sb);
+	struct ouichefs_defrag __user *ud = arg;
+	struct ouichefs_defrag d;
+	unsigned long start = jiffies;
+	long ret;
+
+	if (copy_from_user(&d, ud, sizeof(d)))
+		return -EFAULT;
+	if (d.flags & ~OUICHEFS_DEFRAG_HISTORY)
+		return -EINVAL;
+	if (!S_ISREG(inode->i_mode))
+		return -EINVAL;
+	if (!(file->f_mode & FMODE_WRITE))
+		return -EBADF;
+	ret = mnt_want_write_file(file);
+	if (ret)
+		return ret;
+
+	d.moved = 0;
+	d.skipped = 0;
+	inode_lock(inode);
+	/* Direct I/O completions update the index blocks moved */
+	inode_dio_wait(inode);
+	ret = ouichefs_defrag_latest(inode, &d, start);
+	if (!ret && (d.flags & OUICHEFS_DEFRAG_HISTORY))
+		ret = ouichefs_defrag_history(inode, &d, start);
+	inode_unlock(inode);
+	mnt_drop_write_file(file);
+
+	atomic64_add(d.moved, &sbi->stats.defrag_moved);
+	pr_debug("inode %lu: %u blocks moved, %u -> %u runs\n",
+		 inode->i_ino, d.moved, d.extents_before, d.extents_after);
+	/* What was done is reported even if it stopped on an error */
+	if (copy_to_user(ud, &d, sizeof(d)))
+		ret = -EFAULT;
+	return ret;
+}
@@ -44,7 +44,7 @@ static int ouichefs_iterate(struct file *dir, struct dir_context *ctx)
 		return 0;
 
 	/* Read the directory index block on disk */
-	bh = sb_bread(sb, ci->index_block);
+	bh = ouichefs_bread(sb, ci->index_block);
 	if (!bh)
 		return -EIO;
 	dblock = (struct ouichefs_dir_block *)bh->b_data;
@@ -10,189 +10,631 @@
 #include <linux/module.h>
 #include <linux/kernel.h>
 #include <linux/fs.h>
+#include <linux/bio.h>
+#include <linux/blkdev.h>
 #include <linux/buffer_head.h>
-#include <linux/mpage.h>
+#include <linux/iomap.h>
+#include <linux/pagemap.h>
+#include <linux/string.h>
+#include <linux/uio.h>
 #include "test/requettes.h"
 #include "ouichefs.h"
 #include "bitmap.h"
 
 /*
- * Map the buffer_head passed in argument with the iblock-th block of the file
- * represented by inode. If the requested block is not allocated and create is
- * true,  allocate a new block on disk and map it.
+ * The data path is built on iomap: ouichefs_iomap_begin() maps a whole
+ * extent of the current view of a file at once, so that reads, writes,
+ * writeback, direct I/O and fiemap work on runs of blocks instead of calling
+ * back for each block.
  */
 
-static int affiche_data_in_block(struct ouichefs_inode_info *ci,
-				 struct super_block *sb)
+/*
+ * Map the extent of the current view of inode that starts at pos, at most
+ * length bytes long: a run of slots of its index block holding contiguous
+ * blocks, or a run of holes. With IOMAP_WRITE, a hole is filled with new
+ * blocks first, as long as they are contiguous, and only they are mapped,
+ * with IOMAP_F_NEW. An inline view is mapped as IOMAP_INLINE and its index
+ * block is held in iomap->private until ouichefs_iomap_end(), or as a hole if
+ * inline_ok is false. If seq is not NULL, it is set to the mapping sequence
+ * the extent is valid for, see ouichefs_map_changed().
+ */
+static int ouichefs_map_extent(struct inode *inode, loff_t pos, loff_t length,
+			       unsigned int flags, struct iomap *iomap,
+			       bool inline_ok, uint32_t *seq)
 {
-	int err = 0;
-	struct buffer_head *bh_current_block;
-	struct buffer_head *buffer_head;
+	struct super_block *sb = inode->i_sb;
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
 	struct ouichefs_file_index_block *index;
+	struct ouichefs_version_record *latest;
+	struct buffer_head *bh;
+	uint32_t first = pos >> inode->i_blkbits, last, k, bno;
+	int ret = 0;
+
+	/* If block number exceeds filesize, fail */
+	if (first >= OUICHEFS_INDEX_NR_DATA(sb))
+		return -EFBIG;
+	last = min_t(loff_t, (pos + max_t(loff_t, length, 1) - 1) >>
+		     inode->i_blkbits, OUICHEFS_INDEX_NR_DATA(sb) - 1);
+
+	iomap->bdev = sb->s_bdev;
+	iomap->offset = (loff_t)first << inode->i_blkbits;
+	iomap->addr = IOMAP_NULL_ADDR;
+	iomap->flags = 0;
+	iomap->inline_data = NULL;
+	iomap->private = NULL;
 
-	if ((ci == NULL) || (sb == NULL)) {
-		pr_err("Un block n'est pas alloué\n");
-		err = -1;
-		goto err_1;
-	}
-	bh_current_block = sb_bread(sb, ci->index_block);
-	if (!bh_current_block) {
-		err = -EIO;
-		goto err_1;
-	}
 	/*
-	 * récupère le pointeur vers le début des numéros de block où sont
-	 * stocké les données du fichier
+	 * We may be called from writeback without the inode lock, serialize
+	 * with version changes and other allocations in the index block.
 	 */
-	index = (struct ouichefs_file_index_block *)bh_current_block->b_data;
-	int i = 0;
+	mutex_lock(&ci->index_lock);
+	bh = ouichefs_bread(sb, ci->index_block);
+	if (!bh) {
+		ret = -EIO;
+		goto unlock;
+	}
+	index = (struct ouichefs_file_index_block *)bh->b_data;
 
-	while (index->blocks[i] > 0) {
-		buffer_head = sb_bread(sb, index->blocks[i]);
-		if (!buffer_head) {
-			pr_info("erreur I/O\n");
-			err = -EIO;
-			goto err_1;
+	/* The slots of an inline version hold data, not block numbers */
+	if (ouichefs_view_flags(ci) & OUICHEFS_VREC_INLINE) {
+		if (!inline_ok || pos >= OUICHEFS_INLINE_MAX(sb)) {
+			iomap->type = IOMAP_HOLE;
+			iomap->length = (loff_t)(last - first + 1) <<
+				inode->i_blkbits;
+			goto brelse;
 		}
-		pr_info("{current block : %d} | \
-			[Data in block number %d] :%s\n",
-			ci->index_block, index->blocks[i],
-			buffer_head->b_data);
-
-		brelse(buffer_head);
-		i++;
+		iomap->type = IOMAP_INLINE;
+		iomap->offset = 0;
+		iomap->length = OUICHEFS_INLINE_MAX(sb);
+		iomap->inline_data = index->blocks;
+		iomap->private = bh;
+		goto unlock;
 	}
-err_2:
-	brelse(bh_current_block);
-err_1:
-	return err;
-}
 
+	if (!index->blocks[first] && (flags & IOMAP_WRITE)) {
+		for (k = first; k <= last && !index->blocks[k]; k++) {
+			bno = get_free_block(sbi,
+					     ouichefs_ino_group(sbi, inode->i_ino));
+			if (!bno)
+				break;
+			if (k > first && bno != index->blocks[k - 1] + 1) {
+				put_block(sbi, bno);
+				break;
+			}
+			index->blocks[k] = bno;
+			/* Its checksum is recorded when data is written to it */
+			if (sbi->csums)
+				WRITE_ONCE(sbi->csums[bno], 0);
+		}
+		if (k == first) {
+			ret = -ENOSPC;
+			goto brelse;
+		}
+		ouichefs_mark_dirty(sb, bh, inode);
+		latest = ouichefs_latest_version(ci);
+		if (latest && latest->index_block == ci->index_block)
+			latest->nr_blocks += k - first;
+		ouichefs_map_changed(ci);
+		iomap->flags |= IOMAP_F_NEW;
+		last = k - 1;
+	}
 
+	if (!index->blocks[first]) {
+		for (k = first + 1; k <= last && !index->blocks[k]; k++)
+			;
+		iomap->type = IOMAP_HOLE;
+	} else {
+		for (k = first + 1; k <= last &&
+		     index->blocks[k] == index->blocks[k - 1] + 1; k++)
+			;
+		iomap->type = IOMAP_MAPPED;
+		iomap->addr = (u64)index->blocks[first] << inode->i_blkbits;
+	}
+	iomap->length = (loff_t)(k - first) << inode->i_blkbits;
+brelse:
+	brelse(bh);
+unlock:
+	if (seq)
+		*seq = ci->map_seq;
+	mutex_unlock(&ci->index_lock);
+	return ret;
+}
 
-static int ouichefs_file_get_block(struct inode *inode, sector_t iblock,
-				   struct buffer_head *bh_result, int create)
+/*
+ * Give back the blocks of the latest version allocated for [start, end) by
+ * ouichefs_map_extent() but not written, after a short write, so that they
+ * do not expose stale data.
+ */
+static void ouichefs_put_unwritten(struct inode *inode, loff_t start,
+				   loff_t end)
 {
 	struct super_block *sb = inode->i_sb;
 	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
 	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
 	struct ouichefs_file_index_block *index;
-	struct buffer_head *bh_index;
-	bool alloc = false;
-	int ret = 0, bno;
-	/* If block number exceeds filesize, fail */
-	if (iblock >= (OUICHEFS_BLOCK_SIZE >> 2) - 1)
-		return -EFBIG;
-	/* Read index block from disk */
-	bh_index = sb_bread(sb, ci->index_block);
-	if (!bh_index)
+	struct ouichefs_version_record *latest;
+	struct buffer_head *bh;
+	uint32_t k, nr = 0;
+
+	mutex_lock(&ci->index_lock);
+	bh = ouichefs_bread(sb, ci->index_block);
+	if (!bh)
+		goto unlock;
+	index = (struct ouichefs_file_index_block *)bh->b_data;
+	for (k = start >> inode->i_blkbits; k < end >> inode->i_blkbits; k++) {
+		if (!index->blocks[k])
+			continue;
+		put_block(sbi, index->blocks[k]);
+		index->blocks[k] = 0;
+		nr++;
+	}
+	if (nr) {
+		ouichefs_mark_dirty(sb, bh, inode);
+		latest = ouichefs_latest_version(ci);
+		if (latest && latest->index_block == ci->index_block)
+			latest->nr_blocks -= nr;
+		ouichefs_map_changed(ci);
+	}
+	brelse(bh);
+unlock:
+	mutex_unlock(&ci->index_lock);
+}
+
+/*
+ * Record the checksums of the blocks of iomap overlapping [pos, pos + written)
+ * with the data_csum feature. Data written through the page cache is
+ * checksummed from its pages. Data written directly is not at hand, the
+ * checksums of its blocks are cleared.
+ */
+static void ouichefs_csum_written(struct inode *inode, loff_t pos,
+				  ssize_t written, unsigned int flags,
+				  const struct iomap *iomap)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(inode->i_sb);
+	loff_t off, end = pos + written;
+	struct page *page;
+	uint32_t bno;
+
+	if (!sbi->data_csum)
+		return;
+	for (off = round_down(pos, i_blocksize(inode)); off < end;
+	     off += i_blocksize(inode)) {
+		bno = (iomap->addr + off - iomap->offset) >> inode->i_blkbits;
+		page = NULL;
+		if (!(flags & IOMAP_DIRECT))
+			page = find_lock_page(inode->i_mapping,
+					      off >> PAGE_SHIFT);
+		if (page && PageUptodate(page))
+			ouichefs_csum_set_page(inode, page, offset_in_page(off),
+					       bno);
+		else
+			WRITE_ONCE(sbi->csums[bno], 0);
+		if (page) {
+			unlock_page(page);
+			put_page(page);
+		}
+	}
+}
+
+static int ouichefs_iomap_begin(struct inode *inode, loff_t pos, loff_t length,
+				unsigned int flags, struct iomap *iomap,
+				struct iomap *srcmap)
+{
+	return ouichefs_map_extent(inode, pos, length, flags, iomap, true,
+				   NULL);
+}
+
+/*
+ * Complete an operation on the extent mapped by ouichefs_iomap_begin(). After
+ * a write or a zeroing, the inline data or the checksums of the blocks
+ * written are recorded, and new blocks not written are given back.
+ */
+static int ouichefs_iomap_end(struct inode *inode, loff_t pos, loff_t length,
+			      ssize_t written, unsigned int flags,
+			      struct iomap *iomap)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct buffer_head *bh = iomap->private;
+	loff_t end;
+
+	if (bh) {
+		if ((flags & (IOMAP_WRITE | IOMAP_ZERO)) && written > 0) {
+			mutex_lock(&ci->index_lock);
+			ouichefs_mark_dirty(inode->i_sb, bh, inode);
+			mutex_unlock(&ci->index_lock);
+		}
+		brelse(bh);
+		return 0;
+	}
+	if (!(flags & (IOMAP_WRITE | IOMAP_ZERO)) ||
+	    iomap->type != IOMAP_MAPPED)
+		return 0;
+
+	if (written > 0)
+		ouichefs_csum_written(inode, pos, written, flags, iomap);
+	end = iomap->offset + iomap->length;
+	pos = round_up(pos + max_t(ssize_t, written, 0), i_blocksize(inode));
+	if ((iomap->flags & IOMAP_F_NEW) && pos < end) {
+		if (!(flags & IOMAP_DIRECT))
+			truncate_pagecache_range(inode, pos, end - 1);
+		ouichefs_put_unwritten(inode, pos, end);
+	}
+	return 0;
+}
+
+static const struct iomap_ops ouichefs_iomap_ops = {
+	.iomap_begin = ouichefs_iomap_begin,
+	.iomap_end   = ouichefs_iomap_end,
+};
+
+/*
+ * Read block bno from disk to page at offset off, and verify its checksum
+ * with the data_csum feature.
+ */
+int ouichefs_read_block(struct inode *inode, struct page *page,
+		       unsigned int off, uint32_t bno)
+{
+	struct super_block *sb = inode->i_sb;
+	struct bio *bio;
+	int ret;
+
+	bio = bio_alloc(GFP_NOFS, 1);
+	bio_set_dev(bio, sb->s_bdev);
+	bio->bi_iter.bi_sector = (sector_t)bno <<
+		(inode->i_blkbits - SECTOR_SHIFT);
+	bio->bi_opf = REQ_OP_READ;
+	bio_add_page(bio, page, i_blocksize(inode), off);
+	ret = submit_bio_wait(bio);
+	bio_put(bio);
+	if (ret)
+		return ret;
+	if (OUICHEFS_SB(sb)->data_csum &&
+	    !ouichefs_csum_verify_data(inode, page, off, bno))
 		return -EIO;
-	index = (struct ouichefs_file_index_block *)bh_index->b_data;
-	/*
-	 * Check if iblock is already allocated. If not and create is true,
-	 * allocate it. Else, get the physical block number.
-	 */
-	if (index->blocks[iblock] == 0) {
-		if (!create)
-			return 0;
-		bno = get_free_block(sbi);
-		if (!bno) {
-			ret = -ENOSPC;
-			goto brelse_index;
+	return 0;
+}
+
+/*
+ * Read page block by block and verify the checksum of every block read, with
+ * the data_csum feature: iomap has no hook to check the data read before the
+ * page is made uptodate.
+ */
+static int ouichefs_read_verified(struct inode *inode, struct page *page)
+{
+	unsigned int off, bsize = i_blocksize(inode);
+	struct iomap iomap;
+	int ret = 0;
+
+	for (off = 0; off < PAGE_SIZE; off += bsize) {
+		ret = ouichefs_map_extent(inode, page_offset(page) + off, bsize,
+					  0, &iomap, true, NULL);
+		if (ret)
+			break;
+		if (iomap.type == IOMAP_INLINE) {
+			/* Inline data is in a verified metadata block */
+			brelse(iomap.private);
+			return iomap_readpage(page, &ouichefs_iomap_ops);
 		}
-		index->blocks[iblock] = bno;
-		alloc = true;
-	} else {
-		bno = index->blocks[iblock];
+		if (iomap.type == IOMAP_HOLE) {
+			zero_user(page, off, bsize);
+			continue;
+		}
+
+		ret = ouichefs_read_block(inode, page, off,
+					  iomap.addr >> inode->i_blkbits);
+		if (ret)
+			break;
 	}
-	/* Map the physical block to the given buffer_head */
-	map_bh(bh_result, sb, bno);
-brelse_index:
-	brelse(bh_index);
+
+	if (ret)
+		SetPageError(page);
+	else
+		SetPageUptodate(page);
+	unlock_page(page);
 	return ret;
 }
+
 /*
  * Called by the page cache to read a page from the physical disk and map it in
  * memory.
  */
 static int ouichefs_readpage(struct file *file, struct page *page)
 {
-	return mpage_readpage(page, ouichefs_file_get_block);
+	struct inode *inode = page->mapping->host;
+
+	if (OUICHEFS_SB(inode->i_sb)->data_csum)
+		return ouichefs_read_verified(inode, page);
+	return iomap_readpage(page, &ouichefs_iomap_ops);
+}
+
+static void ouichefs_readahead(struct readahead_control *rac)
+{
+	struct inode *inode = rac->mapping->host;
+	struct page *page;
+
+	if (!OUICHEFS_SB(inode->i_sb)->data_csum) {
+		iomap_readahead(rac, &ouichefs_iomap_ops);
+		return;
+	}
+	while ((page = readahead_page(rac))) {
+		ouichefs_read_verified(inode, page);
+		put_page(page);
+	}
 }
 
+/*
+ * Writeback context. The extent mapped for a page is reused for the next
+ * pages as long as the mapping of the file did not change meanwhile.
+ */
+struct ouichefs_writepage_ctx {
+	struct iomap_writepage_ctx ctx;
+	uint32_t map_seq;
+};
+
+/*
+ * Map the block at offset for writeback. Blocks were allocated by the write
+ * that dirtied them, but for the first page of a file that was inline; a
+ * hole is filled one page at a time. Inline data is in the index block
+ * already, its page is mapped as a hole and skipped.
+ */
+static int ouichefs_map_blocks(struct iomap_writepage_ctx *wpc,
+			       struct inode *inode, loff_t offset)
+{
+	struct ouichefs_writepage_ctx *ctx =
+		container_of(wpc, struct ouichefs_writepage_ctx, ctx);
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	loff_t length = i_size_read(inode) - offset;
+	int ret;
+
+	if (offset >= wpc->iomap.offset &&
+	    offset < wpc->iomap.offset + wpc->iomap.length &&
+	    ctx->map_seq == READ_ONCE(ci->map_seq))
+		return 0;
+
+	ret = ouichefs_map_extent(inode, offset,
+				  max_t(loff_t, length, i_blocksize(inode)), 0,
+				  &wpc->iomap, false, &ctx->map_seq);
+	if (ret || wpc->iomap.type != IOMAP_HOLE)
+		return ret;
+	return ouichefs_map_extent(inode, offset,
+				   PAGE_SIZE - offset_in_page(offset),
+				   IOMAP_WRITE, &wpc->iomap, false,
+				   &ctx->map_seq);
+}
+
+static const struct iomap_writeback_ops ouichefs_writeback_ops = {
+	.map_blocks = ouichefs_map_blocks,
+};
+
 /*
  * Called by the page cache to write a dirty page to the physical disk (when
  * sync is called or when memory is needed).
  */
 static int ouichefs_writepage(struct page *page, struct writeback_control *wbc)
 {
-	return block_write_full_page(page, ouichefs_file_get_block, wbc);
+	struct ouichefs_writepage_ctx ctx = { };
+
+	return iomap_writepage(page, wbc, &ctx.ctx, &ouichefs_writeback_ops);
+}
+
+static int ouichefs_writepages(struct address_space *mapping,
+			       struct writeback_control *wbc)
+{
+	struct ouichefs_writepage_ctx ctx = { };
+
+	return iomap_writepages(mapping, wbc, &ctx.ctx,
+				&ouichefs_writeback_ops);
 }
 
 /*
- * Called by the VFS when a write() syscall occurs on file before writing the
- * data in the page cache. This functions checks if the write will be able to
- * complete and allocates the necessary blocks through block_write_begin().
+ * Read block bno of inode to a new page. Used for the blocks that the page
+ * cache does not map, past the end of a truncated file or left to the
+ * previous version.
  */
-static int ouichefs_write_begin(struct file *file,
-				struct address_space *mapping, loff_t pos,
-				unsigned int len, unsigned int flags,
-				struct page **pagep, void **fsdata)
+static struct page *ouichefs_read_past_eof(struct inode *inode, uint32_t bno)
 {
-	struct buffer_head *bh_current_block;
-	struct buffer_head *bh_new;
-	struct buffer_head *bh_block;
-	struct buffer_head *new_bh_block;
-	struct inode *inode = file->f_inode;
-	struct ouichefs_file_index_block *new_index;
+	struct page *page = alloc_page(GFP_NOFS);
+	int ret;
+
+	if (!page)
+		return ERR_PTR(-ENOMEM);
+	ret = ouichefs_read_block(inode, page, 0, bno);
+	if (ret) {
+		put_page(page);
+		return ERR_PTR(ret);
+	}
+	return page;
+}
+
+/*
+ * Copy the data of the latest version, whose index is index, to freshly
+ * allocated blocks listed in new_index. The data is read through the page
+ * cache, which holds the latest content of the file, so that cached blocks
+ * are never read again from disk, and the copies are initialized without
+ * being read. Holes are not copied, so that they cost no block in either
+ * version, nor are the blocks preallocated past the end of the previous
+ * version. Blocks [cow_first, cow_last) are not copied either: they are about
+ * to be overwritten whole or are past the end of a truncated file, see
+ * ouichefs_file_write_iter(). Called with the inode lock held but without
+ * index_lock since reading a page maps its blocks.
+ */
+static int ouichefs_copy_version(struct inode *inode,
+				 struct ouichefs_file_index_block *index,
+				 struct ouichefs_file_index_block *new_index,
+				 uint32_t cow_first, uint32_t cow_last)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	uint32_t goal = ouichefs_ino_group(sbi, inode->i_ino);
+	loff_t pos, size = i_size_read(inode);
+	/* The file was truncated since the latest version was written */
+	bool truncated = size < OUICHEFS_INODE(inode)->last_size;
+	uint32_t prev_end = DIV_ROUND_UP(OUICHEFS_INODE(inode)->last_size,
+					 OUICHEFS_BSIZE(sb));
+	struct buffer_head *bh;
+	struct page *page;
+	unsigned int off;
+	void *data;
+	uint32_t bno;
+	int k;
+
+	for (k = 0; k < prev_end; k++) {
+		if (!index->blocks[k] || (k >= cow_first && k < cow_last))
+			continue;
+		bno = get_free_block(sbi, goal);
+		if (!bno)
+			return -ENOSPC;
+		pos = (loff_t)k << inode->i_blkbits;
+		if (truncated && pos + i_blocksize(inode) > size) {
+			page = ouichefs_read_past_eof(inode, index->blocks[k]);
+			off = 0;
+		} else {
+			/* Blocks smaller than a page share it */
+			page = read_mapping_page(inode->i_mapping,
+						 pos >> PAGE_SHIFT, NULL);
+			off = offset_in_page(pos);
+		}
+		if (IS_ERR(page)) {
+			put_block(sbi, bno);
+			return PTR_ERR(page);
+		}
+		data = kmap(page);
+		bh = ouichefs_get_new_block(sb, inode, bno, data + off);
+		kunmap(page);
+		put_page(page);
+		if (!bh) {
+			put_block(sbi, bno);
+			return -EIO;
+		}
+		brelse(bh);
+		new_index->blocks[k] = bno;
+	}
+	return 0;
+}
+
+/*
+ * Turn the latest version of an inline file into a regular one because a
+ * write makes it too large. Its data is left in the dirty first page, which
+ * gets a data block at writeback.
+ */
+static int ouichefs_uninline(struct inode *inode)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
 	struct ouichefs_file_index_block *index;
+	struct buffer_head *bh;
+	struct page *page;
+	int ret = 0;
+
+	page = read_mapping_page(inode->i_mapping, 0, NULL);
+	if (IS_ERR(page))
+		return PTR_ERR(page);
+	/* The page must not be reclaimed before it is dirty */
+	lock_page(page);
+
+	mutex_lock(&ci->index_lock);
+	bh = ouichefs_bread(sb, ci->index_block);
+	if (!bh) {
+		ret = -EIO;
+		goto unlock;
+	}
+	index = (struct ouichefs_file_index_block *)bh->b_data;
+	memset(index->blocks, 0, OUICHEFS_INLINE_MAX(sb));
+	ouichefs_mark_dirty(sb, bh, inode);
+	ci->last_flags &= ~OUICHEFS_VREC_INLINE;
+	ouichefs_map_changed(ci);
+	brelse(bh);
+unlock:
+	mutex_unlock(&ci->index_lock);
+
+	if (!ret)
+		set_page_dirty(page);
+	unlock_page(page);
+	put_page(page);
+	return ret;
+}
+
+/*
+ * Prepare a write of len bytes at pos to the latest version of inode. It is
+ * made inline if it has no data block and stays small enough, or turned into
+ * a regular version if it is inline and gets too large.
+ */
+static int ouichefs_prepare_inline(struct inode *inode, loff_t pos,
+				   size_t len)
+{
 	struct super_block *sb = inode->i_sb;
 	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
-	struct buffer_head *bh_version;
+	struct ouichefs_file_index_block *index;
 	struct buffer_head *bh;
-	struct ouichefs_file_index_block *index_version;
-	struct ouichefs_sb_info *sbi = OUICHEFS_SB(file->f_inode->i_sb);
-	int err, v, no_block_new_version, i, block_number, k;
-	uint32_t nr_allocs = 0;
-	uint32_t inode_block, inode_shift;
-
-	/* mise à jour de la latest_version et test si droit à l'ecriture */
-	struct ouichefs_inode *cinode = NULL;
-	/* Check if the write can be completed (enough space or have right?) */
-
-	if (pos + len > OUICHEFS_MAX_FILESIZE)
-		return -ENOSPC;
-
-	nr_allocs = max(pos + len, file->f_inode->i_size) / \
-				OUICHEFS_BLOCK_SIZE;
-	if (nr_allocs > file->f_inode->i_blocks - 1)
-		nr_allocs -= file->f_inode->i_blocks - 1;
-	else
-		nr_allocs = 0;
-	if (nr_allocs > sbi->nr_free_blocks)
-		return -ENOSPC;
+	bool fits, is_inline;
 
-	/* dans quel block se trouve l inode */
-	inode_block = (inode->i_ino / OUICHEFS_INODES_PER_BLOCK) + 1;
-	inode_shift = inode->i_ino % OUICHEFS_INODES_PER_BLOCK;
+	fits = max_t(loff_t, pos + len, i_size_read(inode)) <=
+		OUICHEFS_INLINE_MAX(sb);
 
-	bh = sb_bread(sb, inode_block);
+	mutex_lock(&ci->index_lock);
+	bh = ouichefs_bread(sb, ci->index_block);
 	if (!bh) {
-		err = -EIO;
-		goto err_1;
+		mutex_unlock(&ci->index_lock);
+		return -EIO;
+	}
+	index = (struct ouichefs_file_index_block *)bh->b_data;
+	is_inline = ci->last_flags & OUICHEFS_VREC_INLINE;
+	if (!is_inline && fits &&
+	    !memchr_inv(index->blocks, 0, OUICHEFS_INLINE_MAX(sb))) {
+		ci->last_flags |= OUICHEFS_VREC_INLINE;
+		ouichefs_map_changed(ci);
+		is_inline = true;
 	}
-	cinode = (struct ouichefs_inode *)bh->b_data;
-	cinode += inode_shift;
+	brelse(bh);
+	mutex_unlock(&ci->index_lock);
+
+	if (is_inline && !fits)
+		return ouichefs_uninline(inode);
+	return 0;
+}
+
+/*
+ * Start a new version of inode before a write to it, unless it was never
+ * written. The blocks mapped by the page cache stay with the latest version:
+ * the copies made by ouichefs_copy_version() are given to the previous
+ * version instead. Blocks [cow_first, cow_last) are not copied, the previous
+ * version keeps them and the latest version gets new blocks when they are
+ * written, or copies if the write fails, see ouichefs_refill_cow(). Called
+ * with the inode lock held.
+ */
+static int ouichefs_new_version(struct inode *inode, uint32_t cow_first,
+				uint32_t cow_last)
+{
+	struct buffer_head *bh_current_block;
+	struct buffer_head *bh_new = NULL;
+	struct ouichefs_file_index_block *new_index = NULL;
+	struct ouichefs_file_index_block *index;
+	struct super_block *sb = inode->i_sb;
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_version_record rec = { 0 };
+	struct ouichefs_version_record *latest;
+	int err, k;
+	uint32_t no_block_new_version = 0, nr_cow = 0;
+	uint32_t goal = ouichefs_ino_group(sbi, inode->i_ino);
+	uint32_t prev_end = DIV_ROUND_UP(ci->last_size, OUICHEFS_BSIZE(sb));
+
+	/*
+	 * The inode lock is held by the VFS, index_lock serializes us with
+	 * writeback mapping blocks of the current version.
+	 */
+	mutex_lock(&ci->index_lock);
 
 /*---------------------------------------------------------------------------*/
 /*			Partie 1 :  historique de versions		     */
 /*---------------------------------------------------------------------------*/
-	pr_info("index de bloc actuel avant toute modification \
-		%d\n", ci->index_block);
-	bh_current_block = sb_bread(sb, ci->index_block);
+	pr_debug("index de bloc actuel avant toute modification %d\n",
+		 ci->index_block);
+	bh_current_block = ouichefs_bread(sb, ci->index_block);
 	if (!bh_current_block) {
 		err = -EIO;
-		goto err_2;
+		goto err_1;
 	}
 	/*
 	 * récupère le pointeur vers le début des numéros de block ou sont
@@ -200,394 +642,891 @@ static int ouichefs_write_begin(struct file *file,
 	 */
 	index = (struct ouichefs_file_index_block *)bh_current_block->b_data;
 
-	if (index->blocks[(OUICHEFS_BLOCK_SIZE >> 2) - 1] == 0) {
-		pr_info("/* première fois qu'on écrit sur le fichier */\n");
-		index->blocks[(OUICHEFS_BLOCK_SIZE >> 2) - 1] = -1;
-		cinode->can_write = 1;
-		cinode->nb_versions = 0;
-		mark_buffer_dirty(bh_current_block);
-		sync_dirty_buffer(bh_current_block);
-		mark_buffer_dirty(bh);
-		sync_dirty_buffer(bh);
-		mark_inode_dirty(inode);
-		write_inode_now(inode, 1);
+	if (ci->nb_versions == 0) {
+		pr_debug("/* première fois qu'on écrit sur le fichier */\n");
+		ci->can_write = 1;
 	} else {
-		pr_info("/* passage de version %d à %d */\n",
-			cinode->nb_versions, cinode->nb_versions+1);
-		if (cinode->can_write == 0) {
+		pr_debug("/* passage de version %d à %d */\n",
+			 ci->nb_versions, ci->nb_versions + 1);
+		if (ci->can_write == 0) {
 			pr_err("Read-only file system\n");
-			affiche_data_in_block(ci, sb);
 			err = -EROFS;
-			goto err_3;
+			goto err_2;
+		}
+		/* récupère un block free pour l'index de la nouvelle version */
+		no_block_new_version = get_free_block(sbi, goal);
+		if (!no_block_new_version) {
+			err = -ENOSPC;
+			goto err_2;
 		}
-		/* récupère un block free pour copier les données de l'ancien */
-		no_block_new_version = get_free_block(sbi);
-		bh_new = sb_bread(sb, no_block_new_version);
+		bh_new = ouichefs_get_zeroed_block(sb, inode,
+						   no_block_new_version);
 		if (!bh_new) {
-			pr_err("Erreur récupération du \
-			buffer_head du nouveau block\n");
+			pr_err("Erreur récupération du buffer_head du nouveau block\n");
 			put_block(sbi, no_block_new_version);
 			err = -EIO;
-			goto err_3;
+			goto err_2;
 		}
 		new_index = (struct ouichefs_file_index_block *)bh_new->b_data;
-		k = 0;
-		/* Pour chaque blocs alloués on copie les données */
-		while (index->blocks[k] != 0) {
-			pr_info("nouvelle copie\n");
-			block_number = get_free_block(sbi);
-			new_bh_block = sb_bread(sb, block_number);
-			bh_block = sb_bread(sb, index->blocks[k]);
-			if (bh_block && !new_bh_block)
-				brelse(bh_block);
-			if (!bh_block || !new_bh_block) {
-				pr_info("Erreur de création \
-				d'une nouvelle version\n");
-				/*il faut libérer tous les blocks alloués*/
-				while (k >= 0) {
-					put_block(sbi, new_index->blocks[k]);
-					k--;
-				}
-				err = -EIO;
-				goto err_3;
-			}
-			/* remettre les données à 0 si elle sont différentes pour ne pas
-			 * perturber la copie des vrais données
+
+		if (ci->last_flags & OUICHEFS_VREC_INLINE) {
+			/* Both versions keep their own copy of the data */
+			memcpy(new_index->blocks, index->blocks,
+			       OUICHEFS_INLINE_MAX(sb));
+		} else {
+			/*
+			 * Pour chaque blocs alloués on copie les données.
+			 * Writers are excluded by the inode lock and writeback
+			 * only maps blocks that already exist, so the index
+			 * does not change meanwhile.
 			 */
-			memcpy(new_bh_block->b_data, bh_block->b_data,\
-			 OUICHEFS_BLOCK_SIZE);
-			new_index->blocks[k] = block_number;
-			mark_buffer_dirty(new_bh_block);
-			sync_dirty_buffer(new_bh_block);
-			mark_buffer_dirty(bh_new);
-			sync_dirty_buffer(bh_new);
-			mark_inode_dirty(inode);
-			write_inode_now(inode, 1);
-			brelse(new_bh_block);
-			brelse(bh_block);
-			k++;
+			mutex_unlock(&ci->index_lock);
+			err = ouichefs_copy_version(inode, index, new_index,
+						    cow_first, cow_last);
+			mutex_lock(&ci->index_lock);
+			if (err)
+				goto err_free;
+			for (k = 0; k < prev_end; k++) {
+				if (!index->blocks[k])
+					continue;
+				rec.nr_blocks++;
+				if (!new_index->blocks[k])
+					nr_cow++;
+			}
+		}
+
+		/* Ajout de l'ancienne version à la table des versions */
+		rec.index_block = ci->index_block;
+		rec.number = ci->last_number;
+		rec.size = ci->last_size;
+		/* i_mtime was already updated for the write */
+		rec.mtime = ci->last_mtime;
+		rec.flags = ci->last_flags;
+		err = ouichefs_append_version(inode, &rec);
+		if (err)
+			goto err_free;
+
+		/*
+		 * The copies go to the previous version, the new version keeps
+		 * the blocks mapped by the page cache. The blocks not copied
+		 * stay with the previous version and leave a hole in the new
+		 * one, but for those preallocated past its end, see
+		 * ouichefs_fallocate().
+		 */
+		if (!(ci->last_flags & OUICHEFS_VREC_INLINE)) {
+			for (k = 0; k < OUICHEFS_INDEX_NR_DATA(sb); k++)
+				if (new_index->blocks[k] || k >= prev_end)
+					swap(index->blocks[k],
+					     new_index->blocks[k]);
+			ouichefs_mark_dirty(sb, bh_current_block, inode);
 		}
-		/* Ajout du numéro de blocs contenant l'ancienne version */
-		new_index->blocks[(OUICHEFS_BLOCK_SIZE >> 2) - 1]\
-			 = ci->index_block;
 		/* les données de la nouvelle version */
 		ci->index_block = no_block_new_version;
-		mark_buffer_dirty(bh_new);
-		sync_dirty_buffer(bh_new);
-		mark_inode_dirty(inode);
-		write_inode_now(inode, 1);
+		/* Numbers are never reused, not even after a restore */
+		ci->last_number = max(ci->next_number, ci->last_number + 1);
+		ci->next_number = ci->last_number + 1;
+		ouichefs_cache_new_version(ci, no_block_new_version);
+		ouichefs_map_changed(ci);
+		latest = ouichefs_latest_version(ci);
+		if (latest && latest->index_block == ci->index_block) {
+			latest->nr_blocks -= nr_cow;
+			latest[-1].nr_blocks = rec.nr_blocks;
+		}
 		brelse(bh_new);
-
-
 	}
-	ci = OUICHEFS_INODE(inode);
-	cinode->last_index_block = ci->index_block;
-	cinode->nb_versions++; /* on viens de write on incrémente */
-	mark_buffer_dirty(bh);
-	sync_dirty_buffer(bh);
-	mark_inode_dirty(inode);
-	write_inode_now(inode, 1);
-	pr_info("La dernière version est :%d\n", cinode->last_index_block);
-	/* prepare the write */
-	err = block_write_begin(mapping, pos, len, flags, pagep,
-				ouichefs_file_get_block);
-	/* if this failed, reclaim newly allocated blocks */
-	if (err < 0) {
-		pr_err("%s:%d: newly allocated blocks reclaim not implemented yet\n",
-		       __func__, __LINE__);
-	}
-
-err_3:
+	ci->last_index_block = ci->index_block;
+	ci->nb_versions++; /* on viens de write on incrémente */
+	pr_debug("La dernière version est :%d\n", ci->last_index_block);
 	brelse(bh_current_block);
+	mutex_unlock(&ci->index_lock);
+	mark_inode_dirty(inode);
+	return 0;
+
+err_free:
+	/*il faut libérer tous les blocks alloués*/
+	for (k = 0; k < OUICHEFS_INDEX_NR_DATA(sb) &&
+	     !(ci->last_flags & OUICHEFS_VREC_INLINE); k++)
+		if (new_index->blocks[k])
+			put_block(sbi, new_index->blocks[k]);
+	bforget(bh_new);
+	put_block(sbi, no_block_new_version);
 err_2:
-	brelse(bh);
+	brelse(bh_current_block);
 err_1:
+	mutex_unlock(&ci->index_lock);
 	return err;
-
 }
 
+
 /*
- * Called by the VFS after writing data from a write() syscall to the page
- * cache. This functions updates inode metadata and truncates the file if
- * necessary.
+ * Update the metadata of inode and of its latest version after data was
+ * written to it. Only the blocks actually allocated are counted, holes cost
+ * nothing.
  */
-static int ouichefs_write_end(struct file *file, struct address_space *mapping,
-			      loff_t pos, unsigned int len, unsigned int copied,
-			      struct page *page, void *fsdata)
+static void ouichefs_write_done(struct inode *inode)
 {
-	int ret;
-	struct inode *inode = file->f_inode;
-	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
 	struct super_block *sb = inode->i_sb;
-	/* Complete the write() */
-	ret = generic_write_end(file, mapping, pos, len, copied, page, fsdata);
-	if (ret < len) {
-		pr_err("%s:%d: wrote less than asked... what do I do? nothing for now...\n",
-		       __func__, __LINE__);
-	} else {
-		uint32_t nr_blocks_old = inode->i_blocks;
-
-		/* Update inode metadata */
-		inode->i_blocks = inode->i_size / OUICHEFS_BLOCK_SIZE + 2;
-		inode->i_mtime = inode->i_ctime = current_time(inode);
-		mark_inode_dirty(inode);
-		write_inode_now(inode, 1);
-		void *addr = kmap(page);
-
-		pr_info("données à copier : %s\n", (char *)addr);
-		/* If file is smaller than before, free unused blocks */
-		if (nr_blocks_old > inode->i_blocks) {
-			int i;
-			struct buffer_head *bh_index;
-			struct ouichefs_file_index_block *index;
-
-			/* Free unused blocks from page cache */
-			truncate_pagecache(inode, inode->i_size);
-
-			/* Read index block to remove unused blocks */
-			bh_index = sb_bread(sb, ci->index_block);
-			if (!bh_index) {
-				pr_err("failed truncating '%s'. we just lost %llu blocks\n",
-				       file->f_path.dentry->d_name.name,
-				       nr_blocks_old - inode->i_blocks);
-				goto end;
-			}
-			index = (struct ouichefs_file_index_block *)
-				bh_index->b_data;
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct ouichefs_version_record *latest;
+	struct ouichefs_file_index_block *index;
+	struct buffer_head *bh;
+	uint32_t k, nr_blocks = 0;
 
-			for (i = inode->i_blocks - 1; i < nr_blocks_old - 1;
-			     i++) {
-				put_block(OUICHEFS_SB(sb), index->blocks[i]);
-				index->blocks[i] = 0;
-			}
-			mark_buffer_dirty(bh_index);
-			brelse(bh_index);
+	mutex_lock(&ci->index_lock);
+	/* Update inode metadata, the index block is counted */
+	if (ci->last_flags & OUICHEFS_VREC_INLINE) {
+		ouichefs_set_blocks(inode, 1);
+	} else {
+		bh = ouichefs_bread(sb, ci->index_block);
+		if (bh) {
+			index = (struct ouichefs_file_index_block *)bh->b_data;
+			for (k = 0; k < OUICHEFS_INDEX_NR_DATA(sb); k++)
+				if (index->blocks[k])
+					nr_blocks++;
+			brelse(bh);
+			ouichefs_set_blocks(inode, nr_blocks + 1);
 		}
 	}
-end:
-	kunmap(page);
-	sync_filesystem(sb);
-	return ret;
+	inode->i_mtime = inode->i_ctime = current_time(inode);
+
+	/* The inode holds the metadata of the latest version */
+	ci->last_size = inode->i_size;
+	ci->last_mtime = inode->i_mtime.tv_sec;
+	latest = ouichefs_latest_version(ci);
+	if (latest && latest->index_block == ci->index_block) {
+		latest->size = inode->i_size;
+		latest->mtime = inode->i_mtime.tv_sec;
+	}
+	mutex_unlock(&ci->index_lock);
+	mark_inode_dirty(inode);
 }
 
-const struct address_space_operations ouichefs_aops = {
-	.readpage    = ouichefs_readpage,
-	.writepage   = ouichefs_writepage,
-	.write_begin = ouichefs_write_begin,
-	.write_end   = ouichefs_write_end
-};
+/*
+ * First slot past the end of the latest version of inode if the file was
+ * truncated since it was written, OUICHEFS_INDEX_NR_DATA(sb) otherwise. The
+ * blocks from there are left to the previous version by the next version,
+ * which has holes instead, see ouichefs_setattr().
+ */
+static uint32_t ouichefs_truncated_from(struct inode *inode)
+{
+	struct super_block *sb = inode->i_sb;
+	loff_t size = i_size_read(inode);
 
-/*---------------------------------------------------------------------------*/
-/*			Prtie 3 :  Requettes ioctl			     						 */
-/*---------------------------------------------------------------------------*/
-/**
- * cette fonction lorsque une requette ioctl est lancée
- * 0 CHANGE_VERSION-> permet de changer la version courante vers une
- * vers une version plus ancienne si celle-ci existe
- *
- * 1 RESTOR_VERSION-> permet de supprimer toutes les versions à partir
- * celle donnée
- * 
- * 2 RLEASE_VERSION-> permet de restorer la version ourante lorsque celle-ci
- * a ete modifiée avec la requette CHANGE_VERSION permettant ainsi de pouvoir
- * à nouveau réecrir dans le ficher
+	if (size >= OUICHEFS_INODE(inode)->last_size)
+		return OUICHEFS_INDEX_NR_DATA(sb);
+	return DIV_ROUND_UP(size, OUICHEFS_BSIZE(sb));
+}
+
+/*
+ * Blocks [*first, *last) of the latest version of inode are left to the
+ * previous version by the next version. The blocks past the end of a
+ * truncated file are too: the range is extended to them if they meet, or
+ * replaced by them if not, the blocks of the range are then copied.
  */
+static void ouichefs_cow_tail(struct inode *inode, uint32_t *first,
+			      uint32_t *last)
+{
+	uint32_t tail = ouichefs_truncated_from(inode);
+
+	if (tail == OUICHEFS_INDEX_NR_DATA(inode->i_sb))
+		return;
+	if (*first >= *last || *last < tail)
+		*first = tail;
+	else
+		*first = min(*first, tail);
+	*last = OUICHEFS_INDEX_NR_DATA(inode->i_sb);
+}
 
-long ouichefs_change_version(struct file *file, unsigned int cmd,
-			unsigned long arg)
+/*
+ * Zero the end of the block holding the end of file, up to pos, before the
+ * file is extended to pos. It may hold stale data since a truncation, the
+ * blocks past it are holes.
+ */
+static int ouichefs_zero_eof(struct inode *inode, loff_t pos)
 {
-	int ret = 0;
-	int size = 100;
-	char *request = kvzalloc(100 * sizeof(char), GFP_KERNEL);
-	int requested_version;
+	loff_t size = i_size_read(inode);
+	loff_t end = min_t(loff_t, pos, round_up(size, i_blocksize(inode)));
 
-	ret = copy_from_user(request, (char *)arg, size);
-	if (ret) {
-		pr_err("Erreur récupération de la requette\n");
-		ret = -EFAULT;
-		goto err1;
-	}
-	ret = kstrtoint(request, 0, &requested_version);
-	if (ret < 0) {
-		pr_err("token kstrtoint\n");
-		goto err1;
-	}
-	struct inode *file_inode = file->f_inode;
-	struct ouichefs_inode_info *ci = OUICHEFS_INODE(file_inode);
-	struct buffer_head *bh_index_inode_file;
-	struct buffer_head *bh_index;
-	struct ouichefs_inode *cinode;
-	struct super_block *sb = file_inode->i_sb;
+	if (end <= size)
+		return 0;
+	return iomap_zero_range(inode, size, end - size, NULL,
+				&ouichefs_iomap_ops);
+}
+
+/*
+ * Check that there are enough free blocks to create the next version of
+ * inode if bump, leaving blocks [cow_first, cow_last) to the previous
+ * version, then to fill the holes of the latest version in [pos, end).
+ * Return -ENOSPC otherwise, or -EDQUOT when the quotas of its owners do not
+ * allow it, see ouichefs_quota_check().
+ */
+static int ouichefs_check_space(struct inode *inode, bool bump,
+				uint32_t cow_first, uint32_t cow_last,
+				loff_t pos, loff_t end)
+{
+	struct super_block *sb = inode->i_sb;
 	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
 	struct ouichefs_file_index_block *index;
+	struct buffer_head *bh;
+	uint32_t first = pos >> inode->i_blkbits;
+	uint32_t last = end > pos ? DIV_ROUND_UP(end, OUICHEFS_BSIZE(sb)) :
+		first;
+	uint32_t prev_end = DIV_ROUND_UP(ci->last_size, OUICHEFS_BSIZE(sb));
+	uint32_t k, nr, nr_used = 0, nr_fill = 0, nr_refill = 0, live = 0;
+	bool fill;
+	int ret = 0;
 
+	mutex_lock(&ci->index_lock);
+	/* The first write does not create a version */
+	bump = bump && ci->nb_versions;
+	/* Its index block, and a new version table block at worst */
+	nr = bump ? 2 : 0;
+	if (ci->last_flags & OUICHEFS_VREC_INLINE) {
+		/* Its data moves to a block of its own */
+		if (end > OUICHEFS_INLINE_MAX(sb))
+			live = last - first + (first > 0);
+		nr += live;
+		goto unlock;
+	}
 
+	bh = ouichefs_bread(sb, ci->index_block);
+	if (!bh) {
+		ret = -EIO;
+		goto unlock;
+	}
+	index = (struct ouichefs_file_index_block *)bh->b_data;
+	for (k = 0; k < OUICHEFS_INDEX_NR_DATA(sb); k++) {
+		fill = k >= first && k < last;
+		if (!index->blocks[k]) {
+			nr_fill += fill;
+			continue;
+		}
+		nr_used++;
+		if (!bump || k >= prev_end)
+			continue;
+		/* Copied, or left to the previous version and filled again */
+		if (k < cow_first || k >= cow_last)
+			nr++;
+		else
+			nr_refill += fill;
+	}
+	brelse(bh);
+	/* An empty file that stays small enough is written inline */
+	if (nr_used || end > OUICHEFS_INLINE_MAX(sb)) {
+		nr += nr_fill + nr_refill;
+		live = nr_fill;
+	}
+unlock:
+	mutex_unlock(&ci->index_lock);
+	if (!ret && nr > percpu_counter_read_positive(&sbi->nr_free_blocks))
+		ret = -ENOSPC;
+	/*
+	 * The copies replace the blocks that go to the history with the
+	 * latest version, only the holes filled add to the live blocks.
+	 */
+	if (!ret)
+		ret = ouichefs_quota_check(inode, live,
+					   bump ? inode->i_blocks + 1 : 0);
+	return ret;
+}
 
-	uint32_t inode_block = (file_inode->i_ino / OUICHEFS_INODES_PER_BLOCK) + 1;
-	uint32_t inode_shift = file_inode->i_ino % OUICHEFS_INODES_PER_BLOCK;
+/*
+ * Give zeroed blocks to the holes of the latest version of inode in slots
+ * [first, last), taking them in runs of contiguous blocks as long as the
+ * allocator has some. Called with the inode lock held.
+ */
+static int ouichefs_alloc_range(struct inode *inode, uint32_t first,
+				uint32_t last)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	uint32_t goal = ouichefs_ino_group(sbi, inode->i_ino);
+	struct ouichefs_file_index_block *index;
+	struct ouichefs_version_record *latest;
+	struct buffer_head *bh;
+	uint32_t k = first, len, bno, i, nr;
+	int ret = 0;
 
-	bh_index_inode_file = sb_bread(sb, inode_block);
-	if (!bh_index_inode_file) {
-		ret = -EIO;
-		goto err_1;
+	bh = ouichefs_bread(sb, ci->index_block);
+	if (!bh)
+		return -EIO;
+	index = (struct ouichefs_file_index_block *)bh->b_data;
 
+	while (k < last) {
+		mutex_lock(&ci->index_lock);
+		while (k < last && index->blocks[k])
+			k++;
+		for (len = 0; k + len < last && !index->blocks[k + len]; len++)
+			;
+		mutex_unlock(&ci->index_lock);
+		if (!len)
+			break;
+
+		/* The longest run the allocator has, down to a single block */
+		for (;;) {
+			bno = get_free_run(sbi, goal, len, false);
+			if (bno || len == 1)
+				break;
+			len /= 2;
+		}
+		if (!bno) {
+			ret = -ENOSPC;
+			break;
+		}
+		/* Stale data must not be seen through the file */
+		ret = sb_issue_zeroout(sb, bno, len, GFP_NOFS);
+		if (ret) {
+			for (i = 0; i < len; i++)
+				put_block(sbi, bno + i);
+			break;
+		}
+
+		/* Writeback may have filled a hole meanwhile */
+		mutex_lock(&ci->index_lock);
+		for (i = 0, nr = 0; i < len; i++) {
+			if (index->blocks[k + i]) {
+				put_block(sbi, bno + i);
+				continue;
+			}
+			index->blocks[k + i] = bno + i;
+			if (sbi->csums)
+				WRITE_ONCE(sbi->csums[bno + i], 0);
+			nr++;
+		}
+		ouichefs_mark_dirty(sb, bh, inode);
+		latest = ouichefs_latest_version(ci);
+		if (latest && latest->index_block == ci->index_block)
+			latest->nr_blocks += nr;
+		ouichefs_map_changed(ci);
+		mutex_unlock(&ci->index_lock);
+		k += len;
 	}
-	cinode = (struct ouichefs_inode *)bh_index_inode_file->b_data;
-	cinode += inode_shift;
+	brelse(bh);
+	return ret;
+}
 
+/*
+ * Release the blocks of the latest version of inode in slots [first, last),
+ * which leaves holes there. Their pages must be dropped from the page cache
+ * first.
+ */
+static int ouichefs_free_range(struct inode *inode, uint32_t first,
+			       uint32_t last)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct ouichefs_file_index_block *index;
+	struct ouichefs_version_record *latest;
+	struct buffer_head *bh;
+	uint32_t k, nr = 0;
 
+	mutex_lock(&ci->index_lock);
+	bh = ouichefs_bread(sb, ci->index_block);
+	if (!bh) {
+		mutex_unlock(&ci->index_lock);
+		return -EIO;
+	}
+	index = (struct ouichefs_file_index_block *)bh->b_data;
+	for (k = first; k < last; k++) {
+		if (!index->blocks[k])
+			continue;
+		ouichefs_release_block(sb, index->blocks[k]);
+		index->blocks[k] = 0;
+		nr++;
+	}
+	if (nr) {
+		ouichefs_mark_dirty(sb, bh, inode);
+		latest = ouichefs_latest_version(ci);
+		if (latest && latest->index_block == ci->index_block)
+			latest->nr_blocks -= nr;
+		ouichefs_map_changed(ci);
+	}
+	brelse(bh);
+	mutex_unlock(&ci->index_lock);
+	return 0;
+}
 
+/*
+ * Give back to the latest version of inode the blocks of slots [first, last)
+ * left to the previous version, whose index block is prev, that a direct
+ * write did not reach: a failed or short write leaves holes there, see
+ * ouichefs_put_unwritten(). Their data is copied, each version keeps its own
+ * blocks. Called with the inode lock held.
+ */
+static int ouichefs_refill_cow(struct inode *inode, uint32_t prev,
+			       uint32_t first, uint32_t last)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	uint32_t goal = ouichefs_ino_group(sbi, inode->i_ino);
+	struct ouichefs_file_index_block *index, *prev_index;
+	struct ouichefs_version_record *latest;
+	struct buffer_head *bh, *bh_prev, *bh_new;
+	struct page *page;
+	uint32_t k, bno, nr = 0;
+	int ret = 0;
 
-	if ((requested_version > cinode->nb_versions) || (requested_version < 0)) {
-		pr_err("invalid version\n");
-		ret = -EINVAL;
-		goto err1;
+	if (first >= last || prev == ci->index_block)
+		return 0;
+	mutex_lock(&ci->index_lock);
+	bh = ouichefs_bread(sb, ci->index_block);
+	bh_prev = ouichefs_bread(sb, prev);
+	if (!bh || !bh_prev) {
+		ret = -EIO;
+		goto out;
+	}
+	index = (struct ouichefs_file_index_block *)bh->b_data;
+	prev_index = (struct ouichefs_file_index_block *)bh_prev->b_data;
+	for (k = first; k < last; k++) {
+		if (index->blocks[k] || !prev_index->blocks[k])
+			continue;
+		bno = get_free_block(sbi, goal);
+		if (!bno) {
+			ret = -ENOSPC;
+			break;
+		}
+		page = ouichefs_read_past_eof(inode, prev_index->blocks[k]);
+		if (IS_ERR(page)) {
+			put_block(sbi, bno);
+			ret = PTR_ERR(page);
+			break;
+		}
+		bh_new = ouichefs_get_new_block(sb, inode, bno, kmap(page));
+		kunmap(page);
+		put_page(page);
+		if (!bh_new) {
+			put_block(sbi, bno);
+			ret = -EIO;
+			break;
+		}
+		brelse(bh_new);
+		index->blocks[k] = bno;
+		nr++;
+	}
+	if (nr) {
+		ouichefs_mark_dirty(sb, bh, inode);
+		latest = ouichefs_latest_version(ci);
+		if (latest && latest->index_block == ci->index_block)
+			latest->nr_blocks += nr;
+		ouichefs_map_changed(ci);
 	}
+out:
+	brelse(bh_prev);
+	brelse(bh);
+	mutex_unlock(&ci->index_lock);
+	return ret;
+}
+
+/*
+ * Every write() creates a new version of the file, see
+ * ouichefs_new_version(), then writes to it through the page cache, or
+ * directly with O_DIRECT. Small files are written inline, see
+ * ouichefs_prepare_inline().
+ */
+static ssize_t ouichefs_file_write_iter(struct kiocb *iocb,
+					struct iov_iter *from)
+{
+	struct file *file = iocb->ki_filp;
+	struct inode *inode = file_inode(file);
+	struct super_block *sb = inode->i_sb;
+	bool direct = iocb->ki_flags & IOCB_DIRECT;
+	uint32_t cow_first = 0, cow_last = 0, prev;
+	uint32_t dio_first = 0, dio_last = 0;
+	loff_t pos, end;
+	ssize_t ret, done = 0;
+	int err;
+
+	inode_lock(inode);
+	/* Direct writes in flight complete on the version they started on */
+	inode_dio_wait(inode);
+	ret = generic_write_checks(iocb, from);
+	if (ret <= 0)
+		goto unlock;
+	pos = iocb->ki_pos;
+	end = pos + iov_iter_count(from);
+
+	ret = file_remove_privs(file);
+	if (!ret)
+		ret = file_update_time(file);
+	if (ret)
+		goto unlock;
 
-	if (cmd == RLEASE_VERSION) {
-		pr_info("changement de version from %d to %d\n",
-		ci->index_block, cinode->last_index_block);
-		cinode->can_write = 1;
-		ci->index_block = cinode->last_index_block;
-		mark_buffer_dirty(bh_index_inode_file);
-		sync_dirty_buffer(bh_index_inode_file);
-		mark_inode_dirty(file_inode);
-		write_inode_now(file_inode, 1);
+	if (direct) {
+		/*
+		 * The blocks overwritten whole are left to the previous
+		 * version, which must get the data cached for them first.
+		 */
+		ret = filemap_write_and_wait_range(inode->i_mapping, pos,
+						   end - 1);
+		if (ret)
+			goto unlock;
+		cow_first = DIV_ROUND_UP(pos, OUICHEFS_BSIZE(sb));
+		cow_last = end >> inode->i_blkbits;
+		/*
+		 * Those the write does not reach get the data back, but for
+		 * those past the end of a truncated file, which stay holes.
+		 */
+		dio_first = cow_first;
+		dio_last = min(cow_last, ouichefs_truncated_from(inode));
 	}
+	prev = OUICHEFS_INODE(inode)->index_block;
+	ouichefs_cow_tail(inode, &cow_first, &cow_last);
 
-	if (cmd == CHANGE_VERSION) {
-		pr_info("[Chagnge versions]\n");
-		cinode->can_write = 0;
-		mark_buffer_dirty(bh_index_inode_file);
-		sync_dirty_buffer(bh_index_inode_file);
-		mark_inode_dirty(file_inode);
-		write_inode_now(file_inode, 1);
+	/*
+	 * Check if the write can be completed (enough space or have right?):
+	 * the new version and the holes written need blocks.
+	 */
+	ret = ouichefs_check_space(inode, true, cow_first, cow_last, pos, end);
+	if (!ret)
+		ret = ouichefs_new_version(inode, cow_first, cow_last);
+	if (!ret)
+		ret = ouichefs_prepare_inline(inode, pos, end - pos);
+	if (!ret && pos > i_size_read(inode))
+		ret = ouichefs_zero_eof(inode, pos);
+	if (ret) {
+		ouichefs_refill_cow(inode, prev, dio_first, dio_last);
+		goto unlock;
+	}
 
-		bh_index = sb_bread(sb, cinode->last_index_block);
-		if (!bh_index) {
-			ret = -EIO;
-			goto err1;
+	if (direct) {
+		/* Extending writes complete before the size is updated */
+		ret = iomap_dio_rw(iocb, from, &ouichefs_iomap_ops, NULL,
+				   is_sync_kiocb(iocb) ||
+				   end > i_size_read(inode));
+		/* Cached pages could not be dropped, use the page cache */
+		if (ret == -ENOTBLK)
+			ret = 0;
+		err = ouichefs_refill_cow(inode, prev, dio_first, dio_last);
+		if (err && ret >= 0)
+			ret = err;
+		if (ret < 0 || !iov_iter_count(from))
+			goto done;
+		done = ret;
+		pos = iocb->ki_pos;
+	}
 
-		}
-		index = (struct ouichefs_file_index_block *)bh_index->b_data;
-		int my_version = 0;
-		int cur_version, last_version;
-
-		cur_version = cinode->last_index_block;
-		last_version = index->blocks[(OUICHEFS_BLOCK_SIZE >> 2) - 1];
-		while (last_version != -1) {
-			if (my_version == requested_version) {
-				if (requested_version == 0) {
-					cinode->can_write = 1;
-					mark_buffer_dirty(bh_index_inode_file);
-					sync_dirty_buffer(bh_index_inode_file);
-					mark_inode_dirty(file_inode);
-					write_inode_now(file_inode, 1);
-				}
-				ci->index_block = cur_version;
-				mark_buffer_dirty(bh_index_inode_file);
-				sync_dirty_buffer(bh_index_inode_file);
-				mark_inode_dirty(file_inode);
-				write_inode_now(file_inode, 1);
-				goto fin;
-			}
-			cur_version = last_version;
-			brelse(bh_index);
-			bh_index = sb_bread(sb, last_version);
-			if (!bh_index) {
-				pr_err("erreur lors de la récupération des données\n");
-				ret = -EIO;
-				goto err1;
-			}
-			index = (struct ouichefs_file_index_block *)bh_index->b_data;
-			last_version = index->blocks[(OUICHEFS_BLOCK_SIZE >> 2) - 1];
-			my_version++;
-		}
-fin:
-	pr_info("changement de version from %d to %d\n",
-	cinode->last_index_block, ci->index_block);
-	brelse(bh_index);
+	ret = iomap_file_buffered_write(iocb, from, &ouichefs_iomap_ops);
+	if (ret > 0)
+		iocb->ki_pos += ret;
+	if (direct && ret > 0) {
+		/* Keep the O_DIRECT semantics for the end of the write */
+		end = iocb->ki_pos - 1;
+		if (!filemap_write_and_wait_range(inode->i_mapping, pos, end))
+			invalidate_mapping_pages(inode->i_mapping,
+						 pos >> PAGE_SHIFT,
+						 end >> PAGE_SHIFT);
 	}
+	if (done)
+		ret = ret < 0 ? done : done + ret;
+done:
+	if (iocb->ki_pos > i_size_read(inode))
+		i_size_write(inode, iocb->ki_pos);
+	if (ret > 0 || ret == -EIOCBQUEUED)
+		ouichefs_write_done(inode);
+unlock:
+	inode_unlock(inode);
+	if (ret > 0)
+		ret = generic_write_sync(iocb, ret);
+	return ret;
+}
 
+/*
+ * Reads go through the page cache of the current view, see view.c, or
+ * directly to its blocks with O_DIRECT.
+ */
+static ssize_t ouichefs_file_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct inode *inode = file_inode(iocb->ki_filp);
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	ssize_t ret;
 
-	if (cmd == RESTOR_VERSION) {
-		struct buffer_head *bh_index_remouve_block;
+	if (!iov_iter_count(to))
+		return 0;
 
-		pr_info("[restore version]\n");
-		bh_index = sb_bread(sb, cinode->last_index_block);
-		if (!bh_index) {
-			ret = -EIO;
-			goto err1;
-		}
-		index = (struct ouichefs_file_index_block *)bh_index->b_data;
-		int my_version = 0;
-		int cur_version, last_version, init_version;
-		/* sert uniquement pour l'affichage */
-		init_version = cinode->last_index_block;
-		cur_version = cinode->last_index_block;
-		last_version = index->blocks[(OUICHEFS_BLOCK_SIZE >> 2) - 1];
-		while ((last_version != -1) && my_version != requested_version) {
-			int k = 0;
-			/* Pour chaque blocs alloués on le put */
-			while (k < ((OUICHEFS_BLOCK_SIZE >> 2) - 2)) {
-				if (index->blocks[k] != 0) {
-					bh_index_remouve_block = sb_bread(sb, index->blocks[k]);
-					if (!bh_index_remouve_block) {
-						pr_err("erreur lors de la récupération des données\n");
-						ret = -EIO;
-						brelse(bh_index);
-						goto err1;
-					}
-					memset(bh_index_remouve_block->b_data, 0, OUICHEFS_BLOCK_SIZE);
-					put_block(sbi, index->blocks[k]);
-				}
-				k++;
-			}
-			memset(bh_index->b_data, 0, OUICHEFS_BLOCK_SIZE);
-			put_block(sbi, cur_version);
-			brelse(bh_index);
-			/* lire le block d'avant qui deviens le courant */
-			bh_index = sb_bread(sb, last_version);
-			if (!bh_index) {
-				pr_err("erreur lors de la récupération des données\n");
-				ret = -EIO;
-				goto err1;
-			}
-			cur_version = last_version;
+	/*
+	 * The view does not change under the read, and the mapping of the
+	 * inode is only filled while it views the latest version.
+	 */
+	inode_lock_shared(inode);
+	if (iocb->ki_flags & IOCB_DIRECT) {
+		file_accessed(iocb->ki_filp);
+		ret = iomap_dio_rw(iocb, to, &ouichefs_iomap_ops, NULL,
+				   is_sync_kiocb(iocb));
+	} else if (READ_ONCE(ci->index_block) !=
+		   READ_ONCE(ci->last_index_block)) {
+		ret = ouichefs_view_read(iocb, to);
+	} else {
+		ret = generic_file_read_iter(iocb, to);
+	}
+	inode_unlock_shared(inode);
+	return ret;
+}
 
-			index = (struct ouichefs_file_index_block *)bh_index->b_data;
-			last_version = index->blocks[(OUICHEFS_BLOCK_SIZE >> 2) - 1];
-			my_version++;
-		}
-		if (my_version == requested_version) {
-			ci->index_block = cur_version;
-			cinode->last_index_block = cur_version;
-			pr_info("changement de version from %d to %d\n", init_version, ci->index_block);
+/*
+ * Change the size of a file. Growing it creates a version, as a write does,
+ * with a hole past the former end of file. Shrinking it only drops the data
+ * past the new end from the page cache: the latest version still holds it
+ * until the next version, which leaves it to the previous one, see
+ * ouichefs_truncated_from().
+ */
+static int ouichefs_setattr(struct dentry *dentry, struct iattr *iattr)
+{
+	struct inode *inode = d_inode(dentry);
+	struct super_block *sb = inode->i_sb;
+	uint32_t cow_first = 0, cow_last = 0;
+	loff_t size = iattr->ia_size;
+	int ret;
+
+	ret = setattr_prepare(dentry, iattr);
+	if (ret)
+		return ret;
+
+	if ((iattr->ia_valid & ATTR_SIZE) && size != i_size_read(inode)) {
+		if (!OUICHEFS_INODE(inode)->can_write)
+			return -EROFS;
+		inode_dio_wait(inode);
+		if (size < i_size_read(inode)) {
+			/* The previous version reads the data past it */
+			ret = filemap_write_and_wait_range(inode->i_mapping,
+					round_down(size, OUICHEFS_BSIZE(sb)),
+					LLONG_MAX);
+			if (ret)
+				return ret;
+			truncate_setsize(inode, size);
 		} else {
-			ci->index_block = cur_version;
-			cinode->last_index_block = cur_version;
-			pr_info("changement de version impossible un problème\n est survenu. On arrive à la fin des\nversions et ce n'est pas la version\ndemmandée on garde la toute première\n");
+			ouichefs_cow_tail(inode, &cow_first, &cow_last);
+			ret = ouichefs_check_space(inode, true, cow_first,
+						   cow_last, 0, 0);
+			if (!ret)
+				ret = ouichefs_new_version(inode, cow_first,
+							   cow_last);
+			if (!ret)
+				ret = ouichefs_prepare_inline(inode, size, 0);
+			if (!ret)
+				ret = ouichefs_zero_eof(inode, size);
+			if (ret)
+				return ret;
+			truncate_setsize(inode, size);
+			ouichefs_write_done(inode);
 		}
-		mark_buffer_dirty(bh_index_inode_file);
-		sync_dirty_buffer(bh_index_inode_file);
-		mark_inode_dirty(file_inode);
-		write_inode_now(file_inode, 1);
-		pr_info("changement de version from %d to %d\n", init_version, ci->index_block);
-		brelse(bh_index);
+	}
 
+	/*
+	 * The blocks of the file and of its history go to its new owners,
+	 * last, so that no later failure leaves them charged to them.
+	 */
+	ret = ouichefs_quota_transfer(inode, iattr);
+	if (ret)
+		return ret;
+
+	setattr_copy(inode, iattr);
+	if (iattr->ia_valid & ATTR_MTIME)
+		OUICHEFS_INODE(inode)->last_mtime = inode->i_mtime.tv_sec;
+	mark_inode_dirty(inode);
+	return 0;
+}
+
+/*
+ * i_blocks only counts the blocks of the latest version, in blocks of the
+ * partition. st_blocks adds those of the history, in 512-byte units, so that
+ * du shows the space the file really holds.
+ */
+static int ouichefs_getattr(const struct path *path, struct kstat *stat,
+			    u32 request_mask, unsigned int query_flags)
+{
+	struct inode *inode = d_inode(path->dentry);
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	uint32_t history;
+
+	generic_fillattr(inode, stat);
+	mutex_lock(&ci->index_lock);
+	if (ouichefs_history_blocks(inode, &history))
+		history = 0;
+	stat->blocks = ((u64)inode->i_blocks + history) <<
+		(inode->i_blkbits - 9);
+	mutex_unlock(&ci->index_lock);
+	return 0;
+}
+
+/*
+ * Preallocate zeroed blocks to the holes of the latest version in a range,
+ * punch holes in it or zero it. Punching and zeroing create a version, as a
+ * write does, and the blocks in the range whole are left to the previous
+ * version without being copied. Preallocating only creates one if it grows
+ * the file.
+ */
+static long ouichefs_fallocate(struct file *file, int mode, loff_t offset,
+			       loff_t len)
+{
+	struct inode *inode = file_inode(file);
+	struct super_block *sb = inode->i_sb;
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	uint32_t cow_first = 0, cow_last = 0;
+	loff_t end = offset + len, size, zend;
+	bool change, bump, grow;
+	long ret;
+
+	if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE |
+		     FALLOC_FL_ZERO_RANGE))
+		return -EOPNOTSUPP;
+
+	inode_lock(inode);
+	size = i_size_read(inode);
+	grow = !(mode & FALLOC_FL_KEEP_SIZE) && end > size;
+	if (grow) {
+		ret = inode_newsize_ok(inode, end);
+		if (ret)
+			goto unlock;
 	}
-	invalidate_inode_buffers(file_inode);
-err1:
-	brelse(bh_index_inode_file);
-err_1:
+	if (!ci->can_write) {
+		ret = -EROFS;
+		goto unlock;
+	}
+	inode_dio_wait(inode);
+	ret = file_remove_privs(file);
+	if (!ret)
+		ret = file_update_time(file);
+	if (ret)
+		goto unlock;
+
+	/* Only the data before the end of file changes */
+	zend = min(end, size);
+	change = (mode & (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE)) &&
+		offset < zend;
+	if (change) {
+		/* The previous version must get the data cached first */
+		ret = filemap_write_and_wait_range(inode->i_mapping, offset,
+						   zend - 1);
+		if (ret)
+			goto unlock;
+		cow_first = DIV_ROUND_UP(offset, OUICHEFS_BSIZE(sb));
+		cow_last = zend >> inode->i_blkbits;
+	}
+	ouichefs_cow_tail(inode, &cow_first, &cow_last);
+	bump = change || grow || cow_first < cow_last;
+
+	ret = ouichefs_check_space(inode, bump, cow_first, cow_last, offset,
+				   mode & FALLOC_FL_PUNCH_HOLE ? offset : end);
+	if (!ret && bump)
+		ret = ouichefs_new_version(inode, cow_first, cow_last);
+	if (ret)
+		goto unlock;
+
+	if (mode & (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE)) {
+		/*
+		 * Release the blocks in the range whole the new version did
+		 * not leave behind, and those preallocated past the end of
+		 * file when punching.
+		 */
+		cow_first = DIV_ROUND_UP(offset, OUICHEFS_BSIZE(sb));
+		cow_last = (mode & FALLOC_FL_PUNCH_HOLE ? end : zend) >>
+			inode->i_blkbits;
+		if (cow_first < cow_last) {
+			truncate_pagecache_range(inode,
+				(loff_t)cow_first << inode->i_blkbits,
+				((loff_t)cow_last << inode->i_blkbits) - 1);
+			if (!(ci->last_flags & OUICHEFS_VREC_INLINE))
+				ret = ouichefs_free_range(inode, cow_first,
+							  cow_last);
+		}
+		/* The ends of the range, or all of it if inline */
+		if (!ret && change)
+			ret = iomap_zero_range(inode, offset, zend - offset,
+					       NULL, &ouichefs_iomap_ops);
+	}
+	if (!ret && !(mode & FALLOC_FL_PUNCH_HOLE)) {
+		ret = ouichefs_prepare_inline(inode, offset, len);
+		if (!ret && !(ci->last_flags & OUICHEFS_VREC_INLINE))
+			ret = ouichefs_alloc_range(inode,
+					offset >> inode->i_blkbits,
+					DIV_ROUND_UP(end, OUICHEFS_BSIZE(sb)));
+	}
+	if (!ret && grow) {
+		ret = ouichefs_zero_eof(inode, end);
+		if (!ret)
+			i_size_write(inode, end);
+	}
+	ouichefs_write_done(inode);
+unlock:
+	inode_unlock(inode);
 	return ret;
 }
 
+/*
+ * SEEK_HOLE and SEEK_DATA walk the extents of the current view. The data of
+ * an inline version moved out of the index block only gets its block at
+ * writeback, see ouichefs_uninline(): it is written first so that it is
+ * found as data.
+ */
+static loff_t ouichefs_file_llseek(struct file *file, loff_t offset,
+				   int whence)
+{
+	struct inode *inode = file_inode(file);
+	int ret;
+
+	if (whence != SEEK_HOLE && whence != SEEK_DATA)
+		return generic_file_llseek(file, offset, whence);
+
+	inode_lock_shared(inode);
+	ret = filemap_write_and_wait_range(inode->i_mapping, 0, PAGE_SIZE - 1);
+	if (ret)
+		offset = ret;
+	else if (whence == SEEK_HOLE)
+		offset = iomap_seek_hole(inode, offset, &ouichefs_iomap_ops);
+	else
+		offset = iomap_seek_data(inode, offset, &ouichefs_iomap_ops);
+	inode_unlock_shared(inode);
+	if (offset < 0)
+		return offset;
+	return vfs_setpos(file, offset, inode->i_sb->s_maxbytes);
+}
+
+/*
+ * Report the extents of the current view of the file.
+ */
+static int ouichefs_fiemap(struct inode *inode,
+			   struct fiemap_extent_info *fieinfo, u64 start,
+			   u64 len)
+{
+	int ret;
+
+	inode_lock_shared(inode);
+	ret = iomap_fiemap(inode, fieinfo, start, len, &ouichefs_iomap_ops);
+	inode_unlock_shared(inode);
+	return ret;
+}
+
+const struct address_space_operations ouichefs_aops = {
+	.readpage              = ouichefs_readpage,
+	.readahead             = ouichefs_readahead,
+	.writepage             = ouichefs_writepage,
+	.writepages            = ouichefs_writepages,
+	.set_page_dirty        = iomap_set_page_dirty,
+	.releasepage           = iomap_releasepage,
+	.invalidatepage        = iomap_invalidatepage,
+	.is_partially_uptodate = iomap_is_partially_uptodate,
+	.migratepage           = iomap_migrate_page,
+	.error_remove_page     = generic_error_remove_page,
+	/* O_DIRECT goes through iomap_dio_rw() */
+	.direct_IO             = noop_direct_IO
+};
 
 const struct file_operations ouichefs_file_ops = {
 	.owner      = THIS_MODULE,
-	.llseek     = generic_file_llseek,
-	.read_iter  = generic_file_read_iter,
-	.write_iter = generic_file_write_iter,
-	.unlocked_ioctl = ouichefs_change_version
+	.llseek     = ouichefs_file_llseek,
+	.read_iter  = ouichefs_file_read_iter,
+	.write_iter = ouichefs_file_write_iter,
+	.fsync      = generic_file_fsync,
+	.fallocate  = ouichefs_fallocate,
+	.unlocked_ioctl = ouichefs_ioctl
+};
+
+const struct inode_operations ouichefs_file_inode_ops = {
+	.setattr = ouichefs_setattr,
+	.getattr = ouichefs_getattr,
+	.fiemap  = ouichefs_fiemap,
+	.listxattr = ouichefs_listxattr
 };
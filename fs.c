@@ -22,6 +22,7 @@
 /* pour l'ioctl */
 static struct inode *inode_partition;
 static struct dentry *ouichefs_debug;
+static struct dentry *ouichefs_stats;
 
 
 /*
@@ -46,19 +47,15 @@ static int debug_ouichefs_show(struct seq_file *s_file, void *v)
 	struct inode *sub_file_inode;
 	int num_inode;
 	struct ouichefs_inode_info *ci;
-	struct buffer_head *bh_index;
-	struct buffer_head *bh_index_inode_file;
-	struct ouichefs_file_index_block *index;
-	struct ouichefs_inode *cinode;
-	int nb_versions, offset;
-	/* variables pour changer de version et revenir sur la version actuelle */
-	uint32_t cur_v, last_v, inode_block, inode_shift;
+	int nb_versions, offset, i, ret;
 	char msg[taille_max];
 
 	for (num_inode = 0; num_inode < sbi->nr_inodes; num_inode++) {
 
 		memset(msg, 0, taille_max * (sizeof(char)));
 		sub_file_inode = ouichefs_iget(sb, num_inode);
+		if (IS_ERR(sub_file_inode))
+			continue;
 
 		/* soit l'inode n'est pas allouée
 		 * soit le fichier n'est pas régulier
@@ -73,46 +70,26 @@ static int debug_ouichefs_show(struct seq_file *s_file, void *v)
 			continue;
 		}
 		/* j'ai trouvé un file régulier */
-		inode_block = (sub_file_inode->i_ino / OUICHEFS_INODES_PER_BLOCK) + 1;
-		inode_shift = sub_file_inode->i_ino % OUICHEFS_INODES_PER_BLOCK;
 		offset = taille_max;
-
-		bh_index_inode_file = sb_bread(sb, inode_block);
-		if (!bh_index_inode_file) {
-			iput(sub_file_inode);
-			return  -EIO;
-		}
-		cinode = (struct ouichefs_inode *)bh_index_inode_file->b_data;
-		cinode += inode_shift;
 		ci = OUICHEFS_INODE(sub_file_inode);
-		bh_index = sb_bread(sb, cinode->last_index_block);
-		if (!bh_index) {
+		mutex_lock(&ci->index_lock);
+		ret = ouichefs_load_versions(sub_file_inode);
+		if (ret) {
+			mutex_unlock(&ci->index_lock);
+			iput(sub_file_inode);
 			seq_puts(s_file, "erreur lors de la récupération des données\n");
 			return 0;
 		}
-
-		index = (struct ouichefs_file_index_block *)bh_index->b_data;
-		nb_versions = 0;
-		cur_v = cinode->last_index_block;
-		offset -= scnprintf(msg + (taille_max - offset), offset, "%d", cur_v);
-
-		while (index->blocks[(OUICHEFS_BLOCK_SIZE >> 2) - 1] != -1
-		 && index->blocks[(OUICHEFS_BLOCK_SIZE >> 2) - 1] != 0) {
-			last_v = index->blocks[(OUICHEFS_BLOCK_SIZE >> 2) - 1];
-
-			bh_index = sb_bread(sb, last_v);
-			if (!bh_index) {
-				seq_puts(s_file, "erreur lors de la récupération des données\n");
-				return 0;
-			}
-			index = (struct ouichefs_file_index_block *)bh_index->b_data;
-			cur_v = last_v;
-			nb_versions++;
-			offset -= scnprintf(msg + (taille_max - offset), offset, ",%d", cur_v);
-		}
+		/* de la dernière version à la plus ancienne */
+		nb_versions = ci->nr_cached;
+		for (i = nb_versions; i-- > 0;)
+			offset -= scnprintf(msg + (taille_max - offset), offset,
+					    i == nb_versions - 1 ? "%u" : ",%u",
+					    ci->versions[i].index_block);
+		mutex_unlock(&ci->index_lock);
 		seq_printf(s_file, "inode:%ld | nombre de versions:%d | liste des blocks de version:{%s}\n",
 				sub_file_inode->i_ino,
-				nb_versions + 1,
+				nb_versions,
 				msg);
 
 		iput(sub_file_inode);
@@ -135,6 +112,44 @@ const struct file_operations debug_ouichefs_ops = {
 	.release = single_release,
 };
 
+/*
+ * Statistics of the partition, one counter per line.
+ */
+static int stats_ouichefs_show(struct seq_file *s_file, void *v)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(inode_partition->i_sb);
+
+	seq_printf(s_file, "reads_saved: %lld\n",
+		   atomic64_read(&sbi->stats.reads_saved));
+	seq_printf(s_file, "csum_computed: %lld\n",
+		   atomic64_read(&sbi->stats.csum_computed));
+	seq_printf(s_file, "csum_verified: %lld\n",
+		   atomic64_read(&sbi->stats.csum_verified));
+	seq_printf(s_file, "csum_cached: %lld\n",
+		   atomic64_read(&sbi->stats.csum_cached));
+	seq_printf(s_file, "csum_errors: %lld\n",
+		   atomic64_read(&sbi->stats.csum_errors));
+	seq_printf(s_file, "csum_ns: %lld\n",
+		   atomic64_read(&sbi->stats.csum_ns));
+	seq_printf(s_file, "defrag_moved: %lld\n",
+		   atomic64_read(&sbi->stats.defrag_moved));
+	seq_printf(s_file, "history_blocks: %lld\n",
+		   percpu_counter_sum_positive(&sbi->nr_history_blocks));
+	return 0;
+}
+
+static int stats_ouichefs_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, stats_ouichefs_show, NULL);
+}
+
+const struct file_operations stats_ouichefs_ops = {
+	.owner = THIS_MODULE,
+	.open = stats_ouichefs_open,
+	.read  = seq_read,
+	.release = single_release,
+};
+
 struct dentry *ouichefs_mount(struct file_system_type *fs_type, int flags,
 			      const char *dev_name, void *data)
 {
@@ -142,10 +157,11 @@ struct dentry *ouichefs_mount(struct file_system_type *fs_type, int flags,
 
 	dentry = mount_bdev(fs_type, flags, dev_name, data,
 			    ouichefs_fill_super);
-	if (IS_ERR(dentry))
+	if (IS_ERR(dentry)) {
 		pr_err("'%s' mount failure\n", dev_name);
-	else
-		pr_info("'%s' mount success\n", dev_name);
+		return dentry;
+	}
+	pr_info("'%s' mount success\n", dev_name);
 
 	/*--------------------------------------------------------------*/
 	/* Partie 2 : création du debugfs				*/
@@ -158,6 +174,8 @@ struct dentry *ouichefs_mount(struct file_system_type *fs_type, int flags,
 		pr_err("debugfs_create_file ouichefs_debug failed\n");
 		goto err;
 	}
+	ouichefs_stats = debugfs_create_file("ouichefs_stats", 0400, NULL,
+					     NULL, &stats_ouichefs_ops);
 
 	pr_info("module loaded\n");
 	return dentry;
@@ -174,6 +192,12 @@ void ouichefs_kill_sb(struct super_block *sb)
 	 * on doit enlever le debugfs
 	 */
 	debugfs_remove(ouichefs_debug);
+	debugfs_remove(ouichefs_stats);
+	/* The garbage collector holds inodes, stop it before evicting them */
+	if (sb->s_fs_info) {
+		ouichefs_gc_stop(sb);
+		ouichefs_discard_flush(sb);
+	}
 	kill_block_super(sb);
 	pr_info("unmounted disk\n");
 }
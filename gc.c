@@ -0,0 +1,399 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * ouiche_fs - a simple educational filesystem for Linux
+ *
+ * Copyright (C) 2018 Redha Gouicem <redha.gouicem@lip6.fr>
+ */
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/buffer_head.h>
+#include <linux/parser.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/timekeeping.h>
+#include <linux/workqueue.h>
+
+#include "ouichefs.h"
+#include "test/requettes.h"
+
+/* Default pace of the garbage collector */
+#define OUICHEFS_GC_INTERVAL	60	/* seconds */
+#define OUICHEFS_GC_BATCH	256	/* versions */
+/* Inode store blocks scanned at most by a run */
+#define OUICHEFS_GC_SCAN_BLOCKS	16
+
+enum {
+	Opt_keep, Opt_max_age, Opt_budget, Opt_gc_interval, Opt_gc_batch,
+	Opt_discard, Opt_quota, Opt_usr_live, Opt_usr_history, Opt_grp_live,
+	Opt_grp_history, Opt_err
+};
+
+static const match_table_t tokens = {
+	{ Opt_keep, "keep=%u" },
+	{ Opt_max_age, "max_age=%u" },
+	{ Opt_budget, "budget=%u" },
+	{ Opt_gc_interval, "gc_interval=%u" },
+	{ Opt_gc_batch, "gc_batch=%u" },
+	{ Opt_discard, "discard" },
+	{ Opt_quota, "quota" },
+	{ Opt_usr_live, "usrquota_live=%u" },
+	{ Opt_usr_history, "usrquota_history=%u" },
+	{ Opt_grp_live, "grpquota_live=%u" },
+	{ Opt_grp_history, "grpquota_history=%u" },
+	{ Opt_err, NULL },
+};
+
+/*
+ * Parse the mount options into the retention policy of sbi and its other
+ * settings. Any quota option enables the quotas, see quota.c.
+ */
+int ouichefs_parse_options(struct ouichefs_sb_info *sbi, char *options)
+{
+	struct ouichefs_retention *r = &sbi->retention;
+	struct ouichefs_quota_limits *q = sbi->quota_defaults;
+	substring_t args[MAX_OPT_ARGS];
+	unsigned int val;
+	char *p;
+
+	r->interval = OUICHEFS_GC_INTERVAL;
+	r->batch = OUICHEFS_GC_BATCH;
+	if (!options)
+		return 0;
+
+	while ((p = strsep(&options, ",")) != NULL) {
+		int token;
+
+		if (!*p)
+			continue;
+		token = match_token(p, tokens, args);
+		if (token == Opt_err) {
+			pr_err("unknown mount option '%s'\n", p);
+			return -EINVAL;
+		}
+		if (token == Opt_discard) {
+			sbi->discard = true;
+			continue;
+		}
+		if (token == Opt_quota) {
+			sbi->quota = true;
+			continue;
+		}
+		if (match_uint(&args[0], &val)) {
+			pr_err("invalid value in mount option '%s'\n", p);
+			return -EINVAL;
+		}
+		switch (token) {
+		case Opt_keep:
+			r->keep = val;
+			break;
+		case Opt_max_age:
+			r->max_age = val;
+			break;
+		case Opt_budget:
+			r->budget = val;
+			break;
+		case Opt_gc_interval:
+			if (!val)
+				return -EINVAL;
+			r->interval = val;
+			break;
+		case Opt_gc_batch:
+			if (!val)
+				return -EINVAL;
+			r->batch = val;
+			break;
+		case Opt_usr_live:
+			q[OUICHEFS_USRQUOTA].live = val;
+			sbi->quota = true;
+			break;
+		case Opt_usr_history:
+			q[OUICHEFS_USRQUOTA].history = val;
+			sbi->quota = true;
+			break;
+		case Opt_grp_live:
+			q[OUICHEFS_GRPQUOTA].live = val;
+			sbi->quota = true;
+			break;
+		case Opt_grp_history:
+			q[OUICHEFS_GRPQUOTA].history = val;
+			sbi->quota = true;
+			break;
+		}
+	}
+	return 0;
+}
+
+int ouichefs_show_options(struct seq_file *m, struct dentry *root)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(root->d_sb);
+	struct ouichefs_retention *r = &sbi->retention;
+	struct ouichefs_quota_limits *q = sbi->quota_defaults;
+
+	if (r->keep)
+		seq_printf(m, ",keep=%u", r->keep);
+	if (r->max_age)
+		seq_printf(m, ",max_age=%u", r->max_age);
+	if (r->budget)
+		seq_printf(m, ",budget=%u", r->budget);
+	if (r->interval != OUICHEFS_GC_INTERVAL)
+		seq_printf(m, ",gc_interval=%u", r->interval);
+	if (r->batch != OUICHEFS_GC_BATCH)
+		seq_printf(m, ",gc_batch=%u", r->batch);
+	if (sbi->discard)
+		seq_puts(m, ",discard");
+	if (sbi->quota)
+		seq_puts(m, ",quota");
+	if (q[OUICHEFS_USRQUOTA].live)
+		seq_printf(m, ",usrquota_live=%u", q[OUICHEFS_USRQUOTA].live);
+	if (q[OUICHEFS_USRQUOTA].history)
+		seq_printf(m, ",usrquota_history=%u",
+			   q[OUICHEFS_USRQUOTA].history);
+	if (q[OUICHEFS_GRPQUOTA].live)
+		seq_printf(m, ",grpquota_live=%u", q[OUICHEFS_GRPQUOTA].live);
+	if (q[OUICHEFS_GRPQUOTA].history)
+		seq_printf(m, ",grpquota_history=%u",
+			   q[OUICHEFS_GRPQUOTA].history);
+	return 0;
+}
+
+static bool ouichefs_gc_enabled(struct ouichefs_sb_info *sbi)
+{
+	struct ouichefs_retention *r = &sbi->retention;
+
+	return r->keep || r->max_age || r->budget;
+}
+
+/*
+ * Return how many of the oldest versions of ci may be dropped: never the
+ * current view nor anything newer. The caller must hold index_lock and the
+ * version cache must be loaded.
+ */
+static uint32_t ouichefs_gc_limit(struct ouichefs_inode_info *ci)
+{
+	uint32_t i;
+
+	if (ci->nr_cached < 2)
+		return 0;
+	for (i = 0; i < ci->nr_cached - 1; i++)
+		if (ci->versions[i].index_block == ci->index_block)
+			return i;
+	return ci->nr_cached - 1;
+}
+
+/*
+ * Return how many of the oldest versions of ci the retention policy drops,
+ * at most max. The caller must hold index_lock and the version cache must be
+ * loaded.
+ */
+static uint32_t ouichefs_gc_count(struct ouichefs_sb_info *sbi,
+				  struct ouichefs_inode_info *ci,
+				  uint32_t max)
+{
+	struct ouichefs_retention *r = &sbi->retention;
+	struct ouichefs_version_record *v = ci->versions;
+	uint32_t nr = ci->nr_cached, limit, drop = 0, i;
+	uint64_t used = 0;
+	time64_t now;
+
+	limit = ouichefs_gc_limit(ci);
+	if (!limit)
+		return 0;
+
+	if (r->keep && nr > r->keep)
+		drop = nr - r->keep;
+
+	if (r->max_age) {
+		now = ktime_get_real_seconds();
+		while (drop < limit &&
+		       (time64_t)v[drop].mtime + r->max_age < now)
+			drop++;
+	}
+
+	if (r->budget) {
+		for (i = drop; i < nr - 1; i++)
+			used += v[i].nr_blocks + 1;
+		while (drop < limit && used > r->budget) {
+			used -= v[drop].nr_blocks + 1;
+			drop++;
+		}
+	}
+
+	return min3(drop, limit, max);
+}
+
+/*
+ * Apply the retention policy to inode, freeing at most max versions. Return
+ * the number of versions freed.
+ */
+static uint32_t ouichefs_gc_inode(struct inode *inode, uint32_t max)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(inode->i_sb);
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	uint32_t nr = 0;
+	int ret;
+
+	inode_lock(inode);
+	/* The file may have been unlinked since it was scanned */
+	if (!S_ISREG(inode->i_mode))
+		goto unlock;
+
+	mutex_lock(&ci->index_lock);
+	ret = ouichefs_load_versions(inode);
+	if (!ret)
+		nr = ouichefs_gc_count(sbi, ci, max);
+	mutex_unlock(&ci->index_lock);
+
+	if (nr) {
+		ret = ouichefs_trim_versions(inode, nr);
+		if (ret) {
+			pr_err("inode %lu: failed dropping %u versions (%d)\n",
+			       inode->i_ino, nr, ret);
+			nr = 0;
+		} else {
+			pr_debug("inode %lu: dropped %u versions\n",
+				 inode->i_ino, nr);
+		}
+	}
+unlock:
+	inode_unlock(inode);
+	return nr;
+}
+
+/*
+ * Drop the oldest versions of inode until at least blocks blocks are freed,
+ * or every version that may be dropped. Called with the inode lock held when
+ * the history of its owner goes over its quota. Return the number of blocks
+ * freed.
+ */
+uint32_t ouichefs_gc_reclaim(struct inode *inode, uint32_t blocks)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	uint32_t limit, drop = 0, freed = 0;
+	int ret;
+
+	mutex_lock(&ci->index_lock);
+	ret = ouichefs_load_versions(inode);
+	limit = ret ? 0 : ouichefs_gc_limit(ci);
+	while (drop < limit && freed < blocks)
+		freed += ci->versions[drop++].nr_blocks + 1;
+	mutex_unlock(&ci->index_lock);
+
+	if (!drop)
+		return 0;
+	ret = ouichefs_trim_versions(inode, drop);
+	if (ret) {
+		pr_err("inode %lu: failed dropping %u versions (%d)\n",
+		       inode->i_ino, drop, ret);
+		return 0;
+	}
+	pr_debug("inode %lu: dropped %u versions over quota\n",
+		 inode->i_ino, drop);
+	return freed;
+}
+
+/*
+ * Scan the inode store from the cursor and apply the retention policy to
+ * the files having several versions. A run frees at most retention.batch
+ * versions and scans at most OUICHEFS_GC_SCAN_BLOCKS inode store blocks so
+ * that it never competes with writers for long. A frozen partition is left
+ * alone until the next run.
+ */
+static void ouichefs_gc_work(struct work_struct *work)
+{
+	struct ouichefs_sb_info *sbi = container_of(to_delayed_work(work),
+						    struct ouichefs_sb_info,
+						    gc_work);
+	struct super_block *sb = sbi->sb;
+	uint32_t budget = sbi->retention.batch, nr_inos, ino, i, n;
+	struct ouichefs_inode *disk_inode;
+	struct buffer_head *bh;
+	struct inode *inode;
+	uint32_t *inos;
+
+	if (sb_rdonly(sb) || !sb_start_write_trylock(sb))
+		goto requeue;
+	inos = kmalloc_array(OUICHEFS_INODES_PER_BLOCK(sb), sizeof(*inos),
+			     GFP_NOFS);
+	if (!inos)
+		goto end_write;
+
+	for (n = 0; n < OUICHEFS_GC_SCAN_BLOCKS && budget; n++) {
+		if (sbi->gc_cursor >= sbi->nr_inodes)
+			sbi->gc_cursor = 0;
+		ino = sbi->gc_cursor;
+
+		/* Pick candidates from the on-disk inodes of this block */
+		bh = ouichefs_bread(sb, ino / OUICHEFS_INODES_PER_BLOCK(sb) + 1);
+		if (!bh)
+			break;
+		disk_inode = (struct ouichefs_inode *)bh->b_data;
+		nr_inos = 0;
+		for (i = ino % OUICHEFS_INODES_PER_BLOCK(sb);
+		     i < OUICHEFS_INODES_PER_BLOCK(sb) && ino < sbi->nr_inodes;
+		     i++, ino++) {
+			if (S_ISREG(disk_inode[i].i_mode) &&
+			    disk_inode[i].nb_versions > 1)
+				inos[nr_inos++] = ino;
+		}
+		brelse(bh);
+		sbi->gc_cursor = ino;
+
+		for (i = 0; i < nr_inos && budget; i++) {
+			inode = ouichefs_iget(sb, inos[i]);
+			if (IS_ERR(inode))
+				continue;
+			budget -= ouichefs_gc_inode(inode, budget);
+			iput(inode);
+		}
+		cond_resched();
+	}
+	kfree(inos);
+end_write:
+	sb_end_write(sb);
+requeue:
+	queue_delayed_work(system_long_wq, &sbi->gc_work,
+			   sbi->retention.interval * HZ);
+}
+
+void ouichefs_gc_init(struct super_block *sb)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+
+	sbi->sb = sb;
+	sbi->gc_cursor = 0;
+	INIT_DELAYED_WORK(&sbi->gc_work, ouichefs_gc_work);
+}
+
+/* Run the garbage collector now, blocks are needed */
+void ouichefs_gc_kick(struct super_block *sb)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+
+	if (ouichefs_gc_enabled(sbi))
+		mod_delayed_work(system_long_wq, &sbi->gc_work, 0);
+}
+
+void ouichefs_gc_start(struct super_block *sb)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+
+	if (!ouichefs_gc_enabled(sbi))
+		return;
+	queue_delayed_work(system_long_wq, &sbi->gc_work,
+			   sbi->retention.interval * HZ);
+}
+
+/*
+ * Stop the garbage collector. Must be called before the inodes are evicted
+ * at unmount since a run holds references on inodes.
+ */
+void ouichefs_gc_stop(struct super_block *sb)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+
+	cancel_delayed_work_sync(&sbi->gc_work);
+}
@@ -16,6 +16,8 @@
 #include "bitmap.h"
 
 static const struct inode_operations ouichefs_inode_ops;
+static const struct inode_operations ouichefs_symlink_inode_ops;
+static const struct inode_operations ouichefs_fast_symlink_inode_ops;
 
 /*
  * Get inode ino from disk.
@@ -27,8 +29,8 @@ struct inode *ouichefs_iget(struct super_block *sb, unsigned long ino)
 	struct ouichefs_inode_info *ci = NULL;
 	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
 	struct buffer_head *bh = NULL;
-	uint32_t inode_block = (ino / OUICHEFS_INODES_PER_BLOCK) + 1;
-	uint32_t inode_shift = ino % OUICHEFS_INODES_PER_BLOCK;
+	uint32_t inode_block = (ino / OUICHEFS_INODES_PER_BLOCK(sb)) + 1;
+	uint32_t inode_shift = ino % OUICHEFS_INODES_PER_BLOCK(sb);
 	int ret;
 
 	/* Fail if ino is out of range */
@@ -45,7 +47,7 @@ struct inode *ouichefs_iget(struct super_block *sb, unsigned long ino)
 
 	ci = OUICHEFS_INODE(inode);
 	/* Read inode from disk and initialize */
-	bh = sb_bread(sb, inode_block);
+	bh = ouichefs_bread(sb, inode_block);
 	if (!bh) {
 		ret = -EIO;
 		goto failed;
@@ -71,15 +73,53 @@ struct inode *ouichefs_iget(struct super_block *sb, unsigned long ino)
 	set_nlink(inode, le32_to_cpu(cinode->i_nlink));
 
 	ci->index_block = le32_to_cpu(cinode->index_block);
+	ci->last_index_block = le32_to_cpu(cinode->last_index_block);
+	ci->nb_versions = le32_to_cpu(cinode->nb_versions);
+	ci->version_table = le32_to_cpu(cinode->version_table);
+	ci->last_number = le32_to_cpu(cinode->last_number);
+	ci->last_size = le32_to_cpu(cinode->last_size);
+	ci->last_mtime = le32_to_cpu(cinode->i_mtime);
+	ci->last_flags = le32_to_cpu(cinode->last_flags);
+	ci->xattr_block = le32_to_cpu(cinode->i_xattr);
+	ci->tag_block = le32_to_cpu(cinode->i_tags);
+	ci->next_number = le32_to_cpu(cinode->i_next_number);
+	ci->history_blocks = ci->version_table ? OUICHEFS_HISTORY_UNKNOWN : 0;
+	ci->view_flags = 0;
+	ci->can_write = 1;
 
 	if (S_ISDIR(inode->i_mode)) {
 		inode->i_fop = &ouichefs_dir_ops;
 	} else if (S_ISREG(inode->i_mode)) {
+		inode->i_op = &ouichefs_file_inode_ops;
 		inode->i_fop = &ouichefs_file_ops;
 		inode->i_mapping->a_ops = &ouichefs_aops;
+	} else if (S_ISLNK(inode->i_mode) && !inode->i_blocks) {
+		/* The target of a fast symlink replaces the version fields */
+		memcpy(ci->i_link, cinode->i_link, OUICHEFS_FAST_LINK_LEN);
+		ci->i_link[OUICHEFS_FAST_LINK_LEN - 1] = '\0';
+		ci->index_block = 0;
+		ci->last_index_block = 0;
+		ci->nb_versions = 0;
+		ci->version_table = 0;
+		ci->last_number = 0;
+		ci->last_size = 0;
+		ci->last_flags = 0;
+		ci->history_blocks = 0;
+		inode->i_link = ci->i_link;
+		inode->i_op = &ouichefs_fast_symlink_inode_ops;
+	} else if (S_ISLNK(inode->i_mode)) {
+		inode->i_op = &ouichefs_symlink_inode_ops;
 	}
 
 	brelse(bh);
+	bh = NULL;
+
+	/* A file may be viewing an older version, find its flags */
+	if (S_ISREG(inode->i_mode)) {
+		ret = ouichefs_load_view(inode);
+		if (ret)
+			goto failed;
+	}
 
 	/* Unlock the inode to make it usable */
 	unlock_new_inode(inode);
@@ -113,7 +153,7 @@ static struct dentry *ouichefs_lookup(struct inode *dir, struct dentry *dentry,
 		return ERR_PTR(-ENAMETOOLONG);
 
 	/* Read the directory index block on disk */
-	bh = sb_bread(sb, ci_dir->index_block);
+	bh = ouichefs_bread(sb, ci_dir->index_block);
 	if (!bh)
 		return ERR_PTR(-EIO);
 	dblock = (struct ouichefs_dir_block *)bh->b_data;
@@ -141,6 +181,39 @@ static struct dentry *ouichefs_lookup(struct inode *dir, struct dentry *dentry,
 	return NULL;
 }
 
+/*
+ * Choose the allocation group of a new inode created in dir. Regular files
+ * stay in the group of their parent directory so that a directory and its
+ * files (and all their versions) are allocated close to each other.
+ * Directories are spread over the groups: pick the group with the most free
+ * inodes among those with an above average number of free blocks.
+ */
+static uint32_t ouichefs_find_group(struct inode *dir, mode_t mode)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(dir->i_sb);
+	uint32_t parent_group = ouichefs_ino_group(sbi, dir->i_ino);
+	uint32_t avg_free_blocks, best, best_free = 0, g;
+
+	if (!S_ISDIR(mode) || sbi->nr_groups == 1)
+		return parent_group;
+
+	avg_free_blocks = percpu_counter_read_positive(&sbi->nr_free_blocks) /
+		sbi->nr_groups;
+	best = parent_group;
+	for (g = 0; g < sbi->nr_groups; g++) {
+		struct ouichefs_group_info *gi = &sbi->groups[g];
+
+		if (READ_ONCE(gi->nr_free_blocks) < avg_free_blocks)
+			continue;
+		if (READ_ONCE(gi->nr_free_inodes) > best_free) {
+			best = g;
+			best_free = READ_ONCE(gi->nr_free_inodes);
+		}
+	}
+
+	return best;
+}
+
 /*
  * Create a new inode in dir.
  */
@@ -150,23 +223,25 @@ static struct inode *ouichefs_new_inode(struct inode *dir, mode_t mode)
 	struct ouichefs_inode_info *ci;
 	struct super_block *sb;
 	struct ouichefs_sb_info *sbi;
-	uint32_t ino, bno;
+	uint32_t ino, bno, group;
 	int ret;
 
 	/* Check mode before doing anything to avoid undoing everything */
-	if (!S_ISDIR(mode) && !S_ISREG(mode)) {
-		pr_err("File type not supported (only directory and regular files supported)\n");
+	if (!S_ISDIR(mode) && !S_ISREG(mode) && !S_ISLNK(mode)) {
+		pr_err("File type not supported (only directories, regular files and symlinks supported)\n");
 		return ERR_PTR(-EINVAL);
 	}
 
 	/* Check if inodes are available */
 	sb = dir->i_sb;
 	sbi = OUICHEFS_SB(sb);
-	if (sbi->nr_free_inodes == 0 || sbi->nr_free_blocks == 0)
+	if (percpu_counter_read_positive(&sbi->nr_free_inodes) == 0 ||
+	    percpu_counter_read_positive(&sbi->nr_free_blocks) == 0)
 		return ERR_PTR(-ENOSPC);
 
-	/* Get a new free inode */
-	ino = get_free_inode(sbi);
+	/* Get a new free inode, close to its parent if possible */
+	group = ouichefs_find_group(dir, mode);
+	ino = get_free_inode(sbi, group);
 	if (!ino)
 		return ERR_PTR(-ENOSPC);
 	inode = ouichefs_iget(sb, ino);
@@ -176,29 +251,52 @@ static struct inode *ouichefs_new_inode(struct inode *dir, mode_t mode)
 	}
 	ci = OUICHEFS_INODE(inode);
 
-	/* Get a free block for this new inode's index */
-	bno = get_free_block(sbi);
-	if (!bno) {
-		ret = -ENOSPC;
-		goto put_inode;
+	/*
+	 * Get a free block for this new inode's index. A symlink gets a
+	 * block for its target only if it is too long for the inode, see
+	 * ouichefs_symlink().
+	 */
+	bno = 0;
+	if (!S_ISLNK(mode)) {
+		bno = get_free_block(sbi, ouichefs_ino_group(sbi, ino));
+		if (!bno) {
+			ret = -ENOSPC;
+			goto put_inode;
+		}
 	}
 	ci->index_block = bno;
+	ci->last_index_block = bno;
+	ci->nb_versions = 0;
+	ci->can_write = 1;
+	ci->version_table = 0;
+	ci->last_number = 0;
+	ci->last_size = 0;
+	ci->last_flags = 0;
+	ci->view_flags = 0;
+	ci->xattr_block = 0;
+	ci->tag_block = 0;
+	ci->next_number = 0;
 
 	/* Initialize inode */
 	inode_init_owner(inode, dir, mode);
-	inode->i_blocks = 1;
+	ouichefs_set_blocks(inode, bno ? 1 : 0);
 	if (S_ISDIR(mode)) {
-		inode->i_size = OUICHEFS_BLOCK_SIZE;
+		inode->i_size = OUICHEFS_BSIZE(sb);
 		inode->i_fop = &ouichefs_dir_ops;
 		set_nlink(inode, 2); /* . and .. */
 	} else if (S_ISREG(mode)) {
 		inode->i_size = 0;
+		inode->i_op = &ouichefs_file_inode_ops;
 		inode->i_fop = &ouichefs_file_ops;
 		inode->i_mapping->a_ops = &ouichefs_aops;
 		set_nlink(inode, 1);
+	} else {
+		inode->i_size = 0;
+		set_nlink(inode, 1);
 	}
 
 	inode->i_ctime = inode->i_atime = inode->i_mtime = current_time(inode);
+	ci->last_mtime = inode->i_mtime.tv_sec;
 
 	return inode;
 
@@ -225,7 +323,6 @@ static int ouichefs_create(struct inode *dir, struct dentry *dentry,
 	struct inode *inode;
 	struct ouichefs_inode_info *ci_dir;
 	struct ouichefs_dir_block *dblock;
-	char *fblock;
 	struct buffer_head *bh, *bh2;
 	int ret = 0, i;
 
@@ -236,7 +333,7 @@ static int ouichefs_create(struct inode *dir, struct dentry *dentry,
 	/* Read parent directory index */
 	ci_dir = OUICHEFS_INODE(dir);
 	sb = dir->i_sb;
-	bh = sb_bread(sb, ci_dir->index_block);
+	bh = ouichefs_bread(sb, ci_dir->index_block);
 	if (!bh)
 		return -EIO;
 	dblock = (struct ouichefs_dir_block *)bh->b_data;
@@ -256,16 +353,14 @@ static int ouichefs_create(struct inode *dir, struct dentry *dentry,
 
 	/*
 	 * Scrub index_block for new file/directory to avoid previous data
-	 * messing with new file/directory.
+	 * messing with new file/directory. Freed blocks are not scrubbed.
 	 */
-	bh2 = sb_bread(sb, OUICHEFS_INODE(inode)->index_block);
+	bh2 = ouichefs_get_zeroed_block(sb, inode,
+					OUICHEFS_INODE(inode)->index_block);
 	if (!bh2) {
 		ret = -EIO;
 		goto iput;
 	}
-	fblock = (char *)bh2->b_data;
-	memset(fblock, 0, OUICHEFS_BLOCK_SIZE);
-	mark_buffer_dirty(bh2);
 	brelse(bh2);
 
 	/* Find first free slot in parent index and register new inode */
@@ -275,7 +370,7 @@ static int ouichefs_create(struct inode *dir, struct dentry *dentry,
 	dblock->files[i].inode = inode->i_ino;
 	strncpy(dblock->files[i].filename,
 		dentry->d_name.name, OUICHEFS_FILENAME_LEN);
-	mark_buffer_dirty(bh);
+	ouichefs_mark_dirty(sb, bh, NULL);
 	brelse(bh);
 
 	/* Update stats and mark dir and new inode dirty */
@@ -291,6 +386,7 @@ static int ouichefs_create(struct inode *dir, struct dentry *dentry,
 	return 0;
 
 iput:
+	ouichefs_set_blocks(inode, 0);
 	put_block(OUICHEFS_SB(sb), OUICHEFS_INODE(inode)->index_block);
 	put_inode(OUICHEFS_SB(sb), inode->i_ino);
 	iput(inode);
@@ -299,6 +395,165 @@ end:
 	return ret;
 }
 
+/*
+ * Add an entry named after dentry for inode to dir.
+ */
+static int ouichefs_add_entry(struct inode *dir, struct dentry *dentry,
+			      struct inode *inode)
+{
+	struct super_block *sb = dir->i_sb;
+	struct ouichefs_dir_block *dblock;
+	struct buffer_head *bh;
+	int i;
+
+	bh = ouichefs_bread(sb, OUICHEFS_INODE(dir)->index_block);
+	if (!bh)
+		return -EIO;
+	dblock = (struct ouichefs_dir_block *)bh->b_data;
+
+	for (i = 0; i < OUICHEFS_MAX_SUBFILES; i++)
+		if (dblock->files[i].inode == 0)
+			break;
+	if (i == OUICHEFS_MAX_SUBFILES) {
+		brelse(bh);
+		return -EMLINK;
+	}
+	dblock->files[i].inode = inode->i_ino;
+	strncpy(dblock->files[i].filename, dentry->d_name.name,
+		OUICHEFS_FILENAME_LEN);
+	ouichefs_mark_dirty(sb, bh, NULL);
+	brelse(bh);
+
+	dir->i_mtime = dir->i_atime = dir->i_ctime = current_time(dir);
+	mark_inode_dirty(dir);
+	return 0;
+}
+
+/*
+ * Create a symbolic link. A target shorter than OUICHEFS_FAST_LINK_LEN is
+ * stored in the inode in place of the version fields, a longer one in a
+ * block of its own. Symlinks have no versions.
+ */
+static int ouichefs_symlink(struct inode *dir, struct dentry *dentry,
+			    const char *symname)
+{
+	struct super_block *sb = dir->i_sb;
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_inode_info *ci;
+	struct buffer_head *bh;
+	struct inode *inode;
+	size_t len = strlen(symname);
+	uint32_t bno;
+	int ret;
+
+	if (dentry->d_name.len > OUICHEFS_FILENAME_LEN)
+		return -ENAMETOOLONG;
+	if (len >= OUICHEFS_BSIZE(sb))
+		return -ENAMETOOLONG;
+
+	inode = ouichefs_new_inode(dir, S_IFLNK | 0777);
+	if (IS_ERR(inode))
+		return PTR_ERR(inode);
+	ci = OUICHEFS_INODE(inode);
+
+	if (len < OUICHEFS_FAST_LINK_LEN) {
+		memset(ci->i_link, 0, OUICHEFS_FAST_LINK_LEN);
+		memcpy(ci->i_link, symname, len);
+		inode->i_link = ci->i_link;
+		inode->i_op = &ouichefs_fast_symlink_inode_ops;
+	} else {
+		bno = get_free_block(sbi, ouichefs_ino_group(sbi,
+							     inode->i_ino));
+		if (!bno) {
+			ret = -ENOSPC;
+			goto put_inode;
+		}
+		bh = ouichefs_get_zeroed_block(sb, inode, bno);
+		if (!bh) {
+			put_block(sbi, bno);
+			ret = -EIO;
+			goto put_inode;
+		}
+		memcpy(bh->b_data, symname, len);
+		ouichefs_mark_dirty(sb, bh, inode);
+		brelse(bh);
+		ci->index_block = bno;
+		ouichefs_set_blocks(inode, 1);
+		inode->i_op = &ouichefs_symlink_inode_ops;
+	}
+	inode->i_size = len;
+
+	ret = ouichefs_add_entry(dir, dentry, inode);
+	if (ret)
+		goto release;
+
+	mark_inode_dirty(inode);
+	d_instantiate(dentry, inode);
+	return 0;
+
+release:
+	if (ci->index_block)
+		put_block(sbi, ci->index_block);
+put_inode:
+	ci->index_block = 0;
+	ouichefs_set_blocks(inode, 0);
+	put_inode(sbi, inode->i_ino);
+	iput(inode);
+	return ret;
+}
+
+/*
+ * Get the target of a symlink stored in a block. Fast symlinks use
+ * simple_get_link().
+ */
+static const char *ouichefs_get_link(struct dentry *dentry,
+				     struct inode *inode,
+				     struct delayed_call *done)
+{
+	struct buffer_head *bh;
+	char *link;
+
+	/* Reading the block may sleep */
+	if (!dentry)
+		return ERR_PTR(-ECHILD);
+
+	bh = ouichefs_bread(inode->i_sb, OUICHEFS_INODE(inode)->index_block);
+	if (!bh)
+		return ERR_PTR(-EIO);
+	link = kmemdup_nul(bh->b_data, min_t(loff_t, inode->i_size,
+					     OUICHEFS_BSIZE(inode->i_sb) - 1),
+			   GFP_KERNEL);
+	brelse(bh);
+	if (!link)
+		return ERR_PTR(-ENOMEM);
+	set_delayed_call(done, kfree_link, link);
+	return link;
+}
+
+/*
+ * Add a hard link to a file. All its names share the inode, and so the same
+ * history of versions.
+ */
+static int ouichefs_link(struct dentry *old_dentry, struct inode *dir,
+			 struct dentry *dentry)
+{
+	struct inode *inode = d_inode(old_dentry);
+	int ret;
+
+	if (dentry->d_name.len > OUICHEFS_FILENAME_LEN)
+		return -ENAMETOOLONG;
+
+	ret = ouichefs_add_entry(dir, dentry, inode);
+	if (ret)
+		return ret;
+
+	inode->i_ctime = current_time(inode);
+	inode_inc_link_count(inode);
+	ihold(inode);
+	d_instantiate(dentry, inode);
+	return 0;
+}
+
 /*
  * Remove a link for a file. If link count is 0, destroy file in this way:
  *   - remove the file from its parent directory.
@@ -311,9 +566,8 @@ static int ouichefs_unlink(struct inode *dir, struct dentry *dentry)
 	struct super_block *sb = dir->i_sb;
 	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
 	struct inode *inode = d_inode(dentry);
-	struct buffer_head *bh = NULL, *bh2 = NULL;
+	struct buffer_head *bh = NULL;
 	struct ouichefs_dir_block *dir_block = NULL;
-	struct ouichefs_file_index_block *file_block = NULL;
 	uint32_t ino, bno;
 	int i, f_id = -1, nr_subs = 0;
 
@@ -321,19 +575,28 @@ static int ouichefs_unlink(struct inode *dir, struct dentry *dentry)
 	bno = OUICHEFS_INODE(inode)->index_block;
 
 	/* Read parent directory index */
-	bh = sb_bread(sb, OUICHEFS_INODE(dir)->index_block);
+	bh = ouichefs_bread(sb, OUICHEFS_INODE(dir)->index_block);
 	if (!bh)
 		return -EIO;
 	dir_block = (struct ouichefs_dir_block *)bh->b_data;
 
-	/* Search for inode in parent index and get number of subfiles */
+	/*
+	 * Search for the entry in parent index and get number of subfiles.
+	 * A file may have several names in the same directory.
+	 */
 	for (i = 0; i < OUICHEFS_MAX_SUBFILES; i++) {
-		if (dir_block->files[i].inode == ino)
-			f_id = i;
-		else if (dir_block->files[i].inode == 0)
+		if (dir_block->files[i].inode == 0)
 			break;
+		if (dir_block->files[i].inode == ino &&
+		    !strncmp(dir_block->files[i].filename,
+			     dentry->d_name.name, OUICHEFS_FILENAME_LEN))
+			f_id = i;
 	}
 	nr_subs = i;
+	if (f_id < 0) {
+		brelse(bh);
+		return -ENOENT;
+	}
 
 	/* Remove file from parent directory */
 	if (f_id != OUICHEFS_MAX_SUBFILES - 1)
@@ -342,7 +605,7 @@ static int ouichefs_unlink(struct inode *dir, struct dentry *dentry)
 			(nr_subs - f_id - 1) * sizeof(struct ouichefs_file));
 	memset(&dir_block->files[nr_subs - 1],
 	       0, sizeof(struct ouichefs_file));
-	mark_buffer_dirty(bh);
+	ouichefs_mark_dirty(sb, bh, NULL);
 	brelse(bh);
 
 	/* Update inode stats */
@@ -351,44 +614,35 @@ static int ouichefs_unlink(struct inode *dir, struct dentry *dentry)
 		inode_dec_link_count(dir);
 	mark_inode_dirty(dir);
 
+	/* The other names of the file keep it and its versions */
+	if (!S_ISDIR(inode->i_mode) && inode->i_nlink > 1) {
+		inode->i_ctime = current_time(inode);
+		inode_dec_link_count(inode);
+		return 0;
+	}
+
 	/*
-	 * Cleanup pointed blocks if unlinking a file. If we fail to read the
-	 * index block, cleanup inode anyway and lose this file's blocks
-	 * forever. If we fail to scrub a data block, don't fail (too late
-	 * anyway), just put the block and continue.
+	 * Cleanup every version if unlinking a file: the index blocks of the
+	 * history and their data blocks go back to the free bitmap. The index
+	 * block of a directory is freed below.
 	 */
-	bh = sb_bread(sb, bno);
-	if (!bh)
-		goto clean_inode;
-	file_block = (struct ouichefs_file_index_block *)bh->b_data;
-	if (S_ISDIR(inode->i_mode))
-		goto scrub;
-	for (i = 0; i < inode->i_blocks - 1; i++) {
-		char *block;
-
-		if (!file_block->blocks[i])
-			continue;
-
-		put_block(sbi, file_block->blocks[i]);
-		bh2 = sb_bread(sb, file_block->blocks[i]);
-		if (!bh2)
-			continue;
-		block = (char *)bh2->b_data;
-		memset(block, 0, OUICHEFS_BLOCK_SIZE);
-		mark_buffer_dirty(bh2);
-		brelse(bh2);
+	if (S_ISREG(inode->i_mode)) {
+		ouichefs_free_history(inode);
+		bno = 0;
 	}
+	ouichefs_xattr_free(inode);
 
-scrub:
-	/* Scrub index block */
-	memset(file_block, 0, OUICHEFS_BLOCK_SIZE);
-	mark_buffer_dirty(bh);
-	brelse(bh);
-
-clean_inode:
 	/* Cleanup inode and mark dirty */
-	inode->i_blocks = 0;
+	ouichefs_set_blocks(inode, 0);
 	OUICHEFS_INODE(inode)->index_block = 0;
+	OUICHEFS_INODE(inode)->last_index_block = 0;
+	OUICHEFS_INODE(inode)->nb_versions = 0;
+	OUICHEFS_INODE(inode)->can_write = 0;
+	OUICHEFS_INODE(inode)->version_table = 0;
+	OUICHEFS_INODE(inode)->last_number = 0;
+	OUICHEFS_INODE(inode)->next_number = 0;
+	OUICHEFS_INODE(inode)->last_size = 0;
+	OUICHEFS_INODE(inode)->last_flags = 0;
 	inode->i_size = 0;
 	i_uid_write(inode, 0);
 	i_gid_write(inode, 0);
@@ -399,7 +653,8 @@ clean_inode:
 	mark_inode_dirty(inode);
 
 	/* Free inode and index block from bitmap */
-	put_block(sbi, bno);
+	if (bno)
+		ouichefs_release_block(sb, bno);
 	put_inode(sbi, ino);
 
 	return 0;
@@ -426,7 +681,7 @@ static int ouichefs_rename(struct inode *old_dir, struct dentry *old_dentry,
 		return -ENAMETOOLONG;
 
 	/* Fail if new_dentry exists or if new_dir is full */
-	bh_new = sb_bread(sb, ci_new->index_block);
+	bh_new = ouichefs_bread(sb, ci_new->index_block);
 	if (!bh_new)
 		return -EIO;
 	dir_block = (struct ouichefs_dir_block *)bh_new->b_data;
@@ -452,7 +707,7 @@ static int ouichefs_rename(struct inode *old_dir, struct dentry *old_dentry,
 		strncpy(dir_block->files[f_pos].filename,
 			new_dentry->d_name.name,
 			OUICHEFS_FILENAME_LEN);
-		mark_buffer_dirty(bh_new);
+		ouichefs_mark_dirty(sb, bh_new, NULL);
 		ret = 0;
 		goto relse_new;
 	}
@@ -468,7 +723,7 @@ static int ouichefs_rename(struct inode *old_dir, struct dentry *old_dentry,
 	strncpy(dir_block->files[new_pos].filename,
 		new_dentry->d_name.name,
 		OUICHEFS_FILENAME_LEN);
-	mark_buffer_dirty(bh_new);
+	ouichefs_mark_dirty(sb, bh_new, NULL);
 	brelse(bh_new);
 
 	/* Update new parent inode metadata */
@@ -479,16 +734,18 @@ static int ouichefs_rename(struct inode *old_dir, struct dentry *old_dentry,
 	mark_inode_dirty(new_dir);
 
 	/* remove target from old parent directory */
-	bh_old = sb_bread(sb, ci_old->index_block);
+	bh_old = ouichefs_bread(sb, ci_old->index_block);
 	if (!bh_old)
 		return -EIO;
 	dir_block = (struct ouichefs_dir_block *)bh_old->b_data;
-	/* Search for inode in old directory and number of subfiles */
-	for (i = 0; OUICHEFS_MAX_SUBFILES; i++) {
-		if (dir_block->files[i].inode == src->i_ino)
-			f_id = i;
-		else if (dir_block->files[i].inode == 0)
+	/* Search for the entry in old directory and number of subfiles */
+	for (i = 0; i < OUICHEFS_MAX_SUBFILES; i++) {
+		if (dir_block->files[i].inode == 0)
 			break;
+		if (dir_block->files[i].inode == src->i_ino &&
+		    !strncmp(dir_block->files[i].filename,
+			     old_dentry->d_name.name, OUICHEFS_FILENAME_LEN))
+			f_id = i;
 	}
 	nr_subs = i;
 
@@ -499,7 +756,7 @@ static int ouichefs_rename(struct inode *old_dir, struct dentry *old_dentry,
 			(nr_subs - f_id - 1) * sizeof(struct ouichefs_file));
 	memset(&dir_block->files[nr_subs - 1],
 	       0, sizeof(struct ouichefs_file));
-	mark_buffer_dirty(bh_old);
+	ouichefs_mark_dirty(sb, bh_old, NULL);
 	brelse(bh_old);
 
 	/* Update old parent inode metadata */
@@ -533,7 +790,7 @@ static int ouichefs_rmdir(struct inode *dir, struct dentry *dentry)
 	/* If the directory is not empty, fail */
 	if (inode->i_nlink > 2)
 		return -ENOTEMPTY;
-	bh = sb_bread(sb, OUICHEFS_INODE(inode)->index_block);
+	bh = ouichefs_bread(sb, OUICHEFS_INODE(inode)->index_block);
 	if (!bh)
 		return -EIO;
 	dblock = (struct ouichefs_dir_block *)bh->b_data;
@@ -548,10 +805,23 @@ static int ouichefs_rmdir(struct inode *dir, struct dentry *dentry)
 }
 
 static const struct inode_operations ouichefs_inode_ops = {
-	.lookup = ouichefs_lookup,
-	.create = ouichefs_create,
-	.unlink = ouichefs_unlink,
-	.mkdir  = ouichefs_mkdir,
-	.rmdir  = ouichefs_rmdir,
-	.rename = ouichefs_rename,
+	.lookup  = ouichefs_lookup,
+	.create  = ouichefs_create,
+	.link    = ouichefs_link,
+	.unlink  = ouichefs_unlink,
+	.symlink = ouichefs_symlink,
+	.mkdir   = ouichefs_mkdir,
+	.rmdir   = ouichefs_rmdir,
+	.rename  = ouichefs_rename,
+	.listxattr = ouichefs_listxattr,
+};
+
+static const struct inode_operations ouichefs_symlink_inode_ops = {
+	.get_link  = ouichefs_get_link,
+	.listxattr = ouichefs_listxattr,
+};
+
+static const struct inode_operations ouichefs_fast_symlink_inode_ops = {
+	.get_link  = simple_get_link,
+	.listxattr = ouichefs_listxattr,
 };
@@ -0,0 +1,366 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "image.h"
+
+/*
+ * Offline inspector of a ouiche_fs image: prints the version history of
+ * every file, or of the files given with -i, with the space used by each
+ * version. The image is mapped read-only and the inode store is scanned in
+ * parallel.
+ *
+ * A block referenced more than once (by several versions, files or
+ * directories) is reported as shared. ouiche_fs gives every version its own
+ * copy of the data, so shared blocks are inconsistencies that
+ * fsck.ouichefs repairs.
+ */
+
+/* Inode store blocks scanned at once by a thread */
+#define DUMP_CHUNK_BLOCKS 16
+
+/* Space used by a version: its index block and its data blocks */
+struct version_stats {
+	uint32_t blocks;
+	uint32_t shared;
+};
+
+struct file {
+	struct image_history h;
+	struct version_stats *stats; /* Of each version */
+	uint64_t blocks;           /* Blocks owned, tables included */
+	uint64_t shared_blocks;
+};
+
+struct dump {
+	struct image img;
+	struct file **files;       /* Regular files by inode number */
+	uint32_t *parent;          /* Directory of each inode or -1 */
+	const char **names;        /* Name of each inode in its directory */
+	uint8_t *refs;             /* References to each block, saturated */
+	int oom;
+};
+
+static void usage(char *appname)
+{
+	fprintf(stderr,
+		"Usage:\n"
+		"%s [-s] [-t threads] [-i ino]... image\n"
+		"\t-s: one summary line per file instead of its history\n"
+		"\t-i: only print inode ino\n"
+		"\t-t: number of threads (default: number of CPUs)\n",
+		appname);
+}
+
+static void add_ref(struct dump *d, uint32_t bno)
+{
+	uint8_t old;
+
+	if (bno >= d->img.nr_blocks)
+		return;
+	old = __atomic_load_n(&d->refs[bno], __ATOMIC_RELAXED);
+	while (old < UINT8_MAX &&
+	       !__atomic_compare_exchange_n(&d->refs[bno], &old, old + 1, 1,
+					    __ATOMIC_RELAXED,
+					    __ATOMIC_RELAXED))
+		;
+}
+
+/* Reference the index block and the data blocks of a version */
+static void ref_version(struct dump *d, struct ouichefs_version_record *rec)
+{
+	uint32_t *slots, i;
+
+	add_ref(d, rec->index_block);
+	if ((rec->flags & OUICHEFS_VREC_INLINE) ||
+	    !image_data_block(&d->img, rec->index_block))
+		return;
+	slots = image_block(&d->img, rec->index_block);
+	for (i = 0; i < d->img.index_slots; i++)
+		if (slots[i])
+			add_ref(d, slots[i]);
+}
+
+static void scan_dir(struct dump *d, uint32_t ino,
+		     struct ouichefs_inode *inode)
+{
+	struct ouichefs_dir_block *dir;
+	uint32_t i, child;
+
+	add_ref(d, inode->index_block);
+	if (!image_data_block(&d->img, inode->index_block))
+		return;
+	dir = image_block(&d->img, inode->index_block);
+	for (i = 0; i < OUICHEFS_MAX_SUBFILES; i++) {
+		child = dir->files[i].inode;
+		if (!child)
+			break;
+		if (child >= d->img.nr_inodes)
+			continue;
+		/* Each inode is in one directory, entries are distinct */
+		d->parent[child] = ino;
+		d->names[child] = dir->files[i].filename;
+	}
+}
+
+/* First pass: read the history of the files and count block references */
+static void scan_inodes(void *arg, uint64_t first, uint64_t end)
+{
+	struct dump *d = arg;
+	struct ouichefs_inode *inode;
+	struct file *f;
+	uint32_t ino, i;
+
+	for (ino = first * d->img.inodes_per_block;
+	     ino < end * d->img.inodes_per_block && ino < d->img.nr_inodes;
+	     ino++) {
+		inode = image_inode(&d->img, ino);
+		if (S_ISDIR(inode->i_mode)) {
+			scan_dir(d, ino, inode);
+			continue;
+		}
+		if (!S_ISREG(inode->i_mode))
+			continue;
+
+		f = d->files[ino] = calloc(1, sizeof(*f));
+		if (!f || image_read_versions(&d->img, ino, &f->h)) {
+			d->oom = 1;
+			return;
+		}
+		for (i = 0; i < f->h.nr; i++)
+			ref_version(d, &f->h.recs[i]);
+		for (i = 0; i < f->h.nr_tables; i++)
+			add_ref(d, f->h.tables[i]);
+	}
+}
+
+static uint32_t shared_blocks(struct dump *d,
+			      struct ouichefs_version_record *rec)
+{
+	uint32_t *slots, i, nr = 0;
+
+	if (rec->index_block < d->img.nr_blocks &&
+	    d->refs[rec->index_block] > 1)
+		nr++;
+	if ((rec->flags & OUICHEFS_VREC_INLINE) ||
+	    !image_data_block(&d->img, rec->index_block))
+		return nr;
+	slots = image_block(&d->img, rec->index_block);
+	for (i = 0; i < d->img.index_slots; i++)
+		if (slots[i] && slots[i] < d->img.nr_blocks &&
+		    d->refs[slots[i]] > 1)
+			nr++;
+	return nr;
+}
+
+/* Second pass: find the shared blocks of every version */
+static void scan_shared(void *arg, uint64_t first, uint64_t end)
+{
+	struct dump *d = arg;
+	struct file *f;
+	uint32_t ino, i;
+
+	for (ino = first; ino < end; ino++) {
+		f = d->files[ino];
+		if (!f)
+			continue;
+		f->stats = calloc(f->h.nr, sizeof(*f->stats));
+		if (!f->stats) {
+			d->oom = 1;
+			return;
+		}
+		for (i = 0; i < f->h.nr; i++) {
+			f->stats[i].blocks =
+				image_count_blocks(&d->img, &f->h.recs[i]) + 1;
+			f->stats[i].shared = shared_blocks(d, &f->h.recs[i]);
+			f->blocks += f->stats[i].blocks;
+			f->shared_blocks += f->stats[i].shared;
+		}
+		f->blocks += f->h.nr_tables;
+		for (i = 0; i < f->h.nr_tables; i++)
+			if (d->refs[f->h.tables[i]] > 1)
+				f->shared_blocks++;
+	}
+}
+
+/* Print the path of ino, from the root directory */
+static void print_path(struct dump *d, uint32_t ino)
+{
+	uint32_t chain[64], n = 0, i;
+
+	while (ino && n < 64) {
+		if (d->parent[ino] == UINT32_MAX) {
+			printf("?");
+			break;
+		}
+		chain[n++] = ino;
+		ino = d->parent[ino];
+	}
+	if (!n)
+		printf("/");
+	for (i = n; i > 0; i--)
+		printf("/%.*s", OUICHEFS_FILENAME_LEN, d->names[chain[i - 1]]);
+}
+
+static void print_file(struct dump *d, uint32_t ino, int summary)
+{
+	struct file *f = d->files[ino];
+	struct ouichefs_inode *inode = image_inode(&d->img, ino);
+	struct ouichefs_version_record *rec;
+	char date[32];
+	time_t t;
+	uint32_t i;
+
+	printf("inode %u ", ino);
+	print_path(d, ino);
+	printf(": %u versions, %u table blocks, %llu blocks (%llu KiB), %llu shared\n",
+	       f->h.nr, f->h.nr_tables, (unsigned long long)f->blocks,
+	       (unsigned long long)f->blocks * d->img.bsize / 1024,
+	       (unsigned long long)f->shared_blocks);
+	if (f->h.error)
+		printf("\terror: %s\n", f->h.error);
+	if (summary)
+		return;
+
+	printf("\t%8s | %10s | %10s | %7s | %7s | %-19s | flags\n",
+	       "version", "index", "size", "blocks", "shared", "mtime");
+	for (i = 0; i < f->h.nr; i++) {
+		rec = &f->h.recs[i];
+		t = rec->mtime;
+		strftime(date, sizeof(date), "%F %T", localtime(&t));
+		printf("\t%8u | %10u | %10u | %7u | %7u | %s |%s%s%s\n",
+		       rec->number, rec->index_block, rec->size,
+		       f->stats[i].blocks, f->stats[i].shared, date,
+		       rec->flags & OUICHEFS_VREC_INLINE ? " inline" : "",
+		       rec->index_block == inode->index_block ? " current" : "",
+		       rec->nr_blocks + 1 != f->stats[i].blocks ?
+		       " bad-count" : "");
+	}
+}
+
+int main(int argc, char **argv)
+{
+	struct dump d = { 0 };
+	uint32_t *only = NULL, nr_only = 0, ino, i;
+	uint64_t files = 0, versions = 0, latest = 0, history = 0;
+	uint64_t tables = 0, shared = 0, errors = 0;
+	struct timespec start, stop;
+	struct file *f;
+	int opt, summary = 0, nr_threads = image_default_threads();
+	int ret = EXIT_FAILURE;
+
+	while ((opt = getopt(argc, argv, "si:t:")) != -1) {
+		switch (opt) {
+		case 's':
+			summary = 1;
+			break;
+		case 'i':
+			only = realloc(only, (nr_only + 1) * sizeof(*only));
+			if (!only)
+				return EXIT_FAILURE;
+			only[nr_only++] = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			nr_threads = strtol(optarg, NULL, 0);
+			if (nr_threads < 1)
+				nr_threads = 1;
+			break;
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	if (optind != argc - 1) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	if (image_open(&d.img, argv[optind], 0))
+		return EXIT_FAILURE;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	d.files = calloc(d.img.nr_inodes, sizeof(*d.files));
+	d.parent = malloc(d.img.nr_inodes * sizeof(*d.parent));
+	d.names = calloc(d.img.nr_inodes, sizeof(*d.names));
+	d.refs = calloc(d.img.nr_blocks, sizeof(*d.refs));
+	if (!d.files || !d.parent || !d.names || !d.refs) {
+		perror("calloc()");
+		goto end;
+	}
+	memset(d.parent, 0xff, d.img.nr_inodes * sizeof(*d.parent));
+
+	image_parallel(nr_threads, d.img.sb->nr_istore_blocks,
+		       DUMP_CHUNK_BLOCKS, scan_inodes, &d);
+	if (!d.oom)
+		image_parallel(nr_threads, d.img.nr_inodes,
+			       DUMP_CHUNK_BLOCKS * d.img.inodes_per_block,
+			       scan_shared, &d);
+	if (d.oom) {
+		fprintf(stderr, "Out of memory\n");
+		goto end;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+
+	for (ino = 0; ino < d.img.nr_inodes; ino++) {
+		f = d.files[ino];
+		if (!f)
+			continue;
+		files++;
+		versions += f->h.nr;
+		latest += f->stats[f->h.nr - 1].blocks;
+		history += f->blocks - f->h.nr_tables -
+			f->stats[f->h.nr - 1].blocks;
+		tables += f->h.nr_tables;
+		shared += f->shared_blocks;
+		errors += f->h.error != NULL;
+	}
+
+	if (nr_only) {
+		for (i = 0; i < nr_only; i++) {
+			if (only[i] < d.img.nr_inodes && d.files[only[i]])
+				print_file(&d, only[i], summary);
+			else
+				printf("inode %u: not a regular file\n",
+				       only[i]);
+		}
+	} else {
+		for (ino = 0; ino < d.img.nr_inodes; ino++)
+			if (d.files[ino])
+				print_file(&d, ino, summary);
+		printf("%llu files, %llu versions: %llu blocks in the latest versions, %llu in the history, %llu in version tables, %llu shared, %llu files with errors\n",
+		       (unsigned long long)files,
+		       (unsigned long long)versions,
+		       (unsigned long long)latest,
+		       (unsigned long long)history,
+		       (unsigned long long)tables,
+		       (unsigned long long)shared,
+		       (unsigned long long)errors);
+		printf("Scanned %u inodes in %.3f s with %d threads\n",
+		       d.img.nr_inodes, stop.tv_sec - start.tv_sec +
+		       (stop.tv_nsec - start.tv_nsec) / 1e9, nr_threads);
+	}
+	ret = EXIT_SUCCESS;
+
+end:
+	if (d.files) {
+		for (ino = 0; ino < d.img.nr_inodes; ino++) {
+			if (!d.files[ino])
+				continue;
+			image_free_history(&d.files[ino]->h);
+			free(d.files[ino]->stats);
+			free(d.files[ino]);
+		}
+	}
+	free(d.files);
+	free(d.parent);
+	free(d.names);
+	free(d.refs);
+	free(only);
+	image_close(&d.img);
+	return ret;
+}
@@ -0,0 +1,1101 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "image.h"
+
+/*
+ * Offline checker of a ouiche_fs image. Block ownership is rebuilt from the
+ * inodes, the whole history of the files and their version tables, then
+ * checked against the bitmaps, the group descriptors, the superblock
+ * counters and the checksum map. With -y, the problems found are repaired:
+ *
+ *  - invalid pointers are dropped: data blocks out of the data area become
+ *    holes, versions whose index block is invalid are removed from the
+ *    history, unreadable parts of a version table are cut, invalid
+ *    extended attribute blocks and tag tables are dropped;
+ *  - a block referenced twice is copied, so that every version and every
+ *    file owns its blocks again;
+ *  - directory entries pointing to free inodes are removed, and inodes in
+ *    use found in no directory are linked in the root directory;
+ *  - the bitmaps, the free counters and the checksums of the metadata
+ *    blocks are rebuilt from the blocks and inodes actually used.
+ *
+ * The image is mapped in memory and each pass runs on several threads. The
+ * partition must not be mounted.
+ */
+
+/* Inode store blocks checked at once by a thread */
+#define FSCK_CHUNK_BLOCKS 16
+/* Repair rounds at most, each round fixing one level of shared blocks */
+#define FSCK_MAX_ROUNDS   8
+
+#define NO_OWNER UINT32_MAX
+
+/* Block flags */
+#define BLK_META  0x1 /* Any block but data blocks */
+#define BLK_TAKEN 0x2 /* Reference kept by the owner of a shared block */
+#define BLK_DIRTY 0x4 /* Modified by a repair, its checksum is updated */
+
+/* Kinds of references, shared blocks are repaired in this order */
+enum ref_kind {
+	REF_TABLE,
+	REF_INDEX,
+	REF_DIR,
+	REF_LINK,
+	REF_XATTR,
+	REF_TAGS,
+	REF_DATA,
+};
+
+enum pass {
+	PASS_COUNT,   /* Count the references to each block */
+	PASS_SHARED,  /* Find the references to copy for shared blocks */
+};
+
+/* Reference to a shared block that does not keep it */
+struct loser {
+	uint32_t ino;
+	uint32_t bno;
+	enum ref_kind kind;
+	uint32_t *slot;                       /* Pointer to repoint */
+	struct ouichefs_version_record *rec;  /* Record holding slot or NULL */
+};
+
+struct fsck {
+	struct image img;
+	int repair;
+	int verbose;
+	int nr_threads;
+	enum pass pass;
+
+	uint32_t *owner;     /* Lowest inode referencing each block */
+	uint8_t *refs;       /* References to each block, saturated */
+	uint8_t *flags;      /* BLK_* of each block */
+	uint32_t *links;     /* Directory entries of each inode */
+	uint32_t alloc_cursor;
+
+	pthread_mutex_t lock; /* Protects the lists and the output */
+	struct loser *losers;
+	uint32_t nr_losers, losers_size;
+	uint32_t *bad;       /* Inodes to repair */
+	uint32_t nr_bad, bad_size;
+	int oom;
+
+	uint64_t errors;     /* Problems found */
+	uint64_t unfixed;    /* Problems left */
+	uint64_t leaked_blocks, lost_blocks, leaked_inodes, lost_inodes;
+	uint64_t csum_errors;
+	int rebuild_csums;   /* The checksum map is out of date */
+	uint64_t history_blocks; /* Blocks of the history of every file */
+};
+
+static void usage(char *appname)
+{
+	fprintf(stderr,
+		"Usage:\n"
+		"%s [-y] [-v] [-t threads] image\n"
+		"\t-y: repair the problems found (default: only check)\n"
+		"\t-v: report every block and inode fixed in the bitmaps\n"
+		"\t-t: number of threads (default: number of CPUs)\n",
+		appname);
+}
+
+/* Print a detail of a problem already reported */
+static void note(struct fsck *f, const char *fmt, ...)
+{
+	va_list ap;
+
+	pthread_mutex_lock(&f->lock);
+	va_start(ap, fmt);
+	vprintf(fmt, ap);
+	va_end(ap);
+	pthread_mutex_unlock(&f->lock);
+}
+
+/*
+ * Report a problem. Problems that cannot be repaired, or that are not
+ * repaired because the image is only checked, are counted as left.
+ */
+static void problem(struct fsck *f, int fixable, const char *fmt, ...)
+{
+	va_list ap;
+
+	pthread_mutex_lock(&f->lock);
+	va_start(ap, fmt);
+	vprintf(fmt, ap);
+	va_end(ap);
+	if (fixable && f->repair) {
+		printf(" (fixed)\n");
+	} else {
+		printf("\n");
+		f->unfixed++;
+	}
+	f->errors++;
+	pthread_mutex_unlock(&f->lock);
+}
+
+static void *grow(void *array, uint32_t *size, size_t elem)
+{
+	uint32_t n = *size ? 2 * *size : 64;
+
+	array = realloc(array, n * elem);
+	if (array)
+		*size = n;
+	return array;
+}
+
+static void add_bad(struct fsck *f, uint32_t ino)
+{
+	uint32_t *bad;
+
+	pthread_mutex_lock(&f->lock);
+	if (f->nr_bad == f->bad_size) {
+		bad = grow(f->bad, &f->bad_size, sizeof(*bad));
+		if (!bad) {
+			f->oom = 1;
+			goto unlock;
+		}
+		f->bad = bad;
+	}
+	f->bad[f->nr_bad++] = ino;
+unlock:
+	pthread_mutex_unlock(&f->lock);
+}
+
+static void add_loser(struct fsck *f, uint32_t ino, uint32_t bno,
+		      enum ref_kind kind, uint32_t *slot,
+		      struct ouichefs_version_record *rec)
+{
+	struct loser *l;
+
+	pthread_mutex_lock(&f->lock);
+	if (f->nr_losers == f->losers_size) {
+		l = grow(f->losers, &f->losers_size, sizeof(*l));
+		if (!l) {
+			f->oom = 1;
+			goto unlock;
+		}
+		f->losers = l;
+	}
+	l = &f->losers[f->nr_losers++];
+	l->ino = ino;
+	l->bno = bno;
+	l->kind = kind;
+	l->slot = slot;
+	l->rec = rec;
+unlock:
+	pthread_mutex_unlock(&f->lock);
+}
+
+static void mark_dirty(struct fsck *f, void *addr)
+{
+	uint64_t bno = ((uint8_t *)addr - f->img.base) / f->img.bsize;
+
+	f->flags[bno] |= BLK_DIRTY;
+}
+
+/*
+ * Record a reference of inode ino to the valid block *slot: counted in
+ * PASS_COUNT, checked against its owner in PASS_SHARED.
+ */
+static void ref(struct fsck *f, uint32_t ino, uint32_t *slot,
+		enum ref_kind kind, struct ouichefs_version_record *rec)
+{
+	uint32_t bno = *slot, old;
+	uint8_t n;
+
+	if (f->pass == PASS_COUNT) {
+		n = __atomic_load_n(&f->refs[bno], __ATOMIC_RELAXED);
+		while (n < UINT8_MAX &&
+		       !__atomic_compare_exchange_n(&f->refs[bno], &n, n + 1, 1,
+						    __ATOMIC_RELAXED,
+						    __ATOMIC_RELAXED))
+			;
+		old = __atomic_load_n(&f->owner[bno], __ATOMIC_RELAXED);
+		while (ino < old &&
+		       !__atomic_compare_exchange_n(&f->owner[bno], &old, ino,
+						    1, __ATOMIC_RELAXED,
+						    __ATOMIC_RELAXED))
+			;
+		if (kind != REF_DATA)
+			__atomic_or_fetch(&f->flags[bno], BLK_META,
+					  __ATOMIC_RELAXED);
+		return;
+	}
+
+	if (f->refs[bno] < 2)
+		return;
+	/* Only one thread walks ino, the owner keeps its first reference */
+	if (f->owner[bno] == ino && !(f->flags[bno] & BLK_TAKEN)) {
+		__atomic_or_fetch(&f->flags[bno], BLK_TAKEN, __ATOMIC_RELAXED);
+		return;
+	}
+	add_loser(f, ino, bno, kind, slot, rec);
+}
+
+/* Reference the data blocks of a valid version, return 0 if some are invalid */
+static int ref_data(struct fsck *f, uint32_t ino,
+		    struct ouichefs_version_record *rec)
+{
+	uint32_t *slots, i;
+	int ok = 1;
+
+	if (rec->flags & OUICHEFS_VREC_INLINE)
+		return 1;
+	slots = image_block(&f->img, rec->index_block);
+	for (i = 0; i < f->img.index_slots; i++) {
+		if (!slots[i])
+			continue;
+		if (image_data_block(&f->img, slots[i]))
+			ref(f, ino, &slots[i], REF_DATA, NULL);
+		else
+			ok = 0;
+	}
+	return ok;
+}
+
+/*
+ * Walk the history of regular file ino. Return a description of the first
+ * problem found to repair locally, or NULL.
+ */
+static const char *walk_file(struct fsck *f, uint32_t ino,
+			     struct ouichefs_inode *inode)
+{
+	struct ouichefs_version_table *table;
+	struct ouichefs_version_record *rec;
+	struct image_history h;
+	const char *err = NULL;
+	uint32_t i, *slot, history;
+	int view = 0;
+
+	if (image_read_versions(&f->img, ino, &h)) {
+		f->oom = 1;
+		return NULL;
+	}
+	if (h.error)
+		err = h.error;
+
+	for (i = 0; i < h.nr_tables; i++) {
+		if (i) {
+			table = image_block(&f->img, h.tables[i - 1]);
+			slot = &table->next;
+		} else {
+			slot = &inode->version_table;
+		}
+		ref(f, ino, slot, REF_TABLE, NULL);
+	}
+
+	for (i = 0; i < h.nr; i++) {
+		rec = &h.recs[i];
+		if (!image_data_block(&f->img, rec->index_block)) {
+			if (!err)
+				err = "index block out of range";
+			continue;
+		}
+		if (rec->index_block == inode->index_block)
+			view = 1;
+		if (h.disk[i])
+			ref(f, ino, &h.disk[i]->index_block, REF_INDEX,
+			    h.disk[i]);
+		else
+			ref(f, ino, &inode->last_index_block, REF_INDEX, NULL);
+		if (!ref_data(f, ino, rec) && !err)
+			err = "data block out of range";
+		if (h.disk[i] && rec->nr_blocks != image_count_blocks(&f->img,
+								      rec) &&
+		    !err)
+			err = "wrong block count in version record";
+		if ((rec->flags & OUICHEFS_VREC_INLINE) &&
+		    rec->size > f->img.bsize && !err)
+			err = "inline version larger than a block";
+	}
+	if (!view && !err)
+		err = "viewed version not in the history";
+
+	/* The head of the table counts the blocks of the older versions */
+	history = h.nr_tables;
+	for (i = 0; i < h.nr; i++)
+		if (h.disk[i])
+			history += 1 + h.recs[i].nr_blocks;
+	if (h.nr_tables && !err &&
+	    (f->img.sb->features & OUICHEFS_FEATURE_HISTORY_COUNT)) {
+		table = image_block(&f->img, h.tables[0]);
+		if (table->history_blocks != history)
+			err = "wrong history block count in version table";
+	}
+	if (f->pass == PASS_SHARED)
+		__atomic_add_fetch(&f->history_blocks, history,
+				   __ATOMIC_RELAXED);
+
+	image_free_history(&h);
+	return err;
+}
+
+static int xattr_valid(struct fsck *f, void *block)
+{
+	struct ouichefs_xattr_header *hdr = block;
+
+	return hdr->magic == OUICHEFS_XATTR_MAGIC &&
+		hdr->used > sizeof(*hdr) && hdr->used <= f->img.bsize;
+}
+
+static int tags_valid(struct fsck *f, void *block)
+{
+	struct ouichefs_tag_table *table = block;
+
+	return table->magic == OUICHEFS_TAG_MAGIC && table->nr_tags &&
+		table->nr_tags <=
+		f->img.bsize / sizeof(struct ouichefs_tag) - 1;
+}
+
+/*
+ * Reference a block attached to an inode, its extended attributes or its
+ * tag table. A block that is not one is dropped: its content is lost, the
+ * file is kept.
+ */
+static void walk_attached(struct fsck *f, uint32_t ino,
+			  struct ouichefs_inode *inode, uint32_t *slot,
+			  enum ref_kind kind)
+{
+	void *block;
+	int valid;
+
+	if (!*slot)
+		return;
+	if (image_data_block(&f->img, *slot)) {
+		block = image_block(&f->img, *slot);
+		valid = kind == REF_XATTR ? xattr_valid(f, block) :
+			tags_valid(f, block);
+		if (valid) {
+			ref(f, ino, slot, kind, NULL);
+			return;
+		}
+	}
+	if (f->pass != PASS_COUNT)
+		return;
+	problem(f, 1, "inode %u: invalid %s block %u", ino,
+		kind == REF_XATTR ? "xattr" : "tag table", *slot);
+	if (f->repair) {
+		*slot = 0;
+		mark_dirty(f, inode);
+	}
+}
+
+/* Walk the inodes of the inode store blocks [first, end) */
+static void walk_inodes(void *arg, uint64_t first, uint64_t end)
+{
+	struct fsck *f = arg;
+	struct ouichefs_inode *inode;
+	const char *err;
+	uint32_t ino;
+
+	for (ino = first * f->img.inodes_per_block;
+	     ino < end * f->img.inodes_per_block && ino < f->img.nr_inodes;
+	     ino++) {
+		inode = image_inode(&f->img, ino);
+		if (!inode->i_mode)
+			continue;
+
+		err = NULL;
+		if (S_ISDIR(inode->i_mode)) {
+			if (image_data_block(&f->img, inode->index_block))
+				ref(f, ino, &inode->index_block, REF_DIR, NULL);
+			else
+				err = "directory block out of range";
+		} else if (S_ISREG(inode->i_mode)) {
+			err = walk_file(f, ino, inode);
+		} else if (S_ISLNK(inode->i_mode) && !inode->i_blocks) {
+			/* Fast symlink, the target is in the inode */
+			if (inode->i_size >= OUICHEFS_FAST_LINK_LEN)
+				err = "symlink target too long";
+		} else if (S_ISLNK(inode->i_mode)) {
+			if (inode->i_size >= f->img.bsize)
+				err = "symlink target too long";
+			else if (image_data_block(&f->img, inode->index_block))
+				ref(f, ino, &inode->index_block, REF_LINK,
+				    NULL);
+			else
+				err = "symlink block out of range";
+		} else {
+			err = "unknown file type";
+		}
+		if (!err) {
+			walk_attached(f, ino, inode, &inode->i_xattr,
+				      REF_XATTR);
+			walk_attached(f, ino, inode, &inode->i_tags, REF_TAGS);
+		}
+		if (err && f->pass == PASS_COUNT) {
+			problem(f, 1, "inode %u: %s", ino, err);
+			add_bad(f, ino);
+		}
+	}
+}
+
+/* Allocate a free block for ino, according to the references counted */
+static uint32_t alloc_block(struct fsck *f, uint32_t ino)
+{
+	uint32_t bno;
+
+	if (f->alloc_cursor < f->img.data_start)
+		f->alloc_cursor = f->img.data_start;
+	for (bno = f->alloc_cursor; bno < f->img.nr_blocks; bno++) {
+		if (!f->refs[bno]) {
+			f->refs[bno] = 1;
+			f->owner[bno] = ino;
+			f->flags[bno] |= BLK_DIRTY;
+			f->alloc_cursor = bno + 1;
+			return bno;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Write the n older records of a file in its version table, reusing the
+ * table blocks read. The head holds the newest records and is the only
+ * block that may not be full.
+ */
+static void write_table(struct fsck *f, struct ouichefs_inode *inode,
+			struct ouichefs_version_record *recs, uint32_t n,
+			uint32_t *tables)
+{
+	uint32_t rpt = f->img.records_per_table;
+	uint32_t k = (n + rpt - 1) / rpt, j, first, history = k;
+	struct ouichefs_version_table *table;
+
+	for (j = 0; j < n; j++)
+		history += 1 + recs[j].nr_blocks;
+	for (j = 0; j < k; j++) {
+		table = image_block(&f->img, tables[j]);
+		first = (k - 1 - j) * rpt;
+		memset(table, 0, f->img.bsize);
+		table->next = j + 1 < k ? tables[j + 1] : 0;
+		table->nr_records = j ? rpt : n - first;
+		memcpy(table->records, &recs[first],
+		       table->nr_records * sizeof(*recs));
+		if (!j)
+			table->history_blocks = history;
+		mark_dirty(f, table);
+	}
+	inode->version_table = k ? tables[0] : 0;
+}
+
+static void clear_inode(struct fsck *f, struct ouichefs_inode *inode)
+{
+	memset(inode, 0, sizeof(*inode));
+	mark_dirty(f, inode);
+}
+
+/*
+ * Repair the history of regular file ino: drop the invalid versions and
+ * block pointers and rewrite the version table.
+ */
+static int fix_file(struct fsck *f, uint32_t ino, struct ouichefs_inode *inode)
+{
+	struct ouichefs_version_record *rec, *latest;
+	struct image_history h;
+	uint32_t i, j, keep = 0, *slots, bno;
+	int view = 0;
+
+	if (image_read_versions(&f->img, ino, &h))
+		return -1;
+
+	latest = &h.recs[h.nr - 1];
+	if (!image_data_block(&f->img, latest->index_block)) {
+		/* The latest version is lost, start again from an empty file */
+		bno = alloc_block(f, ino);
+		if (!bno) {
+			clear_inode(f, inode);
+			goto end;
+		}
+		memset(image_block(&f->img, bno), 0, f->img.bsize);
+		latest->index_block = bno;
+		latest->size = 0;
+		latest->flags = 0;
+	}
+
+	for (i = 0; i < h.nr; i++) {
+		rec = &h.recs[i];
+		if (!image_data_block(&f->img, rec->index_block))
+			continue;
+		if (!(rec->flags & OUICHEFS_VREC_INLINE)) {
+			slots = image_block(&f->img, rec->index_block);
+			for (j = 0; j < f->img.index_slots; j++) {
+				if (slots[j] &&
+				    !image_data_block(&f->img, slots[j])) {
+					slots[j] = 0;
+					mark_dirty(f, slots);
+				}
+			}
+		} else if (rec->size > f->img.bsize) {
+			rec->size = f->img.bsize;
+		}
+		rec->nr_blocks = image_count_blocks(&f->img, rec);
+		rec->checksum = image_record_csum(rec);
+		if (rec->index_block == inode->index_block)
+			view = 1;
+		h.recs[keep++] = *rec;
+	}
+
+	/* The latest version is always kept, last */
+	write_table(f, inode, h.recs, keep - 1, h.tables);
+	if (inode->nb_versions || keep > 1)
+		inode->nb_versions = keep;
+	latest = &h.recs[keep - 1];
+	inode->last_index_block = latest->index_block;
+	inode->last_size = latest->size;
+	inode->last_flags = latest->flags;
+	if (!view) {
+		inode->index_block = inode->last_index_block;
+		inode->i_size = inode->last_size;
+	}
+	mark_dirty(f, inode);
+end:
+	image_free_history(&h);
+	return 0;
+}
+
+static int fix_inode(struct fsck *f, uint32_t ino)
+{
+	struct ouichefs_inode *inode = image_inode(&f->img, ino);
+	uint32_t bno;
+
+	if (S_ISREG(inode->i_mode))
+		return fix_file(f, ino, inode);
+	if (!S_ISDIR(inode->i_mode) || !ino) {
+		/* The root directory keeps its type, it is checked at start */
+		clear_inode(f, inode);
+		return 0;
+	}
+	/* Lost directory block: the directory is empty, its files orphans */
+	bno = alloc_block(f, ino);
+	if (!bno) {
+		clear_inode(f, inode);
+		return 0;
+	}
+	memset(image_block(&f->img, bno), 0, f->img.bsize);
+	inode->index_block = bno;
+	inode->last_index_block = bno;
+	mark_dirty(f, inode);
+	return 0;
+}
+
+static int loser_cmp(const void *a, const void *b)
+{
+	const struct loser *la = a, *lb = b;
+
+	if (la->kind != lb->kind)
+		return la->kind < lb->kind ? -1 : 1;
+	if (la->ino != lb->ino)
+		return la->ino < lb->ino ? -1 : 1;
+	return la->bno < lb->bno ? -1 : la->bno > lb->bno;
+}
+
+/*
+ * Give a copy of a shared block to a reference that does not keep it.
+ */
+static void fix_loser(struct fsck *f, struct loser *l)
+{
+	struct ouichefs_inode *inode = image_inode(&f->img, l->ino);
+	uint32_t bno;
+
+	if (*l->slot != l->bno)
+		return;
+	bno = alloc_block(f, l->ino);
+	if (!bno) {
+		problem(f, 0, "inode %u: no free block to copy block %u",
+			l->ino, l->bno);
+		return;
+	}
+	memcpy(image_block(&f->img, bno), image_block(&f->img, l->bno),
+	       f->img.bsize);
+	if (l->kind != REF_DATA)
+		f->flags[bno] |= BLK_META;
+	*l->slot = bno;
+	mark_dirty(f, l->slot);
+	if (l->rec)
+		l->rec->checksum = image_record_csum(l->rec);
+	/* The view follows the latest version */
+	if (l->slot == &inode->last_index_block && inode->index_block == l->bno)
+		inode->index_block = bno;
+	if (l->kind == REF_DIR)
+		inode->last_index_block = bno;
+}
+
+static void reset_refs(struct fsck *f)
+{
+	uint64_t bno;
+
+	memset(f->refs, 0, f->img.nr_blocks);
+	memset(f->owner, 0xff, (uint64_t)f->img.nr_blocks * sizeof(*f->owner));
+	for (bno = 0; bno < f->img.nr_blocks; bno++)
+		f->flags[bno] &= BLK_DIRTY;
+	/* The fixed metadata blocks are owned by nobody */
+	memset(f->refs, 1, f->img.data_start);
+	f->nr_bad = 0;
+	f->nr_losers = 0;
+	f->history_blocks = 0;
+	f->alloc_cursor = f->img.data_start;
+}
+
+/*
+ * Rebuild the block ownership until every block has at most one owner,
+ * repairing the inodes with invalid pointers and copying shared blocks.
+ */
+static int check_blocks(struct fsck *f)
+{
+	uint32_t i, round;
+	enum ref_kind kind;
+
+	for (round = 0; round < FSCK_MAX_ROUNDS; round++) {
+		reset_refs(f);
+		f->pass = PASS_COUNT;
+		image_parallel(f->nr_threads, f->img.sb->nr_istore_blocks,
+			       FSCK_CHUNK_BLOCKS, walk_inodes, f);
+		if (f->oom)
+			return -1;
+		if (f->nr_bad && f->repair) {
+			for (i = 0; i < f->nr_bad; i++)
+				if (fix_inode(f, f->bad[i]))
+					return -1;
+			continue;
+		}
+
+		f->pass = PASS_SHARED;
+		image_parallel(f->nr_threads, f->img.sb->nr_istore_blocks,
+			       FSCK_CHUNK_BLOCKS, walk_inodes, f);
+		if (f->oom)
+			return -1;
+		if (!f->nr_losers)
+			return 0;
+
+		/* Copy the tables and index blocks before their content */
+		qsort(f->losers, f->nr_losers, sizeof(*f->losers), loser_cmp);
+		kind = f->losers[0].kind;
+		for (i = 0; i < f->nr_losers; i++) {
+			if (f->losers[i].kind != kind && f->repair)
+				break;
+			problem(f, 1, "inode %u: block %u shared with inode %u",
+				f->losers[i].ino, f->losers[i].bno,
+				f->owner[f->losers[i].bno]);
+			if (f->repair)
+				fix_loser(f, &f->losers[i]);
+		}
+		if (!f->repair)
+			return 0;
+	}
+	problem(f, 0, "block ownership still inconsistent after %u rounds",
+		FSCK_MAX_ROUNDS);
+	return 0;
+}
+
+/*
+ * Check the entries of the directories of the inode store blocks
+ * [first, end): entries must point to inodes in use. Count the links of
+ * every inode.
+ */
+static void check_dirs(void *arg, uint64_t first, uint64_t end)
+{
+	struct fsck *f = arg;
+	struct ouichefs_inode *inode, *child;
+	struct ouichefs_dir_block *dir;
+	uint32_t ino, i, n, c;
+
+	for (ino = first * f->img.inodes_per_block;
+	     ino < end * f->img.inodes_per_block && ino < f->img.nr_inodes;
+	     ino++) {
+		inode = image_inode(&f->img, ino);
+		if (!S_ISDIR(inode->i_mode) ||
+		    !image_data_block(&f->img, inode->index_block))
+			continue;
+		dir = image_block(&f->img, inode->index_block);
+		for (i = 0, n = 0; i < OUICHEFS_MAX_SUBFILES; i++) {
+			c = dir->files[i].inode;
+			if (!c)
+				break;
+			child = c < f->img.nr_inodes ? image_inode(&f->img, c) :
+				NULL;
+			if (!child || !child->i_mode || c == ino) {
+				problem(f, 1, "directory %u: entry '%.*s' points to invalid inode %u",
+					ino, OUICHEFS_FILENAME_LEN,
+					dir->files[i].filename, c);
+				continue;
+			}
+			__atomic_add_fetch(&f->links[c], 1, __ATOMIC_RELAXED);
+			if (n != i && f->repair)
+				dir->files[n] = dir->files[i];
+			n++;
+		}
+		if (n != i && f->repair) {
+			memset(&dir->files[n], 0, (i - n) * sizeof(dir->files[0]));
+			mark_dirty(f, dir);
+		}
+	}
+}
+
+/* Link the inodes in use found in no directory in the root directory */
+static void check_orphans(struct fsck *f)
+{
+	struct ouichefs_dir_block *root;
+	struct ouichefs_inode *inode;
+	uint32_t ino, n;
+
+	root = image_block(&f->img, image_inode(&f->img, 0)->index_block);
+	for (n = 0; n < OUICHEFS_MAX_SUBFILES && root->files[n].inode; n++)
+		;
+	for (ino = 1; ino < f->img.nr_inodes; ino++) {
+		inode = image_inode(&f->img, ino);
+		if (!inode->i_mode || f->links[ino])
+			continue;
+		if (n == OUICHEFS_MAX_SUBFILES) {
+			problem(f, 0, "inode %u: in no directory, root directory full",
+				ino);
+			continue;
+		}
+		problem(f, 1, "inode %u: in no directory, linked as /#%u", ino,
+			ino);
+		/* Check the link count the inode will have once linked */
+		f->links[ino] = 1;
+		if (!f->repair)
+			continue;
+		root->files[n].inode = ino;
+		snprintf(root->files[n].filename, OUICHEFS_FILENAME_LEN, "#%u",
+			 ino);
+		n++;
+		mark_dirty(f, root);
+	}
+}
+
+/* Check the link counts of the inodes of the inode store blocks */
+static void check_links(void *arg, uint64_t first, uint64_t end)
+{
+	struct fsck *f = arg;
+	struct ouichefs_inode *inode;
+	struct ouichefs_dir_block *dir;
+	uint32_t ino, i, c, nlink;
+
+	for (ino = first * f->img.inodes_per_block;
+	     ino < end * f->img.inodes_per_block && ino < f->img.nr_inodes;
+	     ino++) {
+		inode = image_inode(&f->img, ino);
+		if (!inode->i_mode)
+			continue;
+		nlink = f->links[ino];
+		if (S_ISDIR(inode->i_mode)) {
+			/* Left to repair, see check_blocks() */
+			if (!image_data_block(&f->img, inode->index_block))
+				continue;
+			if (ino && f->links[ino] > 1)
+				problem(f, 0, "directory %u: in %u directories",
+					ino, f->links[ino]);
+			/* ".", the entry in its parent and ".." of subdirs */
+			nlink = 2;
+			dir = image_block(&f->img, inode->index_block);
+			for (i = 0; i < OUICHEFS_MAX_SUBFILES; i++) {
+				c = dir->files[i].inode;
+				if (!c)
+					break;
+				if (c < f->img.nr_inodes &&
+				    S_ISDIR(image_inode(&f->img, c)->i_mode))
+					nlink++;
+			}
+		}
+		if (inode->i_nlink == nlink)
+			continue;
+		problem(f, 1, "inode %u: link count %u, should be %u", ino,
+			inode->i_nlink, nlink);
+		if (f->repair) {
+			inode->i_nlink = nlink;
+			mark_dirty(f, inode);
+		}
+	}
+}
+
+/*
+ * Check the bitmap slices and the descriptor of the groups [first, end)
+ * against the inodes and blocks in use.
+ */
+static void check_groups(void *arg, uint64_t first, uint64_t end)
+{
+	struct fsck *f = arg;
+	struct ouichefs_superblock *sb = f->img.sb;
+	struct ouichefs_group_desc *desc;
+	uint8_t *ifree = image_block(&f->img, f->img.ifree_start);
+	uint8_t *bfree = image_block(&f->img, f->img.bfree_start);
+	uint64_t g, i, start, stop;
+	uint32_t free_inodes, free_blocks;
+	int used;
+
+	for (g = first; g < end; g++) {
+		free_inodes = 0;
+		start = g * sb->inodes_per_group;
+		stop = start + sb->inodes_per_group;
+		for (i = start; i < stop && i < f->img.nr_inodes; i++) {
+			used = !i || image_inode(&f->img, i)->i_mode;
+			free_inodes += !used;
+			if (bit_test(ifree, i) != used)
+				continue;
+			__atomic_add_fetch(used ? &f->lost_inodes :
+					   &f->leaked_inodes, 1,
+					   __ATOMIC_RELAXED);
+			if (f->verbose)
+				note(f, "inode %llu: marked %s\n",
+				     (unsigned long long)i,
+				     used ? "free" : "used");
+			if (!f->repair)
+				continue;
+			if (used)
+				bit_clear(ifree, i);
+			else
+				bit_set(ifree, i);
+			mark_dirty(f, ifree + i / 8);
+		}
+
+		free_blocks = 0;
+		start = g * sb->blocks_per_group;
+		stop = start + sb->blocks_per_group;
+		for (i = start; i < stop && i < f->img.nr_blocks; i++) {
+			used = f->refs[i] != 0;
+			free_blocks += !used;
+			if (bit_test(bfree, i) != used)
+				continue;
+			__atomic_add_fetch(used ? &f->lost_blocks :
+					   &f->leaked_blocks, 1,
+					   __ATOMIC_RELAXED);
+			if (f->verbose)
+				note(f, "block %llu: marked %s\n",
+				     (unsigned long long)i,
+				     used ? "free" : "used");
+			if (!f->repair)
+				continue;
+			if (used)
+				bit_clear(bfree, i);
+			else
+				bit_set(bfree, i);
+			mark_dirty(f, bfree + i / 8);
+		}
+
+		desc = (struct ouichefs_group_desc *)image_block(&f->img,
+								 f->img.gdt_start) + g;
+		if (desc->nr_free_inodes != free_inodes ||
+		    desc->nr_free_blocks != free_blocks) {
+			problem(f, 1, "group %llu: %u free inodes and %u free blocks, should be %u and %u",
+				(unsigned long long)g, desc->nr_free_inodes,
+				desc->nr_free_blocks, free_inodes, free_blocks);
+			if (f->repair) {
+				desc->nr_free_inodes = free_inodes;
+				desc->nr_free_blocks = free_blocks;
+				mark_dirty(f, desc);
+			}
+		}
+	}
+}
+
+static void check_counters(struct fsck *f)
+{
+	struct ouichefs_superblock *sb = f->img.sb;
+	struct ouichefs_group_desc *desc = image_block(&f->img,
+						       f->img.gdt_start);
+	uint64_t free_inodes = 0, free_blocks = 0, g;
+
+	for (g = 0; g < sb->nr_groups; g++) {
+		free_inodes += desc[g].nr_free_inodes;
+		free_blocks += desc[g].nr_free_blocks;
+	}
+	if (sb->nr_free_inodes != free_inodes ||
+	    sb->nr_free_blocks != free_blocks) {
+		problem(f, 1, "superblock: %u free inodes and %u free blocks, should be %llu and %llu",
+			sb->nr_free_inodes, sb->nr_free_blocks,
+			(unsigned long long)free_inodes,
+			(unsigned long long)free_blocks);
+		if (f->repair) {
+			sb->nr_free_inodes = free_inodes;
+			sb->nr_free_blocks = free_blocks;
+			mark_dirty(f, sb);
+		}
+	}
+
+	if (!(sb->features & OUICHEFS_FEATURE_HISTORY_COUNT) ||
+	    sb->nr_history_blocks == f->history_blocks)
+		return;
+	problem(f, 1, "superblock: %u blocks of history, should be %llu",
+		sb->nr_history_blocks, (unsigned long long)f->history_blocks);
+	if (f->repair) {
+		sb->nr_history_blocks = f->history_blocks;
+		mark_dirty(f, sb);
+	}
+}
+
+/*
+ * Check the checksums recorded for the blocks [first, end), and record the
+ * checksums of the blocks modified by the repairs. When the map is out of
+ * date, it is rebuilt instead.
+ */
+static void check_csums(void *arg, uint64_t first, uint64_t end)
+{
+	struct fsck *f = arg;
+	uint32_t *csums = image_block(&f->img, f->img.csum_start);
+	int data_csum = f->img.sb->features & OUICHEFS_FEATURE_DATA_CSUM;
+	uint64_t bno;
+	uint32_t crc;
+	int meta;
+
+	for (bno = first; bno < end; bno++) {
+		if (bno >= f->img.csum_start && bno < f->img.data_start)
+			continue;
+		meta = bno < f->img.csum_start || (f->flags[bno] & BLK_META);
+		if (!meta && !(data_csum && f->refs[bno]))
+			continue;
+		if (f->rebuild_csums) {
+			if (f->repair)
+				csums[bno] = crc32c(~0U,
+						    image_block(&f->img, bno),
+						    f->img.bsize);
+			continue;
+		}
+		if (!csums[bno] && !(f->flags[bno] & BLK_DIRTY))
+			continue;
+		crc = crc32c(~0U, image_block(&f->img, bno), f->img.bsize);
+		if (f->flags[bno] & BLK_DIRTY) {
+			csums[bno] = crc;
+			continue;
+		}
+		if (csums[bno] == crc)
+			continue;
+		__atomic_add_fetch(&f->csum_errors, 1, __ATOMIC_RELAXED);
+		/* Data cannot be repaired, metadata was checked above */
+		problem(f, meta, "block %llu: %s checksum mismatch",
+			(unsigned long long)bno, meta ? "metadata" : "data");
+		if (meta && f->repair)
+			csums[bno] = crc;
+	}
+}
+
+int main(int argc, char **argv)
+{
+	struct fsck f = { 0 };
+	struct ouichefs_inode *root;
+	struct timespec start, stop;
+	uint64_t nr_istore;
+	int opt, ret = 8;
+
+	f.nr_threads = image_default_threads();
+	pthread_mutex_init(&f.lock, NULL);
+	while ((opt = getopt(argc, argv, "yvt:")) != -1) {
+		switch (opt) {
+		case 'y':
+			f.repair = 1;
+			break;
+		case 'v':
+			f.verbose = 1;
+			break;
+		case 't':
+			f.nr_threads = strtol(optarg, NULL, 0);
+			if (f.nr_threads < 1)
+				f.nr_threads = 1;
+			break;
+		default:
+			usage(argv[0]);
+			return 8;
+		}
+	}
+	if (optind != argc - 1) {
+		usage(argv[0]);
+		return 8;
+	}
+
+	if (image_open(&f.img, argv[optind], f.repair))
+		return 8;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	nr_istore = f.img.sb->nr_istore_blocks;
+
+	root = image_inode(&f.img, 0);
+	if (!S_ISDIR(root->i_mode) ||
+	    !image_data_block(&f.img, root->index_block)) {
+		fprintf(stderr, "Root directory is corrupted, reformat the partition\n");
+		ret = 4;
+		goto close;
+	}
+
+	f.owner = malloc((uint64_t)f.img.nr_blocks * sizeof(*f.owner));
+	f.refs = malloc(f.img.nr_blocks);
+	f.flags = calloc(f.img.nr_blocks, 1);
+	f.links = calloc(f.img.nr_inodes, sizeof(*f.links));
+	if (!f.owner || !f.refs || !f.flags || !f.links) {
+		perror("malloc()");
+		goto free;
+	}
+
+	printf("Pass 1: block ownership\n");
+	if (check_blocks(&f)) {
+		fprintf(stderr, "Out of memory\n");
+		goto free;
+	}
+
+	printf("Pass 2: directories and links\n");
+	image_parallel(f.nr_threads, nr_istore, FSCK_CHUNK_BLOCKS, check_dirs,
+		       &f);
+	check_orphans(&f);
+	image_parallel(f.nr_threads, nr_istore, FSCK_CHUNK_BLOCKS, check_links,
+		       &f);
+
+	printf("Pass 3: bitmaps and free counters\n");
+	image_parallel(f.nr_threads, f.img.sb->nr_groups, 1, check_groups, &f);
+	if (f.leaked_blocks || f.lost_blocks || f.leaked_inodes ||
+	    f.lost_inodes)
+		problem(&f, 1, "bitmaps: %llu blocks and %llu inodes leaked, %llu blocks and %llu inodes in use marked free",
+			(unsigned long long)f.leaked_blocks,
+			(unsigned long long)f.leaked_inodes,
+			(unsigned long long)f.lost_blocks,
+			(unsigned long long)f.lost_inodes);
+	check_counters(&f);
+
+	/* The map on disk may not match the metadata written since a sync */
+	if (f.img.sb->state & OUICHEFS_STATE_DIRTY) {
+		problem(&f, 1, "superblock: not unmounted cleanly, checksum map out of date");
+		f.rebuild_csums = 1;
+		if (f.repair) {
+			f.img.sb->state &= ~OUICHEFS_STATE_DIRTY;
+			mark_dirty(&f, f.img.sb);
+		}
+	}
+
+	if (f.img.sb->features & OUICHEFS_FEATURE_METADATA_CSUM) {
+		printf("Pass 4: checksums\n");
+		image_parallel(f.nr_threads, f.img.nr_blocks,
+			       FSCK_CHUNK_BLOCKS * 64, check_csums, &f);
+	}
+
+	if (f.repair && image_sync(&f.img)) {
+		perror("msync()");
+		goto free;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+
+	printf("%llu problems found, %llu left; checked %u inodes and %u blocks in %.3f s with %d threads\n",
+	       (unsigned long long)f.errors, (unsigned long long)f.unfixed,
+	       f.img.nr_inodes, f.img.nr_blocks,
+	       stop.tv_sec - start.tv_sec +
+	       (stop.tv_nsec - start.tv_nsec) / 1e9, f.nr_threads);
+	/* Exit status of e2fsck: clean, errors corrected, errors left */
+	ret = !f.errors ? 0 : f.unfixed ? 4 : 1;
+
+free:
+	free(f.owner);
+	free(f.refs);
+	free(f.flags);
+	free(f.links);
+	free(f.losers);
+	free(f.bad);
+close:
+	image_close(&f.img);
+	return ret;
+}
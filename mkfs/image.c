@@ -0,0 +1,382 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+#include <linux/fs.h>
+
+#include "image.h"
+
+static uint32_t crc_table[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+/* crc32c (Castagnoli), as computed by crc32c() in the kernel */
+static void crc32c_init(void)
+{
+	uint32_t i, k, crc;
+
+	for (i = 0; i < 256; i++) {
+		crc = i;
+		for (k = 0; k < 8; k++)
+			crc = crc & 1 ? (crc >> 1) ^ 0x82f63b78 : crc >> 1;
+		crc_table[i] = crc;
+	}
+}
+
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t *p, uint64_t len)
+{
+	while (len--)
+		crc = crc_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	return crc;
+}
+
+#if defined(__x86_64__)
+/* The crc32 instruction of SSE 4.2 computes crc32c, 8 bytes at a time */
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const uint8_t *p, uint64_t len)
+{
+	uint64_t crc64 = crc, word;
+
+	for (; len >= 8; len -= 8, p += 8) {
+		memcpy(&word, p, sizeof(word));
+		crc64 = __builtin_ia32_crc32di(crc64, word);
+	}
+	crc = crc64;
+	for (; len; len--)
+		crc = __builtin_ia32_crc32qi(crc, *p++);
+	return crc;
+}
+
+static int crc32c_has_hw;
+#endif
+
+static void crc32c_setup(void)
+{
+	crc32c_init();
+#if defined(__x86_64__)
+	crc32c_has_hw = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+uint32_t crc32c(uint32_t crc, const void *data, uint64_t len)
+{
+	pthread_once(&crc_once, crc32c_setup);
+#if defined(__x86_64__)
+	if (crc32c_has_hw)
+		return crc32c_hw(crc, data, len);
+#endif
+	return crc32c_sw(crc, data, len);
+}
+
+uint32_t image_record_csum(struct ouichefs_version_record *rec)
+{
+	return crc32c(~0U, rec, offsetof(struct ouichefs_version_record,
+					 checksum));
+}
+
+/*
+ * Map the image at path, read-write if writable, and check its superblock.
+ * Return 0 or -1 with a message printed.
+ */
+int image_open(struct image *img, const char *path, int writable)
+{
+	struct ouichefs_superblock *sb;
+	struct stat st;
+	uint64_t needed;
+
+	memset(img, 0, sizeof(*img));
+	img->fd = open(path, writable ? O_RDWR : O_RDONLY);
+	if (img->fd < 0) {
+		perror(path);
+		return -1;
+	}
+	if (fstat(img->fd, &st)) {
+		perror("fstat()");
+		goto close;
+	}
+	img->size = st.st_size;
+	if (S_ISBLK(st.st_mode) &&
+	    ioctl(img->fd, BLKGETSIZE64, &img->size)) {
+		perror("BLKGETSIZE64");
+		goto close;
+	}
+	if (img->size < OUICHEFS_BLOCK_SIZE) {
+		fprintf(stderr, "%s: too small for a ouiche_fs partition\n",
+			path);
+		goto close;
+	}
+
+	img->base = mmap(NULL, img->size,
+			 PROT_READ | (writable ? PROT_WRITE : 0), MAP_SHARED,
+			 img->fd, 0);
+	if (img->base == MAP_FAILED) {
+		img->base = NULL;
+		perror("mmap()");
+		goto close;
+	}
+	/* The tools mostly walk the image in order */
+	madvise(img->base, img->size, MADV_WILLNEED);
+
+	sb = img->sb = (struct ouichefs_superblock *)img->base;
+	if (sb->magic != OUICHEFS_MAGIC) {
+		fprintf(stderr, "%s: not a ouiche_fs partition\n", path);
+		goto unmap;
+	}
+	img->bsize = sb->block_size ? sb->block_size : OUICHEFS_BLOCK_SIZE;
+	if (img->bsize < OUICHEFS_MIN_BLOCK_SIZE ||
+	    img->bsize > OUICHEFS_MAX_BLOCK_SIZE ||
+	    (img->bsize & (img->bsize - 1))) {
+		fprintf(stderr, "%s: invalid block size %u\n", path,
+			img->bsize);
+		goto unmap;
+	}
+	/* Older images have 64 B inodes */
+	if (!(sb->features & OUICHEFS_FEATURE_VERSION_TABLE) ||
+	    !(sb->features & OUICHEFS_FEATURE_XATTR) ||
+	    (sb->features & ~OUICHEFS_FEATURES_SUPPORTED)) {
+		fprintf(stderr, "%s: unsupported on-disk format (features %#x)\n",
+			path, sb->features);
+		goto unmap;
+	}
+
+	img->nr_blocks = sb->nr_blocks;
+	img->nr_inodes = sb->nr_inodes;
+	img->inodes_per_block = img->bsize / sizeof(struct ouichefs_inode);
+	img->index_slots = img->bsize >> 2;
+	img->records_per_table =
+		img->bsize / sizeof(struct ouichefs_version_record) - 1;
+	img->ifree_start = 1 + sb->nr_istore_blocks;
+	img->bfree_start = img->ifree_start + sb->nr_ifree_blocks;
+	img->gdt_start = img->bfree_start + sb->nr_bfree_blocks;
+	img->csum_start = img->gdt_start + sb->nr_gdt_blocks;
+	img->data_start = img->csum_start + sb->nr_csum_blocks;
+
+	needed = (uint64_t)img->nr_blocks * img->bsize;
+	if (needed > img->size || img->data_start >= img->nr_blocks ||
+	    (uint64_t)sb->nr_istore_blocks * img->inodes_per_block <
+	    img->nr_inodes ||
+	    (uint64_t)sb->nr_ifree_blocks * img->bsize * 8 < img->nr_inodes ||
+	    (uint64_t)sb->nr_bfree_blocks * img->bsize * 8 < img->nr_blocks ||
+	    (uint64_t)sb->nr_groups * sb->blocks_per_group < img->nr_blocks ||
+	    (uint64_t)sb->nr_groups * sb->inodes_per_group < img->nr_inodes ||
+	    (uint64_t)sb->nr_gdt_blocks * img->bsize <
+	    (uint64_t)sb->nr_groups * sizeof(struct ouichefs_group_desc) ||
+	    ((sb->features & OUICHEFS_FEATURE_METADATA_CSUM) &&
+	     (uint64_t)sb->nr_csum_blocks * img->bsize <
+	     (uint64_t)img->nr_blocks * sizeof(uint32_t))) {
+		fprintf(stderr, "%s: inconsistent superblock\n", path);
+		goto unmap;
+	}
+	return 0;
+
+unmap:
+	munmap(img->base, img->size);
+	img->base = NULL;
+close:
+	close(img->fd);
+	return -1;
+}
+
+int image_sync(struct image *img)
+{
+	if (msync(img->base, img->size, MS_SYNC))
+		return -1;
+	return fsync(img->fd);
+}
+
+void image_close(struct image *img)
+{
+	if (img->base)
+		munmap(img->base, img->size);
+	close(img->fd);
+}
+
+/*
+ * Count the data blocks of a version. Slots out of the data area are
+ * counted too, the caller checks them.
+ */
+uint32_t image_count_blocks(struct image *img,
+			    struct ouichefs_version_record *rec)
+{
+	uint32_t *slots, i, nr = 0;
+
+	if ((rec->flags & OUICHEFS_VREC_INLINE) ||
+	    !image_data_block(img, rec->index_block))
+		return 0;
+	slots = image_block(img, rec->index_block);
+	for (i = 0; i < img->index_slots; i++)
+		if (slots[i])
+			nr++;
+	return nr;
+}
+
+/*
+ * Read the versions of regular file ino, from its version table and its
+ * inode, like ouichefs_load_versions() does. h->disk points to the records
+ * in the image, NULL for the latest version which is described by the
+ * inode. The walk stops at the first inconsistency, reported in h->error;
+ * h then holds the versions and the table blocks read so far. Return -1 if
+ * out of memory.
+ */
+int image_read_versions(struct image *img, uint32_t ino,
+			struct image_history *h)
+{
+	struct ouichefs_inode *inode = image_inode(img, ino);
+	struct ouichefs_version_table *table;
+	struct ouichefs_version_record *latest;
+	uint32_t older, left, bno, n, i;
+
+	memset(h, 0, sizeof(*h));
+	older = inode->nb_versions ? inode->nb_versions - 1 : 0;
+	if (older > img->nr_blocks) {
+		h->error = "number of versions out of range";
+		older = 0;
+	}
+	h->recs = calloc(older + 1, sizeof(*h->recs));
+	h->disk = calloc(older + 1, sizeof(*h->disk));
+	if (!h->recs || !h->disk)
+		return -1;
+
+	/* The head holds the newest records, fill recs from its end */
+	left = older;
+	bno = inode->version_table;
+	while (bno && !h->error) {
+		if (!image_data_block(img, bno)) {
+			h->error = "version table block out of range";
+			break;
+		}
+		if (h->nr_tables >= img->nr_blocks / 2) {
+			h->error = "version table loops";
+			break;
+		}
+
+		table = image_block(img, bno);
+		n = table->nr_records;
+		if (!n || n > img->records_per_table || n > left) {
+			h->error = "invalid number of records in version table";
+			break;
+		}
+		for (i = 0; i < n; i++) {
+			if (table->records[i].checksum !=
+			    image_record_csum(&table->records[i])) {
+				h->error = "version record checksum mismatch";
+				break;
+			}
+		}
+		if (h->error)
+			break;
+
+		if (!(h->nr_tables & (h->nr_tables - 1))) {
+			uint32_t *tables;
+
+			tables = realloc(h->tables, (h->nr_tables ?
+						     2 * h->nr_tables : 1) *
+					 sizeof(*tables));
+			if (!tables)
+				return -1;
+			h->tables = tables;
+		}
+		h->tables[h->nr_tables++] = bno;
+		left -= n;
+		memcpy(&h->recs[left], table->records, n * sizeof(*h->recs));
+		for (i = 0; i < n; i++)
+			h->disk[left + i] = &table->records[i];
+		bno = table->next;
+	}
+	if (left && !h->error)
+		h->error = "version table shorter than the history";
+	/* Keep the records read, the oldest ones are lost */
+	if (left) {
+		memmove(h->recs, &h->recs[left],
+			(older - left) * sizeof(*h->recs));
+		memmove(h->disk, &h->disk[left],
+			(older - left) * sizeof(*h->disk));
+	}
+	h->nr = older - left;
+
+	/* The latest version is described by the inode */
+	latest = &h->recs[h->nr];
+	latest->index_block = inode->last_index_block;
+	latest->number = inode->last_number;
+	latest->parent = h->nr ? h->recs[h->nr - 1].number :
+		OUICHEFS_NO_VERSION;
+	latest->size = inode->last_size;
+	latest->mtime = inode->i_mtime;
+	latest->flags = inode->last_flags;
+	latest->nr_blocks = image_count_blocks(img, latest);
+	h->nr++;
+	return 0;
+}
+
+void image_free_history(struct image_history *h)
+{
+	free(h->recs);
+	free(h->disk);
+	free(h->tables);
+	memset(h, 0, sizeof(*h));
+}
+
+struct parallel {
+	uint64_t next;             /* Next item handed out */
+	uint64_t nr;
+	uint64_t chunk;
+	void (*fn)(void *arg, uint64_t first, uint64_t end);
+	void *arg;
+};
+
+static void *parallel_worker(void *arg)
+{
+	struct parallel *p = arg;
+	uint64_t first, end;
+
+	for (;;) {
+		first = __atomic_fetch_add(&p->next, p->chunk,
+					   __ATOMIC_RELAXED);
+		if (first >= p->nr)
+			break;
+		end = first + p->chunk < p->nr ? first + p->chunk : p->nr;
+		p->fn(p->arg, first, end);
+	}
+	return NULL;
+}
+
+void image_parallel(int nr_threads, uint64_t nr, uint64_t chunk,
+		    void (*fn)(void *arg, uint64_t first, uint64_t end),
+		    void *arg)
+{
+	struct parallel p = {
+		.next = 0, .nr = nr, .chunk = chunk ? chunk : 1,
+		.fn = fn, .arg = arg,
+	};
+	pthread_t *tids;
+	int i, started = 0;
+
+	tids = calloc(nr_threads, sizeof(*tids));
+	for (i = 1; tids && i < nr_threads; i++) {
+		if (pthread_create(&tids[i], NULL, parallel_worker, &p))
+			break;
+		started++;
+	}
+	/* The calling thread works too, alone if no thread could start */
+	parallel_worker(&p);
+	for (i = 1; i <= started; i++)
+		pthread_join(tids[i], NULL);
+	free(tids);
+}
+
+int image_default_threads(void)
+{
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (n < 1)
+		return 1;
+	return n > 64 ? 64 : n;
+}
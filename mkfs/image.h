@@ -0,0 +1,237 @@
+/*
+ * Offline access to a ouiche_fs image, shared by the userspace tools.
+ *
+ * The image is mapped in memory and its structures are read in place. Like
+ * the kernel module, the tools read the on-disk structures in the byte order
+ * of the host.
+ */
+#ifndef _OUICHEFS_IMAGE_H
+#define _OUICHEFS_IMAGE_H
+
+#include <stdint.h>
+
+#define OUICHEFS_MAGIC  0x48434957
+
+#define OUICHEFS_SB_BLOCK_NR     0
+
+#define OUICHEFS_BLOCK_SIZE       (1 << 12)  /* 4 KiB */
+#define OUICHEFS_MIN_BLOCK_SIZE   (1 << 12)  /* 4 KiB */
+#define OUICHEFS_MAX_BLOCK_SIZE   (1 << 16)  /* 64 KiB */
+#define OUICHEFS_FILENAME_LEN            28
+#define OUICHEFS_MAX_SUBFILES           128
+#define OUICHEFS_NO_VERSION       ((uint32_t)-1)
+
+#define OUICHEFS_FEATURE_VERSION_TABLE 0x1 /* Packed version records */
+#define OUICHEFS_FEATURE_METADATA_CSUM 0x2 /* Checksum map */
+#define OUICHEFS_FEATURE_DATA_CSUM     0x4 /* Data blocks checksummed too */
+#define OUICHEFS_FEATURE_HISTORY_COUNT 0x8 /* Blocks of the history counted */
+#define OUICHEFS_FEATURE_XATTR         0x10 /* 128 B inodes, xattr blocks */
+#define OUICHEFS_FEATURES_SUPPORTED    (OUICHEFS_FEATURE_VERSION_TABLE | \
+					OUICHEFS_FEATURE_METADATA_CSUM | \
+					OUICHEFS_FEATURE_DATA_CSUM | \
+					OUICHEFS_FEATURE_HISTORY_COUNT | \
+					OUICHEFS_FEATURE_XATTR)
+
+/* Set while the partition is mounted read-write */
+#define OUICHEFS_STATE_DIRTY 0x1
+
+/* Version fields replaced by the target of a fast symlink */
+#define OUICHEFS_FAST_LINK_LEN 28
+
+struct ouichefs_inode {
+	uint32_t i_mode;	/* File mode */
+	uint32_t i_uid;         /* Owner id */
+	uint32_t i_gid;		/* Group id */
+	uint32_t i_size;	/* Size in bytes */
+	uint32_t i_ctime;	/* Inode change time */
+	uint32_t i_atime;	/* Access time */
+	uint32_t i_mtime;	/* Modification time */
+	uint32_t i_blocks;	/* Block count */
+	uint32_t i_nlink;	/* Hard links count */
+	/* Regular files and directories, slow symlinks use index_block */
+	union {
+		struct {
+			uint32_t last_index_block; /* Latest version */
+			uint32_t nb_versions;
+			uint32_t version_table; /* Newest table block or 0 */
+			uint32_t index_block;	/* Block list of the view */
+			uint32_t last_number;  /* Latest version number */
+			uint32_t last_size;    /* Size of the latest version */
+			uint32_t last_flags;   /* Flags of the latest version */
+		};
+		/* Target of a fast symlink, NUL terminated */
+		char i_link[OUICHEFS_FAST_LINK_LEN];
+	};
+	uint32_t i_xattr;	/* Extended attribute block or 0 */
+	uint32_t i_tags;	/* Tag table block or 0 */
+	uint32_t i_next_number;	/* Number of the next version */
+	uint32_t reserved[13];
+};
+
+struct ouichefs_version_record {
+	uint32_t index_block; /* Index block of the version */
+	uint32_t number;      /* Version number, never reused in a file */
+	uint32_t parent;      /* Number of the previous version or -1 */
+	uint32_t nr_blocks;   /* Number of data blocks owned by the version */
+	uint32_t size;        /* Size in bytes */
+	uint32_t mtime;       /* Modification time (seconds) */
+	uint32_t flags;       /* OUICHEFS_VREC_* */
+	uint32_t checksum;    /* crc32c of the fields above */
+};
+
+#define OUICHEFS_VREC_INLINE      0x1 /* Data stored in the index block */
+
+struct ouichefs_version_table {
+	uint32_t next;        /* Block of the older records or 0 */
+	uint32_t nr_records;  /* Number of records in this block */
+	uint32_t history_blocks; /* Blocks of the history (head only) */
+	uint32_t reserved[5];
+	struct ouichefs_version_record records[];
+};
+
+#define OUICHEFS_XATTR_MAGIC 0x78617472 /* "xatr" */
+
+struct ouichefs_xattr_header {
+	uint32_t magic;       /* OUICHEFS_XATTR_MAGIC */
+	uint32_t used;        /* Bytes used, header included */
+	uint32_t reserved[2];
+};
+
+#define OUICHEFS_TAG_MAGIC 0x74616773 /* "tags" */
+#define OUICHEFS_TAG_LEN   28
+
+struct ouichefs_tag {
+	char name[OUICHEFS_TAG_LEN]; /* NUL padded */
+	uint32_t number;             /* Version number */
+};
+
+struct ouichefs_tag_table {
+	uint32_t magic;       /* OUICHEFS_TAG_MAGIC */
+	uint32_t nr_tags;     /* Number of tags */
+	uint32_t reserved[6];
+	struct ouichefs_tag tags[];
+};
+
+struct ouichefs_superblock {
+	uint32_t magic;		  /* Magic number */
+
+	uint32_t nr_blocks;	  /* Total number of blocks (incl sb & inodes) */
+	uint32_t nr_inodes;       /* Total number of inodes */
+
+	uint32_t nr_istore_blocks;/* Number of inode store blocks */
+	uint32_t nr_ifree_blocks; /* Number of free inodes bitmask blocks */
+	uint32_t nr_bfree_blocks; /* Number of free blocks bitmask blocks */
+
+	uint32_t nr_free_inodes;  /* Number of free inodes */
+	uint32_t nr_free_blocks;  /* Number of free blocks */
+
+	uint32_t nr_groups;        /* Number of allocation groups */
+	uint32_t blocks_per_group; /* Number of blocks in a group */
+	uint32_t inodes_per_group; /* Number of inodes in a group */
+	uint32_t nr_gdt_blocks;    /* Number of group descriptor blocks */
+	uint32_t block_size;       /* Block size in bytes, 0 means 4 KiB */
+	uint32_t features;         /* OUICHEFS_FEATURE_* */
+	uint32_t nr_csum_blocks;   /* Number of checksum map blocks */
+	uint32_t nr_history_blocks;/* Blocks of the history of every file */
+	uint32_t state;            /* OUICHEFS_STATE_*, 0 when formatted */
+};
+
+struct ouichefs_group_desc {
+	uint32_t nr_free_inodes;  /* Number of free inodes in this group */
+	uint32_t nr_free_blocks;  /* Number of free blocks in this group */
+};
+
+struct ouichefs_dir_block {
+	struct ouichefs_file {
+		uint32_t inode;
+		char filename[OUICHEFS_FILENAME_LEN];
+	} files[OUICHEFS_MAX_SUBFILES];
+};
+
+/* A mapped image and its layout */
+struct image {
+	int fd;
+	uint8_t *base;
+	uint64_t size;
+	struct ouichefs_superblock *sb;
+	uint32_t bsize;            /* Block size */
+	uint32_t nr_blocks;
+	uint32_t nr_inodes;
+	uint32_t inodes_per_block;
+	uint32_t index_slots;      /* Data block slots of an index block */
+	uint32_t records_per_table;
+	uint32_t ifree_start;      /* First block of each region */
+	uint32_t bfree_start;
+	uint32_t gdt_start;
+	uint32_t csum_start;
+	uint32_t data_start;
+};
+
+/* Versions of a regular file, see image_read_versions() */
+struct image_history {
+	struct ouichefs_version_record *recs; /* Oldest to latest version */
+	struct ouichefs_version_record **disk; /* Records in the image */
+	uint32_t nr;
+	uint32_t *tables;          /* Blocks of the version table read */
+	uint32_t nr_tables;
+	const char *error;         /* First inconsistency found or NULL */
+};
+
+static inline void *image_block(struct image *img, uint32_t bno)
+{
+	return img->base + (uint64_t)bno * img->bsize;
+}
+
+static inline struct ouichefs_inode *image_inode(struct image *img,
+						 uint32_t ino)
+{
+	struct ouichefs_inode *block;
+
+	block = image_block(img, 1 + ino / img->inodes_per_block);
+	return block + ino % img->inodes_per_block;
+}
+
+/* Is bno a block that may be owned by a file? */
+static inline int image_data_block(struct image *img, uint32_t bno)
+{
+	return bno >= img->data_start && bno < img->nr_blocks;
+}
+
+static inline int bit_test(const uint8_t *map, uint64_t bit)
+{
+	return (map[bit / 8] >> (bit % 8)) & 1;
+}
+
+static inline void bit_set(uint8_t *map, uint64_t bit)
+{
+	map[bit / 8] |= 1 << (bit % 8);
+}
+
+static inline void bit_clear(uint8_t *map, uint64_t bit)
+{
+	map[bit / 8] &= ~(1 << (bit % 8));
+}
+
+int image_open(struct image *img, const char *path, int writable);
+int image_sync(struct image *img);
+void image_close(struct image *img);
+
+uint32_t crc32c(uint32_t crc, const void *data, uint64_t len);
+uint32_t image_record_csum(struct ouichefs_version_record *rec);
+
+int image_read_versions(struct image *img, uint32_t ino,
+			struct image_history *h);
+void image_free_history(struct image_history *h);
+uint32_t image_count_blocks(struct image *img,
+			    struct ouichefs_version_record *rec);
+
+/*
+ * Run fn on [0, nr) split in chunks of chunk items, in parallel on
+ * nr_threads threads. Chunks are handed out in order as threads get free.
+ */
+void image_parallel(int nr_threads, uint64_t nr, uint64_t chunk,
+		    void (*fn)(void *arg, uint64_t first, uint64_t end),
+		    void *arg);
+int image_default_threads(void);
+
+#endif	/* _OUICHEFS_IMAGE_H */
@@ -1,23 +1,70 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdint.h>
 #include <errno.h>
 #include <endian.h>
 #include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <linux/fs.h>
+#include <linux/falloc.h>
 
 #define OUICHEFS_MAGIC  0x48434957
 
 #define OUICHEFS_SB_BLOCK_NR     0
 
-#define OUICHEFS_BLOCK_SIZE       (1 << 12)  /* 4 KiB */
+#define OUICHEFS_BLOCK_SIZE       (1 << 12)  /* 4 KiB, default */
+#define OUICHEFS_MIN_BLOCK_SIZE   (1 << 12)  /* 4 KiB */
+#define OUICHEFS_MAX_BLOCK_SIZE   (1 << 16)  /* 64 KiB */
 #define OUICHEFS_MAX_FILESIZE     (1 << 22)  /* 4 MiB */
 #define OUICHEFS_FILENAME_LEN            28
 #define OUICHEFS_MAX_SUBFILES           128
 
+#define OUICHEFS_FEATURE_VERSION_TABLE 0x1 /* Packed version records */
+#define OUICHEFS_FEATURE_METADATA_CSUM 0x2 /* Checksum map */
+#define OUICHEFS_FEATURE_DATA_CSUM     0x4 /* Data blocks checksummed too */
+#define OUICHEFS_FEATURE_HISTORY_COUNT 0x8 /* Blocks of the history counted */
+#define OUICHEFS_FEATURE_XATTR         0x10 /* 128 B inodes, xattr blocks */
+
+/* Block size of the partition, chosen with -b */
+static uint32_t block_size = OUICHEFS_BLOCK_SIZE;
+/* Checksum data blocks too, chosen with -c */
+static int data_csum;
+
+/* Bytes of partition per inode, chosen with -i (0: one inode per block) */
+static uint64_t inode_ratio;
+/* Number of writer threads, chosen with -t */
+static int nr_threads;
+
+/*
+ * Regions are written with large pwrite() calls, split between the threads
+ * in jobs of at least MKFS_MIN_JOB_BLOCKS blocks. Zeroed regions are written
+ * from a shared buffer of MKFS_CHUNK_SIZE bytes when the device cannot zero
+ * them itself.
+ */
+#define MKFS_MAX_THREADS    64
+#define MKFS_MIN_JOB_BLOCKS 256
+#define MKFS_CHUNK_SIZE     (8 << 20)
+
+static int is_blkdev;
+static char *zeroes;
+
+/*
+ * Checksum map of the metadata blocks: crc32c of every block of the region
+ * from the superblock to the root directory block, indexed by block number.
+ * The blocks after, data blocks left untouched, have no checksum (0). The
+ * blocks of the map are not checksummed either.
+ */
+static uint32_t *csums;
+static uint64_t nr_csummed, csum_first, csum_end;
+static uint32_t zero_crc;
+static uint32_t crc_table[256];
 
 struct ouichefs_inode {
 	uint32_t i_mode;	/* File mode */
@@ -31,11 +78,18 @@ struct ouichefs_inode {
 	uint32_t i_nlink;	/* Hard links count */
 	uint32_t last_index_block; /* num block de la derniere version */
 	uint32_t nb_versions;
-	int can_write;	/*lors du changement de version peut-on ecrir*/
+	uint32_t version_table; /* Newest block of the version table or 0 */
 	uint32_t index_block;	/* Block with list of blocks for this file */
+	uint32_t last_number;  /* Number of the latest version */
+	uint32_t last_size;    /* Size of the latest version */
+	uint32_t last_flags;   /* Flags of the latest version */
+	uint32_t i_xattr;      /* Extended attribute block or 0 */
+	uint32_t i_tags;       /* Tag table block or 0 */
+	uint32_t i_next_number; /* Number of the next version */
+	uint32_t reserved[13];
 };
 
-#define OUICHEFS_INODES_PER_BLOCK (OUICHEFS_BLOCK_SIZE / sizeof(struct ouichefs_inode))
+#define OUICHEFS_INODES_PER_BLOCK (block_size / sizeof(struct ouichefs_inode))
 
 struct ouichefs_superblock {
 	uint32_t magic;		  /* Magic number */
@@ -50,13 +104,32 @@ struct ouichefs_superblock {
 	uint32_t nr_free_inodes;  /* Number of free inodes */
 	uint32_t nr_free_blocks;  /* Number of free blocks */
 
-	char padding[4064];       /* Padding to match block size */
+	uint32_t nr_groups;        /* Number of allocation groups */
+	uint32_t blocks_per_group; /* Number of blocks in a group */
+	uint32_t inodes_per_group; /* Number of inodes in a group */
+	uint32_t nr_gdt_blocks;    /* Number of group descriptor blocks */
+	uint32_t block_size;       /* Block size in bytes, 0 means 4 KiB */
+	uint32_t features;         /* OUICHEFS_FEATURE_* */
+	uint32_t nr_csum_blocks;   /* Number of checksum map blocks */
+	uint32_t nr_history_blocks;/* Blocks of the history of every file */
+	uint32_t state;            /* OUICHEFS_STATE_*, 0 when formatted */
 };
 
-struct ouichefs_file_index_block {
-	uint32_t blocks[OUICHEFS_BLOCK_SIZE >> 2];
+struct ouichefs_group_desc {
+	uint32_t nr_free_inodes;  /* Number of free inodes in this group */
+	uint32_t nr_free_blocks;  /* Number of free blocks in this group */
 };
 
+#define OUICHEFS_GROUP_DESCS_PER_BLOCK \
+	(block_size / sizeof(struct ouichefs_group_desc))
+
+/*
+ * One bfree bitmap block per allocation group, and inode slices aligned on
+ * 64 bits so that two groups never share a bitmap word.
+ */
+#define OUICHEFS_BLOCKS_PER_GROUP (block_size * 8)
+#define OUICHEFS_INODES_ALIGN     64
+
 struct ouichefs_dir_block {
 	struct ouichefs_file {
 		uint32_t inode;
@@ -64,60 +137,354 @@ struct ouichefs_dir_block {
 	} files[OUICHEFS_MAX_SUBFILES];
 };
 
+/*
+ * Layout of the partition, in host byte order. Sizes are 64-bit so that
+ * multi-TiB devices are sized without overflow.
+ */
+struct layout {
+	uint64_t nr_blocks;
+	uint64_t nr_inodes;
+	uint64_t nr_istore_blocks;
+	uint64_t nr_ifree_blocks;
+	uint64_t nr_bfree_blocks;
+	uint64_t nr_groups;
+	uint64_t inodes_per_group;
+	uint64_t nr_gdt_blocks;
+	uint64_t nr_csum_blocks;
+	uint64_t nr_used;	/* Metadata blocks and root directory block */
+};
+
+static inline uint64_t ifree_start(struct layout *l)
+{
+	return 1 + l->nr_istore_blocks;
+}
+
+static inline uint64_t bfree_start(struct layout *l)
+{
+	return ifree_start(l) + l->nr_ifree_blocks;
+}
+
+static inline uint64_t gdt_start(struct layout *l)
+{
+	return bfree_start(l) + l->nr_bfree_blocks;
+}
+
+static inline uint64_t csum_start(struct layout *l)
+{
+	return gdt_start(l) + l->nr_gdt_blocks;
+}
+
+/* The root directory block is the first data block */
+static inline uint64_t root_block(struct layout *l)
+{
+	return csum_start(l) + l->nr_csum_blocks;
+}
+
+/* Bitmaps, kept to count the free blocks and inodes of each group */
+static uint8_t *ifree_map, *bfree_map;
+
 static inline void usage(char *appname)
 {
 	fprintf(stderr,
 		"Usage:\n"
-		"%s disk\n",
+		"%s [-b block_size] [-i bytes_per_inode] [-t threads] [-c] disk\n"
+		"\tblock_size: power of 2 from 4096 to 65536 (default 4096)\n"
+		"\tbytes_per_inode: one inode per bytes_per_inode bytes of disk, from 1024 (default block_size)\n"
+		"\tthreads: number of writer threads (default: number of CPUs)\n"
+		"\t-c: checksum data blocks, not only metadata\n",
 		appname);
 }
 
 /* Returns ceil(a/b) */
-static inline uint32_t idiv_ceil(uint32_t a, uint32_t b)
+static inline uint64_t idiv_ceil(uint64_t a, uint64_t b)
 {
-	uint32_t ret = a / b;
+	uint64_t ret = a / b;
 	if (a % b != 0)
 		return ret + 1;
 	return ret;
 }
 
-static struct ouichefs_superblock *write_superblock(int fd, struct stat *fstats)
+static inline uint64_t min_u64(uint64_t a, uint64_t b)
+{
+	return a < b ? a : b;
+}
+
+/* crc32c (Castagnoli), as computed by crc32c() in the kernel */
+static void crc32c_init(void)
+{
+	uint32_t i, k, crc;
+
+	for (i = 0; i < 256; i++) {
+		crc = i;
+		for (k = 0; k < 8; k++)
+			crc = crc & 1 ? (crc >> 1) ^ 0x82f63b78 : crc >> 1;
+		crc_table[i] = crc;
+	}
+}
+
+static uint32_t crc32c(uint32_t crc, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+
+	while (len--)
+		crc = crc_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	return crc;
+}
+
+/*
+ * Record the checksums of nr blocks from first, whose content is in buf, or
+ * zeroes if buf is NULL. Threads record disjoint ranges.
+ */
+static void record_csums(uint64_t first, const char *buf, uint64_t nr)
+{
+	uint64_t b;
+
+	for (b = first; b < first + nr && b < nr_csummed; b++) {
+		if (b >= csum_first && b < csum_end)
+			continue;
+		csums[b] = htole32(buf ? crc32c(~0U, buf + (b - first) * block_size,
+						block_size) : zero_crc);
+	}
+}
+
+static int pwrite_full(int fd, const void *buf, uint64_t len, uint64_t off)
+{
+	const char *p = buf;
+	ssize_t n;
+
+	while (len) {
+		n = pwrite(fd, p, min_u64(len, 1U << 30), off);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			if (!n)
+				errno = EIO;
+			return -1;
+		}
+		p += n;
+		off += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/*
+ * Part of a region written by a thread: nr blocks from first, copied from
+ * buf or zeroed if buf is NULL.
+ */
+struct job {
+	int fd;
+	uint64_t first;
+	uint64_t nr;
+	const char *buf;
+	int err;
+};
+
+static void *write_job(void *arg)
+{
+	struct job *job = arg;
+	uint64_t done, n, chunk = MKFS_CHUNK_SIZE / block_size;
+
+	record_csums(job->first, job->buf, job->nr);
+	if (job->buf) {
+		if (pwrite_full(job->fd, job->buf, job->nr * block_size,
+				job->first * block_size))
+			job->err = errno;
+		return NULL;
+	}
+	for (done = 0; done < job->nr; done += n) {
+		n = min_u64(job->nr - done, chunk);
+		if (pwrite_full(job->fd, zeroes, n * block_size,
+				(job->first + done) * block_size)) {
+			job->err = errno;
+			break;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Write nr blocks from first with the content of buf, or zeroes if buf is
+ * NULL, splitting the region between the threads.
+ */
+static int write_region(int fd, uint64_t first, const char *buf, uint64_t nr)
+{
+	pthread_t tids[MKFS_MAX_THREADS];
+	struct job jobs[MKFS_MAX_THREADS];
+	int started[MKFS_MAX_THREADS];
+	uint64_t per, done = 0;
+	int i, n = 0, err = 0;
+
+	per = idiv_ceil(nr, nr_threads);
+	if (per < MKFS_MIN_JOB_BLOCKS)
+		per = MKFS_MIN_JOB_BLOCKS;
+	for (n = 0; done < nr; n++) {
+		jobs[n].fd = fd;
+		jobs[n].first = first + done;
+		jobs[n].nr = min_u64(per, nr - done);
+		jobs[n].buf = buf ? buf + done * block_size : NULL;
+		jobs[n].err = 0;
+		done += jobs[n].nr;
+	}
+
+	/* The last job is run by the calling thread, as are jobs without thread */
+	for (i = 0; i < n; i++) {
+		started[i] = i < n - 1 &&
+			!pthread_create(&tids[i], NULL, write_job, &jobs[i]);
+		if (!started[i])
+			write_job(&jobs[i]);
+	}
+	for (i = 0; i < n; i++) {
+		if (started[i])
+			pthread_join(tids[i], NULL);
+		if (jobs[i].err)
+			err = jobs[i].err;
+	}
+	if (err) {
+		errno = err;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Zero nr blocks from first. The device is asked to do it when it can, which
+ * is much faster than writing zeroes on large partitions.
+ */
+static int zero_region(int fd, uint64_t first, uint64_t nr)
+{
+	uint64_t range[2] = { first * block_size, nr * block_size };
+
+	if (!nr)
+		return 0;
+	if (is_blkdev) {
+		if (!ioctl(fd, BLKZEROOUT, range))
+			goto done;
+	} else if (!fallocate(fd, FALLOC_FL_ZERO_RANGE, range[0], range[1]) ||
+		   !fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+			      range[0], range[1])) {
+		goto done;
+	}
+	return write_region(fd, first, NULL, nr);
+done:
+	record_csums(first, NULL, nr);
+	return 0;
+}
+
+/* Set bits [start, end) of bitmap map */
+static void set_bits(uint8_t *map, uint64_t start, uint64_t end)
+{
+	for (; start < end && start % 8; start++)
+		map[start / 8] |= 1 << (start % 8);
+	if (end - start >= 8) {
+		memset(map + start / 8, 0xff, (end - start) / 8);
+		start += (end - start) & ~7ULL;
+	}
+	for (; start < end; start++)
+		map[start / 8] |= 1 << (start % 8);
+}
+
+/* Count the bits set in [start, end) of bitmap map */
+static uint64_t count_bits(const uint8_t *map, uint64_t start, uint64_t end)
+{
+	uint64_t count = 0, word;
+
+	for (; start < end && start % 64; start++)
+		count += (map[start / 8] >> (start % 8)) & 1;
+	for (; end - start >= 64; start += 64) {
+		memcpy(&word, map + start / 8, sizeof(word));
+		count += __builtin_popcountll(word);
+	}
+	for (; start < end; start++)
+		count += (map[start / 8] >> (start % 8)) & 1;
+	return count;
+}
+
+/*
+ * Compute the layout of a partition of size bytes. Return -1 if it does not
+ * leave room for data.
+ */
+static int compute_layout(struct layout *l, uint64_t size)
+{
+	/* Keep every block and inode number of a group within 32 bits */
+	uint64_t max_blocks = (1ULL << 32) - OUICHEFS_BLOCKS_PER_GROUP;
+	uint64_t ipb = OUICHEFS_INODES_PER_BLOCK, max_inodes;
+
+	l->nr_blocks = size / block_size;
+	if (l->nr_blocks > max_blocks) {
+		fprintf(stderr, "Warning: only the first %llu blocks are used\n",
+			(unsigned long long)max_blocks);
+		l->nr_blocks = max_blocks;
+	}
+	l->nr_groups = idiv_ceil(l->nr_blocks, OUICHEFS_BLOCKS_PER_GROUP);
+
+	if (inode_ratio)
+		l->nr_inodes = l->nr_blocks * block_size / inode_ratio;
+	else
+		l->nr_inodes = l->nr_blocks;
+	/* Fill the inode store blocks */
+	l->nr_inodes = idiv_ceil(l->nr_inodes ? l->nr_inodes : 1, ipb) * ipb;
+	max_inodes = (UINT32_MAX - OUICHEFS_INODES_ALIGN * l->nr_groups) /
+		ipb * ipb;
+	if (l->nr_inodes > max_inodes)
+		l->nr_inodes = max_inodes;
+
+	l->nr_istore_blocks = l->nr_inodes / ipb;
+	l->nr_ifree_blocks = idiv_ceil(l->nr_inodes, block_size * 8);
+	l->nr_bfree_blocks = l->nr_groups;
+	l->inodes_per_group = idiv_ceil(idiv_ceil(l->nr_inodes, l->nr_groups),
+					OUICHEFS_INODES_ALIGN) *
+		OUICHEFS_INODES_ALIGN;
+	l->nr_gdt_blocks = idiv_ceil(l->nr_groups,
+				     OUICHEFS_GROUP_DESCS_PER_BLOCK);
+	l->nr_csum_blocks = idiv_ceil(l->nr_blocks * sizeof(uint32_t),
+				      block_size);
+	l->nr_used = root_block(l) + 1;
+
+	if (l->nr_used >= l->nr_blocks) {
+		fprintf(stderr,
+			"No room left for data (%llu metadata blocks out of %llu), use a larger inode ratio\n",
+			(unsigned long long)l->nr_used,
+			(unsigned long long)l->nr_blocks);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Build the superblock and record its checksum. It is written last, once the
+ * rest of the partition is on disk, so that an interrupted format does not
+ * leave a mountable partition.
+ */
+static struct ouichefs_superblock *build_superblock(struct layout *l)
 {
-	int ret;
 	struct ouichefs_superblock *sb;
-	uint32_t nr_inodes = 0, nr_blocks = 0, nr_ifree_blocks = 0;
-	uint32_t nr_bfree_blocks = 0, nr_data_blocks = 0, nr_istore_blocks = 0;
-	uint32_t mod;
 
-	sb = malloc(sizeof(struct ouichefs_superblock));
+	/* The superblock is alone in block 0, padded with zeroes */
+	sb = calloc(1, block_size);
 	if (!sb)
 		return NULL;
 
-	nr_blocks = fstats->st_size / OUICHEFS_BLOCK_SIZE;
-	nr_inodes = nr_blocks;
-	mod = nr_inodes % OUICHEFS_INODES_PER_BLOCK;
-	if (mod != 0)
-		nr_inodes += mod;
-	nr_istore_blocks = idiv_ceil(nr_inodes, OUICHEFS_INODES_PER_BLOCK);
-	nr_ifree_blocks = idiv_ceil(nr_inodes, OUICHEFS_BLOCK_SIZE * 8);
-	nr_bfree_blocks = idiv_ceil(nr_blocks, OUICHEFS_BLOCK_SIZE * 8);
-	nr_data_blocks = nr_blocks - 1 - nr_istore_blocks - nr_ifree_blocks - nr_bfree_blocks;
-
-	memset(sb, 0, sizeof(struct ouichefs_superblock));
 	sb->magic = htole32(OUICHEFS_MAGIC);
-	sb->nr_blocks = htole32(nr_blocks);
-	sb->nr_inodes = htole32(nr_inodes);
-	sb->nr_istore_blocks = htole32(nr_istore_blocks);
-	sb->nr_ifree_blocks = htole32(nr_ifree_blocks);
-	sb->nr_bfree_blocks = htole32(nr_bfree_blocks);
-	sb->nr_free_inodes = htole32(nr_inodes - 1);
-	sb->nr_free_blocks = htole32(nr_data_blocks - 1);
-
-	ret = write(fd, sb, sizeof(struct ouichefs_superblock));
-	if (ret != sizeof(struct ouichefs_superblock)) {
-		free(sb);
-		return NULL;
-	}
+	sb->nr_blocks = htole32(l->nr_blocks);
+	sb->nr_inodes = htole32(l->nr_inodes);
+	sb->nr_istore_blocks = htole32(l->nr_istore_blocks);
+	sb->nr_ifree_blocks = htole32(l->nr_ifree_blocks);
+	sb->nr_bfree_blocks = htole32(l->nr_bfree_blocks);
+	sb->nr_free_inodes = htole32(l->nr_inodes - 1);
+	sb->nr_free_blocks = htole32(l->nr_blocks - l->nr_used);
+	sb->nr_groups = htole32(l->nr_groups);
+	sb->blocks_per_group = htole32(OUICHEFS_BLOCKS_PER_GROUP);
+	sb->inodes_per_group = htole32(l->inodes_per_group);
+	sb->nr_gdt_blocks = htole32(l->nr_gdt_blocks);
+	sb->block_size = htole32(block_size);
+	sb->features = htole32(OUICHEFS_FEATURE_VERSION_TABLE |
+			       OUICHEFS_FEATURE_METADATA_CSUM |
+			       OUICHEFS_FEATURE_HISTORY_COUNT |
+			       OUICHEFS_FEATURE_XATTR |
+			       (data_csum ? OUICHEFS_FEATURE_DATA_CSUM : 0));
+	sb->nr_csum_blocks = htole32(l->nr_csum_blocks);
+	record_csums(OUICHEFS_SB_BLOCK_NR, (char *)sb, 1);
 
 	printf("Superblock: (%ld)\n"
 	       "\tmagic=%#x\n"
@@ -126,204 +493,239 @@ static struct ouichefs_superblock *write_superblock(int fd, struct stat *fstats)
 	       "\tnr_ifree_blocks=%u\n"
 	       "\tnr_bfree_blocks=%u\n"
 	       "\tnr_free_inodes=%u\n"
-	       "\tnr_free_blocks=%u\n",
+	       "\tnr_free_blocks=%u\n"
+	       "\tnr_groups=%u (%u blocks, %u inodes per group)\n"
+	       "\tnr_gdt_blocks=%u\n"
+	       "\tblock_size=%u\n"
+	       "\tfeatures=%#x\n"
+	       "\tnr_csum_blocks=%u\n",
 	       sizeof(struct ouichefs_superblock),
-	       sb->magic, sb->nr_blocks, sb->nr_inodes, sb->nr_istore_blocks,
-	       sb->nr_ifree_blocks, sb->nr_bfree_blocks, sb->nr_free_inodes,
-	       sb->nr_free_blocks);
+	       le32toh(sb->magic), le32toh(sb->nr_blocks),
+	       le32toh(sb->nr_inodes), le32toh(sb->nr_istore_blocks),
+	       le32toh(sb->nr_ifree_blocks), le32toh(sb->nr_bfree_blocks),
+	       le32toh(sb->nr_free_inodes), le32toh(sb->nr_free_blocks),
+	       le32toh(sb->nr_groups), le32toh(sb->blocks_per_group),
+	       le32toh(sb->inodes_per_group), le32toh(sb->nr_gdt_blocks),
+	       le32toh(sb->block_size), le32toh(sb->features),
+	       le32toh(sb->nr_csum_blocks));
 
 	return sb;
 }
 
-static int write_inode_store(int fd, struct ouichefs_superblock *sb)
+static int write_superblock(int fd, struct ouichefs_superblock *sb)
+{
+	if (fsync(fd))
+		return -1;
+	if (pwrite_full(fd, sb, block_size,
+			(uint64_t)OUICHEFS_SB_BLOCK_NR * block_size))
+		return -1;
+	return fsync(fd);
+}
+
+static int write_inode_store(int fd, struct layout *l)
 {
 	int ret = 0;
-	uint32_t i;
 	struct ouichefs_inode *inode;
 	char *block;
-	uint32_t first_data_block;
 
 	/* Allocate a zeroed block for inode store */
-	block = malloc(OUICHEFS_BLOCK_SIZE);
+	block = calloc(1, block_size);
 	if (!block)
 		return -1;
-	memset(block, 0, OUICHEFS_BLOCK_SIZE);
 
 	/* Root inode (inode 0) */
 	inode = (struct ouichefs_inode *)block;
-	first_data_block = 1 + le32toh(sb->nr_bfree_blocks) +
-		le32toh(sb->nr_ifree_blocks) +
-		le32toh(sb->nr_istore_blocks);
 	inode->i_mode = htole32(S_IFDIR |
 				S_IRUSR | S_IRGRP | S_IROTH |
 				S_IWUSR | S_IWGRP |
 				S_IXUSR | S_IXGRP | S_IXOTH);
 	inode->i_uid = 0;
 	inode->i_gid = 0;
-	inode->i_size = htole32(OUICHEFS_BLOCK_SIZE);
+	inode->i_size = htole32(block_size);
 	inode->i_ctime = inode->i_atime = inode->i_mtime = htole32(0);
 	inode->i_blocks = htole32(1);
 	inode->i_nlink = htole32(2);
-	inode->index_block = htole32(first_data_block);
+	inode->index_block = htole32(root_block(l));
 
-	ret = write(fd, block, OUICHEFS_BLOCK_SIZE);
-	if (ret != OUICHEFS_BLOCK_SIZE) {
-		ret = -1;
+	ret = write_region(fd, 1, block, 1);
+	if (ret)
 		goto end;
-	}
 
 	/* Reset inode store blocks to zero */
-	memset(block, 0, OUICHEFS_BLOCK_SIZE);
-	for (i = 1; i < sb->nr_istore_blocks; i++) {
-		ret = write(fd, block, OUICHEFS_BLOCK_SIZE);
-		if (ret != OUICHEFS_BLOCK_SIZE) {
-			ret = -1;
-			goto end;
-		}
-	}
-	ret = 0;
+	ret = zero_region(fd, 2, l->nr_istore_blocks - 1);
+	if (ret)
+		goto end;
 
-	printf("Inode store: wrote %d blocks\n"
+	printf("Inode store: wrote %llu blocks\n"
 	       "\tinode size = %ld B\n",
-	       i, sizeof(struct ouichefs_inode));
+	       (unsigned long long)l->nr_istore_blocks,
+	       sizeof(struct ouichefs_inode));
 
 end:
 	free(block);
 	return ret;
 }
 
-static int write_ifree_blocks(int fd, struct ouichefs_superblock *sb)
+static int write_ifree_blocks(int fd, struct layout *l)
 {
-	int ret = 0;
-	uint32_t i;
-	char *block;
-	uint64_t *ifree;
-
-	block = malloc(OUICHEFS_BLOCK_SIZE);
-	if (!block)
+	/* Inodes past nr_inodes are never free */
+	ifree_map = calloc(l->nr_ifree_blocks, block_size);
+	if (!ifree_map)
 		return -1;
-	ifree = (uint64_t *) block;
 
-	/* Set all bits to 1 */
-	memset(ifree, 0xff, OUICHEFS_BLOCK_SIZE);
-
-	/* First ifree block, containing first used inode */
-	ifree[0] = htole64(0xfffffffffffffffe);
-	ret = write(fd, ifree, OUICHEFS_BLOCK_SIZE);
-	if (ret != OUICHEFS_BLOCK_SIZE) {
-		ret = -1;
-		goto end;
-	}
+	/* Every inode but the root inode is free */
+	set_bits(ifree_map, 1, l->nr_inodes);
+	if (write_region(fd, ifree_start(l), (char *)ifree_map,
+			 l->nr_ifree_blocks))
+		return -1;
 
-	/* All ifree blocks except the one containing 2 first inodes */
-	ifree[0] = 0xffffffffffffffff;
-	for (i = 1; i < le32toh(sb->nr_ifree_blocks); i++) {
-		ret = write(fd, ifree, OUICHEFS_BLOCK_SIZE);
-		if (ret != OUICHEFS_BLOCK_SIZE) {
-			ret = -1;
-			goto end;
-		}
-	}
-	ret = 0;
+	printf("Ifree blocks: wrote %llu blocks\n",
+	       (unsigned long long)l->nr_ifree_blocks);
+	return 0;
+}
 
-	printf("Ifree blocks: wrote %d blocks\n", i);
+static int write_bfree_blocks(int fd, struct layout *l)
+{
+	/* Blocks past nr_blocks are never free */
+	bfree_map = calloc(l->nr_bfree_blocks, block_size);
+	if (!bfree_map)
+		return -1;
 
-end:
-	free(block);
+	/*
+	 * sb + istore + ifree + bfree + gdt + csum map + root directory block
+	 * are used, they may span several bitmap blocks
+	 */
+	set_bits(bfree_map, l->nr_used, l->nr_blocks);
+	if (write_region(fd, bfree_start(l), (char *)bfree_map,
+			 l->nr_bfree_blocks))
+		return -1;
 
-	return ret;
+	printf("Bfree blocks: wrote %llu blocks\n",
+	       (unsigned long long)l->nr_bfree_blocks);
+	return 0;
 }
 
-static int write_bfree_blocks(int fd, struct ouichefs_superblock *sb)
+static int write_gdt_blocks(int fd, struct layout *l)
 {
-	int ret = 0;
-	uint32_t i;
-	char *block;
-	uint64_t *bfree, mask, line;
-	uint32_t nr_used = le32toh(sb->nr_istore_blocks) +
-		le32toh(sb->nr_ifree_blocks) +
-		le32toh(sb->nr_bfree_blocks) + 2;
+	int ret;
+	uint64_t g, first, end;
+	struct ouichefs_group_desc *desc;
 
-	block = malloc(OUICHEFS_BLOCK_SIZE);
-	if (!block)
+	desc = calloc(l->nr_gdt_blocks, block_size);
+	if (!desc)
 		return -1;
-	bfree = (uint64_t *)block;
 
-	/*
-	 * First blocks (incl. sb + istore + ifree + bfree + 1 used block)
-	 * we suppose it won't go further than the first block
-	 */
-	memset(bfree, 0xff, OUICHEFS_BLOCK_SIZE);
-	i = 0;
-	while (nr_used) {
-		line = 0xffffffffffffffff;
-		for (mask = 0x1; mask != 0x0; mask <<= 1) {
-			line &= ~mask;
-			nr_used--;
-			if (!nr_used)
-				break;
-		}
-		bfree[i] = htole64(line);
-		i++;
-	}
-	ret = write(fd, bfree, OUICHEFS_BLOCK_SIZE);
-	if (ret != OUICHEFS_BLOCK_SIZE) {
-		ret = -1;
-		goto end;
-	}
-
-	/* other blocks */
-	memset(bfree, 0xff, OUICHEFS_BLOCK_SIZE);
-	for (i = 1; i < le32toh(sb->nr_bfree_blocks); i++) {
-		ret = write(fd, bfree, OUICHEFS_BLOCK_SIZE);
-		if (ret != OUICHEFS_BLOCK_SIZE) {
-			ret = -1;
-			goto end;
-		}
+	/* Count the free blocks and inodes of each group in the bitmaps */
+	for (g = 0; g < l->nr_groups; g++) {
+		first = g * OUICHEFS_BLOCKS_PER_GROUP;
+		end = min_u64(first + OUICHEFS_BLOCKS_PER_GROUP, l->nr_blocks);
+		desc[g].nr_free_blocks = htole32(count_bits(bfree_map, first,
+							    end));
+
+		first = g * l->inodes_per_group;
+		end = min_u64(first + l->inodes_per_group, l->nr_inodes);
+		if (first < end)
+			desc[g].nr_free_inodes =
+				htole32(count_bits(ifree_map, first, end));
 	}
-	ret = 0;
 
-	printf("Bfree blocks: wrote %d blocks\n", i);
-end:
-	free(block);
+	ret = write_region(fd, gdt_start(l), (char *)desc, l->nr_gdt_blocks);
+	if (!ret)
+		printf("Group descriptors: wrote %llu blocks (%llu groups)\n",
+		       (unsigned long long)l->nr_gdt_blocks,
+		       (unsigned long long)l->nr_groups);
+	free(desc);
 
 	return ret;
 }
 
-static int write_data_blocks(int fd, struct ouichefs_superblock *sb)
+/*
+ * Write the checksum map, once every other metadata block has its checksum
+ * recorded. Only its first blocks, covering the metadata blocks, are not
+ * zero.
+ */
+static int write_csum_blocks(int fd, struct layout *l)
 {
-	int ret = 0;
-	/* struct ouichefs_dir_block root_block; */
-	/* struct ouichefs_file_index_block foo_block; */
-	/* char *foo; */
-	/* uint32_t first_block = le32toh(sb->nr_istore_blocks) + */
-	/* 	le32toh(sb->nr_ifree_blocks) + le32toh(sb->nr_bfree_blocks) + 3; */
+	uint64_t nr = idiv_ceil(nr_csummed * sizeof(uint32_t), block_size);
+
+	if (write_region(fd, csum_start(l), (char *)csums, nr))
+		return -1;
+	if (zero_region(fd, csum_start(l) + nr, l->nr_csum_blocks - nr))
+		return -1;
 
-	/* foo = malloc(OUICHEFS_BLOCK_SIZE); */
-	/* if (!foo) */
-	/* 	return -1; */
-	/* memset(foo, 0, OUICHEFS_BLOCK_SIZE); */
+	printf("Checksum map: wrote %llu blocks\n",
+	       (unsigned long long)l->nr_csum_blocks);
+	return 0;
+}
 
-/* end: */
-/* 	free(foo); */
+/* The root directory block starts empty */
+static int write_data_blocks(int fd, struct layout *l)
+{
+	return write_region(fd, root_block(l), zeroes, 1);
+}
 
-	return ret;
+static int get_size(int fd, struct stat *fstats, uint64_t *size)
+{
+	if (!S_ISBLK(fstats->st_mode)) {
+		*size = fstats->st_size;
+		return 0;
+	}
+	is_blkdev = 1;
+	return ioctl(fd, BLKGETSIZE64, size);
 }
 
 int main(int argc, char **argv)
 {
 	int ret = EXIT_SUCCESS, fd;
-	long int min_size;
+	uint64_t size, min_size;
 	struct stat stat_buf;
 	struct ouichefs_superblock *sb = NULL;
-
-	if (argc != 2) {
+	struct layout layout;
+	struct timespec start, stop;
+	int opt;
+
+	nr_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	while ((opt = getopt(argc, argv, "b:ci:t:")) != -1) {
+		switch (opt) {
+		case 'b':
+			block_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'c':
+			data_csum = 1;
+			break;
+		case 'i':
+			inode_ratio = strtoull(optarg, NULL, 0);
+			if (inode_ratio < 1024) {
+				fprintf(stderr, "Invalid inode ratio %s\n",
+					optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 't':
+			nr_threads = strtol(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	if (optind != argc - 1) {
 		usage(argv[0]);
 		return EXIT_FAILURE;
 	}
+	if (block_size < OUICHEFS_MIN_BLOCK_SIZE ||
+	    block_size > OUICHEFS_MAX_BLOCK_SIZE ||
+	    (block_size & (block_size - 1))) {
+		fprintf(stderr, "Invalid block size %u\n", block_size);
+		return EXIT_FAILURE;
+	}
+	if (nr_threads < 1)
+		nr_threads = 1;
+	if (nr_threads > MKFS_MAX_THREADS)
+		nr_threads = MKFS_MAX_THREADS;
 
 	/* Open disk image */
-	fd = open(argv[1], O_RDWR);
+	fd = open(argv[optind], O_RDWR);
 	if (fd == -1) {
 		perror("open():");
 		return EXIT_FAILURE;
@@ -331,6 +733,8 @@ int main(int argc, char **argv)
 
 	/* Get image size */
 	ret = fstat(fd, &stat_buf);
+	if (ret == 0)
+		ret = get_size(fd, &stat_buf, &size);
 	if (ret != 0) {
 		perror("fstat():");
 		ret = EXIT_FAILURE;
@@ -338,60 +742,97 @@ int main(int argc, char **argv)
 	}
 
 	/* Check if image is large enough */
-	min_size = 100 * OUICHEFS_BLOCK_SIZE;
-	if (stat_buf.st_size <= min_size) {
+	min_size = 100 * block_size;
+	if (size <= min_size) {
 		fprintf(stderr,
-			"File is not large enough (size=%ld, min size=%ld)\n",
-			stat_buf.st_size,
-			min_size);
+			"File is not large enough (size=%llu, min size=%llu)\n",
+			(unsigned long long)size,
+			(unsigned long long)min_size);
 		ret = EXIT_FAILURE;
 		goto fclose;
 	}
 
-	/* Write superblock (block 0) */
-	sb = write_superblock(fd, &stat_buf);
-	if (!sb) {
-		perror("write_superblock():");
-		ret = EXIT_FAILURE;
+	ret = EXIT_FAILURE;
+	if (compute_layout(&layout, size))
 		goto fclose;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	crc32c_init();
+	zeroes = calloc(1, MKFS_CHUNK_SIZE);
+	nr_csummed = layout.nr_used;
+	csum_first = csum_start(&layout);
+	csum_end = csum_first + layout.nr_csum_blocks;
+	csums = calloc(idiv_ceil(nr_csummed * sizeof(uint32_t), block_size),
+		       block_size);
+	if (!zeroes || !csums) {
+		perror("calloc():");
+		goto free_sb;
+	}
+	zero_crc = crc32c(~0U, zeroes, block_size);
+
+	/* Build superblock (block 0) */
+	sb = build_superblock(&layout);
+	if (!sb) {
+		perror("build_superblock():");
+		goto free_sb;
 	}
 
 	/* Write inode store blocks (from block 1) */
-	ret = write_inode_store(fd, sb);
-	if (ret != 0) {
+	if (write_inode_store(fd, &layout)) {
 		perror("write_inode_store():");
-		ret = EXIT_FAILURE;
 		goto free_sb;
 	}
 
 	/* Write inode free bitmap blocks */
-	ret = write_ifree_blocks(fd, sb);
-	if (ret != 0) {
+	if (write_ifree_blocks(fd, &layout)) {
 		perror("write_ifree_blocks()");
-		ret = EXIT_FAILURE;
 		goto free_sb;
 	}
 
 	/* Write block free bitmap blocks */
-	ret = write_bfree_blocks(fd, sb);
-	if (ret != 0) {
+	if (write_bfree_blocks(fd, &layout)) {
 		perror("write_bfree_blocks()");
-		ret = EXIT_FAILURE;
+		goto free_sb;
+	}
+
+	/* Write group descriptor blocks */
+	if (write_gdt_blocks(fd, &layout)) {
+		perror("write_gdt_blocks()");
 		goto free_sb;
 	}
 
 	/* Write data blocks */
-	ret = write_data_blocks(fd, sb);
-	if (ret != 0) {
+	if (write_data_blocks(fd, &layout)) {
 		perror("write_data_blocks():");
-		ret = EXIT_FAILURE;
 		goto free_sb;
 	}
 
+	/* Write checksum map blocks, after every checksummed block */
+	if (write_csum_blocks(fd, &layout)) {
+		perror("write_csum_blocks()");
+		goto free_sb;
+	}
+
+	/* Write superblock (block 0) last */
+	if (write_superblock(fd, sb)) {
+		perror("write_superblock():");
+		goto free_sb;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+	printf("Formatted in %.3f s with %d threads\n",
+	       stop.tv_sec - start.tv_sec +
+	       (stop.tv_nsec - start.tv_nsec) / 1e9, nr_threads);
+	ret = EXIT_SUCCESS;
+
 free_sb:
 	free(sb);
+	free(csums);
+	free(ifree_map);
+	free(bfree_map);
+	free(zeroes);
 fclose:
 	close(fd);
 
 	return ret;
-}
\ No newline at end of file
+}
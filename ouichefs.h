@@ -7,17 +7,69 @@
 #ifndef _OUICHEFS_H
 #define _OUICHEFS_H
 
+#include <linux/buffer_head.h>
 #include <linux/fs.h>
 #include <linux/ioctl.h>
 #include <linux/module.h>
 #include <linux/kernel.h>
+#include <linux/mutex.h>
+#include <linux/percpu_counter.h>
+#include <linux/hashtable.h>
+#include <linux/workqueue.h>
 
 #define OUICHEFS_MAGIC  0x48434957
 
 #define OUICHEFS_SB_BLOCK_NR     0
 
+/*
+ * The block size is chosen by mkfs, from 4 KiB to 64 KiB, and can be mounted
+ * if it is not larger than the page size. OUICHEFS_BLOCK_SIZE is the block
+ * size of partitions formatted before it was configurable; use
+ * OUICHEFS_BSIZE(sb) for the block size of a mounted partition.
+ */
 #define OUICHEFS_BLOCK_SIZE       (1 << 12)  /* 4 KiB */
-#define OUICHEFS_MAX_FILESIZE     (1 << 22)  /* 4 MiB */
+#define OUICHEFS_MIN_BLOCK_SIZE   (1 << 12)  /* 4 KiB */
+#define OUICHEFS_MAX_BLOCK_SIZE   (1 << 16)  /* 64 KiB */
+#define OUICHEFS_BSIZE(sb)        ((sb)->s_blocksize)
+
+/*
+ * Every slot of the index block of a file version maps a data block, the
+ * metadata of the versions is kept in version records.
+ */
+#define OUICHEFS_INDEX_NR_DATA(sb) (OUICHEFS_BSIZE(sb) >> 2)
+#define OUICHEFS_NO_VERSION       ((uint32_t)-1)
+/* History size of an inode not read from its version table yet */
+#define OUICHEFS_HISTORY_UNKNOWN  ((uint32_t)-1)
+
+/*
+ * Small versions keep their data inline, in their index block, instead of
+ * in data blocks. A file stays inline as long as it is not larger than
+ * OUICHEFS_INLINE_MAX(sb).
+ */
+#define OUICHEFS_INLINE_MAX(sb)   OUICHEFS_BSIZE(sb)
+
+/* Features of the on-disk format, see struct ouichefs_superblock */
+#define OUICHEFS_FEATURE_VERSION_TABLE 0x1 /* Packed version records */
+#define OUICHEFS_FEATURE_METADATA_CSUM 0x2 /* Checksum map, see csum.c */
+#define OUICHEFS_FEATURE_DATA_CSUM     0x4 /* Data blocks checksummed too */
+#define OUICHEFS_FEATURE_HISTORY_COUNT 0x8 /* Blocks of the history counted */
+#define OUICHEFS_FEATURE_XATTR         0x10 /* 128 B inodes, xattr blocks */
+#define OUICHEFS_FEATURES_REQUIRED     (OUICHEFS_FEATURE_VERSION_TABLE | \
+					OUICHEFS_FEATURE_HISTORY_COUNT | \
+					OUICHEFS_FEATURE_XATTR)
+#define OUICHEFS_FEATURES_SUPPORTED    (OUICHEFS_FEATURE_VERSION_TABLE | \
+					OUICHEFS_FEATURE_METADATA_CSUM | \
+					OUICHEFS_FEATURE_DATA_CSUM | \
+					OUICHEFS_FEATURE_HISTORY_COUNT | \
+					OUICHEFS_FEATURE_XATTR)
+
+/* State of the partition, see struct ouichefs_superblock */
+#define OUICHEFS_STATE_CLEAN 0   /* Unmounted cleanly or mounted read-only */
+#define OUICHEFS_STATE_DIRTY 0x1 /* Mounted read-write */
+
+/* 4 MiB with 4 KiB blocks, 1 GiB with 64 KiB blocks */
+#define OUICHEFS_MAX_FILESIZE(sb) \
+	((loff_t)OUICHEFS_INDEX_NR_DATA(sb) * OUICHEFS_BSIZE(sb))
 #define OUICHEFS_FILENAME_LEN            28
 #define OUICHEFS_MAX_SUBFILES           128
 
@@ -34,12 +86,30 @@
  * +---------------+
  * | bfree bitmap  |  sb->nr_bfree_blocks blocks
  * +---------------+
+ * | group descs   |  sb->nr_gdt_blocks blocks
+ * +---------------+
+ * | checksum map  |  sb->nr_csum_blocks blocks (metadata_csum only)
+ * +---------------+
  * |    data       |
  * |      blocks   |  rest of the blocks
  * +---------------+
  *
+ * A regular file has an index block per version and, once it has several
+ * versions, a version table: a chain of blocks packing the records of its
+ * older versions. The inode describes the latest version.
+ *
+ * The partition is split in sb->nr_groups allocation groups. Group g owns
+ * blocks [g * blocks_per_group, (g + 1) * blocks_per_group) and inodes
+ * [g * inodes_per_group, (g + 1) * inodes_per_group), i.e. one slice of the
+ * inode store and one slice of each bitmap. blocks_per_group is a multiple
+ * of the number of bits in a bitmap block, so each group has its own bfree
+ * bitmap block(s), and inodes_per_group is a multiple of BITS_PER_LONG, so
+ * two groups never share a bitmap word.
  */
 
+/* Version fields replaced by the target of a fast symlink */
+#define OUICHEFS_FAST_LINK_LEN 28
+
 struct ouichefs_inode {
 	uint32_t i_mode;	/* File mode */
 	uint32_t i_uid;         /* Owner id */
@@ -48,24 +118,189 @@ struct ouichefs_inode {
 	uint32_t i_ctime;	/* Inode change time */
 	uint32_t i_atime;	/* Access time */
 	uint32_t i_mtime;	/* Modification time */
-	uint32_t i_blocks;	/* Block count */
+	uint32_t i_blocks;	/* Blocks of the latest version */
 	uint32_t i_nlink;	/* Hard links count */
-	uint32_t last_index_block; /* numéro de block de la dernière version */
-	uint32_t nb_versions; /* nombre de version du fichier */
-	int can_write;	/* permet de savoir si on peut écrire dans la version actuelle */
-	uint32_t index_block;	/* Block with list of blocks for this file */
+	/* Regular files and directories, slow symlinks use index_block */
+	union {
+		struct {
+			uint32_t last_index_block; /* dernière version */
+			uint32_t nb_versions; /* nombre de versions */
+			uint32_t version_table; /* Newest table block or 0 */
+			uint32_t index_block;	/* Block list of the view */
+			uint32_t last_number;  /* Latest version number */
+			uint32_t last_size;    /* Size of the latest version */
+			uint32_t last_flags;   /* OUICHEFS_VREC_* flags */
+		};
+		/* Target of a fast symlink, NUL terminated */
+		char i_link[OUICHEFS_FAST_LINK_LEN];
+	};
+	uint32_t i_xattr;	/* Extended attribute block or 0 */
+	uint32_t i_tags;	/* Tag table block or 0 */
+	uint32_t i_next_number;	/* Number of the next version, see file.c */
+	uint32_t reserved[13];
+};
+
+/*
+ * Metadata of an older version of a file. Records are packed in the version
+ * table of the file, ordered from the oldest to the newest version.
+ */
+struct ouichefs_version_record {
+	uint32_t index_block; /* Index block of the version */
+	uint32_t number;      /* Version number, never reused in a file */
+	uint32_t parent;      /* Number of the previous version or -1 */
+	uint32_t nr_blocks;   /* Number of data blocks owned by the version */
+	uint32_t size;        /* Size in bytes */
+	uint32_t mtime;       /* Modification time (seconds) */
+	uint32_t flags;       /* OUICHEFS_VREC_* */
+	uint32_t checksum;    /* crc32c of the fields above */
+};
+
+#define OUICHEFS_VREC_INLINE      0x1 /* Data stored in the index block */
+
+/*
+ * Block of a version table. The head of the chain, pointed to by the inode,
+ * holds the newest records and is the only one that may not be full. Only
+ * the head keeps history_blocks up to date: the index and data blocks of the
+ * older versions plus the blocks of the table, so that the space used by the
+ * history of a file is known without walking it.
+ */
+struct ouichefs_version_table {
+	uint32_t next;        /* Block of the older records or 0 */
+	uint32_t nr_records;  /* Number of records in this block */
+	uint32_t history_blocks; /* Blocks of the history (head only) */
+	uint32_t reserved[5];
+	struct ouichefs_version_record records[];
+};
+
+#define OUICHEFS_RECORDS_PER_TABLE(sb) \
+	(OUICHEFS_BSIZE(sb) / sizeof(struct ouichefs_version_record) - 1)
+
+/*
+ * Block holding the extended attributes of an inode, see xattr.c. Entries
+ * follow the header, each padded to 4 bytes, in no particular order.
+ */
+#define OUICHEFS_XATTR_MAGIC 0x78617472 /* "xatr" */
+
+struct ouichefs_xattr_header {
+	uint32_t magic;       /* OUICHEFS_XATTR_MAGIC */
+	uint32_t used;        /* Bytes used, header included */
+	uint32_t reserved[2];
+};
+
+struct ouichefs_xattr_entry {
+	uint8_t name_index;   /* OUICHEFS_XATTR_INDEX_* */
+	uint8_t name_len;     /* Length of name, without prefix */
+	uint16_t value_len;   /* Length of the value following the name */
+	uint32_t version;     /* Version number or OUICHEFS_NO_VERSION */
+	char name[];
+};
+
+#define OUICHEFS_XATTR_INDEX_USER     1
+#define OUICHEFS_XATTR_INDEX_TRUSTED  2
+#define OUICHEFS_XATTR_INDEX_SECURITY 3
+
+/* user.ouichefs.version.* attributes belong to the version viewed */
+#define OUICHEFS_XATTR_VERSION_PREFIX "ouichefs.version."
+
+/*
+ * Tag table of a file, see tag.c: the names given to its versions, sorted
+ * so that a tag is found by binary search (127 tags per 4 KiB block).
+ */
+#define OUICHEFS_TAG_MAGIC 0x74616773 /* "tags" */
+#define OUICHEFS_TAG_LEN   28         /* Name length, final NUL included */
+
+struct ouichefs_tag {
+	char name[OUICHEFS_TAG_LEN]; /* NUL padded */
+	uint32_t number;             /* Version number */
 };
 
+struct ouichefs_tag_table {
+	uint32_t magic;       /* OUICHEFS_TAG_MAGIC */
+	uint32_t nr_tags;     /* Number of tags */
+	uint32_t reserved[6];
+	struct ouichefs_tag tags[];
+};
+
+#define OUICHEFS_TAGS_PER_BLOCK(sb) \
+	(OUICHEFS_BSIZE(sb) / sizeof(struct ouichefs_tag) - 1)
+
+struct ouichefs_group_desc {
+	uint32_t nr_free_inodes;  /* Number of free inodes in this group */
+	uint32_t nr_free_blocks;  /* Number of free blocks in this group */
+};
+
+#define OUICHEFS_GROUP_DESCS_PER_BLOCK(sb) \
+	(OUICHEFS_BSIZE(sb) / sizeof(struct ouichefs_group_desc))
+
+/*
+ * Locking
+ *
+ * - Allocation state (bitmap slices and free counters of a group) is
+ *   protected by the spinlock of its group, see struct ouichefs_group_info.
+ *   The partition-wide free counters are percpu counters, so they never need
+ *   a lock and statfs/sync read them with percpu_counter_sum().
+ * - The on-disk inode is only ever written by ouichefs_write_inode() from the
+ *   in-memory inode, under the lock of the inode store buffer since several
+ *   inodes share it. Nobody else edits the inode store directly.
+ * - The version state of a file (index_block and the fields below it,
+ *   including the version cache) and the content of its index blocks are
+ *   protected by index_lock. Writers and ioctls also hold the inode lock,
+ *   but block mapping from writeback only holds index_lock.
+ */
+
+/*
+ * The version cache of a file holds the records of all its versions, from
+ * the oldest to the latest one, so that listing the history of a file does
+ * not read its version table again. The record of the latest version is
+ * built from the inode.
+ */
 struct ouichefs_inode_info {
-	uint32_t index_block;
+	uint32_t index_block;      /* Index block of the current view */
+	uint32_t last_index_block; /* Index block of the latest version */
+	uint32_t nb_versions;      /* Number of versions of the file */
+	int can_write;             /* Is the current view writable? */
+	uint32_t version_table;    /* Newest block of the version table */
+	uint32_t last_number;      /* Number of the latest version */
+	uint32_t next_number;      /* Number of the next version */
+	uint32_t last_size;        /* Size of the latest version */
+	uint32_t last_mtime;       /* Time the latest version was written */
+	uint32_t last_flags;       /* Flags of the latest version */
+	uint32_t view_flags;       /* Flags of the current view if older */
+	uint32_t view_number;      /* Number of the current view if older */
+	struct ouichefs_version_record *versions; /* Version cache or NULL */
+	uint32_t nr_cached;        /* Number of entries in versions */
+	uint32_t cache_size;       /* Allocated entries in versions */
+	uint32_t map_seq;          /* Bumped when the blocks mapped change */
+	uint32_t history_blocks;   /* See ouichefs_history_blocks() */
+	struct list_head views;    /* Older versions cached, MRU first */
+	uint32_t nr_views;         /* Number of entries in views */
+	char i_link[OUICHEFS_FAST_LINK_LEN]; /* Target of a fast symlink */
+	uint32_t xattr_block;      /* Extended attribute block or 0 */
+	void *xattrs;              /* Copy of the used part of it or NULL */
+	uint32_t xattr_size;       /* Bytes in xattrs */
+	uint32_t tag_block;        /* Tag table block or 0 */
+	struct mutex index_lock;
 	struct inode vfs_inode;
 };
 
-#define OUICHEFS_INODES_PER_BLOCK \
-	(OUICHEFS_BLOCK_SIZE / sizeof(struct ouichefs_inode))
+/*
+ * Page cache of an older version of a file, see view.c. The latest version
+ * is cached in the mapping of the inode.
+ */
+struct ouichefs_view {
+	struct address_space mapping;
+	struct list_head list;
+	uint32_t number;           /* Number of the version cached */
+};
 
+/* Page caches of older versions kept per file */
+#define OUICHEFS_MAX_VIEWS 4
 
-struct ouichefs_sb_info {
+#define OUICHEFS_INODES_PER_BLOCK(sb) \
+	(OUICHEFS_BSIZE(sb) / sizeof(struct ouichefs_inode))
+
+
+struct ouichefs_superblock {
 	uint32_t magic;	        /* Magic number */
 
 	uint32_t nr_blocks;      /* Total number of blocks (incl sb & inodes) */
@@ -78,15 +313,196 @@ struct ouichefs_sb_info {
 	uint32_t nr_free_inodes;  /* Number of free inodes */
 	uint32_t nr_free_blocks;  /* Number of free blocks */
 
+	uint32_t nr_groups;        /* Number of allocation groups */
+	uint32_t blocks_per_group; /* Number of blocks in a group */
+	uint32_t inodes_per_group; /* Number of inodes in a group */
+	uint32_t nr_gdt_blocks;    /* Number of group descriptor blocks */
+	uint32_t block_size;       /* Block size in bytes, 0 means 4 KiB */
+	uint32_t features;         /* OUICHEFS_FEATURE_* */
+	uint32_t nr_csum_blocks;   /* Number of checksum map blocks */
+	uint32_t nr_history_blocks;/* Blocks of the history of every file */
+	uint32_t state;            /* OUICHEFS_STATE_*, see csum.c */
+};
+
+/*
+ * Retention policy of the versions, set at mount time. A limit of 0 means no
+ * limit. The latest version and the current view of a file are never
+ * dropped.
+ */
+struct ouichefs_retention {
+	uint32_t keep;     /* Keep at most keep versions of a file */
+	uint32_t max_age;  /* Drop versions older than max_age seconds */
+	uint32_t budget;   /* Blocks owned by the older versions of a file */
+	uint32_t interval; /* Seconds between two garbage collector runs */
+	uint32_t batch;    /* Versions freed at most by a run */
+};
+
+/*
+ * Default quota limits of every owner, in blocks, set at mount time. A
+ * limit of 0 means no limit.
+ */
+struct ouichefs_quota_limits {
+	uint32_t live;     /* Blocks of the latest versions of its files */
+	uint32_t history;  /* Blocks of their older versions */
+};
+
+#define OUICHEFS_MAXQUOTAS 2 /* OUICHEFS_USRQUOTA and OUICHEFS_GRPQUOTA */
+
+/* Usage and limits of an owner, see quota.c */
+struct ouichefs_dquot {
+	struct hlist_node node;
+	uint32_t type;           /* OUICHEFS_USRQUOTA or OUICHEFS_GRPQUOTA */
+	uint32_t id;             /* uid or gid */
+	s64 live;                /* Blocks of the latest versions */
+	s64 history;             /* Blocks of the older versions */
+	uint64_t live_limit;     /* Or OUICHEFS_QUOTA_DEFAULT */
+	uint64_t history_limit;  /* Or OUICHEFS_QUOTA_DEFAULT */
+};
+
+/* Statistics, shown in debugfs */
+struct ouichefs_stats {
+	atomic64_t reads_saved; /* Reads avoided when initializing new blocks */
+	atomic64_t csum_computed; /* Checksums computed for written blocks */
+	atomic64_t csum_verified; /* Blocks verified when read from disk */
+	atomic64_t csum_cached;   /* Reads of blocks already verified */
+	atomic64_t csum_errors;   /* Checksum mismatches */
+	atomic64_t csum_ns;       /* Time spent computing checksums */
+	atomic64_t defrag_moved;  /* Blocks moved by defragmentation */
+};
+
+/* Range of blocks */
+struct ouichefs_extent {
+	uint32_t start;
+	uint32_t len;
+};
+
+struct ouichefs_sb_info {
+	uint32_t magic;	        /* Magic number */
+
+	uint32_t nr_blocks;      /* Total number of blocks (incl sb & inodes) */
+	uint32_t nr_inodes;      /* Total number of inodes */
+
+	uint32_t nr_istore_blocks;/* Number of inode store blocks */
+	uint32_t nr_ifree_blocks; /* Number of inode free bitmap blocks */
+	uint32_t nr_bfree_blocks; /* Number of block free bitmap blocks */
+
+	struct percpu_counter nr_free_inodes; /* Number of free inodes */
+	struct percpu_counter nr_free_blocks; /* Number of free blocks */
+	/* Blocks of the history of every file, see ouichefs_history_blocks() */
+	struct percpu_counter nr_history_blocks;
+
+	uint32_t nr_groups;        /* Number of allocation groups */
+	uint32_t blocks_per_group; /* Number of blocks in a group */
+	uint32_t inodes_per_group; /* Number of inodes in a group */
+	uint32_t nr_gdt_blocks;    /* Number of group descriptor blocks */
+	uint32_t features;         /* OUICHEFS_FEATURE_* */
+	uint32_t nr_csum_blocks;   /* Number of checksum map blocks */
+	uint32_t state;            /* OUICHEFS_STATE_* on disk */
+
 	unsigned long *ifree_bitmap; /* In-memory free inodes bitmap */
 	unsigned long *bfree_bitmap; /* In-memory free blocks bitmap */
+	struct ouichefs_group_info *groups; /* In-memory group descriptors */
+	uint32_t *csums;             /* In-memory checksum map or NULL */
+	unsigned long *csum_dirty;   /* Map blocks changed since written */
+	bool data_csum;              /* Data blocks are checksummed */
+
+	struct super_block *sb;
+	struct ouichefs_retention retention; /* Mount options */
+	struct delayed_work gc_work;  /* Background version collector */
+	uint32_t gc_cursor;           /* Next inode scanned by the collector */
+
+	bool discard;                 /* Discard freed blocks */
+	struct mutex discard_lock;    /* Protects the discard queue */
+	struct ouichefs_extent *discard_queue; /* Freed blocks to discard */
+	uint32_t nr_discard;          /* Number of extents in discard_queue */
+	uint32_t discard_size;        /* Allocated extents in discard_queue */
+	struct delayed_work discard_work; /* Discards the queued blocks */
+
+	bool quota;                   /* Usage of the owners counted */
+	struct ouichefs_quota_limits quota_defaults[OUICHEFS_MAXQUOTAS];
+	spinlock_t quota_lock;        /* Protects quota_hash and its entries */
+	DECLARE_HASHTABLE(quota_hash, 6); /* struct ouichefs_dquot */
+
+	struct ouichefs_stats stats;
 	//struct dentry *ouichefs_debug_file; /* fichier de debug du ouichefs */
 };
 
+/*
+ * In-memory state of an allocation group. lock protects the group's slices
+ * of ifree_bitmap and bfree_bitmap as well as its free counters, so that
+ * allocations in different groups never contend. It is a leaf lock: nothing
+ * else is taken or slept on while holding it.
+ */
+struct ouichefs_group_info {
+	spinlock_t lock;
+	uint32_t nr_free_inodes;
+	uint32_t nr_free_blocks;
+};
+
+static inline uint32_t ouichefs_ino_group(struct ouichefs_sb_info *sbi,
+					  uint32_t ino)
+{
+	return ino / sbi->inodes_per_group;
+}
+
+static inline uint32_t ouichefs_block_group(struct ouichefs_sb_info *sbi,
+					    uint32_t bno)
+{
+	return bno / sbi->blocks_per_group;
+}
+
+/* First inode of group g and first inode past its end */
+static inline uint32_t ouichefs_group_first_ino(struct ouichefs_sb_info *sbi,
+						uint32_t g)
+{
+	return g * sbi->inodes_per_group;
+}
+
+static inline uint32_t ouichefs_group_end_ino(struct ouichefs_sb_info *sbi,
+					      uint32_t g)
+{
+	return min(sbi->nr_inodes, (g + 1) * sbi->inodes_per_group);
+}
+
+/* First block of group g and first block past its end */
+static inline uint32_t ouichefs_group_first_block(struct ouichefs_sb_info *sbi,
+						  uint32_t g)
+{
+	return g * sbi->blocks_per_group;
+}
+
+static inline uint32_t ouichefs_group_end_block(struct ouichefs_sb_info *sbi,
+						uint32_t g)
+{
+	return min(sbi->nr_blocks, (g + 1) * sbi->blocks_per_group);
+}
+
+/* First block of the group descriptor table */
+static inline uint32_t ouichefs_gdt_block(struct ouichefs_sb_info *sbi)
+{
+	return 1 + sbi->nr_istore_blocks + sbi->nr_ifree_blocks +
+		sbi->nr_bfree_blocks;
+}
+
+/* First block of the checksum map */
+static inline uint32_t ouichefs_csum_block(struct ouichefs_sb_info *sbi)
+{
+	return ouichefs_gdt_block(sbi) + sbi->nr_gdt_blocks;
+}
+
+/* Buffer state: checksum verified since the block was read */
+enum ouichefs_bh_state_bits {
+	BH_Verified = BH_PrivateStart,
+};
+
+BUFFER_FNS(Verified, verified)
+
+/* Only the first OUICHEFS_INDEX_NR_DATA(sb) slots exist on disk */
 struct ouichefs_file_index_block {
-	uint32_t blocks[(OUICHEFS_BLOCK_SIZE >> 2)];
+	uint32_t blocks[(OUICHEFS_MAX_BLOCK_SIZE >> 2)];
 };
 
+/* A directory uses the first 4 KiB of its index block, whatever its size */
 struct ouichefs_dir_block {
 	struct ouichefs_file {
 		uint32_t inode;
@@ -97,21 +513,165 @@ struct ouichefs_dir_block {
 /* superblock functions */
 int ouichefs_fill_super(struct super_block *sb, void *data, int silent);
 
+/* block functions */
+struct buffer_head *ouichefs_get_new_block(struct super_block *sb,
+					   struct inode *inode,
+					   uint32_t bno, const void *src);
+void ouichefs_release_block(struct super_block *sb, uint32_t bno);
+void ouichefs_discard_init(struct super_block *sb);
+void ouichefs_discard_flush(struct super_block *sb);
+
+/* checksum functions */
+struct buffer_head *ouichefs_bread(struct super_block *sb, uint32_t bno);
+void ouichefs_csum_set(struct super_block *sb, struct buffer_head *bh);
+void ouichefs_mark_dirty(struct super_block *sb, struct buffer_head *bh,
+			 struct inode *inode);
+void ouichefs_csum_set_page(struct inode *inode, struct page *page,
+			    unsigned int offset, uint32_t bno);
+bool ouichefs_csum_verify_data(struct inode *inode, struct page *page,
+			       unsigned int offset, uint32_t bno);
+int ouichefs_csum_load(struct super_block *sb, struct buffer_head *sb_bh);
+void ouichefs_csum_free(struct ouichefs_sb_info *sbi);
+int ouichefs_csum_sync(struct super_block *sb, int wait);
+
+/* garbage collector functions */
+int ouichefs_parse_options(struct ouichefs_sb_info *sbi, char *options);
+int ouichefs_show_options(struct seq_file *m, struct dentry *root);
+void ouichefs_gc_init(struct super_block *sb);
+void ouichefs_gc_start(struct super_block *sb);
+void ouichefs_gc_stop(struct super_block *sb);
+void ouichefs_gc_kick(struct super_block *sb);
+uint32_t ouichefs_gc_reclaim(struct inode *inode, uint32_t blocks);
+
+/* quota functions */
+struct ouichefs_quota_info;
+int ouichefs_quota_load(struct super_block *sb);
+void ouichefs_quota_free(struct ouichefs_sb_info *sbi);
+void ouichefs_quota_charge(struct inode *inode, s64 live, s64 history);
+int ouichefs_quota_check(struct inode *inode, uint32_t live,
+			 uint32_t history);
+int ouichefs_quota_transfer(struct inode *inode, struct iattr *iattr);
+long ouichefs_ioctl_quota(struct file *file, unsigned int cmd,
+			  struct ouichefs_quota_info __user *uinfo);
+
+/* view functions */
+struct ouichefs_view *ouichefs_get_view(struct inode *inode,
+					uint32_t number);
+void ouichefs_prune_views(struct inode *inode,
+			  struct ouichefs_version_record *recs, uint32_t nr,
+			  struct list_head *dead);
+void ouichefs_free_views(struct list_head *dead);
+ssize_t ouichefs_view_read(struct kiocb *iocb, struct iov_iter *to);
+
+/* extended attribute functions */
+extern const struct xattr_handler *ouichefs_xattr_handlers[];
+ssize_t ouichefs_listxattr(struct dentry *dentry, char *buffer, size_t size);
+int ouichefs_xattr_prune(struct inode *inode,
+			 struct ouichefs_version_record *recs, uint32_t nr);
+void ouichefs_xattr_free(struct inode *inode);
+
+/* tag functions */
+int ouichefs_find_tag(struct inode *inode, const char *name,
+		      uint32_t *number);
+int ouichefs_prune_tags(struct inode *inode,
+			struct ouichefs_version_record *recs, uint32_t nr);
+long ouichefs_ioctl_tag(struct file *file, unsigned int cmd,
+			void __user *arg);
+
 /* inode functions */
 int ouichefs_init_inode_cache(void);
 void ouichefs_destroy_inode_cache(void);
 struct inode *ouichefs_iget(struct super_block *sb, unsigned long ino);
 
 /* file functions */
+long ouichefs_ioctl(struct file *file, unsigned int cmd, unsigned long arg);
+int ouichefs_read_block(struct inode *inode, struct page *page,
+		       unsigned int off, uint32_t bno);
 extern const struct file_operations ouichefs_file_ops;
 extern const struct file_operations ouichefs_dir_ops;
 extern const struct address_space_operations ouichefs_aops;
+extern const struct inode_operations ouichefs_file_inode_ops;
+
+/* version functions */
+void ouichefs_free_version(struct super_block *sb, uint32_t index_block,
+			   uint32_t flags);
+void ouichefs_free_history(struct inode *inode);
+int ouichefs_load_versions(struct inode *inode);
+int ouichefs_load_view(struct inode *inode);
+int ouichefs_history_blocks(struct inode *inode, uint32_t *nr);
+int ouichefs_append_version(struct inode *inode,
+			    struct ouichefs_version_record *rec);
+void ouichefs_cache_new_version(struct ouichefs_inode_info *ci,
+				uint32_t index_block);
+void ouichefs_drop_versions(struct ouichefs_inode_info *ci);
+int ouichefs_trim_versions(struct inode *inode, uint32_t nr);
+int ouichefs_commit_versions(struct inode *inode,
+			     struct ouichefs_version_record *recs,
+			     uint32_t nr);
+uint32_t ouichefs_version_index(struct ouichefs_version_record *recs,
+				uint32_t nr, uint32_t number);
+
+/* defragmentation functions */
+long ouichefs_ioctl_defrag(struct file *file, void __user *arg);
 
 /* Getters for superbock and inode */
 #define OUICHEFS_SB(sb) (sb->s_fs_info)
 #define OUICHEFS_INODE(inode) (container_of(inode, struct ouichefs_inode_info, \
 					    vfs_inode))
 
+/* Get the buffer of a newly allocated block filled with zeroes */
+static inline struct buffer_head *
+ouichefs_get_zeroed_block(struct super_block *sb, struct inode *inode,
+			  uint32_t bno)
+{
+	return ouichefs_get_new_block(sb, inode, bno, NULL);
+}
+
+/* Cached record of the latest version, NULL if the cache is not loaded */
+static inline struct ouichefs_version_record *
+ouichefs_latest_version(struct ouichefs_inode_info *ci)
+{
+	if (!ci->versions || !ci->nr_cached)
+		return NULL;
+	return &ci->versions[ci->nr_cached - 1];
+}
+
+/* Number of the version currently viewed. The caller must hold index_lock. */
+static inline uint32_t ouichefs_view_number(struct ouichefs_inode_info *ci)
+{
+	if (ci->index_block == ci->last_index_block)
+		return ci->last_number;
+	return ci->view_number;
+}
+
+/* Flags of the version currently viewed. The caller must hold index_lock. */
+static inline uint32_t ouichefs_view_flags(struct ouichefs_inode_info *ci)
+{
+	if (ci->index_block == ci->last_index_block)
+		return ci->last_flags;
+	return ci->view_flags;
+}
+
+/*
+ * Record that the blocks mapped by the current view of a file changed, so
+ * that the extents mapped by writeback beforehand are mapped again. The
+ * caller must hold index_lock.
+ */
+static inline void ouichefs_map_changed(struct ouichefs_inode_info *ci)
+{
+	WRITE_ONCE(ci->map_seq, ci->map_seq + 1);
+}
+
+/*
+ * Set the number of blocks of the latest version of inode, index block
+ * included, and charge the difference to the quotas of its owners.
+ */
+static inline void ouichefs_set_blocks(struct inode *inode, blkcnt_t nr)
+{
+	ouichefs_quota_charge(inode, (s64)nr - (s64)inode->i_blocks, 0);
+	inode->i_blocks = nr;
+}
+
 #endif	/* _OUICHEFS_H */
 
 
@@ -0,0 +1,388 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * ouiche_fs - a simple educational filesystem for Linux
+ *
+ * Copyright (C) 2018 Redha Gouicem <redha.gouicem@lip6.fr>
+ */
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/buffer_head.h>
+#include <linux/capability.h>
+#include <linux/cred.h>
+#include <linux/hashtable.h>
+#include <linux/slab.h>
+#include <linux/uaccess.h>
+
+#include "ouichefs.h"
+#include "test/requettes.h"
+
+/*
+ * Disk quotas per uid and gid, with separate limits for the latest versions
+ * of the files (live blocks) and for their history. The usage of every owner
+ * is counted once at mount, then charged as the blocks of the files change,
+ * see ouichefs_set_blocks() and ouichefs_history_blocks(). Only regular
+ * files are counted, and only their data, index and version table blocks:
+ * the extended attribute block and the tag table of a file, one block each
+ * at most, are left out like its inode. They are not in i_blocks either,
+ * whose 0 also marks a fast symlink. The default limits come from the mount
+ * options and apply to every owner but root; ouichefs_ioctl_quota() sets the
+ * limits of a single owner until the partition is unmounted.
+ */
+
+static uint32_t ouichefs_quota_id(struct inode *inode, int type)
+{
+	return type == OUICHEFS_USRQUOTA ? i_uid_read(inode) :
+		i_gid_read(inode);
+}
+
+static inline uint32_t ouichefs_quota_hash(int type, uint32_t id)
+{
+	return id * 2 + type;
+}
+
+/* Find the usage of owner id. The caller must hold quota_lock. */
+static struct ouichefs_dquot *ouichefs_dquot_find(struct ouichefs_sb_info *sbi,
+						  int type, uint32_t id)
+{
+	struct ouichefs_dquot *dq;
+
+	hash_for_each_possible(sbi->quota_hash, dq, node,
+			       ouichefs_quota_hash(type, id))
+		if (dq->type == type && dq->id == id)
+			return dq;
+	return NULL;
+}
+
+/*
+ * Find the usage of owner id, adding it if it is not counted yet. Entries are
+ * only freed at unmount, so the result stays valid.
+ */
+static struct ouichefs_dquot *ouichefs_dquot_get(struct ouichefs_sb_info *sbi,
+						 int type, uint32_t id)
+{
+	struct ouichefs_dquot *dq, *new;
+
+	spin_lock(&sbi->quota_lock);
+	dq = ouichefs_dquot_find(sbi, type, id);
+	spin_unlock(&sbi->quota_lock);
+	if (dq)
+		return dq;
+
+	new = kzalloc(sizeof(*new), GFP_NOFS);
+	if (!new)
+		return NULL;
+	new->type = type;
+	new->id = id;
+	new->live_limit = OUICHEFS_QUOTA_DEFAULT;
+	new->history_limit = OUICHEFS_QUOTA_DEFAULT;
+
+	spin_lock(&sbi->quota_lock);
+	dq = ouichefs_dquot_find(sbi, type, id);
+	if (!dq) {
+		hash_add(sbi->quota_hash, &new->node,
+			 ouichefs_quota_hash(type, id));
+		dq = new;
+		new = NULL;
+	}
+	spin_unlock(&sbi->quota_lock);
+	kfree(new);
+	return dq;
+}
+
+static int ouichefs_quota_add(struct ouichefs_sb_info *sbi, int type,
+			      uint32_t id, s64 live, s64 history)
+{
+	struct ouichefs_dquot *dq = ouichefs_dquot_get(sbi, type, id);
+
+	if (!dq)
+		return -ENOMEM;
+	spin_lock(&sbi->quota_lock);
+	dq->live += live;
+	dq->history += history;
+	spin_unlock(&sbi->quota_lock);
+	return 0;
+}
+
+/*
+ * Charge live and history blocks, negative when freed, to the owners of
+ * inode.
+ */
+void ouichefs_quota_charge(struct inode *inode, s64 live, s64 history)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(inode->i_sb);
+	uint32_t id;
+	int type;
+
+	if (!sbi->quota || !S_ISREG(inode->i_mode) || (!live && !history))
+		return;
+	for (type = 0; type < OUICHEFS_MAXQUOTAS; type++) {
+		id = ouichefs_quota_id(inode, type);
+		if (ouichefs_quota_add(sbi, type, id, live, history))
+			pr_warn_ratelimited("inode %lu: quota usage lost\n",
+					    inode->i_ino);
+	}
+}
+
+/* Limit of owner dq, 0 when there is none. The caller holds quota_lock. */
+static uint64_t ouichefs_quota_limit(struct ouichefs_sb_info *sbi,
+				     struct ouichefs_dquot *dq, bool history)
+{
+	uint64_t limit = history ? dq->history_limit : dq->live_limit;
+
+	if (limit != OUICHEFS_QUOTA_DEFAULT)
+		return limit;
+	/* root only has the limits set for it */
+	if (!dq->id)
+		return 0;
+	return history ? sbi->quota_defaults[dq->type].history :
+		sbi->quota_defaults[dq->type].live;
+}
+
+/*
+ * Return how many blocks owner id goes over its history limit if it gets
+ * live and history more blocks, or -EDQUOT if it goes over its live limit.
+ */
+static s64 ouichefs_quota_excess(struct ouichefs_sb_info *sbi, int type,
+				 uint32_t id, uint64_t live, uint64_t history)
+{
+	struct ouichefs_dquot *dq;
+	uint64_t limit;
+	s64 excess = 0;
+
+	spin_lock(&sbi->quota_lock);
+	dq = ouichefs_dquot_find(sbi, type, id);
+	if (!dq) {
+		/* Nothing charged yet, only the defaults apply */
+		limit = id ? sbi->quota_defaults[type].live : 0;
+		if (live && limit && live > limit)
+			excess = -EDQUOT;
+		limit = id ? sbi->quota_defaults[type].history : 0;
+		if (!excess && history && limit && history > limit)
+			excess = history - limit;
+		goto unlock;
+	}
+	limit = ouichefs_quota_limit(sbi, dq, false);
+	if (live && limit && dq->live + live > limit) {
+		excess = -EDQUOT;
+		goto unlock;
+	}
+	limit = ouichefs_quota_limit(sbi, dq, true);
+	if (history && limit && dq->history + history > limit)
+		excess = dq->history + history - limit;
+unlock:
+	spin_unlock(&sbi->quota_lock);
+	return excess;
+}
+
+/*
+ * Check that the owners of inode may get live more blocks in the latest
+ * versions and history more in the history. The oldest versions of inode
+ * are dropped to stay under the history limit when possible, and the
+ * garbage collector is woken up to apply the retention policy to the other
+ * files. Called with the inode lock held. Return 0 or -EDQUOT.
+ */
+int ouichefs_quota_check(struct inode *inode, uint32_t live,
+			 uint32_t history)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(inode->i_sb);
+	bool pruned = false;
+	s64 excess, worst;
+	int type;
+
+	if (!sbi->quota || !S_ISREG(inode->i_mode) || (!live && !history))
+		return 0;
+
+	for (;;) {
+		worst = 0;
+		for (type = 0; type < OUICHEFS_MAXQUOTAS; type++) {
+			excess = ouichefs_quota_excess(sbi, type,
+					ouichefs_quota_id(inode, type),
+					live, history);
+			if (excess < 0)
+				return excess;
+			worst = max(worst, excess);
+		}
+		if (!worst)
+			return 0;
+		if (pruned ||
+		    !ouichefs_gc_reclaim(inode, min_t(s64, worst, U32_MAX)))
+			break;
+		pruned = true;
+	}
+	ouichefs_gc_kick(inode->i_sb);
+	return -EDQUOT;
+}
+
+/*
+ * Move the usage of inode to the owners set by iattr. Called from setattr
+ * with the inode lock held, before the owners change.
+ */
+int ouichefs_quota_transfer(struct inode *inode, struct iattr *iattr)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(inode->i_sb);
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	uint32_t ids[OUICHEFS_MAXQUOTAS], history;
+	bool change[OUICHEFS_MAXQUOTAS];
+	int type, ret;
+
+	if (!sbi->quota || !S_ISREG(inode->i_mode))
+		return 0;
+
+	change[OUICHEFS_USRQUOTA] = (iattr->ia_valid & ATTR_UID) &&
+		!uid_eq(iattr->ia_uid, inode->i_uid);
+	ids[OUICHEFS_USRQUOTA] = from_kuid(&init_user_ns, iattr->ia_uid);
+	change[OUICHEFS_GRPQUOTA] = (iattr->ia_valid & ATTR_GID) &&
+		!gid_eq(iattr->ia_gid, inode->i_gid);
+	ids[OUICHEFS_GRPQUOTA] = from_kgid(&init_user_ns, iattr->ia_gid);
+	if (!change[OUICHEFS_USRQUOTA] && !change[OUICHEFS_GRPQUOTA])
+		return 0;
+
+	mutex_lock(&ci->index_lock);
+	ret = ouichefs_history_blocks(inode, &history);
+	mutex_unlock(&ci->index_lock);
+	if (ret)
+		return ret;
+
+	for (type = 0; type < OUICHEFS_MAXQUOTAS; type++) {
+		if (change[type] &&
+		    ouichefs_quota_excess(sbi, type, ids[type],
+					  inode->i_blocks, history))
+			return -EDQUOT;
+	}
+	for (type = 0; type < OUICHEFS_MAXQUOTAS; type++) {
+		if (!change[type])
+			continue;
+		ret = ouichefs_quota_add(sbi, type, ids[type],
+					 inode->i_blocks, history);
+		if (ret)
+			return ret;
+		ouichefs_quota_add(sbi, type, ouichefs_quota_id(inode, type),
+				   -(s64)inode->i_blocks, -(s64)history);
+	}
+	return 0;
+}
+
+/*
+ * Count the usage of every owner from the inodes and the heads of the
+ * version tables, once at mount.
+ */
+int ouichefs_quota_load(struct super_block *sb)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_inode *disk_inode;
+	struct ouichefs_version_table *table;
+	struct buffer_head *bh, *bh_table;
+	uint32_t i, j, ino, history;
+	int ret = 0;
+
+	spin_lock_init(&sbi->quota_lock);
+	hash_init(sbi->quota_hash);
+	if (!sbi->quota)
+		return 0;
+
+	for (i = 0; i < sbi->nr_istore_blocks && !ret; i++) {
+		bh = ouichefs_bread(sb, i + 1);
+		if (!bh)
+			return -EIO;
+		disk_inode = (struct ouichefs_inode *)bh->b_data;
+		for (j = 0; j < OUICHEFS_INODES_PER_BLOCK(sb); j++) {
+			ino = i * OUICHEFS_INODES_PER_BLOCK(sb) + j;
+			if (ino >= sbi->nr_inodes)
+				break;
+			if (!S_ISREG(disk_inode[j].i_mode))
+				continue;
+			history = 0;
+			if (disk_inode[j].version_table) {
+				bh_table = ouichefs_bread(sb,
+						disk_inode[j].version_table);
+				if (!bh_table) {
+					ret = -EIO;
+					break;
+				}
+				table = (struct ouichefs_version_table *)
+					bh_table->b_data;
+				history = table->history_blocks;
+				brelse(bh_table);
+			}
+			ret = ouichefs_quota_add(sbi, OUICHEFS_USRQUOTA,
+						 disk_inode[j].i_uid,
+						 disk_inode[j].i_blocks,
+						 history);
+			if (!ret)
+				ret = ouichefs_quota_add(sbi,
+						OUICHEFS_GRPQUOTA,
+						disk_inode[j].i_gid,
+						disk_inode[j].i_blocks,
+						history);
+			if (ret)
+				break;
+		}
+		brelse(bh);
+		cond_resched();
+	}
+	if (ret)
+		ouichefs_quota_free(sbi);
+	return ret;
+}
+
+void ouichefs_quota_free(struct ouichefs_sb_info *sbi)
+{
+	struct ouichefs_dquot *dq;
+	struct hlist_node *tmp;
+	int bkt;
+
+	hash_for_each_safe(sbi->quota_hash, bkt, tmp, dq, node) {
+		hash_del(&dq->node);
+		kfree(dq);
+	}
+}
+
+/*
+ * OUICHEFS_IOC_GET_QUOTA reports the usage and limits of an owner, to itself
+ * or to the administrator. OUICHEFS_IOC_SET_QUOTA sets them.
+ */
+long ouichefs_ioctl_quota(struct file *file, unsigned int cmd,
+			  struct ouichefs_quota_info __user *uinfo)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(file_inode(file)->i_sb);
+	struct ouichefs_quota_info info;
+	struct ouichefs_dquot *dq;
+
+	if (!sbi->quota)
+		return -ESRCH;
+	if (copy_from_user(&info, uinfo, sizeof(info)))
+		return -EFAULT;
+	if (info.type >= OUICHEFS_MAXQUOTAS)
+		return -EINVAL;
+
+	if (cmd == OUICHEFS_IOC_SET_QUOTA) {
+		if (!capable(CAP_SYS_ADMIN))
+			return -EPERM;
+	} else if (!capable(CAP_SYS_ADMIN) &&
+		   info.id != (info.type == OUICHEFS_USRQUOTA ?
+			       from_kuid(&init_user_ns, current_fsuid()) :
+			       from_kgid(&init_user_ns, current_fsgid()))) {
+		return -EPERM;
+	}
+
+	dq = ouichefs_dquot_get(sbi, info.type, info.id);
+	if (!dq)
+		return -ENOMEM;
+	spin_lock(&sbi->quota_lock);
+	if (cmd == OUICHEFS_IOC_SET_QUOTA) {
+		dq->live_limit = info.live_limit;
+		dq->history_limit = info.history_limit;
+	}
+	info.live_blocks = max_t(s64, dq->live, 0);
+	info.history_blocks = max_t(s64, dq->history, 0);
+	info.live_limit = ouichefs_quota_limit(sbi, dq, false);
+	info.history_limit = ouichefs_quota_limit(sbi, dq, true);
+	spin_unlock(&sbi->quota_lock);
+
+	if (copy_to_user(uinfo, &info, sizeof(info)))
+		return -EFAULT;
+	return 0;
+}
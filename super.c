@@ -12,6 +12,7 @@
 #include <linux/buffer_head.h>
 #include <linux/slab.h>
 #include <linux/statfs.h>
+#include <linux/log2.h>
 
 #include "ouichefs.h"
 
@@ -41,6 +42,18 @@ static struct inode *ouichefs_alloc_inode(struct super_block *sb)
 	ci = kmem_cache_alloc(ouichefs_inode_cache, GFP_KERNEL);
 	if (!ci)
 		return NULL;
+	mutex_init(&ci->index_lock);
+	ci->versions = NULL;
+	ci->nr_cached = 0;
+	ci->cache_size = 0;
+	ci->map_seq = 0;
+	ci->history_blocks = 0;
+	INIT_LIST_HEAD(&ci->views);
+	ci->nr_views = 0;
+	ci->xattr_block = 0;
+	ci->xattrs = NULL;
+	ci->xattr_size = 0;
+	ci->tag_block = 0;
 	inode_init_once(&ci->vfs_inode);
 	return &ci->vfs_inode;
 }
@@ -50,6 +63,9 @@ static void ouichefs_destroy_inode(struct inode *inode)
 	struct ouichefs_inode_info *ci;
 
 	ci = OUICHEFS_INODE(inode);
+	ouichefs_drop_versions(ci);
+	ouichefs_free_views(&ci->views);
+	kfree(ci->xattrs);
 	kmem_cache_free(ouichefs_inode_cache, ci);
 }
 
@@ -62,18 +78,41 @@ static int ouichefs_write_inode(struct inode *inode,
 	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
 	struct buffer_head *bh;
 	uint32_t ino = inode->i_ino;
-	uint32_t inode_block = (ino / OUICHEFS_INODES_PER_BLOCK) + 1;
-	uint32_t inode_shift = ino % OUICHEFS_INODES_PER_BLOCK;
+	uint32_t inode_block = (ino / OUICHEFS_INODES_PER_BLOCK(sb)) + 1;
+	uint32_t inode_shift = ino % OUICHEFS_INODES_PER_BLOCK(sb);
+	uint32_t index_block, last_index_block, nb_versions, version_table;
+	uint32_t last_number, last_size, last_flags, xattr_block;
+	uint32_t tag_block, next_number;
 
 	if (ino >= sbi->nr_inodes)
 		return 0;
 
-	bh = sb_bread(sb, inode_block);
+	/* Snapshot the version state of the file */
+	mutex_lock(&ci->index_lock);
+	index_block = ci->index_block;
+	last_index_block = ci->last_index_block;
+	nb_versions = ci->nb_versions;
+	version_table = ci->version_table;
+	last_number = ci->last_number;
+	last_size = ci->last_size;
+	last_flags = ci->last_flags;
+	xattr_block = ci->xattr_block;
+	tag_block = ci->tag_block;
+	next_number = ci->next_number;
+	mutex_unlock(&ci->index_lock);
+
+	bh = ouichefs_bread(sb, inode_block);
 	if (!bh)
 		return -EIO;
 	disk_inode = (struct ouichefs_inode *)bh->b_data;
 	disk_inode += inode_shift;
 
+	/*
+	 * Other inodes of this block may be written concurrently, lock the
+	 * buffer so that it is never flushed with a half-updated inode.
+	 */
+	lock_buffer(bh);
+
 	/* update the mode using what the generic inode has */
 	disk_inode->i_mode      = inode->i_mode;
 	disk_inode->i_uid       = i_uid_read(inode);
@@ -84,36 +123,62 @@ static int ouichefs_write_inode(struct inode *inode,
 	disk_inode->i_mtime     = inode->i_mtime.tv_sec;
 	disk_inode->i_blocks    = inode->i_blocks;
 	disk_inode->i_nlink     = inode->i_nlink;
-	disk_inode->index_block = ci->index_block;
-
+	disk_inode->index_block = index_block;
+	disk_inode->last_index_block = last_index_block;
+	disk_inode->nb_versions = nb_versions;
+	disk_inode->version_table = version_table;
+	disk_inode->last_number = last_number;
+	disk_inode->last_size = last_size;
+	disk_inode->last_flags = last_flags;
+	if (S_ISLNK(inode->i_mode) && !inode->i_blocks)
+		memcpy(disk_inode->i_link, ci->i_link, OUICHEFS_FAST_LINK_LEN);
+	disk_inode->i_xattr = xattr_block;
+	disk_inode->i_tags = tag_block;
+	disk_inode->i_next_number = next_number;
+	ouichefs_csum_set(sb, bh);
+
+	unlock_buffer(bh);
 	mark_buffer_dirty(bh);
-	sync_dirty_buffer(bh);
+	if (wbc->sync_mode == WB_SYNC_ALL)
+		sync_dirty_buffer(bh);
 	brelse(bh);
 
 	return 0;
 }
 
+static void fill_disk_sb(struct ouichefs_sb_info *sbi,
+			 struct ouichefs_superblock *disk_sb)
+{
+	disk_sb->nr_blocks        = sbi->nr_blocks;
+	disk_sb->nr_inodes        = sbi->nr_inodes;
+	disk_sb->nr_istore_blocks = sbi->nr_istore_blocks;
+	disk_sb->nr_ifree_blocks  = sbi->nr_ifree_blocks;
+	disk_sb->nr_bfree_blocks  = sbi->nr_bfree_blocks;
+	disk_sb->nr_free_inodes   =
+		percpu_counter_sum_positive(&sbi->nr_free_inodes);
+	disk_sb->nr_free_blocks   =
+		percpu_counter_sum_positive(&sbi->nr_free_blocks);
+	disk_sb->nr_history_blocks =
+		percpu_counter_sum_positive(&sbi->nr_history_blocks);
+	disk_sb->nr_groups        = sbi->nr_groups;
+	disk_sb->blocks_per_group = sbi->blocks_per_group;
+	disk_sb->inodes_per_group = sbi->inodes_per_group;
+	disk_sb->nr_gdt_blocks    = sbi->nr_gdt_blocks;
+	disk_sb->state            = sbi->state;
+}
+
 static int sync_sb_info(struct super_block *sb, int wait)
 {
-	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
-	struct ouichefs_sb_info *disk_sb;
 	struct buffer_head *bh;
 
 	/* Flush superblock */
 	bh = sb_bread(sb, 0);
 	if (!bh)
 		return -EIO;
-	disk_sb = (struct ouichefs_sb_info *)bh->b_data;
-
-	disk_sb->nr_blocks        = sbi->nr_blocks;
-	disk_sb->nr_inodes        = sbi->nr_inodes;
-	disk_sb->nr_istore_blocks = sbi->nr_istore_blocks;
-	disk_sb->nr_ifree_blocks  = sbi->nr_ifree_blocks;
-	disk_sb->nr_bfree_blocks  = sbi->nr_bfree_blocks;
-	disk_sb->nr_free_inodes   = sbi->nr_free_inodes;
-	disk_sb->nr_free_blocks   = sbi->nr_free_blocks;
+	fill_disk_sb(OUICHEFS_SB(sb),
+		     (struct ouichefs_superblock *)bh->b_data);
 
-	mark_buffer_dirty(bh);
+	ouichefs_mark_dirty(sb, bh, NULL);
 	if (wait)
 		sync_dirty_buffer(bh);
 	brelse(bh);
@@ -121,13 +186,47 @@ static int sync_sb_info(struct super_block *sb, int wait)
 	return 0;
 }
 
+/*
+ * Write state to the superblock, see csum.c. The partition is marked dirty
+ * before it is modified. It is marked clean once everything else is on
+ * disk, and after the checksum map holding the checksum of the clean
+ * superblock, so that a crash in between leaves it dirty.
+ */
+static int ouichefs_set_state(struct super_block *sb, uint32_t state)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct buffer_head *bh;
+	int ret = 0;
+
+	bh = sb_bread(sb, OUICHEFS_SB_BLOCK_NR);
+	if (!bh)
+		return -EIO;
+	sbi->state = state;
+	lock_buffer(bh);
+	fill_disk_sb(sbi, (struct ouichefs_superblock *)bh->b_data);
+	ouichefs_csum_set(sb, bh);
+	unlock_buffer(bh);
+	if (state == OUICHEFS_STATE_CLEAN)
+		ret = ouichefs_csum_sync(sb, 1);
+	if (!ret) {
+		mark_buffer_dirty(bh);
+		ret = sync_dirty_buffer(bh);
+	}
+	brelse(bh);
+	return ret;
+}
+
 static int sync_ifree(struct super_block *sb, int wait)
 {
 	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
 	struct buffer_head *bh;
 	int i, idx;
 
-	/* Flush free inodes bitmask */
+	/*
+	 * Flush free inodes bitmask. Inode slices are not aligned on bitmap
+	 * blocks, so copy without the group locks: words are copied whole
+	 * and a concurrent change will be written by the next sync.
+	 */
 	for (i = 0; i < sbi->nr_ifree_blocks; i++) {
 		idx = sbi->nr_istore_blocks + i + 1;
 
@@ -135,9 +234,12 @@ static int sync_ifree(struct super_block *sb, int wait)
 		if (!bh)
 			return -EIO;
 
+		lock_buffer(bh);
 		memcpy(bh->b_data,
-		       (void *)sbi->ifree_bitmap + i * OUICHEFS_BLOCK_SIZE,
-		       OUICHEFS_BLOCK_SIZE);
+		       (void *)sbi->ifree_bitmap + i * OUICHEFS_BSIZE(sb),
+		       OUICHEFS_BSIZE(sb));
+		ouichefs_csum_set(sb, bh);
+		unlock_buffer(bh);
 
 		mark_buffer_dirty(bh);
 		if (wait)
@@ -154,17 +256,29 @@ static int sync_bfree(struct super_block *sb, int wait)
 	struct buffer_head *bh;
 	int i, idx;
 
-	/* Flush free blocks bitmask */
+	/*
+	 * Flush free blocks bitmask. Each bitmap block belongs to a single
+	 * group, so take its lock to get a consistent copy.
+	 */
 	for (i = 0; i < sbi->nr_bfree_blocks; i++) {
+		struct ouichefs_group_info *gi;
+
 		idx = sbi->nr_istore_blocks + sbi->nr_ifree_blocks + i + 1;
+		gi = &sbi->groups[ouichefs_block_group(sbi,
+					i * OUICHEFS_BSIZE(sb) * 8)];
 
 		bh = sb_bread(sb, idx);
 		if (!bh)
 			return -EIO;
 
+		lock_buffer(bh);
+		spin_lock(&gi->lock);
 		memcpy(bh->b_data,
-		       (void *)sbi->bfree_bitmap + i * OUICHEFS_BLOCK_SIZE,
-		       OUICHEFS_BLOCK_SIZE);
+		       (void *)sbi->bfree_bitmap + i * OUICHEFS_BSIZE(sb),
+		       OUICHEFS_BSIZE(sb));
+		spin_unlock(&gi->lock);
+		ouichefs_csum_set(sb, bh);
+		unlock_buffer(bh);
 
 		mark_buffer_dirty(bh);
 		if (wait)
@@ -175,13 +289,153 @@ static int sync_bfree(struct super_block *sb, int wait)
 	return 0;
 }
 
+static int sync_gdt(struct super_block *sb, int wait)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_group_desc *desc;
+	struct buffer_head *bh;
+	uint32_t g = 0;
+	int i, j;
+
+	/* Flush group descriptors */
+	for (i = 0; i < sbi->nr_gdt_blocks; i++) {
+		bh = sb_bread(sb, ouichefs_gdt_block(sbi) + i);
+		if (!bh)
+			return -EIO;
+		desc = (struct ouichefs_group_desc *)bh->b_data;
+
+		for (j = 0; j < OUICHEFS_GROUP_DESCS_PER_BLOCK(sb) &&
+			    g < sbi->nr_groups; j++, g++) {
+			struct ouichefs_group_info *gi = &sbi->groups[g];
+
+			spin_lock(&gi->lock);
+			desc[j].nr_free_inodes = gi->nr_free_inodes;
+			desc[j].nr_free_blocks = gi->nr_free_blocks;
+			spin_unlock(&gi->lock);
+		}
+
+		ouichefs_mark_dirty(sb, bh, NULL);
+		if (wait)
+			sync_dirty_buffer(bh);
+		brelse(bh);
+	}
+
+	return 0;
+}
+
+/*
+ * Load the group descriptors from disk and initialize the partition-wide free
+ * counters. If the descriptors do not add up to the counters of the on-disk
+ * superblock (e.g. after a crash), recount every group from the bitmaps,
+ * which are the reference.
+ */
+static int load_groups(struct super_block *sb, uint32_t disk_free_inodes,
+		       uint32_t disk_free_blocks, uint32_t disk_history_blocks)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_group_desc *desc;
+	struct buffer_head *bh;
+	uint64_t free_inodes = 0, free_blocks = 0;
+	uint32_t g = 0, first, end;
+	int i, j, ret;
+
+	sbi->groups = kcalloc(sbi->nr_groups, sizeof(*sbi->groups),
+			      GFP_KERNEL);
+	if (!sbi->groups)
+		return -ENOMEM;
+
+	for (i = 0; i < sbi->nr_gdt_blocks; i++) {
+		bh = ouichefs_bread(sb, ouichefs_gdt_block(sbi) + i);
+		if (!bh) {
+			ret = -EIO;
+			goto free_groups;
+		}
+		desc = (struct ouichefs_group_desc *)bh->b_data;
+
+		for (j = 0; j < OUICHEFS_GROUP_DESCS_PER_BLOCK(sb) &&
+			    g < sbi->nr_groups; j++, g++) {
+			spin_lock_init(&sbi->groups[g].lock);
+			sbi->groups[g].nr_free_inodes = desc[j].nr_free_inodes;
+			sbi->groups[g].nr_free_blocks = desc[j].nr_free_blocks;
+			free_inodes += desc[j].nr_free_inodes;
+			free_blocks += desc[j].nr_free_blocks;
+		}
+		brelse(bh);
+	}
+
+	if (free_inodes != disk_free_inodes ||
+	    free_blocks != disk_free_blocks) {
+		pr_warn("group descriptors out of sync, recounting free inodes and blocks\n");
+		free_inodes = 0;
+		free_blocks = 0;
+		for (g = 0; g < sbi->nr_groups; g++) {
+			struct ouichefs_group_info *gi = &sbi->groups[g];
+
+			first = ouichefs_group_first_ino(sbi, g);
+			end = ouichefs_group_end_ino(sbi, g);
+			gi->nr_free_inodes =
+				bitmap_weight(sbi->ifree_bitmap, end) -
+				bitmap_weight(sbi->ifree_bitmap, first);
+
+			first = ouichefs_group_first_block(sbi, g);
+			end = ouichefs_group_end_block(sbi, g);
+			gi->nr_free_blocks =
+				bitmap_weight(sbi->bfree_bitmap, end) -
+				bitmap_weight(sbi->bfree_bitmap, first);
+
+			free_inodes += gi->nr_free_inodes;
+			free_blocks += gi->nr_free_blocks;
+		}
+	}
+
+	ret = percpu_counter_init(&sbi->nr_free_inodes, free_inodes,
+				  GFP_KERNEL);
+	if (ret)
+		goto free_groups;
+	ret = percpu_counter_init(&sbi->nr_free_blocks, free_blocks,
+				  GFP_KERNEL);
+	if (ret)
+		goto destroy_inodes;
+	/* Kept by the version code, fsck counts it again after a crash */
+	ret = percpu_counter_init(&sbi->nr_history_blocks,
+				  disk_history_blocks, GFP_KERNEL);
+	if (ret)
+		goto destroy_blocks;
+
+	return 0;
+
+destroy_blocks:
+	percpu_counter_destroy(&sbi->nr_free_blocks);
+destroy_inodes:
+	percpu_counter_destroy(&sbi->nr_free_inodes);
+free_groups:
+	kfree(sbi->groups);
+	return ret;
+}
+
+static void ouichefs_free_groups(struct ouichefs_sb_info *sbi)
+{
+	percpu_counter_destroy(&sbi->nr_history_blocks);
+	percpu_counter_destroy(&sbi->nr_free_blocks);
+	percpu_counter_destroy(&sbi->nr_free_inodes);
+	kfree(sbi->groups);
+}
+
 static void ouichefs_put_super(struct super_block *sb)
 {
 	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
 
 	if (sbi) {
+		/* Everything else was synced by generic_shutdown_super() */
+		if (!sb_rdonly(sb))
+			ouichefs_set_state(sb, OUICHEFS_STATE_CLEAN);
+		cancel_delayed_work_sync(&sbi->discard_work);
+		kfree(sbi->discard_queue);
+		ouichefs_quota_free(sbi);
+		ouichefs_free_groups(sbi);
 		kfree(sbi->ifree_bitmap);
 		kfree(sbi->bfree_bitmap);
+		ouichefs_csum_free(sbi);
 		kfree(sbi);
 	}
 }
@@ -190,6 +444,10 @@ static int ouichefs_sync_fs(struct super_block *sb, int wait)
 {
 	int ret = 0;
 
+	/* Give queued freed blocks back to the allocator before syncing it */
+	if (wait)
+		ouichefs_discard_flush(sb);
+
 	ret = sync_sb_info(sb, wait);
 	if (ret)
 		return ret;
@@ -197,58 +455,91 @@ static int ouichefs_sync_fs(struct super_block *sb, int wait)
 	if (ret)
 		return ret;
 	ret = sync_bfree(sb, wait);
+	if (ret)
+		return ret;
+	ret = sync_gdt(sb, wait);
+	if (ret)
+		return ret;
+	/* Last, once every other metadata block has its checksum */
+	ret = ouichefs_csum_sync(sb, wait);
 	if (ret)
 		return ret;
 
 	return 0;
 }
 
+/*
+ * The blocks of the older versions are used blocks. struct kstatfs has no
+ * field for them, their total is reported by OUICHEFS_IOC_SPACE_INFO and in
+ * debugfs.
+ */
 static int ouichefs_statfs(struct dentry *dentry, struct kstatfs *stat)
 {
 	struct super_block *sb = dentry->d_sb;
 	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
 
 	stat->f_type = OUICHEFS_MAGIC;
-	stat->f_bsize = OUICHEFS_BLOCK_SIZE;
+	stat->f_bsize = OUICHEFS_BSIZE(sb);
 	stat->f_blocks = sbi->nr_blocks;
-	stat->f_bfree = sbi->nr_free_blocks;
-	stat->f_bavail = sbi->nr_free_blocks;
-	stat->f_files = sbi->nr_inodes - sbi->nr_free_inodes;
-	stat->f_ffree = sbi->nr_free_inodes;
+	stat->f_bfree = percpu_counter_sum_positive(&sbi->nr_free_blocks);
+	stat->f_bavail = stat->f_bfree;
+	stat->f_ffree = percpu_counter_sum_positive(&sbi->nr_free_inodes);
+	stat->f_files = sbi->nr_inodes;
+	stat->f_fsid = u64_to_fsid(huge_encode_dev(sb->s_bdev->bd_dev));
 	stat->f_namelen = OUICHEFS_FILENAME_LEN;
 
 	return 0;
 }
 
+/*
+ * The partition is marked clean while it is mounted read-only, see
+ * ouichefs_set_state().
+ */
+static int ouichefs_remount_fs(struct super_block *sb, int *flags,
+			       char *data)
+{
+	sync_filesystem(sb);
+	if ((*flags & SB_RDONLY) && !sb_rdonly(sb))
+		return ouichefs_set_state(sb, OUICHEFS_STATE_CLEAN);
+	if (!(*flags & SB_RDONLY) && sb_rdonly(sb))
+		return ouichefs_set_state(sb, OUICHEFS_STATE_DIRTY);
+	return 0;
+}
+
 static struct super_operations ouichefs_super_ops = {
 	.put_super     = ouichefs_put_super,
 	.alloc_inode   = ouichefs_alloc_inode,
 	.destroy_inode = ouichefs_destroy_inode,
 	.write_inode   = ouichefs_write_inode,
 	.sync_fs       = ouichefs_sync_fs,
+	.remount_fs    = ouichefs_remount_fs,
 	.statfs        = ouichefs_statfs,
+	.show_options  = ouichefs_show_options,
 };
 
 /* Fill the struct superblock from partition superblock */
 int ouichefs_fill_super(struct super_block *sb, void *data, int silent)
 {
 	struct buffer_head *bh = NULL;
-	struct ouichefs_sb_info *csb = NULL;
+	struct ouichefs_superblock *csb = NULL;
 	struct ouichefs_sb_info *sbi = NULL;
 	struct inode *root_inode = NULL;
+	uint32_t disk_free_inodes, disk_free_blocks, disk_history_blocks;
+	uint32_t block_size;
 	int ret = 0, i;
 
 	/* Init sb */
 	sb->s_magic = OUICHEFS_MAGIC;
-	sb_set_blocksize(sb, OUICHEFS_BLOCK_SIZE);
-	sb->s_maxbytes = OUICHEFS_MAX_FILESIZE;
+	if (!sb_set_blocksize(sb, OUICHEFS_MIN_BLOCK_SIZE))
+		return -EINVAL;
 	sb->s_op = &ouichefs_super_ops;
+	sb->s_xattr = ouichefs_xattr_handlers;
 
 	/* Read sb from disk */
 	bh = sb_bread(sb, OUICHEFS_SB_BLOCK_NR);
 	if (!bh)
 		return -EIO;
-	csb = (struct ouichefs_sb_info *)bh->b_data;
+	csb = (struct ouichefs_superblock *)bh->b_data;
 
 	/* Check magic number */
 	if (csb->magic != sb->s_magic) {
@@ -257,6 +548,45 @@ int ouichefs_fill_super(struct super_block *sb, void *data, int silent)
 		goto release;
 	}
 
+	/* Older images keep the version history in the index blocks */
+	if ((csb->features & OUICHEFS_FEATURES_REQUIRED) !=
+	    OUICHEFS_FEATURES_REQUIRED ||
+	    (csb->features & ~OUICHEFS_FEATURES_SUPPORTED)) {
+		pr_err("Unsupported on-disk format (features %#x), reformat the partition\n",
+		       csb->features);
+		ret = -EINVAL;
+		goto release;
+	}
+
+	/*
+	 * Switch to the block size of the partition, the superblock fits in
+	 * the first 4 KiB of block 0 whatever the block size.
+	 */
+	block_size = csb->block_size ? csb->block_size : OUICHEFS_BLOCK_SIZE;
+	if (block_size != OUICHEFS_MIN_BLOCK_SIZE) {
+		if (!is_power_of_2(block_size) ||
+		    block_size > OUICHEFS_MAX_BLOCK_SIZE ||
+		    block_size < OUICHEFS_MIN_BLOCK_SIZE) {
+			pr_err("Invalid block size %u\n", block_size);
+			ret = -EINVAL;
+			goto release;
+		}
+		if (block_size > PAGE_SIZE) {
+			pr_err("Block size %u larger than the page size (%lu) not supported\n",
+			       block_size, PAGE_SIZE);
+			ret = -EINVAL;
+			goto release;
+		}
+		brelse(bh);
+		if (!sb_set_blocksize(sb, block_size))
+			return -EINVAL;
+		bh = sb_bread(sb, OUICHEFS_SB_BLOCK_NR);
+		if (!bh)
+			return -EIO;
+		csb = (struct ouichefs_superblock *)bh->b_data;
+	}
+	sb->s_maxbytes = OUICHEFS_MAX_FILESIZE(sb);
+
 	/* Alloc sb_info */
 	sbi = kzalloc(sizeof(struct ouichefs_sb_info), GFP_KERNEL);
 	if (!sbi) {
@@ -268,36 +598,74 @@ int ouichefs_fill_super(struct super_block *sb, void *data, int silent)
 	sbi->nr_istore_blocks = csb->nr_istore_blocks;
 	sbi->nr_ifree_blocks = csb->nr_ifree_blocks;
 	sbi->nr_bfree_blocks = csb->nr_bfree_blocks;
-	sbi->nr_free_inodes = csb->nr_free_inodes;
-	sbi->nr_free_blocks = csb->nr_free_blocks;
+	disk_free_inodes = csb->nr_free_inodes;
+	disk_free_blocks = csb->nr_free_blocks;
+	disk_history_blocks = csb->nr_history_blocks;
+	sbi->nr_groups = csb->nr_groups;
+	sbi->blocks_per_group = csb->blocks_per_group;
+	sbi->inodes_per_group = csb->inodes_per_group;
+	sbi->nr_gdt_blocks = csb->nr_gdt_blocks;
+	sbi->features = csb->features;
+	sbi->nr_csum_blocks = csb->nr_csum_blocks;
+	sbi->state = csb->state;
+	sbi->data_csum = (csb->features & OUICHEFS_FEATURE_DATA_CSUM) &&
+		(csb->features & OUICHEFS_FEATURE_METADATA_CSUM);
 	sb->s_fs_info = sbi;
+	ouichefs_gc_init(sb);
+
+	/* Retention policy of the versions and other mount options */
+	ret = ouichefs_parse_options(sbi, data);
+	if (ret)
+		goto free_sbi;
+	ouichefs_discard_init(sb);
+
+	/* Check that the allocation groups cover the whole partition */
+	if (!sbi->nr_groups || !sbi->blocks_per_group ||
+	    sbi->blocks_per_group % (OUICHEFS_BSIZE(sb) * 8) ||
+	    !sbi->inodes_per_group ||
+	    sbi->inodes_per_group % BITS_PER_LONG ||
+	    (uint64_t)sbi->nr_groups * sbi->blocks_per_group <
+	    sbi->nr_blocks ||
+	    (uint64_t)sbi->nr_groups * sbi->inodes_per_group <
+	    sbi->nr_inodes ||
+	    sbi->nr_gdt_blocks * OUICHEFS_GROUP_DESCS_PER_BLOCK(sb) <
+	    sbi->nr_groups) {
+		pr_err("Invalid allocation group layout\n");
+		ret = -EINVAL;
+		goto free_sbi;
+	}
+
+	/* Load the checksum map before reading any other metadata */
+	ret = ouichefs_csum_load(sb, bh);
+	if (ret)
+		goto free_sbi;
 
 	brelse(bh);
 
 	/* Alloc and copy ifree_bitmap */
-	sbi->ifree_bitmap = kzalloc(sbi->nr_ifree_blocks * OUICHEFS_BLOCK_SIZE,
+	sbi->ifree_bitmap = kzalloc(sbi->nr_ifree_blocks * OUICHEFS_BSIZE(sb),
 				    GFP_KERNEL);
 	if (!sbi->ifree_bitmap) {
 		ret = -ENOMEM;
-		goto free_sbi;
+		goto free_csum;
 	}
 	for (i = 0; i < sbi->nr_ifree_blocks; i++) {
 		int idx = sbi->nr_istore_blocks + i + 1;
 
-		bh = sb_bread(sb, idx);
+		bh = ouichefs_bread(sb, idx);
 		if (!bh) {
 			ret = -EIO;
 			goto free_ifree;
 		}
 
-		memcpy((void *)sbi->ifree_bitmap + i * OUICHEFS_BLOCK_SIZE,
-		       bh->b_data, OUICHEFS_BLOCK_SIZE);
+		memcpy((void *)sbi->ifree_bitmap + i * OUICHEFS_BSIZE(sb),
+		       bh->b_data, OUICHEFS_BSIZE(sb));
 
 		brelse(bh);
 	}
 
 	/* Alloc and copy bfree_bitmap */
-	sbi->bfree_bitmap = kzalloc(sbi->nr_bfree_blocks * OUICHEFS_BLOCK_SIZE,
+	sbi->bfree_bitmap = kzalloc(sbi->nr_bfree_blocks * OUICHEFS_BSIZE(sb),
 				    GFP_KERNEL);
 	if (!sbi->bfree_bitmap) {
 		ret = -ENOMEM;
@@ -306,23 +674,41 @@ int ouichefs_fill_super(struct super_block *sb, void *data, int silent)
 	for (i = 0; i < sbi->nr_bfree_blocks; i++) {
 		int idx = sbi->nr_istore_blocks + sbi->nr_ifree_blocks + i + 1;
 
-		bh = sb_bread(sb, idx);
+		bh = ouichefs_bread(sb, idx);
 		if (!bh) {
 			ret = -EIO;
 			goto free_bfree;
 		}
 
-		memcpy((void *)sbi->bfree_bitmap + i * OUICHEFS_BLOCK_SIZE,
-		       bh->b_data, OUICHEFS_BLOCK_SIZE);
+		memcpy((void *)sbi->bfree_bitmap + i * OUICHEFS_BSIZE(sb),
+		       bh->b_data, OUICHEFS_BSIZE(sb));
 
 		brelse(bh);
 	}
 
+	/* Load allocation groups */
+	ret = load_groups(sb, disk_free_inodes, disk_free_blocks,
+			  disk_history_blocks);
+	if (ret)
+		goto free_bfree;
+
+	/* Dirty until unmounted, before anything is modified, see csum.c */
+	if (!sb_rdonly(sb)) {
+		ret = ouichefs_set_state(sb, OUICHEFS_STATE_DIRTY);
+		if (ret)
+			goto free_groups;
+	}
+
+	/* Count the usage of the owners when quotas are enabled */
+	ret = ouichefs_quota_load(sb);
+	if (ret)
+		goto free_groups;
+
 	/* Create root inode */
 	root_inode = ouichefs_iget(sb, 0);
 	if (IS_ERR(root_inode)) {
 		ret = PTR_ERR(root_inode);
-		goto free_bfree;
+		goto free_quota;
 	}
 	inode_init_owner(root_inode, NULL, root_inode->i_mode);
 	sb->s_root = d_make_root(root_inode);
@@ -331,15 +717,24 @@ int ouichefs_fill_super(struct super_block *sb, void *data, int silent)
 		goto iput;
 	}
 
+	ouichefs_gc_start(sb);
+
 	return 0;
 
 iput:
 	iput(root_inode);
+free_quota:
+	ouichefs_quota_free(sbi);
+free_groups:
+	ouichefs_free_groups(sbi);
 free_bfree:
 	kfree(sbi->bfree_bitmap);
 free_ifree:
 	kfree(sbi->ifree_bitmap);
+free_csum:
+	ouichefs_csum_free(sbi);
 free_sbi:
+	sb->s_fs_info = NULL;
 	kfree(sbi);
 release:
 	brelse(bh);
@@ -0,0 +1,372 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * ouiche_fs - a simple educational filesystem for Linux
+ *
+ * Copyright (C) 2018 Redha Gouicem <redha.gouicem@lip6.fr>
+ */
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/buffer_head.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/mount.h>
+#include <linux/string.h>
+#include <linux/uaccess.h>
+
+#include "ouichefs.h"
+#include "bitmap.h"
+#include "test/requettes.h"
+
+/*
+ * Tags of the versions of a file. The tags of a file are kept in one block,
+ * its tag table, allocated with the first tag and freed with the last one.
+ * Tags are sorted by name: a tag is found by a binary search of the table,
+ * and its version by a binary search of the version cache, see
+ * ouichefs_version_index(). A tag names a version by its number, which is
+ * never reused, so tags stay right whatever happens to the other versions,
+ * and go away with their version, see ouichefs_prune_tags().
+ *
+ * The table is changed with the inode lock and index_lock held, and read
+ * with index_lock held.
+ */
+
+/*
+ * Read the tag table of inode in *bhp, NULL if the file has no tag. The
+ * caller must hold index_lock.
+ */
+static int ouichefs_read_tags(struct inode *inode, struct buffer_head **bhp)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct ouichefs_tag_table *table;
+	struct buffer_head *bh;
+
+	*bhp = NULL;
+	if (!ci->tag_block)
+		return 0;
+	bh = ouichefs_bread(sb, ci->tag_block);
+	if (!bh)
+		return -EIO;
+	table = (struct ouichefs_tag_table *)bh->b_data;
+	if (table->magic != OUICHEFS_TAG_MAGIC || !table->nr_tags ||
+	    table->nr_tags > OUICHEFS_TAGS_PER_BLOCK(sb)) {
+		pr_err("inode %lu: corrupted tag table %u\n", inode->i_ino,
+		       ci->tag_block);
+		brelse(bh);
+		return -EUCLEAN;
+	}
+	*bhp = bh;
+	return 0;
+}
+
+/*
+ * Look for name in table, which may be NULL. Return true if it is found,
+ * with its position in *pos, false with the position to insert it at.
+ */
+static bool ouichefs_search_tag(struct ouichefs_tag_table *table,
+				const char *name, uint32_t *pos)
+{
+	uint32_t lo = 0, hi = table ? table->nr_tags : 0, mid;
+	int cmp;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		cmp = strncmp(name, table->tags[mid].name, OUICHEFS_TAG_LEN);
+		if (!cmp) {
+			*pos = mid;
+			return true;
+		}
+		if (cmp > 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	*pos = lo;
+	return false;
+}
+
+/*
+ * Find the number of the version tagged name. The caller must hold
+ * index_lock.
+ */
+int ouichefs_find_tag(struct inode *inode, const char *name,
+		      uint32_t *number)
+{
+	struct ouichefs_tag_table *table;
+	struct buffer_head *bh;
+	uint32_t pos;
+	int ret;
+
+	ret = ouichefs_read_tags(inode, &bh);
+	if (ret)
+		return ret;
+	if (!bh)
+		return -ENOENT;
+	table = (struct ouichefs_tag_table *)bh->b_data;
+	if (ouichefs_search_tag(table, name, &pos))
+		*number = table->tags[pos].number;
+	else
+		ret = -ENOENT;
+	brelse(bh);
+	return ret;
+}
+
+/*
+ * Write back the tag table of inode in bh after a change, or free it if it
+ * holds no tag anymore. Releases bh. The caller must hold index_lock.
+ */
+static void ouichefs_update_tags(struct inode *inode, struct buffer_head *bh)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct ouichefs_tag_table *table;
+
+	table = (struct ouichefs_tag_table *)bh->b_data;
+	if (table->nr_tags) {
+		ouichefs_mark_dirty(inode->i_sb, bh, inode);
+		brelse(bh);
+		return;
+	}
+	bforget(bh);
+	ouichefs_release_block(inode->i_sb, ci->tag_block);
+	ci->tag_block = 0;
+	mark_inode_dirty(inode);
+}
+
+/*
+ * Allocate the tag table of inode, empty. The caller must hold index_lock.
+ */
+static int ouichefs_new_tags(struct inode *inode, struct buffer_head **bhp)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct buffer_head *bh;
+	uint32_t bno;
+
+	bno = get_free_block(sbi, ouichefs_ino_group(sbi, inode->i_ino));
+	if (!bno)
+		return -ENOSPC;
+	bh = ouichefs_get_zeroed_block(sb, inode, bno);
+	if (!bh) {
+		put_block(sbi, bno);
+		return -EIO;
+	}
+	((struct ouichefs_tag_table *)bh->b_data)->magic = OUICHEFS_TAG_MAGIC;
+	ci->tag_block = bno;
+	mark_inode_dirty(inode);
+	*bhp = bh;
+	return 0;
+}
+
+/*
+ * Add, move or remove a tag as asked by tag, and set tag->id to the version
+ * it names. The inode lock must be held.
+ */
+static int ouichefs_set_tag(struct inode *inode,
+			    struct ouichefs_version_tag *tag)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct ouichefs_tag_table *table = NULL;
+	struct buffer_head *bh;
+	uint32_t pos, number = tag->id;
+	bool found;
+	int ret;
+
+	if (!tag->name[0])
+		return -EINVAL;
+
+	mutex_lock(&ci->index_lock);
+	ret = ouichefs_load_versions(inode);
+	if (ret)
+		goto unlock;
+	if (number == OUICHEFS_TAG_VIEW)
+		number = ouichefs_view_number(ci);
+	else if (!(tag->flags & OUICHEFS_TAG_REMOVE) &&
+		 ouichefs_version_index(ci->versions, ci->nr_cached,
+					number) == ci->nr_cached) {
+		ret = -EINVAL;
+		goto unlock;
+	}
+
+	ret = ouichefs_read_tags(inode, &bh);
+	if (ret)
+		goto unlock;
+	if (bh)
+		table = (struct ouichefs_tag_table *)bh->b_data;
+	found = ouichefs_search_tag(table, tag->name, &pos);
+
+	if (tag->flags & OUICHEFS_TAG_REMOVE) {
+		if (!found) {
+			ret = -ENOENT;
+			goto release;
+		}
+		number = table->tags[pos].number;
+		table->nr_tags--;
+		memmove(&table->tags[pos], &table->tags[pos + 1],
+			(table->nr_tags - pos) * sizeof(table->tags[0]));
+		memset(&table->tags[table->nr_tags], 0,
+		       sizeof(table->tags[0]));
+		goto update;
+	}
+	if (found) {
+		if (!(tag->flags & OUICHEFS_TAG_REPLACE)) {
+			ret = -EEXIST;
+			goto release;
+		}
+		table->tags[pos].number = number;
+		goto update;
+	}
+
+	if (!bh) {
+		ret = ouichefs_new_tags(inode, &bh);
+		if (ret)
+			goto unlock;
+		table = (struct ouichefs_tag_table *)bh->b_data;
+	} else if (table->nr_tags == OUICHEFS_TAGS_PER_BLOCK(inode->i_sb)) {
+		ret = -ENOSPC;
+		goto release;
+	}
+	memmove(&table->tags[pos + 1], &table->tags[pos],
+		(table->nr_tags - pos) * sizeof(table->tags[0]));
+	memset(&table->tags[pos], 0, sizeof(table->tags[0]));
+	strscpy(table->tags[pos].name, tag->name, OUICHEFS_TAG_LEN);
+	table->tags[pos].number = number;
+	table->nr_tags++;
+
+update:
+	ouichefs_update_tags(inode, bh);
+	tag->id = number;
+	inode->i_ctime = current_time(inode);
+	mark_inode_dirty(inode);
+	goto unlock;
+release:
+	brelse(bh);
+unlock:
+	mutex_unlock(&ci->index_lock);
+	return ret;
+}
+
+/*
+ * Drop the tags of the versions that are not among the nr versions of recs
+ * anymore. The caller must hold index_lock.
+ */
+int ouichefs_prune_tags(struct inode *inode,
+			struct ouichefs_version_record *recs, uint32_t nr)
+{
+	struct ouichefs_tag_table *table;
+	struct buffer_head *bh;
+	uint32_t i, kept = 0;
+	int ret;
+
+	ret = ouichefs_read_tags(inode, &bh);
+	if (ret || !bh)
+		return ret;
+	table = (struct ouichefs_tag_table *)bh->b_data;
+	for (i = 0; i < table->nr_tags; i++) {
+		if (ouichefs_version_index(recs, nr,
+					   table->tags[i].number) == nr)
+			continue;
+		if (kept != i)
+			table->tags[kept] = table->tags[i];
+		kept++;
+	}
+	if (kept == table->nr_tags) {
+		brelse(bh);
+		return 0;
+	}
+	memset(&table->tags[kept], 0,
+	       (table->nr_tags - kept) * sizeof(table->tags[0]));
+	table->nr_tags = kept;
+	ouichefs_update_tags(inode, bh);
+	return 0;
+}
+
+static long ouichefs_ioctl_list_tags(struct inode *inode,
+				     struct ouichefs_tag_list __user *ulist)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct ouichefs_version_tag *tags = NULL;
+	struct ouichefs_tag_table *table;
+	struct ouichefs_tag_list list;
+	struct buffer_head *bh;
+	uint32_t i;
+	long ret;
+
+	if (copy_from_user(&list, ulist, sizeof(list)))
+		return -EFAULT;
+
+	mutex_lock(&ci->index_lock);
+	ret = ouichefs_read_tags(inode, &bh);
+	if (ret) {
+		mutex_unlock(&ci->index_lock);
+		return ret;
+	}
+	table = bh ? (struct ouichefs_tag_table *)bh->b_data : NULL;
+	list.nr_tags = table ? table->nr_tags : 0;
+	list.nr_entries = min(list.nr_entries, list.nr_tags);
+	if (list.nr_entries) {
+		tags = kvcalloc(list.nr_entries, sizeof(*tags), GFP_KERNEL);
+		if (!tags)
+			ret = -ENOMEM;
+	}
+	for (i = 0; tags && i < list.nr_entries; i++) {
+		memcpy(tags[i].name, table->tags[i].name, OUICHEFS_TAG_LEN);
+		tags[i].name[OUICHEFS_TAG_LEN - 1] = '\0';
+		tags[i].id = table->tags[i].number;
+	}
+	brelse(bh);
+	mutex_unlock(&ci->index_lock);
+	if (ret)
+		return ret;
+
+	/* Copy out without index_lock, the buffer may be mapped from a file */
+	if (list.nr_entries &&
+	    copy_to_user(u64_to_user_ptr(list.entries), tags,
+			 list.nr_entries * sizeof(*tags)))
+		ret = -EFAULT;
+	else if (copy_to_user(ulist, &list, sizeof(list)))
+		ret = -EFAULT;
+	kvfree(tags);
+	return ret;
+}
+
+long ouichefs_ioctl_tag(struct file *file, unsigned int cmd,
+			void __user *arg)
+{
+	struct inode *inode = file_inode(file);
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct ouichefs_version_tag tag;
+	long ret;
+
+	BUILD_BUG_ON(OUICHEFS_TAG_NAME_LEN != OUICHEFS_TAG_LEN);
+
+	if (cmd == OUICHEFS_IOC_LIST_TAGS)
+		return ouichefs_ioctl_list_tags(inode, arg);
+
+	if (copy_from_user(&tag, arg, sizeof(tag)))
+		return -EFAULT;
+	tag.name[sizeof(tag.name) - 1] = '\0';
+
+	if (cmd == OUICHEFS_IOC_SET_TAG) {
+		if (!(file->f_mode & FMODE_WRITE))
+			return -EBADF;
+		ret = mnt_want_write_file(file);
+		if (ret)
+			return ret;
+		inode_lock(inode);
+		ret = ouichefs_set_tag(inode, &tag);
+		inode_unlock(inode);
+		mnt_drop_write_file(file);
+		return ret;
+	}
+
+	mutex_lock(&ci->index_lock);
+	ret = ouichefs_find_tag(inode, tag.name, &tag.id);
+	mutex_unlock(&ci->index_lock);
+	if (!ret && copy_to_user(arg, &tag, sizeof(tag)))
+		ret = -EFAULT;
+	return ret;
+}
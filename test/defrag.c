@@ -0,0 +1,74 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/ioctl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include "requettes.h"
+
+/*
+ * Défragmentation en ligne.
+ *
+ *   defrag [-H] [-r blocs/s] fichier [fichier ...]
+ *
+ * La dernière version de chaque fichier est déplacée dans une seule suite
+ * de blocs contigus. -H range aussi les anciennes versions à la fin de la
+ * partition, -r limite le nombre de blocs déplacés par seconde pour ne pas
+ * gêner les autres accès.
+ */
+
+static int defrag(const char *path, struct ouichefs_defrag *args)
+{
+	struct ouichefs_defrag d = *args;
+	int fd, ret = 0;
+
+	fd = open(path, O_RDWR);
+	if (fd < 0) {
+		perror(path);
+		return 1;
+	}
+	if (ioctl(fd, OUICHEFS_IOC_DEFRAG, &d) < 0) {
+		printf("%s: %s\n", path, strerror(errno));
+		ret = 1;
+	}
+	printf("%s: %u blocs déplacés, dernière version en %u morceau(x) au lieu de %u",
+	       path, d.moved, d.extents_after, d.extents_before);
+	if (d.skipped)
+		printf(", %u version(s) laissée(s) faute de place", d.skipped);
+	printf("\n");
+	close(fd);
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	struct ouichefs_defrag args = { 0 };
+	int opt, ret = 0;
+
+	while ((opt = getopt(argc, argv, "Hr:")) != -1) {
+		switch (opt) {
+		case 'H':
+			args.flags |= OUICHEFS_DEFRAG_HISTORY;
+			break;
+		case 'r':
+			args.max_rate = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			optind = argc;
+			break;
+		}
+	}
+	if (optind >= argc) {
+		printf("Usage: %s [-H] [-r blocs/s] fichier [fichier ...]\n",
+		       argv[0]);
+		return 1;
+	}
+
+	for (; optind < argc; optind++)
+		ret |= defrag(argv[optind], &args);
+	return ret;
+}
@@ -0,0 +1,85 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/ioctl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include "requettes.h"
+
+/*
+ * Consultation et réglage des quotas.
+ *
+ *   quota [-g] fichier id
+ *   quota [-g] fichier id limite_live limite_historique
+ *
+ * fichier est n'importe quel fichier de la partition, id un uid (un gid
+ * avec -g). Sans limites, affiche les blocs utilisés par id et ses limites.
+ * Avec limites (en blocs, 0 = pas de limite, d = limite donnée au montage),
+ * les change jusqu'au démontage, ce qui demande d'être root.
+ */
+
+static uint64_t parse_limit(const char *s)
+{
+	if (!strcmp(s, "d"))
+		return OUICHEFS_QUOTA_DEFAULT;
+	return strtoull(s, NULL, 10);
+}
+
+static void print_limit(uint64_t limit)
+{
+	if (limit)
+		printf("%10llu", (unsigned long long)limit);
+	else
+		printf("%10s", "-");
+}
+
+int main(int argc, char **argv)
+{
+	struct ouichefs_quota_info info = { 0 };
+	unsigned long cmd = OUICHEFS_IOC_GET_QUOTA;
+	int fd, i = 1;
+
+	if (argc > 1 && !strcmp(argv[1], "-g")) {
+		info.type = OUICHEFS_GRPQUOTA;
+		i++;
+	}
+	if (argc - i != 2 && argc - i != 4) {
+		printf("Usage: %s [-g] fichier id [limite_live limite_historique]\n",
+		       argv[0]);
+		printf("limites en blocs, 0 = pas de limite, d = limite du montage\n");
+		return 1;
+	}
+	info.id = strtoul(argv[i + 1], NULL, 10);
+	if (argc - i == 4) {
+		info.live_limit = parse_limit(argv[i + 2]);
+		info.history_limit = parse_limit(argv[i + 3]);
+		cmd = OUICHEFS_IOC_SET_QUOTA;
+	}
+
+	fd = open(argv[i], O_RDONLY);
+	if (fd < 0) {
+		perror(argv[i]);
+		return 1;
+	}
+	if (ioctl(fd, cmd, &info) < 0) {
+		perror(cmd == OUICHEFS_IOC_SET_QUOTA ? "OUICHEFS_IOC_SET_QUOTA" :
+		       "OUICHEFS_IOC_GET_QUOTA");
+		close(fd);
+		return 1;
+	}
+	close(fd);
+
+	printf("%s %u\n", info.type == OUICHEFS_GRPQUOTA ? "groupe" :
+	       "utilisateur", info.id);
+	printf("             blocs     limite\n");
+	printf("live    %10llu ", (unsigned long long)info.live_blocks);
+	print_limit(info.live_limit);
+	printf("\nhistoire %9llu ", (unsigned long long)info.history_blocks);
+	print_limit(info.history_limit);
+	printf("\n");
+	return 0;
+}
@@ -2,6 +2,7 @@
 #include <linux/kernel.h>
 #include <linux/fs.h>
 #include <linux/ioctl.h>
+#include <linux/types.h>
 
 
 /*---------------------------------------------------------------------------*/
@@ -11,4 +12,180 @@
 #define CHANGE_VERSION _IOWR(MAGIQUE, 0, char*)
 #define RESTOR_VERSION _IOWR(MAGIQUE, 1, char*)
 #define RLEASE_VERSION _IOWR(MAGIQUE, 2, char*)
-/*---------------------------------------------------------------------------*/
\ No newline at end of file
+/*---------------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------------*/
+/*
+ * Binary version management interface.
+ *
+ * Versions are numbered from the oldest (0) to the latest (nr_versions - 1),
+ * unless OUICHEFS_VOP_FROM_LATEST is set on an operation, in which case they
+ * are counted back from the latest one (0 is the latest) like the legacy
+ * requests above. These positions change when versions are created or
+ * dropped. Each version also has an id, which only grows from the oldest
+ * version to the latest one and is never reused in a file: with
+ * OUICHEFS_VOP_BY_ID, operations name versions by id.
+ */
+
+/* flags of struct ouichefs_version_info */
+#define OUICHEFS_VERSION_CURRENT	0x1	/* current view of the file */
+#define OUICHEFS_VERSION_LATEST		0x2	/* latest (writable) version */
+
+struct ouichefs_version_info {
+	__u32 version;		/* in: version number */
+	__u32 index_block;	/* out: index block of the version */
+	__u64 size;		/* out: size in bytes */
+	__s64 mtime;		/* out: modification time (seconds) */
+	__u32 nr_blocks;	/* out: number of data blocks */
+	__u32 flags;		/* out: OUICHEFS_VERSION_* */
+	__u32 id;		/* out: stable id of the version */
+	__u32 pad;
+};
+
+struct ouichefs_version_list {
+	__u32 nr_versions;	/* out: number of versions of the file */
+	__u32 nr_entries;	/* in: size of entries, out: entries filled */
+	__u64 entries;		/* in: struct ouichefs_version_info array */
+};
+
+/* operations of a batch */
+#define OUICHEFS_VOP_CHECKOUT	1	/* view version first (read-only) */
+#define OUICHEFS_VOP_RELEASE	2	/* go back to the latest version */
+#define OUICHEFS_VOP_RESTORE	3	/* drop every version newer than first */
+#define OUICHEFS_VOP_DELETE	4	/* drop versions first to last */
+
+/* flags of struct ouichefs_version_op */
+#define OUICHEFS_VOP_FROM_LATEST	0x1
+#define OUICHEFS_VOP_BY_ID		0x2	/* first and last are ids */
+
+struct ouichefs_version_op {
+	__u32 op;		/* OUICHEFS_VOP_* */
+	__u32 flags;		/* OUICHEFS_VOP_FROM_LATEST */
+	__u32 first;		/* first version of the range */
+	__u32 last;		/* last version of the range (DELETE only) */
+	__s32 result;		/* out: 0 or -errno */
+	__u32 pad;
+};
+
+/*
+ * The batch, like the legacy requests, changes the history: the file must
+ * be open for writing (EBADF otherwise).
+ */
+
+/* flags of struct ouichefs_version_batch */
+#define OUICHEFS_BATCH_STOP_ON_ERROR	0x1
+
+struct ouichefs_version_batch {
+	__u32 nr_ops;		/* in: number of ops, out: ops executed */
+	__u32 flags;		/* OUICHEFS_BATCH_* */
+	__u64 ops;		/* in: struct ouichefs_version_op array */
+};
+
+#define OUICHEFS_BATCH_MAX_OPS	1024
+
+#define OUICHEFS_IOC_LIST_VERSIONS \
+	_IOWR(MAGIQUE, 3, struct ouichefs_version_list)
+#define OUICHEFS_IOC_VERSION_INFO \
+	_IOWR(MAGIQUE, 4, struct ouichefs_version_info)
+#define OUICHEFS_IOC_VERSION_BATCH \
+	_IOWR(MAGIQUE, 5, struct ouichefs_version_batch)
+
+/*
+ * Defragmentation: the latest version of the file is moved to a single run
+ * of blocks, and with OUICHEFS_DEFRAG_HISTORY every older version too, at
+ * the end of the partition. max_rate limits the blocks moved per second so
+ * that it can run along the usual load.
+ */
+#define OUICHEFS_DEFRAG_HISTORY		0x1	/* pack the older versions */
+
+struct ouichefs_defrag {
+	__u32 flags;		/* in: OUICHEFS_DEFRAG_* */
+	__u32 max_rate;		/* in: blocks moved per second, 0: no limit */
+	__u32 moved;		/* out: blocks moved */
+	__u32 skipped;		/* out: versions left, no free run for them */
+	__u32 extents_before;	/* out: runs of the latest version before */
+	__u32 extents_after;	/* out: and after */
+};
+
+#define OUICHEFS_IOC_DEFRAG \
+	_IOWR(MAGIQUE, 6, struct ouichefs_defrag)
+
+/*
+ * Space used by a file: its latest version (index block included) and its
+ * history (older versions and version table), in blocks of block_size
+ * bytes. The totals of the partition are returned too.
+ */
+struct ouichefs_space_info {
+	__u64 head_blocks;	/* out: blocks of the latest version */
+	__u64 history_blocks;	/* out: blocks of the older versions */
+	__u64 fs_blocks;	/* out: blocks of the partition */
+	__u64 fs_free_blocks;	/* out: free blocks of the partition */
+	__u64 fs_history_blocks; /* out: history of every file */
+	__u32 block_size;	/* out: block size in bytes */
+	__u32 pad;
+};
+
+#define OUICHEFS_IOC_SPACE_INFO \
+	_IOR(MAGIQUE, 7, struct ouichefs_space_info)
+
+/*
+ * Disk quotas of an owner (uid or gid), in blocks: the latest versions of
+ * its files (live) and their older versions (history) have their own limit.
+ * A limit of 0 means no limit. Setting OUICHEFS_QUOTA_DEFAULT goes back to
+ * the limit given at mount. Quotas must be enabled at mount.
+ */
+#define OUICHEFS_USRQUOTA	0
+#define OUICHEFS_GRPQUOTA	1
+
+#define OUICHEFS_QUOTA_DEFAULT	(~0ULL)
+
+struct ouichefs_quota_info {
+	__u32 type;		/* in: OUICHEFS_USRQUOTA or OUICHEFS_GRPQUOTA */
+	__u32 id;		/* in: uid or gid */
+	__u64 live_blocks;	/* out: blocks of the latest versions */
+	__u64 history_blocks;	/* out: blocks of the older versions */
+	__u64 live_limit;	/* in (set), out: limit of live_blocks */
+	__u64 history_limit;	/* in (set), out: limit of history_blocks */
+};
+
+#define OUICHEFS_IOC_GET_QUOTA \
+	_IOWR(MAGIQUE, 8, struct ouichefs_quota_info)
+#define OUICHEFS_IOC_SET_QUOTA \
+	_IOWR(MAGIQUE, 9, struct ouichefs_quota_info)
+
+/*
+ * Tags: names given to versions of a file, e.g. "release-42", kept in a tag
+ * table sorted by name. A version may have several tags, a tag names one
+ * version and goes away with it. SET_TAG and CHECKOUT_TAG need the file
+ * open for writing; id OUICHEFS_TAG_VIEW tags the version currently viewed.
+ * CHECKOUT_TAG views (or restores) the version of a tag and returns its id.
+ */
+#define OUICHEFS_TAG_NAME_LEN	28	/* final NUL included */
+#define OUICHEFS_TAG_VIEW	(~0U)
+
+/* flags of struct ouichefs_version_tag */
+#define OUICHEFS_TAG_REPLACE	0x1	/* SET_TAG: move an existing tag */
+#define OUICHEFS_TAG_REMOVE	0x2	/* SET_TAG: remove the tag */
+#define OUICHEFS_TAG_RESTORE	0x4	/* CHECKOUT_TAG: restore, not view */
+
+struct ouichefs_version_tag {
+	char name[OUICHEFS_TAG_NAME_LEN];
+	__u32 id;		/* in (SET_TAG), out: id of the version */
+	__u32 flags;		/* in: OUICHEFS_TAG_* */
+};
+
+struct ouichefs_tag_list {
+	__u32 nr_tags;		/* out: number of tags of the file */
+	__u32 nr_entries;	/* in: size of entries, out: entries filled */
+	__u64 entries;		/* in: struct ouichefs_version_tag array */
+};
+
+#define OUICHEFS_IOC_SET_TAG \
+	_IOW(MAGIQUE, 10, struct ouichefs_version_tag)
+#define OUICHEFS_IOC_GET_TAG \
+	_IOWR(MAGIQUE, 11, struct ouichefs_version_tag)
+#define OUICHEFS_IOC_LIST_TAGS \
+	_IOWR(MAGIQUE, 12, struct ouichefs_tag_list)
+#define OUICHEFS_IOC_CHECKOUT_TAG \
+	_IOWR(MAGIQUE, 13, struct ouichefs_version_tag)
+/*---------------------------------------------------------------------------*/
@@ -0,0 +1,127 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+/*
+ * Stress test et benchmark des écritures concurrentes: pour 1, 2, 4, ...
+ * max_threads écrivains, chaque thread crée son propre fichier dans dir et y
+ * écrit nr_writes fois un bloc de 4 KiB (chaque écriture crée une version).
+ * Le débit total doit augmenter avec le nombre de threads puisque les
+ * écrivains ne partagent ni inode ni verrou d'allocation.
+ */
+
+#define BLOCK_SIZE 4096
+
+struct writer {
+	pthread_t thread;
+	char path[256];
+	int nr_writes;
+	int nr_blocks;
+	int err;
+};
+
+static void *writer_run(void *arg)
+{
+	struct writer *w = arg;
+	char buf[BLOCK_SIZE];
+	int fd, i;
+
+	fd = open(w->path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		perror(w->path);
+		w->err = 1;
+		return NULL;
+	}
+	for (i = 0; i < w->nr_writes; i++) {
+		off_t off = (off_t)(i % w->nr_blocks) * BLOCK_SIZE;
+
+		memset(buf, 'a' + i % 26, sizeof(buf));
+		if (pwrite(fd, buf, sizeof(buf), off) != sizeof(buf)) {
+			perror("pwrite");
+			w->err = 1;
+			break;
+		}
+	}
+	if (fsync(fd) < 0) {
+		perror("fsync");
+		w->err = 1;
+	}
+	close(fd);
+	return NULL;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int run(const char *dir, int nr_threads, int nr_writes, int nr_blocks)
+{
+	struct writer *writers;
+	double start, elapsed, mib;
+	int i, err = 0;
+
+	writers = calloc(nr_threads, sizeof(*writers));
+	if (!writers)
+		return 1;
+
+	start = now();
+	for (i = 0; i < nr_threads; i++) {
+		snprintf(writers[i].path, sizeof(writers[i].path),
+			 "%s/stress_%d_%d", dir, nr_threads, i);
+		writers[i].nr_writes = nr_writes;
+		writers[i].nr_blocks = nr_blocks;
+		pthread_create(&writers[i].thread, NULL, writer_run,
+			       &writers[i]);
+	}
+	for (i = 0; i < nr_threads; i++) {
+		pthread_join(writers[i].thread, NULL);
+		err |= writers[i].err;
+	}
+	elapsed = now() - start;
+
+	mib = (double)nr_threads * nr_writes * BLOCK_SIZE / (1 << 20);
+	printf("%3d threads | %8d écritures | %8.3f s | %8.2f MiB/s | %10.0f écritures/s\n",
+	       nr_threads, nr_threads * nr_writes, elapsed, mib / elapsed,
+	       nr_threads * nr_writes / elapsed);
+
+	for (i = 0; i < nr_threads; i++)
+		unlink(writers[i].path);
+	free(writers);
+	return err;
+}
+
+int main(int argc, char **argv)
+{
+	int max_threads = 8, nr_writes = 200, nr_blocks = 1, n;
+
+	if (argc < 2) {
+		printf("Usage: %s dossier [max_threads] [écritures par thread] [taille du fichier en blocs]\n",
+		       argv[0]);
+		return 1;
+	}
+	if (argc > 2)
+		max_threads = atoi(argv[2]);
+	if (argc > 3)
+		nr_writes = atoi(argv[3]);
+	if (argc > 4)
+		nr_blocks = atoi(argv[4]);
+	if (max_threads < 1 || nr_writes < 1 || nr_blocks < 1) {
+		printf("Paramètres invalides\n");
+		return 1;
+	}
+
+	for (n = 1; n <= max_threads; n *= 2)
+		if (run(argv[1], n, nr_writes, nr_blocks))
+			return 1;
+	return 0;
+}
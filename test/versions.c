@@ -0,0 +1,319 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <stdint.h>
+#include <sys/ioctl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include "requettes.h"
+
+/*
+ * Client de l'interface binaire de gestion des versions.
+ *
+ *   versions fichier list
+ *   versions fichier info num
+ *   versions fichier space
+ *   versions fichier [-l | -i] [-s] op [op ...]
+ *   versions fichier tags [nom]
+ *   versions fichier tag [-f] nom [id]
+ *   versions fichier untag nom
+ *   versions fichier checkout-tag nom
+ *   versions fichier restore-tag nom
+ *
+ * avec op parmi checkout:num, release, restore:num, delete:premier-dernier
+ * et keep:n (supprime tout sauf les n dernières versions). Toutes les
+ * opérations d'une même ligne de commande partent dans un seul ioctl.
+ * -l numérote les versions depuis la dernière (0 = dernière), -i les désigne
+ * par leur id, qui ne change jamais, -s arrête le lot à la première erreur.
+ *
+ * tag donne le nom à la version id (par défaut la version courante), -f
+ * déplace un nom déjà donné. checkout-tag et restore-tag affichent ou
+ * restaurent la version d'un nom.
+ */
+
+static void print_info(struct ouichefs_version_info *info)
+{
+	char date[32];
+	time_t t = info->mtime;
+
+	strftime(date, sizeof(date), "%F %T", localtime(&t));
+	printf("%5u | id %5u | bloc %8u | %10llu octets | %6u blocs | %s%s%s\n",
+	       info->version, info->id, info->index_block,
+	       (unsigned long long)info->size, info->nr_blocks, date,
+	       info->flags & OUICHEFS_VERSION_CURRENT ? " | courante" : "",
+	       info->flags & OUICHEFS_VERSION_LATEST ? " | dernière" : "");
+}
+
+static int do_list(int fd)
+{
+	struct ouichefs_version_list list = { 0 };
+	struct ouichefs_version_info *entries;
+	uint32_t i;
+
+	/* premier appel pour connaître le nombre de versions */
+	if (ioctl(fd, OUICHEFS_IOC_LIST_VERSIONS, &list) < 0) {
+		perror("OUICHEFS_IOC_LIST_VERSIONS");
+		return 1;
+	}
+	entries = calloc(list.nr_versions + 1, sizeof(*entries));
+	if (!entries)
+		return 1;
+	list.nr_entries = list.nr_versions;
+	list.entries = (uintptr_t)entries;
+	if (ioctl(fd, OUICHEFS_IOC_LIST_VERSIONS, &list) < 0) {
+		perror("OUICHEFS_IOC_LIST_VERSIONS");
+		free(entries);
+		return 1;
+	}
+	printf("%u versions\n", list.nr_versions);
+	for (i = 0; i < list.nr_entries; i++)
+		print_info(&entries[i]);
+	free(entries);
+	return 0;
+}
+
+static int do_info(int fd, const char *num)
+{
+	struct ouichefs_version_info info = { 0 };
+
+	info.version = strtoul(num, NULL, 10);
+	if (ioctl(fd, OUICHEFS_IOC_VERSION_INFO, &info) < 0) {
+		perror("OUICHEFS_IOC_VERSION_INFO");
+		return 1;
+	}
+	print_info(&info);
+	return 0;
+}
+
+/* blocs de la dernière version et de l'historique, et de la partition */
+static int do_space(int fd)
+{
+	struct ouichefs_space_info space = { 0 };
+
+	if (ioctl(fd, OUICHEFS_IOC_SPACE_INFO, &space) < 0) {
+		perror("OUICHEFS_IOC_SPACE_INFO");
+		return 1;
+	}
+	printf("fichier: %llu blocs dans la dernière version, %llu dans l'historique (blocs de %u octets)\n",
+	       (unsigned long long)space.head_blocks,
+	       (unsigned long long)space.history_blocks, space.block_size);
+	printf("partition: %llu blocs, %llu libres, %llu dans l'historique des fichiers\n",
+	       (unsigned long long)space.fs_blocks,
+	       (unsigned long long)space.fs_free_blocks,
+	       (unsigned long long)space.fs_history_blocks);
+	return 0;
+}
+
+/* liste des noms, ou la version d'un nom */
+static int do_tags(int fd, const char *name)
+{
+	struct ouichefs_tag_list list = { 0 };
+	struct ouichefs_version_tag tag = { 0 }, *entries;
+	uint32_t i;
+
+	if (name) {
+		strncpy(tag.name, name, sizeof(tag.name) - 1);
+		if (ioctl(fd, OUICHEFS_IOC_GET_TAG, &tag) < 0) {
+			perror("OUICHEFS_IOC_GET_TAG");
+			return 1;
+		}
+		printf("%s: id %u\n", tag.name, tag.id);
+		return 0;
+	}
+
+	if (ioctl(fd, OUICHEFS_IOC_LIST_TAGS, &list) < 0) {
+		perror("OUICHEFS_IOC_LIST_TAGS");
+		return 1;
+	}
+	entries = calloc(list.nr_tags + 1, sizeof(*entries));
+	if (!entries)
+		return 1;
+	list.nr_entries = list.nr_tags;
+	list.entries = (uintptr_t)entries;
+	if (ioctl(fd, OUICHEFS_IOC_LIST_TAGS, &list) < 0) {
+		perror("OUICHEFS_IOC_LIST_TAGS");
+		free(entries);
+		return 1;
+	}
+	printf("%u noms\n", list.nr_tags);
+	for (i = 0; i < list.nr_entries; i++)
+		printf("%-28s id %u\n", entries[i].name, entries[i].id);
+	free(entries);
+	return 0;
+}
+
+/* tag, untag, checkout-tag et restore-tag */
+static int do_tag(int fd, const char *cmd, int argc, char **argv)
+{
+	struct ouichefs_version_tag tag = { .id = OUICHEFS_TAG_VIEW };
+	unsigned long req = OUICHEFS_IOC_SET_TAG;
+	const char *what = "OUICHEFS_IOC_SET_TAG";
+
+	if (argc && !strcmp(argv[0], "-f")) {
+		tag.flags |= OUICHEFS_TAG_REPLACE;
+		argc--;
+		argv++;
+	}
+	if (!argc || strlen(argv[0]) >= sizeof(tag.name)) {
+		printf("Nom invalide (au plus %d caractères)\n",
+		       OUICHEFS_TAG_NAME_LEN - 1);
+		return 1;
+	}
+	strcpy(tag.name, argv[0]);
+	if (!strcmp(cmd, "tag") && argc > 1) {
+		tag.id = strtoul(argv[1], NULL, 10);
+	} else if (!strcmp(cmd, "untag")) {
+		tag.flags |= OUICHEFS_TAG_REMOVE;
+	} else if (strcmp(cmd, "tag")) {
+		req = OUICHEFS_IOC_CHECKOUT_TAG;
+		what = "OUICHEFS_IOC_CHECKOUT_TAG";
+		if (!strcmp(cmd, "restore-tag"))
+			tag.flags |= OUICHEFS_TAG_RESTORE;
+	}
+	if (ioctl(fd, req, &tag) < 0) {
+		perror(what);
+		return 1;
+	}
+	if (req == OUICHEFS_IOC_CHECKOUT_TAG)
+		printf("%s: id %u\n", tag.name, tag.id);
+	return 0;
+}
+
+static int is_op(const char *arg, size_t len, const char *name)
+{
+	return len == strlen(name) && !strncmp(arg, name, len);
+}
+
+static int parse_op(const char *arg, struct ouichefs_version_op *op)
+{
+	const char *val = strchr(arg, ':');
+	size_t len = val ? (size_t)(val - arg) : strlen(arg);
+
+	if (val)
+		val++;
+	if (is_op(arg, len, "release") && !val) {
+		op->op = OUICHEFS_VOP_RELEASE;
+		return 0;
+	}
+	if (!val)
+		return -1;
+	if (is_op(arg, len, "checkout")) {
+		op->op = OUICHEFS_VOP_CHECKOUT;
+		op->first = strtoul(val, NULL, 10);
+	} else if (is_op(arg, len, "restore")) {
+		op->op = OUICHEFS_VOP_RESTORE;
+		op->first = strtoul(val, NULL, 10);
+	} else if (is_op(arg, len, "delete")) {
+		op->op = OUICHEFS_VOP_DELETE;
+		if (sscanf(val, "%u-%u", &op->first, &op->last) != 2)
+			op->last = op->first;
+	} else if (is_op(arg, len, "keep")) {
+		/* depuis la dernière: supprime de n jusqu'à la plus ancienne */
+		op->op = OUICHEFS_VOP_DELETE;
+		op->flags |= OUICHEFS_VOP_FROM_LATEST;
+		op->first = strtoul(val, NULL, 10);
+		op->last = UINT32_MAX;
+		if (!op->first)
+			return -1;
+	} else {
+		return -1;
+	}
+	return 0;
+}
+
+static int do_batch(int fd, int argc, char **argv)
+{
+	struct ouichefs_version_batch batch = { 0 };
+	struct ouichefs_version_op *ops;
+	char **names;
+	uint32_t flags = 0;
+	int i, nr = 0, ret = 0;
+
+	ops = calloc(argc, sizeof(*ops));
+	names = calloc(argc, sizeof(*names));
+	if (!ops || !names) {
+		free(ops);
+		free(names);
+		return 1;
+	}
+	for (i = 0; i < argc; i++) {
+		if (!strcmp(argv[i], "-l")) {
+			flags |= OUICHEFS_VOP_FROM_LATEST;
+			continue;
+		}
+		if (!strcmp(argv[i], "-i")) {
+			flags |= OUICHEFS_VOP_BY_ID;
+			continue;
+		}
+		if (!strcmp(argv[i], "-s")) {
+			batch.flags |= OUICHEFS_BATCH_STOP_ON_ERROR;
+			continue;
+		}
+		if (parse_op(argv[i], &ops[nr])) {
+			printf("Opération invalide: %s\n", argv[i]);
+			free(ops);
+			free(names);
+			return 1;
+		}
+		names[nr++] = argv[i];
+	}
+	for (i = 0; i < nr; i++)
+		ops[i].flags |= flags;
+
+	batch.nr_ops = nr;
+	batch.ops = (uintptr_t)ops;
+	if (ioctl(fd, OUICHEFS_IOC_VERSION_BATCH, &batch) < 0) {
+		perror("OUICHEFS_IOC_VERSION_BATCH");
+		ret = 1;
+	}
+	for (i = 0; i < (int)batch.nr_ops; i++)
+		printf("%s: %s\n", names[i],
+		       ops[i].result ? strerror(-ops[i].result) : "ok");
+	free(ops);
+	free(names);
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	int fd, ret, readonly;
+
+	if (argc < 3) {
+		printf("Usage: %s fichier list | info num | space | [-l | -i] [-s] op [op ...]\n",
+		       argv[0]);
+		printf("       %s fichier tags [nom] | tag [-f] nom [id] | untag nom | checkout-tag nom | restore-tag nom\n",
+		       argv[0]);
+		printf("op: checkout:num release restore:num delete:premier-dernier keep:n\n");
+		return 1;
+	}
+	/* lister les versions ou les noms ne demande que le droit de lecture */
+	readonly = !strcmp(argv[2], "list") || !strcmp(argv[2], "info") ||
+		!strcmp(argv[2], "space") || !strcmp(argv[2], "tags");
+	fd = open(argv[1], readonly ? O_RDONLY : O_RDWR);
+	if (fd < 0) {
+		perror(argv[1]);
+		return 1;
+	}
+
+	if (!strcmp(argv[2], "list"))
+		ret = do_list(fd);
+	else if (!strcmp(argv[2], "info") && argc > 3)
+		ret = do_info(fd, argv[3]);
+	else if (!strcmp(argv[2], "space"))
+		ret = do_space(fd);
+	else if (!strcmp(argv[2], "tags"))
+		ret = do_tags(fd, argc > 3 ? argv[3] : NULL);
+	else if (!strcmp(argv[2], "tag") || !strcmp(argv[2], "untag") ||
+		 !strcmp(argv[2], "checkout-tag") ||
+		 !strcmp(argv[2], "restore-tag"))
+		ret = do_tag(fd, argv[2], argc - 3, argv + 3);
+	else
+		ret = do_batch(fd, argc - 2, argv + 2);
+
+	close(fd);
+	return ret;
+}
@@ -0,0 +1,1157 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * ouiche_fs - a simple educational filesystem for Linux
+ *
+ * Copyright (C) 2018 Redha Gouicem <redha.gouicem@lip6.fr>
+ */
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/buffer_head.h>
+#include <linux/crc32c.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/mount.h>
+#include <linux/string.h>
+#include <linux/uaccess.h>
+
+#include "ouichefs.h"
+#include "bitmap.h"
+#include "test/requettes.h"
+
+static uint32_t ouichefs_record_csum(struct ouichefs_version_record *rec)
+{
+	return crc32c(~0, rec, offsetof(struct ouichefs_version_record,
+					checksum));
+}
+
+/*
+ * Count the data blocks of the version whose index block is bno.
+ */
+static int ouichefs_count_blocks(struct super_block *sb, uint32_t bno,
+				 uint32_t flags, uint32_t *nr_blocks)
+{
+	struct ouichefs_file_index_block *index;
+	struct buffer_head *bh;
+	int i;
+
+	*nr_blocks = 0;
+	if (flags & OUICHEFS_VREC_INLINE)
+		return 0;
+	bh = ouichefs_bread(sb, bno);
+	if (!bh)
+		return -EIO;
+	index = (struct ouichefs_file_index_block *)bh->b_data;
+	for (i = 0; i < OUICHEFS_INDEX_NR_DATA(sb); i++)
+		if (index->blocks[i])
+			(*nr_blocks)++;
+	brelse(bh);
+
+	return 0;
+}
+
+/*
+ * Read the version table of inode into recs, which has room for the records
+ * of its nr older versions. The caller must hold index_lock.
+ */
+static int ouichefs_read_table(struct inode *inode,
+			       struct ouichefs_version_record *recs,
+			       uint32_t nr)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct ouichefs_version_table *table;
+	struct buffer_head *bh;
+	uint32_t bno = ci->version_table, left = nr, n, i;
+
+	/* The head holds the newest records, fill recs from its end */
+	while (bno) {
+		if (bno >= sbi->nr_blocks)
+			goto corrupted;
+		bh = ouichefs_bread(sb, bno);
+		if (!bh)
+			return -EIO;
+		table = (struct ouichefs_version_table *)bh->b_data;
+		n = table->nr_records;
+		if (!n || n > OUICHEFS_RECORDS_PER_TABLE(sb) || n > left) {
+			brelse(bh);
+			goto corrupted;
+		}
+		for (i = 0; i < n; i++) {
+			if (table->records[i].checksum !=
+			    ouichefs_record_csum(&table->records[i])) {
+				brelse(bh);
+				goto corrupted;
+			}
+		}
+		left -= n;
+		memcpy(&recs[left], table->records, n * sizeof(*recs));
+		bno = table->next;
+		brelse(bh);
+	}
+	if (left)
+		goto corrupted;
+	return 0;
+
+corrupted:
+	pr_err("inode %lu: corrupted version table\n", inode->i_ino);
+	return -EUCLEAN;
+}
+
+/*
+ * Build the record of the latest version of inode. The caller must hold
+ * index_lock.
+ */
+static int ouichefs_latest_record(struct inode *inode,
+				  struct ouichefs_version_record *rec)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+
+	rec->index_block = ci->last_index_block;
+	rec->number = ci->last_number;
+	rec->parent = OUICHEFS_NO_VERSION;
+	rec->size = ci->last_size;
+	rec->mtime = ci->last_mtime;
+	rec->flags = ci->last_flags;
+	return ouichefs_count_blocks(inode->i_sb, rec->index_block, rec->flags,
+				     &rec->nr_blocks);
+}
+
+/*
+ * Load the version cache of inode if it is not loaded yet. The caller must
+ * hold index_lock. The cache is then kept up to date by the write path and
+ * dropped by operations rewriting the history.
+ */
+int ouichefs_load_versions(struct inode *inode)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct ouichefs_version_record *recs;
+	uint32_t nr = ci->nb_versions;
+	int ret;
+
+	if (ci->versions)
+		return 0;
+
+	/* Leave room for the next versions */
+	recs = kvmalloc_array(nr + 8, sizeof(*recs), GFP_KERNEL);
+	if (!recs)
+		return -ENOMEM;
+	if (nr) {
+		ret = ouichefs_read_table(inode, recs, nr - 1);
+		if (!ret)
+			ret = ouichefs_latest_record(inode, &recs[nr - 1]);
+		if (ret) {
+			kvfree(recs);
+			return ret;
+		}
+		if (nr > 1)
+			recs[nr - 1].parent = recs[nr - 2].number;
+	}
+	ci->versions = recs;
+	ci->nr_cached = nr;
+	ci->cache_size = nr + 8;
+	return 0;
+}
+
+/*
+ * Find the flags of the version viewed by inode when it is not the latest
+ * one, typically when the inode is read from disk. If the view is not in the
+ * history anymore, go back to the latest version.
+ */
+int ouichefs_load_view(struct inode *inode)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	uint32_t i;
+	int ret;
+
+	mutex_lock(&ci->index_lock);
+	ci->can_write = ci->index_block == ci->last_index_block;
+	if (ci->can_write)
+		goto unlock;
+	ret = ouichefs_load_versions(inode);
+	if (ret) {
+		mutex_unlock(&ci->index_lock);
+		return ret;
+	}
+	for (i = 0; i < ci->nr_cached; i++) {
+		if (ci->versions[i].index_block != ci->index_block)
+			continue;
+		if (!ouichefs_get_view(inode, ci->versions[i].number)) {
+			mutex_unlock(&ci->index_lock);
+			return -ENOMEM;
+		}
+		ci->view_flags = ci->versions[i].flags;
+		ci->view_number = ci->versions[i].number;
+		goto unlock;
+	}
+	pr_warn("inode %lu: viewed version %u not found, back to the latest\n",
+		inode->i_ino, ci->index_block);
+	ci->index_block = ci->last_index_block;
+	ci->can_write = 1;
+	ouichefs_map_changed(ci);
+	i_size_write(inode, ci->last_size);
+unlock:
+	mutex_unlock(&ci->index_lock);
+	return 0;
+}
+
+/*
+ * Get the number of blocks owned by the older versions of inode and its
+ * version table, read from the head of the table the first time. The counts
+ * are kept by every operation changing the history, and their sum over the
+ * partition in sbi->nr_history_blocks. The caller must hold index_lock.
+ */
+int ouichefs_history_blocks(struct inode *inode, uint32_t *nr)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct buffer_head *bh;
+
+	if (ci->history_blocks == OUICHEFS_HISTORY_UNKNOWN) {
+		bh = ouichefs_bread(inode->i_sb, ci->version_table);
+		if (!bh)
+			return -EIO;
+		ci->history_blocks = ((struct ouichefs_version_table *)
+				      bh->b_data)->history_blocks;
+		brelse(bh);
+	}
+	*nr = ci->history_blocks;
+	return 0;
+}
+
+/*
+ * Record that the history of inode now has nr blocks, in its head table
+ * block, in the partition counter and in the quotas of its owners. old is
+ * the previous count.
+ */
+static void ouichefs_set_history(struct inode *inode,
+				 struct ouichefs_version_table *head,
+				 uint32_t old, uint32_t nr)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(inode->i_sb);
+
+	if (head)
+		head->history_blocks = nr;
+	OUICHEFS_INODE(inode)->history_blocks = nr;
+	percpu_counter_add(&sbi->nr_history_blocks, (s64)nr - old);
+	ouichefs_quota_charge(inode, 0, (s64)nr - old);
+}
+
+/*
+ * Add rec, the record of the version preceding the latest one, to the version
+ * table of inode. The caller must hold index_lock.
+ */
+int ouichefs_append_version(struct inode *inode,
+			    struct ouichefs_version_record *rec)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct ouichefs_version_table *table = NULL;
+	struct buffer_head *bh = NULL;
+	uint32_t bno, old = 0, nr;
+
+	rec->parent = OUICHEFS_NO_VERSION;
+	if (ci->version_table) {
+		bh = ouichefs_bread(sb, ci->version_table);
+		if (!bh)
+			return -EIO;
+		table = (struct ouichefs_version_table *)bh->b_data;
+		old = table->history_blocks;
+		if (table->nr_records)
+			rec->parent =
+				table->records[table->nr_records - 1].number;
+		if (table->nr_records >= OUICHEFS_RECORDS_PER_TABLE(sb)) {
+			brelse(bh);
+			bh = NULL;
+		}
+	}
+
+	/* Start a new head block when there is no room left */
+	if (!bh) {
+		bno = get_free_block(sbi, ouichefs_ino_group(sbi,
+							     inode->i_ino));
+		if (!bno)
+			return -ENOSPC;
+		bh = ouichefs_get_zeroed_block(sb, inode, bno);
+		if (!bh) {
+			put_block(sbi, bno);
+			return -EIO;
+		}
+		table = (struct ouichefs_version_table *)bh->b_data;
+		table->next = ci->version_table;
+		ci->version_table = bno;
+		nr = old + 1;
+	} else {
+		nr = old;
+	}
+
+	rec->checksum = ouichefs_record_csum(rec);
+	table->records[table->nr_records++] = *rec;
+	/* Its index block and data blocks leave the latest version */
+	ouichefs_set_history(inode, table, old, nr + 1 + rec->nr_blocks);
+	ouichefs_mark_dirty(sb, bh, inode);
+	brelse(bh);
+	return 0;
+}
+
+/*
+ * Write the records of the nr older versions of inode to its version table,
+ * reusing its blocks, and count the blocks of the history again. The blocks
+ * missing are allocated before anything is written and those left over are
+ * only freed once the table is written, so that a failure leaves the table
+ * as it was. The caller must hold index_lock.
+ */
+static int ouichefs_write_table(struct inode *inode,
+				struct ouichefs_version_record *recs,
+				uint32_t nr)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	uint32_t per_block = OUICHEFS_RECORDS_PER_TABLE(sb);
+	uint32_t nr_tables = DIV_ROUND_UP(nr, per_block);
+	struct ouichefs_version_table *table;
+	struct buffer_head *bh;
+	uint32_t *blocks, bno, next, first, n, i, j, old = 0, history;
+	uint32_t kept, surplus = 0;
+	int ret = 0;
+
+	history = nr_tables;
+	for (i = 0; i < nr; i++)
+		history += 1 + recs[i].nr_blocks;
+
+	blocks = kcalloc(nr_tables, sizeof(*blocks), GFP_NOFS);
+	if (!blocks)
+		return -ENOMEM;
+
+	/* Keep the newest blocks of the table, the others are freed last */
+	bno = ci->version_table;
+	for (i = 0; bno && bno < sbi->nr_blocks && i < sbi->nr_blocks; i++) {
+		bh = ouichefs_bread(sb, bno);
+		if (!bh) {
+			ret = -EIO;
+			goto out;
+		}
+		table = (struct ouichefs_version_table *)bh->b_data;
+		next = table->next;
+		if (!i)
+			old = table->history_blocks;
+		if (i < nr_tables)
+			blocks[i] = bno;
+		else if (i == nr_tables)
+			surplus = bno;
+		brelse(bh);
+		bno = next;
+	}
+	kept = min(i, nr_tables);
+	for (i = kept; i < nr_tables; i++) {
+		blocks[i] = get_free_block(sbi,
+					   ouichefs_ino_group(sbi, inode->i_ino));
+		if (!blocks[i]) {
+			while (i-- > kept)
+				put_block(sbi, blocks[i]);
+			ret = -ENOSPC;
+			goto out;
+		}
+	}
+
+	/* Fill them from the oldest records, the head gets the remainder */
+	next = 0;
+	for (i = nr_tables; i-- > 0;) {
+		first = (nr_tables - 1 - i) * per_block;
+		n = min(nr - first, per_block);
+		bh = ouichefs_get_zeroed_block(sb, inode, blocks[i]);
+		if (!bh) {
+			ret = -EIO;
+			goto out;
+		}
+		table = (struct ouichefs_version_table *)bh->b_data;
+		table->next = next;
+		table->nr_records = n;
+		for (j = 0; j < n; j++) {
+			table->records[j] = recs[first + j];
+			table->records[j].checksum =
+				ouichefs_record_csum(&table->records[j]);
+		}
+		if (!i)
+			ouichefs_set_history(inode, table, old, history);
+		brelse(bh);
+		next = blocks[i];
+	}
+	ci->version_table = next;
+	if (!nr_tables)
+		ouichefs_set_history(inode, NULL, old, 0);
+
+	for (bno = surplus, j = 0; bno && bno < sbi->nr_blocks &&
+	     j < sbi->nr_blocks; bno = next, j++) {
+		bh = ouichefs_bread(sb, bno);
+		if (!bh)
+			break;
+		next = ((struct ouichefs_version_table *)bh->b_data)->next;
+		bforget(bh);
+		ouichefs_release_block(sb, bno);
+	}
+out:
+	kfree(blocks);
+	return ret;
+}
+
+/*
+ * Record in the version cache that index_block is the new latest version, a
+ * copy of the previous one. The caller must hold index_lock. The cache is
+ * only an optimization: if it cannot grow, it is dropped and will be loaded
+ * again from disk.
+ */
+void ouichefs_cache_new_version(struct ouichefs_inode_info *ci,
+				uint32_t index_block)
+{
+	struct ouichefs_version_record *recs, *latest;
+
+	if (!ci->versions || !ci->nr_cached)
+		return;
+
+	if (ci->nr_cached == ci->cache_size) {
+		recs = kvmalloc_array(ci->cache_size * 2, sizeof(*recs),
+				      GFP_KERNEL);
+		if (!recs) {
+			ouichefs_drop_versions(ci);
+			return;
+		}
+		memcpy(recs, ci->versions, ci->nr_cached * sizeof(*recs));
+		kvfree(ci->versions);
+		ci->versions = recs;
+		ci->cache_size *= 2;
+	}
+
+	latest = &ci->versions[ci->nr_cached];
+	*latest = ci->versions[ci->nr_cached - 1];
+	latest->index_block = index_block;
+	latest->parent = latest->number;
+	latest->number = ci->last_number;
+	ci->nr_cached++;
+}
+
+/*
+ * Drop the version cache. The caller must hold index_lock, or be the last
+ * user of the inode.
+ */
+void ouichefs_drop_versions(struct ouichefs_inode_info *ci)
+{
+	kvfree(ci->versions);
+	ci->versions = NULL;
+	ci->nr_cached = 0;
+	ci->cache_size = 0;
+}
+
+/*
+ * Free the data blocks and the index block of a version. Freed blocks are
+ * not scrubbed, see ouichefs_release_block(). An inline version only owns
+ * its index block.
+ */
+void ouichefs_free_version(struct super_block *sb, uint32_t index_block,
+			   uint32_t flags)
+{
+	struct ouichefs_file_index_block *index;
+	struct buffer_head *bh_index;
+	int i;
+
+	bh_index = ouichefs_bread(sb, index_block);
+	if (!bh_index) {
+		pr_err("failed reading version %u, its blocks are lost\n",
+		       index_block);
+		ouichefs_release_block(sb, index_block);
+		return;
+	}
+	index = (struct ouichefs_file_index_block *)bh_index->b_data;
+
+	for (i = 0; i < OUICHEFS_INDEX_NR_DATA(sb) &&
+	     !(flags & OUICHEFS_VREC_INLINE); i++)
+		if (index->blocks[i])
+			ouichefs_release_block(sb, index->blocks[i]);
+	/* The index block may be dirty, it must not be written anymore */
+	bforget(bh_index);
+	ouichefs_release_block(sb, index_block);
+}
+
+/*
+ * Free every version of a file that is being deleted, its version table and
+ * its tag table.
+ */
+void ouichefs_free_history(struct inode *inode)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct ouichefs_version_table *table;
+	struct buffer_head *bh;
+	uint32_t bno, next, i, n = 0, old = 0;
+
+	mutex_lock(&ci->index_lock);
+	if (ci->last_index_block)
+		ouichefs_free_version(sb, ci->last_index_block,
+				      ci->last_flags);
+	bno = ci->version_table;
+	while (bno && bno < sbi->nr_blocks && n++ < sbi->nr_blocks) {
+		bh = ouichefs_bread(sb, bno);
+		if (!bh) {
+			pr_err("inode %lu: failed reading version table %u, older versions are lost\n",
+			       inode->i_ino, bno);
+			break;
+		}
+		table = (struct ouichefs_version_table *)bh->b_data;
+		if (n == 1)
+			old = table->history_blocks;
+		for (i = 0; i < table->nr_records &&
+		     i < OUICHEFS_RECORDS_PER_TABLE(sb); i++)
+			ouichefs_free_version(sb, table->records[i].index_block,
+					      table->records[i].flags);
+		next = table->next;
+		bforget(bh);
+		ouichefs_release_block(sb, bno);
+		bno = next;
+	}
+	if (ci->tag_block)
+		ouichefs_release_block(sb, ci->tag_block);
+	ci->index_block = 0;
+	ci->last_index_block = 0;
+	ci->version_table = 0;
+	ci->nb_versions = 0;
+	ci->last_number = 0;
+	ci->next_number = 0;
+	ci->tag_block = 0;
+	ci->last_size = 0;
+	ci->last_flags = 0;
+	ci->view_flags = 0;
+	ouichefs_set_history(inode, NULL, old, 0);
+	ouichefs_drop_versions(ci);
+	mutex_unlock(&ci->index_lock);
+}
+
+/*
+ * Fill info from the cached record of a version.
+ */
+static void ouichefs_fill_info(struct ouichefs_inode_info *ci,
+			       struct ouichefs_version_record *rec,
+			       bool latest,
+			       struct ouichefs_version_info *info)
+{
+	info->id = rec->number;
+	info->index_block = rec->index_block;
+	info->size = rec->size;
+	info->mtime = rec->mtime;
+	info->nr_blocks = rec->nr_blocks;
+	info->flags = 0;
+	if (latest)
+		info->flags |= OUICHEFS_VERSION_LATEST;
+	if (rec->index_block == ci->index_block)
+		info->flags |= OUICHEFS_VERSION_CURRENT;
+}
+
+/*
+ * Make version v the current view of the file. Only the latest version can
+ * be written. An older version is read through a page cache of its own, see
+ * view.c.
+ */
+static int ouichefs_checkout(struct inode *inode,
+			     struct ouichefs_version_record *recs,
+			     uint32_t nr, uint32_t v)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+
+	if (v >= nr)
+		return -EINVAL;
+	if (v < nr - 1 && !ouichefs_get_view(inode, recs[v].number))
+		return -ENOMEM;
+
+	pr_debug("inode %lu: view %u -> %u\n",
+		 inode->i_ino, ci->index_block, recs[v].index_block);
+	ci->index_block = recs[v].index_block;
+	ci->view_flags = recs[v].flags;
+	ci->view_number = recs[v].number;
+	ouichefs_map_changed(ci);
+	ci->can_write = (v == nr - 1);
+	i_size_write(inode, recs[v].size);
+
+	return 0;
+}
+
+/*
+ * Drop every version newer than v, which becomes the latest version and the
+ * current view. The records dropped are added to the nr_dead ones of dead,
+ * their blocks are only freed once the history is committed.
+ */
+static int ouichefs_restore(struct inode *inode,
+			    struct ouichefs_version_record *recs,
+			    uint32_t *nr, uint32_t v,
+			    struct ouichefs_version_record *dead,
+			    uint32_t *nr_dead)
+{
+	uint32_t i;
+
+	if (v >= *nr)
+		return -EINVAL;
+
+	for (i = *nr - 1; i > v; i--)
+		dead[(*nr_dead)++] = recs[i];
+	*nr = v + 1;
+
+	return ouichefs_checkout(inode, recs, *nr, v);
+}
+
+/*
+ * Drop versions first to last, added to dead like ouichefs_restore() does.
+ * The latest version cannot be deleted this way, use ouichefs_restore()
+ * instead. If the current view is deleted, the latest version becomes the
+ * current view.
+ */
+static int ouichefs_delete(struct inode *inode,
+			   struct ouichefs_version_record *recs,
+			   uint32_t *nr, uint32_t first, uint32_t last,
+			   struct ouichefs_version_record *dead,
+			   uint32_t *nr_dead)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	bool view_deleted = false;
+	uint32_t i;
+
+	if (first > last || last + 1 >= *nr)
+		return -EINVAL;
+
+	/* Link the version following the range to the one preceding it */
+	recs[last + 1].parent = first ? recs[first - 1].number :
+		OUICHEFS_NO_VERSION;
+
+	for (i = first; i <= last; i++) {
+		if (recs[i].index_block == ci->index_block)
+			view_deleted = true;
+		dead[(*nr_dead)++] = recs[i];
+	}
+	memmove(&recs[first], &recs[last + 1],
+		(*nr - last - 1) * sizeof(*recs));
+	*nr -= last - first + 1;
+
+	if (view_deleted)
+		return ouichefs_checkout(inode, recs, *nr, *nr - 1);
+	return 0;
+}
+
+/*
+ * Make the nr versions of recs the history of inode: the last one becomes
+ * the latest version and the others are written to the version table. The
+ * inode is left as it was if the table cannot be written. The caller must
+ * hold index_lock.
+ */
+int ouichefs_commit_versions(struct inode *inode,
+			     struct ouichefs_version_record *recs,
+			     uint32_t nr)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct ouichefs_version_record *latest = &recs[nr - 1];
+	int ret;
+
+	ret = ouichefs_write_table(inode, recs, nr - 1);
+	if (ret)
+		return ret;
+	if (latest->index_block != ci->last_index_block) {
+		ci->last_index_block = latest->index_block;
+		ci->last_number = latest->number;
+		ci->last_size = latest->size;
+		ci->last_flags = latest->flags;
+		ci->last_mtime = latest->mtime;
+		inode->i_mtime.tv_sec = latest->mtime;
+		inode->i_mtime.tv_nsec = 0;
+		ouichefs_set_blocks(inode, latest->nr_blocks + 1);
+	}
+	ci->nb_versions = nr;
+	return 0;
+}
+
+/*
+ * Find version number among the nr versions of recs. Numbers only grow from
+ * the oldest version to the latest one, so it is a binary search. Return its
+ * position, or nr if it is not in the history.
+ */
+uint32_t ouichefs_version_index(struct ouichefs_version_record *recs,
+				uint32_t nr, uint32_t number)
+{
+	uint32_t lo = 0, hi = nr, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (recs[mid].number == number)
+			return mid;
+		if (recs[mid].number < number)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return nr;
+}
+
+/*
+ * Run a batch of version operations on inode. The inode lock must be held.
+ * Direct I/O still in flight is waited for first, its completion updates the
+ * latest version. Every operation sees the numbering left by the previous
+ * ones. Metadata is committed once, after the last operation.
+ * Return 0 if all operations succeeded, the error of the first failed one
+ * otherwise.
+ */
+static int ouichefs_run_version_ops(struct inode *inode,
+				    struct ouichefs_version_op *ops,
+				    uint32_t *nr_ops, uint32_t flags)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct ouichefs_version_record *recs, *dead;
+	struct ouichefs_version_op *op;
+	uint32_t nr, first, last, i, last_number, nr_dead = 0;
+	uint32_t view, view_flags, view_number;
+	int can_write;
+	loff_t size;
+	LIST_HEAD(dead_views);
+	int ret, err = 0;
+
+	inode_dio_wait(inode);
+	view = ci->index_block;
+	view_flags = ci->view_flags;
+	view_number = ci->view_number;
+	can_write = ci->can_write;
+	size = i_size_read(inode);
+
+	/*
+	 * The dirty pages of the latest version are written to its blocks
+	 * before the view leaves it or it is dropped: writeback maps the
+	 * blocks of the current view.
+	 */
+	for (i = 0; i < *nr_ops; i++) {
+		if (ops[i].op == OUICHEFS_VOP_CHECKOUT ||
+		    ops[i].op == OUICHEFS_VOP_RESTORE) {
+			ret = filemap_write_and_wait(inode->i_mapping);
+			if (ret)
+				return ret;
+			break;
+		}
+	}
+
+	mutex_lock(&ci->index_lock);
+	last_number = ci->last_number;
+	ret = ouichefs_load_versions(inode);
+	if (!ret && !ci->nr_cached)
+		ret = -EINVAL;
+	if (ret) {
+		mutex_unlock(&ci->index_lock);
+		return ret;
+	}
+	/* The operations edit the cache, it is dropped once committed */
+	recs = ci->versions;
+	nr = ci->nr_cached;
+	/* The versions dropped, each at most once */
+	dead = kvmalloc_array(nr, sizeof(*dead), GFP_KERNEL);
+	if (!dead) {
+		mutex_unlock(&ci->index_lock);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < *nr_ops; i++) {
+		op = &ops[i];
+		first = op->first;
+		last = op->op == OUICHEFS_VOP_DELETE ? op->last : op->first;
+
+		if (op->flags & OUICHEFS_VOP_BY_ID) {
+			/* Unknown ids give nr, never a valid version */
+			first = ouichefs_version_index(recs, nr, first);
+			last = ouichefs_version_index(recs, nr, last);
+		} else {
+			/* Deletion ranges past the oldest version are clamped */
+			if (op->op == OUICHEFS_VOP_DELETE && last >= nr)
+				last = nr - 1;
+			if (op->flags & OUICHEFS_VOP_FROM_LATEST) {
+				/* nr is never a valid version, for errors */
+				first = first < nr ? nr - 1 - first : nr;
+				last = last < nr ? nr - 1 - last : nr;
+				if (op->op == OUICHEFS_VOP_DELETE)
+					swap(first, last);
+			}
+		}
+
+		switch (op->op) {
+		case OUICHEFS_VOP_CHECKOUT:
+			op->result = ouichefs_checkout(inode, recs, nr, first);
+			break;
+		case OUICHEFS_VOP_RELEASE:
+			op->result = ouichefs_checkout(inode, recs, nr, nr - 1);
+			break;
+		case OUICHEFS_VOP_RESTORE:
+			op->result = ouichefs_restore(inode, recs, &nr, first,
+						      dead, &nr_dead);
+			break;
+		case OUICHEFS_VOP_DELETE:
+			op->result = ouichefs_delete(inode, recs, &nr, first,
+						     last, dead, &nr_dead);
+			break;
+		default:
+			op->result = -EINVAL;
+		}
+
+		if (op->result && !err)
+			err = op->result;
+		if (op->result && (flags & OUICHEFS_BATCH_STOP_ON_ERROR)) {
+			i++;
+			break;
+		}
+	}
+	*nr_ops = i;
+
+	ret = ouichefs_commit_versions(inode, recs, nr);
+	if (ret) {
+		/* The history on disk is unchanged, so is the view */
+		ci->index_block = view;
+		ci->view_flags = view_flags;
+		ci->view_number = view_number;
+		ci->can_write = can_write;
+		ouichefs_map_changed(ci);
+		i_size_write(inode, size);
+		ouichefs_drop_versions(ci);
+		mutex_unlock(&ci->index_lock);
+		kvfree(dead);
+		return ret;
+	}
+	/* No record points to them anymore */
+	for (i = 0; i < nr_dead; i++)
+		ouichefs_free_version(inode->i_sb, dead[i].index_block,
+				      dead[i].flags);
+	kvfree(dead);
+	/* The attributes of the versions gone go with them */
+	ret = ouichefs_xattr_prune(inode, recs, nr);
+	if (!ret)
+		ret = ouichefs_prune_tags(inode, recs, nr);
+	ouichefs_prune_views(inode, recs, nr - 1, &dead_views);
+	ouichefs_drop_versions(ci);
+	mutex_unlock(&ci->index_lock);
+
+	/* The pages cached for versions gone or restored are stale */
+	ouichefs_free_views(&dead_views);
+	if (ci->last_number != last_number)
+		truncate_inode_pages(inode->i_mapping, 0);
+
+	/* Single metadata commit for the whole batch */
+	inode->i_ctime = current_time(inode);
+	mark_inode_dirty(inode);
+	if (!ret)
+		ret = sync_mapping_buffers(inode->i_mapping);
+	if (!ret)
+		ret = write_inode_now(inode, 1);
+
+	return err ? err : ret;
+}
+
+/*
+ * Drop the nr oldest versions of inode. The inode lock must be held.
+ */
+int ouichefs_trim_versions(struct inode *inode, uint32_t nr)
+{
+	struct ouichefs_version_op op = {
+		.op = OUICHEFS_VOP_DELETE,
+		.first = 0,
+		.last = nr - 1,
+	};
+	uint32_t nr_ops = 1;
+
+	if (!nr)
+		return 0;
+	return ouichefs_run_version_ops(inode, &op, &nr_ops, 0);
+}
+
+/*
+ * Run a batch of version operations for an ioctl on file. They change the
+ * history and the inode, so the file must be open for writing and the
+ * partition writable.
+ */
+static int ouichefs_run_file_ops(struct file *file,
+				 struct ouichefs_version_op *ops,
+				 uint32_t *nr_ops, uint32_t flags)
+{
+	struct inode *inode = file_inode(file);
+	int ret;
+
+	if (!(file->f_mode & FMODE_WRITE)) {
+		*nr_ops = 0;
+		return -EBADF;
+	}
+	ret = mnt_want_write_file(file);
+	if (ret) {
+		*nr_ops = 0;
+		return ret;
+	}
+	inode_lock(inode);
+	ret = ouichefs_run_version_ops(inode, ops, nr_ops, flags);
+	inode_unlock(inode);
+	mnt_drop_write_file(file);
+	return ret;
+}
+
+static long ouichefs_ioctl_batch(struct file *file,
+				 struct ouichefs_version_batch __user *ubatch)
+{
+	struct ouichefs_version_batch batch;
+	struct ouichefs_version_op *ops;
+	long ret;
+
+	if (copy_from_user(&batch, ubatch, sizeof(batch)))
+		return -EFAULT;
+	if (!batch.nr_ops)
+		return 0;
+	if (batch.nr_ops > OUICHEFS_BATCH_MAX_OPS)
+		return -E2BIG;
+
+	ops = memdup_user(u64_to_user_ptr(batch.ops),
+			  batch.nr_ops * sizeof(*ops));
+	if (IS_ERR(ops))
+		return PTR_ERR(ops);
+
+	ret = ouichefs_run_file_ops(file, ops, &batch.nr_ops, batch.flags);
+
+	if (copy_to_user(u64_to_user_ptr(batch.ops), ops,
+			 batch.nr_ops * sizeof(*ops)) ||
+	    copy_to_user(ubatch, &batch, sizeof(batch)))
+		ret = -EFAULT;
+	kfree(ops);
+
+	return ret;
+}
+
+/*
+ * List the versions of a file from its version cache, so that listing the
+ * history of many files does not read their version tables again.
+ */
+static long ouichefs_ioctl_list(struct inode *inode,
+				struct ouichefs_version_list __user *ulist)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct ouichefs_version_list list;
+	struct ouichefs_version_info *infos = NULL;
+	uint32_t i;
+	long ret;
+
+	if (copy_from_user(&list, ulist, sizeof(list)))
+		return -EFAULT;
+
+	mutex_lock(&ci->index_lock);
+	ret = ouichefs_load_versions(inode);
+	if (ret)
+		goto unlock;
+
+	list.nr_versions = ci->nr_cached;
+	list.nr_entries = min(list.nr_entries, ci->nr_cached);
+	if (list.nr_entries) {
+		infos = kvcalloc(list.nr_entries, sizeof(*infos), GFP_KERNEL);
+		if (!infos) {
+			ret = -ENOMEM;
+			goto unlock;
+		}
+	}
+	for (i = 0; i < list.nr_entries; i++) {
+		infos[i].version = i;
+		ouichefs_fill_info(ci, &ci->versions[i],
+				   i == ci->nr_cached - 1, &infos[i]);
+	}
+	mutex_unlock(&ci->index_lock);
+
+	/* Copy out without index_lock, the buffer may be mapped from a file */
+	if (list.nr_entries &&
+	    copy_to_user(u64_to_user_ptr(list.entries), infos,
+			 list.nr_entries * sizeof(*infos)))
+		ret = -EFAULT;
+	else if (copy_to_user(ulist, &list, sizeof(list)))
+		ret = -EFAULT;
+	kvfree(infos);
+	return ret;
+
+unlock:
+	mutex_unlock(&ci->index_lock);
+	return ret;
+}
+
+static long ouichefs_ioctl_info(struct inode *inode,
+				struct ouichefs_version_info __user *uinfo)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct ouichefs_version_info info;
+	long ret;
+
+	if (copy_from_user(&info, uinfo, sizeof(info)))
+		return -EFAULT;
+
+	mutex_lock(&ci->index_lock);
+	ret = ouichefs_load_versions(inode);
+	if (!ret && info.version >= ci->nr_cached)
+		ret = -EINVAL;
+	if (!ret)
+		ouichefs_fill_info(ci, &ci->versions[info.version],
+				   info.version == ci->nr_cached - 1, &info);
+	mutex_unlock(&ci->index_lock);
+
+	if (!ret && copy_to_user(uinfo, &info, sizeof(info)))
+		ret = -EFAULT;
+	return ret;
+}
+
+/*
+ * Report the blocks used by the latest version of a file and by its history,
+ * and the totals of the partition. Nothing is walked, see
+ * ouichefs_history_blocks().
+ */
+static long ouichefs_ioctl_space(struct inode *inode,
+				 struct ouichefs_space_info __user *uspace)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct ouichefs_space_info space = { 0 };
+	uint32_t history;
+	long ret;
+
+	mutex_lock(&ci->index_lock);
+	ret = ouichefs_history_blocks(inode, &history);
+	space.head_blocks = inode->i_blocks;
+	mutex_unlock(&ci->index_lock);
+	if (ret)
+		return ret;
+
+	space.history_blocks = history;
+	space.block_size = OUICHEFS_BSIZE(sb);
+	space.fs_blocks = sbi->nr_blocks;
+	space.fs_free_blocks =
+		percpu_counter_sum_positive(&sbi->nr_free_blocks);
+	space.fs_history_blocks =
+		percpu_counter_sum_positive(&sbi->nr_history_blocks);
+
+	if (copy_to_user(uspace, &space, sizeof(space)))
+		return -EFAULT;
+	return 0;
+}
+
+/*
+ * View or restore (OUICHEFS_TAG_RESTORE) the version tagged utag->name: one
+ * lookup in the tag table, one in the version cache. Like the batch, it
+ * needs the file open for writing.
+ */
+static long ouichefs_ioctl_checkout_tag(struct file *file,
+					struct ouichefs_version_tag __user *utag)
+{
+	struct inode *inode = file_inode(file);
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct ouichefs_version_tag tag;
+	struct ouichefs_version_op op = {
+		.op = OUICHEFS_VOP_CHECKOUT,
+		.flags = OUICHEFS_VOP_BY_ID,
+	};
+	uint32_t nr_ops = 1;
+	long ret;
+
+	if (copy_from_user(&tag, utag, sizeof(tag)))
+		return -EFAULT;
+	tag.name[sizeof(tag.name) - 1] = '\0';
+	if (tag.flags & OUICHEFS_TAG_RESTORE)
+		op.op = OUICHEFS_VOP_RESTORE;
+	if (!(file->f_mode & FMODE_WRITE))
+		return -EBADF;
+	ret = mnt_want_write_file(file);
+	if (ret)
+		return ret;
+
+	/* The tags do not change while the inode lock is held */
+	inode_lock(inode);
+	mutex_lock(&ci->index_lock);
+	ret = ouichefs_find_tag(inode, tag.name, &op.first);
+	mutex_unlock(&ci->index_lock);
+	if (!ret)
+		ret = ouichefs_run_version_ops(inode, &op, &nr_ops, 0);
+	inode_unlock(inode);
+	mnt_drop_write_file(file);
+
+	tag.id = op.first;
+	if (!ret && copy_to_user(utag, &tag, sizeof(tag)))
+		ret = -EFAULT;
+	return ret;
+}
+
+/*
+ * Legacy requests: the argument is a string holding a version number counted
+ * back from the latest version.
+ * CHANGE_VERSION makes this version the current (read-only) view,
+ * RESTOR_VERSION drops every newer version and RLEASE_VERSION goes back to
+ * the latest version.
+ */
+static long ouichefs_ioctl_legacy(struct file *file, unsigned int cmd,
+				  char __user *arg)
+{
+	struct ouichefs_version_op op = {
+		.flags = OUICHEFS_VOP_FROM_LATEST,
+	};
+	uint32_t nr_ops = 1;
+	char request[100];
+	int requested_version;
+	long ret;
+
+	if (strncpy_from_user(request, arg, sizeof(request)) < 0) {
+		pr_err("Erreur récupération de la requette\n");
+		return -EFAULT;
+	}
+	request[sizeof(request) - 1] = '\0';
+	ret = kstrtoint(strim(request), 0, &requested_version);
+	if (ret < 0) {
+		pr_err("token kstrtoint\n");
+		return ret;
+	}
+	if (requested_version < 0)
+		return -EINVAL;
+
+	if (cmd == CHANGE_VERSION)
+		op.op = OUICHEFS_VOP_CHECKOUT;
+	else if (cmd == RESTOR_VERSION)
+		op.op = OUICHEFS_VOP_RESTORE;
+	else
+		op.op = OUICHEFS_VOP_RELEASE;
+	op.first = requested_version;
+
+	return ouichefs_run_file_ops(file, &op, &nr_ops, 0);
+}
+
+/*---------------------------------------------------------------------------*/
+/*			Partie 3 :  Requettes ioctl			     */
+/*---------------------------------------------------------------------------*/
+long ouichefs_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+	struct inode *inode = file_inode(file);
+
+	switch (cmd) {
+	case CHANGE_VERSION:
+	case RESTOR_VERSION:
+	case RLEASE_VERSION:
+		return ouichefs_ioctl_legacy(file, cmd, (char __user *)arg);
+	case OUICHEFS_IOC_LIST_VERSIONS:
+		return ouichefs_ioctl_list(inode, (void __user *)arg);
+	case OUICHEFS_IOC_VERSION_INFO:
+		return ouichefs_ioctl_info(inode, (void __user *)arg);
+	case OUICHEFS_IOC_VERSION_BATCH:
+		return ouichefs_ioctl_batch(file, (void __user *)arg);
+	case OUICHEFS_IOC_DEFRAG:
+		return ouichefs_ioctl_defrag(file, (void __user *)arg);
+	case OUICHEFS_IOC_SPACE_INFO:
+		return ouichefs_ioctl_space(inode, (void __user *)arg);
+	case OUICHEFS_IOC_GET_QUOTA:
+	case OUICHEFS_IOC_SET_QUOTA:
+		return ouichefs_ioctl_quota(file, cmd, (void __user *)arg);
+	case OUICHEFS_IOC_SET_TAG:
+	case OUICHEFS_IOC_GET_TAG:
+	case OUICHEFS_IOC_LIST_TAGS:
+		return ouichefs_ioctl_tag(file, cmd, (void __user *)arg);
+	case OUICHEFS_IOC_CHECKOUT_TAG:
+		return ouichefs_ioctl_checkout_tag(file, (void __user *)arg);
+	default:
+		return -ENOTTY;
+	}
+}
@@ -0,0 +1,243 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * ouiche_fs - a simple educational filesystem for Linux
+ *
+ * Copyright (C) 2018 Redha Gouicem <redha.gouicem@lip6.fr>
+ */
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/buffer_head.h>
+#include <linux/highmem.h>
+#include <linux/pagemap.h>
+#include <linux/slab.h>
+#include <linux/uio.h>
+
+#include "ouichefs.h"
+
+/*
+ * Page caches of the older versions of a file. The mapping of the inode
+ * only caches the latest version, the one written. When an older version is
+ * viewed, reads go to a mapping of its own, found by its version number, so
+ * that switching views never serves the pages of another version and the
+ * pages of the latest version and of the last OUICHEFS_MAX_VIEWS versions
+ * viewed stay cached.
+ *
+ * Older versions are never written, so these mappings only hold clean pages.
+ * They are read with the inode lock shared and created, pruned and freed
+ * with the inode lock held exclusively: a mapping never goes away under a
+ * read. The list of views is protected by index_lock.
+ */
+
+/* Find the record of version number. The caller must hold index_lock. */
+static int ouichefs_find_version(struct inode *inode, uint32_t number,
+				 struct ouichefs_version_record *rec)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	uint32_t i;
+	int ret;
+
+	ret = ouichefs_load_versions(inode);
+	if (ret)
+		return ret;
+	for (i = 0; i < ci->nr_cached; i++) {
+		if (ci->versions[i].number == number) {
+			*rec = ci->versions[i];
+			return 0;
+		}
+	}
+	return -ESTALE;
+}
+
+/*
+ * Read a page of an older version, block by block. The data of an inline
+ * version is in its index block.
+ */
+static int ouichefs_view_readpage(struct file *file, struct page *page)
+{
+	struct ouichefs_view *view = container_of(page->mapping,
+						  struct ouichefs_view,
+						  mapping);
+	struct inode *inode = page->mapping->host;
+	struct super_block *sb = inode->i_sb;
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct ouichefs_file_index_block *index;
+	struct ouichefs_version_record rec;
+	unsigned int off, bsize = i_blocksize(inode);
+	uint32_t k = page_offset(page) >> inode->i_blkbits;
+	struct buffer_head *bh;
+	void *kaddr;
+	int ret;
+
+	mutex_lock(&ci->index_lock);
+	ret = ouichefs_find_version(inode, view->number, &rec);
+	mutex_unlock(&ci->index_lock);
+	if (ret)
+		goto out;
+	bh = ouichefs_bread(sb, rec.index_block);
+	if (!bh) {
+		ret = -EIO;
+		goto out;
+	}
+	index = (struct ouichefs_file_index_block *)bh->b_data;
+
+	if (rec.flags & OUICHEFS_VREC_INLINE) {
+		kaddr = kmap_atomic(page);
+		memset(kaddr, 0, PAGE_SIZE);
+		if (!page->index)
+			memcpy(kaddr, index->blocks, OUICHEFS_INLINE_MAX(sb));
+		kunmap_atomic(kaddr);
+		flush_dcache_page(page);
+		goto brelse;
+	}
+
+	for (off = 0; off < PAGE_SIZE; off += bsize, k++) {
+		if (k >= OUICHEFS_INDEX_NR_DATA(sb) || !index->blocks[k]) {
+			zero_user(page, off, bsize);
+			continue;
+		}
+		ret = ouichefs_read_block(inode, page, off, index->blocks[k]);
+		if (ret)
+			break;
+	}
+brelse:
+	brelse(bh);
+out:
+	if (ret)
+		SetPageError(page);
+	else
+		SetPageUptodate(page);
+	unlock_page(page);
+	return ret;
+}
+
+static const struct address_space_operations ouichefs_view_aops = {
+	.readpage = ouichefs_view_readpage,
+};
+
+/* Find the page cache of version number. The caller must hold index_lock. */
+static struct ouichefs_view *ouichefs_find_view(struct ouichefs_inode_info *ci,
+						uint32_t number)
+{
+	struct ouichefs_view *view;
+
+	list_for_each_entry(view, &ci->views, list)
+		if (view->number == number)
+			return view;
+	return NULL;
+}
+
+/*
+ * Get the page cache of version number of inode, creating it if needed, and
+ * make it the most recently used one. The caller must hold index_lock and
+ * the inode lock. Return NULL if it cannot be allocated.
+ */
+struct ouichefs_view *ouichefs_get_view(struct inode *inode, uint32_t number)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct ouichefs_view *view;
+
+	view = ouichefs_find_view(ci, number);
+	if (view) {
+		list_move(&view->list, &ci->views);
+		return view;
+	}
+
+	view = kzalloc(sizeof(*view), GFP_NOFS);
+	if (!view)
+		return NULL;
+	address_space_init_once(&view->mapping);
+	view->mapping.host = inode;
+	view->mapping.a_ops = &ouichefs_view_aops;
+	mapping_set_gfp_mask(&view->mapping, mapping_gfp_mask(&inode->i_data));
+	view->number = number;
+	list_add(&view->list, &ci->views);
+	ci->nr_views++;
+	return view;
+}
+
+/*
+ * Move to dead the page caches of the versions that are not among the nr
+ * older versions of recs anymore, and the least recently used ones past
+ * OUICHEFS_MAX_VIEWS. The current view is the most recently used one, it is
+ * kept. The caller must hold index_lock and the inode lock, and free dead
+ * with ouichefs_free_views() once index_lock is released.
+ */
+void ouichefs_prune_views(struct inode *inode,
+			  struct ouichefs_version_record *recs, uint32_t nr,
+			  struct list_head *dead)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct ouichefs_view *view, *tmp;
+	uint32_t i, kept = 0;
+
+	list_for_each_entry_safe(view, tmp, &ci->views, list) {
+		for (i = 0; i < nr; i++)
+			if (recs[i].number == view->number)
+				break;
+		if (i < nr && kept < OUICHEFS_MAX_VIEWS) {
+			kept++;
+			continue;
+		}
+		list_move(&view->list, dead);
+		ci->nr_views--;
+	}
+}
+
+/* Drop the pages of the page caches of dead and free them. */
+void ouichefs_free_views(struct list_head *dead)
+{
+	struct ouichefs_view *view, *tmp;
+
+	list_for_each_entry_safe(view, tmp, dead, list) {
+		truncate_inode_pages_final(&view->mapping);
+		list_del(&view->list);
+		kfree(view);
+	}
+}
+
+/*
+ * Read from the page cache of the older version currently viewed. The caller
+ * must hold the inode lock shared.
+ */
+ssize_t ouichefs_view_read(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct inode *inode = file_inode(iocb->ki_filp);
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct ouichefs_view *view;
+	loff_t size = i_size_read(inode);
+	size_t off, n, copied;
+	struct page *page;
+	ssize_t done = 0;
+	int ret = 0;
+
+	mutex_lock(&ci->index_lock);
+	view = ouichefs_find_view(ci, ci->view_number);
+	mutex_unlock(&ci->index_lock);
+	if (!view)
+		return -EIO;
+
+	while (iov_iter_count(to) && iocb->ki_pos < size) {
+		off = offset_in_page(iocb->ki_pos);
+		n = min_t(loff_t, PAGE_SIZE - off, size - iocb->ki_pos);
+		page = read_mapping_page(&view->mapping,
+					 iocb->ki_pos >> PAGE_SHIFT, NULL);
+		if (IS_ERR(page)) {
+			ret = PTR_ERR(page);
+			break;
+		}
+		copied = copy_page_to_iter(page, off, n, to);
+		put_page(page);
+		iocb->ki_pos += copied;
+		done += copied;
+		if (copied < n) {
+			ret = -EFAULT;
+			break;
+		}
+		cond_resched();
+	}
+	file_accessed(iocb->ki_filp);
+	return done ? done : ret;
+}
@@ -0,0 +1,503 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * ouiche_fs - a simple educational filesystem for Linux
+ *
+ * Copyright (C) 2018 Redha Gouicem <redha.gouicem@lip6.fr>
+ */
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/buffer_head.h>
+#include <linux/capability.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/xattr.h>
+
+#include "ouichefs.h"
+#include "bitmap.h"
+
+/*
+ * Extended attributes. All the attributes of an inode are packed in one
+ * block, pointed to by the inode, allocated with the first attribute and
+ * freed with the last one. The used part of the block is copied in memory
+ * the first time it is needed, so that lookups and listings never read the
+ * disk again, and every change is written through to the block.
+ *
+ * user.ouichefs.version.<name> attributes belong to the version of a file
+ * currently viewed: each entry records the number of its version, which is
+ * never reused, and the entries of a version go away with it, see
+ * ouichefs_xattr_prune(). The cache and the block are protected by
+ * index_lock.
+ */
+
+#define OUICHEFS_XATTR_ENTRY_SIZE(name_len, value_len)			\
+	ALIGN(sizeof(struct ouichefs_xattr_entry) + (name_len) + (value_len), 4)
+
+static inline uint32_t ouichefs_xattr_esize(struct ouichefs_xattr_entry *e)
+{
+	return OUICHEFS_XATTR_ENTRY_SIZE(e->name_len, e->value_len);
+}
+
+static inline struct ouichefs_xattr_entry *
+ouichefs_xattr_at(void *xattrs, uint32_t off)
+{
+	return (struct ouichefs_xattr_entry *)((char *)xattrs + off);
+}
+
+#define for_each_xattr(e, off, xattrs, size)				\
+	for (off = sizeof(struct ouichefs_xattr_header);		\
+	     off < (size) && (e = ouichefs_xattr_at(xattrs, off));	\
+	     off += ouichefs_xattr_esize(e))
+
+/*
+ * Copy the attributes of inode in memory if they are not yet. The caller
+ * must hold index_lock.
+ */
+static int ouichefs_xattr_load(struct inode *inode)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct ouichefs_xattr_header *hdr;
+	struct ouichefs_xattr_entry *e;
+	struct buffer_head *bh;
+	uint32_t off, used;
+
+	if (ci->xattrs || !ci->xattr_block)
+		return 0;
+
+	bh = ouichefs_bread(sb, ci->xattr_block);
+	if (!bh)
+		return -EIO;
+	hdr = (struct ouichefs_xattr_header *)bh->b_data;
+	used = hdr->used;
+	if (hdr->magic != OUICHEFS_XATTR_MAGIC || used < sizeof(*hdr) ||
+	    used > OUICHEFS_BSIZE(sb))
+		goto corrupted;
+	/* Every entry must fit in the used part of the block */
+	for (off = sizeof(*hdr); off < used; off += ouichefs_xattr_esize(e)) {
+		if (off + sizeof(*e) > used)
+			goto corrupted;
+		e = ouichefs_xattr_at(hdr, off);
+		if (!e->name_len || off + ouichefs_xattr_esize(e) > used)
+			goto corrupted;
+	}
+
+	ci->xattrs = kmemdup(hdr, used, GFP_NOFS);
+	brelse(bh);
+	if (!ci->xattrs)
+		return -ENOMEM;
+	ci->xattr_size = used;
+	return 0;
+
+corrupted:
+	pr_err("inode %lu: corrupted xattr block %u\n", inode->i_ino,
+	       ci->xattr_block);
+	brelse(bh);
+	return -EIO;
+}
+
+/* Find an attribute in the cache. The caller must hold index_lock. */
+static struct ouichefs_xattr_entry *
+ouichefs_xattr_find(struct ouichefs_inode_info *ci, int index,
+		    const char *name, uint32_t version)
+{
+	struct ouichefs_xattr_entry *e;
+	size_t len = strlen(name);
+	uint32_t off;
+
+	if (!ci->xattrs)
+		return NULL;
+	for_each_xattr(e, off, ci->xattrs, ci->xattr_size)
+		if (e->name_index == index && e->version == version &&
+		    e->name_len == len && !memcmp(e->name, name, len))
+			return e;
+	return NULL;
+}
+
+/*
+ * Make xattrs, size bytes long, the attributes of inode: write it to the
+ * attribute block, allocated if needed, or free the block if xattrs holds
+ * no attribute. xattrs then replaces the cache. The caller must hold
+ * index_lock.
+ */
+static int ouichefs_xattr_write(struct inode *inode, void *xattrs,
+				uint32_t size)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct buffer_head *bh;
+	uint32_t bno = ci->xattr_block;
+
+	if (size <= sizeof(struct ouichefs_xattr_header)) {
+		kfree(xattrs);
+		xattrs = NULL;
+		size = 0;
+		if (bno)
+			ouichefs_release_block(sb, bno);
+		bno = 0;
+		goto done;
+	}
+
+	((struct ouichefs_xattr_header *)xattrs)->magic = OUICHEFS_XATTR_MAGIC;
+	((struct ouichefs_xattr_header *)xattrs)->used = size;
+	if (!bno) {
+		bno = get_free_block(sbi, ouichefs_ino_group(sbi,
+							     inode->i_ino));
+		if (!bno)
+			return -ENOSPC;
+		bh = ouichefs_get_zeroed_block(sb, inode, bno);
+		if (!bh) {
+			put_block(sbi, bno);
+			return -EIO;
+		}
+	} else {
+		bh = ouichefs_bread(sb, bno);
+		if (!bh)
+			return -EIO;
+		memset(bh->b_data + size, 0, OUICHEFS_BSIZE(sb) - size);
+	}
+	memcpy(bh->b_data, xattrs, size);
+	ouichefs_mark_dirty(sb, bh, inode);
+	brelse(bh);
+
+done:
+	if (xattrs != ci->xattrs)
+		kfree(ci->xattrs);
+	ci->xattrs = xattrs;
+	ci->xattr_size = size;
+	if (ci->xattr_block != bno) {
+		ci->xattr_block = bno;
+		mark_inode_dirty(inode);
+	}
+	return 0;
+}
+
+/* Strip the prefix of a per-version attribute name, or return NULL */
+static const char *ouichefs_xattr_version_name(int index, const char *name)
+{
+	size_t len = strlen(OUICHEFS_XATTR_VERSION_PREFIX);
+
+	if (index != OUICHEFS_XATTR_INDEX_USER ||
+	    strncmp(name, OUICHEFS_XATTR_VERSION_PREFIX, len))
+		return NULL;
+	return name + len;
+}
+
+/*
+ * Resolve name to the name stored and the version it belongs to. The caller
+ * must hold index_lock.
+ */
+static int ouichefs_xattr_resolve(struct inode *inode, int index,
+				  const char **name, uint32_t *version)
+{
+	const char *vname = ouichefs_xattr_version_name(index, *name);
+
+	*version = OUICHEFS_NO_VERSION;
+	if (!vname)
+		return 0;
+	/* Only regular files have versions */
+	if (!S_ISREG(inode->i_mode))
+		return -EOPNOTSUPP;
+	if (!*vname)
+		return -EINVAL;
+	*name = vname;
+	*version = ouichefs_view_number(OUICHEFS_INODE(inode));
+	return 0;
+}
+
+static int ouichefs_xattr_get(struct inode *inode, int index,
+			      const char *name, void *buffer, size_t size)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct ouichefs_xattr_entry *e;
+	uint32_t version;
+	int ret;
+
+	mutex_lock(&ci->index_lock);
+	ret = ouichefs_xattr_resolve(inode, index, &name, &version);
+	if (!ret)
+		ret = ouichefs_xattr_load(inode);
+	if (ret)
+		goto unlock;
+
+	e = ouichefs_xattr_find(ci, index, name, version);
+	if (!e) {
+		ret = -ENODATA;
+		goto unlock;
+	}
+	ret = e->value_len;
+	if (!buffer)
+		goto unlock;
+	if (e->value_len > size) {
+		ret = -ERANGE;
+		goto unlock;
+	}
+	memcpy(buffer, e->name + e->name_len, e->value_len);
+unlock:
+	mutex_unlock(&ci->index_lock);
+	return ret;
+}
+
+/*
+ * Set, replace or remove (value NULL) an attribute. The new attributes are
+ * built in a new buffer, so that the cache is left untouched on error.
+ */
+static int ouichefs_xattr_set(struct inode *inode, int index,
+			      const char *name, const void *value,
+			      size_t size, int flags)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct ouichefs_xattr_entry *e, *old, *new;
+	uint32_t version, off, new_size;
+	size_t len;
+	void *xattrs;
+	int ret;
+
+	mutex_lock(&ci->index_lock);
+	ret = ouichefs_xattr_resolve(inode, index, &name, &version);
+	if (!ret)
+		ret = ouichefs_xattr_load(inode);
+	if (ret)
+		goto unlock;
+	len = strlen(name);
+	if (len > U8_MAX || size > U16_MAX) {
+		ret = -ERANGE;
+		goto unlock;
+	}
+
+	old = ouichefs_xattr_find(ci, index, name, version);
+	if (old && (flags & XATTR_CREATE)) {
+		ret = -EEXIST;
+		goto unlock;
+	}
+	if (!old && ((flags & XATTR_REPLACE) || !value)) {
+		ret = -ENODATA;
+		goto unlock;
+	}
+
+	new_size = ci->xattrs ? ci->xattr_size :
+		sizeof(struct ouichefs_xattr_header);
+	if (old)
+		new_size -= ouichefs_xattr_esize(old);
+	if (value)
+		new_size += OUICHEFS_XATTR_ENTRY_SIZE(len, size);
+	if (new_size > OUICHEFS_BSIZE(sb)) {
+		ret = -ENOSPC;
+		goto unlock;
+	}
+
+	xattrs = kzalloc(new_size, GFP_NOFS);
+	if (!xattrs) {
+		ret = -ENOMEM;
+		goto unlock;
+	}
+	/* Keep the other attributes, the one set goes at the end */
+	off = sizeof(struct ouichefs_xattr_header);
+	if (ci->xattrs) {
+		uint32_t o;
+
+		for_each_xattr(e, o, ci->xattrs, ci->xattr_size) {
+			if (e == old)
+				continue;
+			memcpy((char *)xattrs + off, e,
+			       ouichefs_xattr_esize(e));
+			off += ouichefs_xattr_esize(e);
+		}
+	}
+	if (value) {
+		new = ouichefs_xattr_at(xattrs, off);
+		new->name_index = index;
+		new->name_len = len;
+		new->value_len = size;
+		new->version = version;
+		memcpy(new->name, name, len);
+		memcpy(new->name + len, value, size);
+	}
+
+	ret = ouichefs_xattr_write(inode, xattrs, new_size);
+	if (ret) {
+		kfree(xattrs);
+		goto unlock;
+	}
+	inode->i_ctime = current_time(inode);
+	mark_inode_dirty(inode);
+unlock:
+	mutex_unlock(&ci->index_lock);
+	return ret;
+}
+
+/*
+ * Drop the attributes of the versions that are not among the nr versions of
+ * recs anymore. The caller must hold index_lock.
+ */
+int ouichefs_xattr_prune(struct inode *inode,
+			 struct ouichefs_version_record *recs, uint32_t nr)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct ouichefs_xattr_entry *e;
+	uint32_t off, i, new_size;
+	void *xattrs;
+	int ret;
+
+	ret = ouichefs_xattr_load(inode);
+	if (ret || !ci->xattrs)
+		return ret;
+
+	xattrs = kzalloc(ci->xattr_size, GFP_NOFS);
+	if (!xattrs)
+		return -ENOMEM;
+	new_size = sizeof(struct ouichefs_xattr_header);
+	for_each_xattr(e, off, ci->xattrs, ci->xattr_size) {
+		if (e->version != OUICHEFS_NO_VERSION) {
+			for (i = 0; i < nr; i++)
+				if (recs[i].number == e->version)
+					break;
+			if (i == nr)
+				continue;
+		}
+		memcpy((char *)xattrs + new_size, e, ouichefs_xattr_esize(e));
+		new_size += ouichefs_xattr_esize(e);
+	}
+	if (new_size == ci->xattr_size) {
+		kfree(xattrs);
+		return 0;
+	}
+
+	ret = ouichefs_xattr_write(inode, xattrs, new_size);
+	if (ret)
+		kfree(xattrs);
+	return ret;
+}
+
+/* Free the attributes of an inode being deleted */
+void ouichefs_xattr_free(struct inode *inode)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+
+	mutex_lock(&ci->index_lock);
+	if (ci->xattr_block)
+		ouichefs_release_block(inode->i_sb, ci->xattr_block);
+	ci->xattr_block = 0;
+	kfree(ci->xattrs);
+	ci->xattrs = NULL;
+	ci->xattr_size = 0;
+	mutex_unlock(&ci->index_lock);
+}
+
+static const char *ouichefs_xattr_prefix(int index)
+{
+	switch (index) {
+	case OUICHEFS_XATTR_INDEX_USER:
+		return XATTR_USER_PREFIX;
+	case OUICHEFS_XATTR_INDEX_TRUSTED:
+		return XATTR_TRUSTED_PREFIX;
+	case OUICHEFS_XATTR_INDEX_SECURITY:
+		return XATTR_SECURITY_PREFIX;
+	}
+	return NULL;
+}
+
+/*
+ * List the attributes of the inode of dentry: those of the inode and those
+ * of the version viewed. Trusted attributes are only listed for
+ * CAP_SYS_ADMIN.
+ */
+ssize_t ouichefs_listxattr(struct dentry *dentry, char *buffer, size_t size)
+{
+	struct inode *inode = d_inode(dentry);
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct ouichefs_xattr_entry *e;
+	const char *prefix, *vprefix;
+	size_t plen, vlen, total = 0;
+	uint32_t off, view;
+	ssize_t ret;
+
+	mutex_lock(&ci->index_lock);
+	ret = ouichefs_xattr_load(inode);
+	if (ret || !ci->xattrs)
+		goto unlock;
+	view = ouichefs_view_number(ci);
+
+	for_each_xattr(e, off, ci->xattrs, ci->xattr_size) {
+		prefix = ouichefs_xattr_prefix(e->name_index);
+		if (!prefix)
+			continue;
+		if (e->name_index == OUICHEFS_XATTR_INDEX_TRUSTED &&
+		    !capable(CAP_SYS_ADMIN))
+			continue;
+		vprefix = "";
+		if (e->version != OUICHEFS_NO_VERSION) {
+			if (e->version != view)
+				continue;
+			vprefix = OUICHEFS_XATTR_VERSION_PREFIX;
+		}
+		plen = strlen(prefix);
+		vlen = strlen(vprefix);
+		if (buffer) {
+			if (total + plen + vlen + e->name_len + 1 > size) {
+				ret = -ERANGE;
+				goto unlock;
+			}
+			memcpy(buffer + total, prefix, plen);
+			memcpy(buffer + total + plen, vprefix, vlen);
+			memcpy(buffer + total + plen + vlen, e->name,
+			       e->name_len);
+			buffer[total + plen + vlen + e->name_len] = '\0';
+		}
+		total += plen + vlen + e->name_len + 1;
+	}
+	ret = total;
+unlock:
+	mutex_unlock(&ci->index_lock);
+	return ret;
+}
+
+static int ouichefs_xattr_handler_get(const struct xattr_handler *handler,
+				      struct dentry *unused,
+				      struct inode *inode, const char *name,
+				      void *buffer, size_t size)
+{
+	return ouichefs_xattr_get(inode, handler->flags, name, buffer, size);
+}
+
+static int ouichefs_xattr_handler_set(const struct xattr_handler *handler,
+				      struct dentry *unused,
+				      struct inode *inode, const char *name,
+				      const void *value, size_t size,
+				      int flags)
+{
+	return ouichefs_xattr_set(inode, handler->flags, name, value, size,
+				  flags);
+}
+
+static const struct xattr_handler ouichefs_xattr_user_handler = {
+	.prefix = XATTR_USER_PREFIX,
+	.flags  = OUICHEFS_XATTR_INDEX_USER,
+	.get    = ouichefs_xattr_handler_get,
+	.set    = ouichefs_xattr_handler_set,
+};
+
+static const struct xattr_handler ouichefs_xattr_trusted_handler = {
+	.prefix = XATTR_TRUSTED_PREFIX,
+	.flags  = OUICHEFS_XATTR_INDEX_TRUSTED,
+	.get    = ouichefs_xattr_handler_get,
+	.set    = ouichefs_xattr_handler_set,
+};
+
+static const struct xattr_handler ouichefs_xattr_security_handler = {
+	.prefix = XATTR_SECURITY_PREFIX,
+	.flags  = OUICHEFS_XATTR_INDEX_SECURITY,
+	.get    = ouichefs_xattr_handler_get,
+	.set    = ouichefs_xattr_handler_set,
+};
+
+const struct xattr_handler *ouichefs_xattr_handlers[] = {
+	&ouichefs_xattr_user_handler,
+	&ouichefs_xattr_trusted_handler,
+	&ouichefs_xattr_security_handler,
+	NULL
+};